@@ -6,6 +6,8 @@
 #include <graehl/shared/serialize_batch.hpp>
 #include <graehl/shared/time_space_report.hpp>
 #include <graehl/shared/periodic.hpp>
+#include <graehl/shared/lz4stream.hpp>
+#include <memory>
 
 namespace graehl {
 
@@ -25,7 +27,7 @@ struct cached_derivs
 
   unsigned size()
   {
-    return cached?derivs.size():corpus.size();
+    return shared?shared->derivs.size():cached?derivs.size():corpus.size();
   }
   double n_output() const
   {
@@ -33,20 +35,36 @@ struct cached_derivs
   }
 
   cached_derivs(WFST &x, cascade_parameters const& cascade, training_corpus &corpus, WFST::deriv_cache_opts const& copt)
-      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt)
+      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt), shared()
   {
     if ((cached = copt.cache()))
       cache_derivations();
     first = true; // for non-caching
   }
+
+  // enumerate the derivations already cached by o rather than caching our own.  o must have cached them in
+  // memory, with their backward structure (-:), so that enumerating is read-only; then several of these may
+  // run concurrently (parallel random restarts)
+  cached_derivs(cached_derivs const& o)
+      : x(o.x), derivs(false, o.copt.disk_cache_filename), arcs(o.x), cascade(o.cascade), corpus(o.corpus), copt(o.copt), cached(true), shared(&o)
+  {
+    assert(o.shareable());
+    first = false;
+  }
   bool first;
+  cached_derivs const* shared;
+
+  bool shareable() const
+  {
+    return cached && !shared && !derivs.use_file && copt.cache_backward();
+  }
 
   template <class F>
   void foreach_deriv(F &f)
   {
     if (first&&!out_derivfile.empty()) {
-      std::ofstream o(out_derivfile.c_str());
-      foreach_deriv(f, &o);
+      std::unique_ptr<std::ostream> o(graehl::new_lz4_or_ofstream(out_derivfile));
+      foreach_deriv(f, o.get());
     } else
       foreach_deriv(f, 0);
   }
@@ -60,6 +78,14 @@ struct cached_derivs
   template <class F>
   void foreach_deriv(F &f, std::ostream *od)
   {
+    if (shared) {
+      typedef serialize_batch<derivations>::A store_t;
+      store_t &store = const_cast<store_t &>(shared->derivs.store);
+      unsigned n = 0;
+      for (store_t::iterator i = store.begin(), e = store.end(); i!=e; ++i)
+        f(++n, *i);
+      return;
+    }
     cascade_parameters::arcid_type aid;
     bool fem = od&&first;
     if (fem)
@@ -76,8 +102,8 @@ struct cached_derivs
     } else {
       wfst_io_index io(x); // TODO: lift outside of foreach deriv?
       unsigned n = 0;
-      List<IOSymSeq> &ex = corpus.examples;
-      for (List<IOSymSeq>::erase_iterator i = ex.erase_begin(), end = ex.erase_end(); i!=end;) {
+      training_corpus::Examples &ex = corpus.examples;
+      for (training_corpus::Examples::erase_iterator i = ex.erase_begin(), end = ex.erase_end(); i!=end;) {
         ++n;
         derivations d;
         if (d.init_and_compute(x, io, arcs, i->i, i->o, i->weight, n, copt.cache_backward(), copt.prune())) {
@@ -105,7 +131,7 @@ struct cached_derivs
   {
     bool cache_backward = copt.cache_backward();
     bool prune = copt.prune();
-    typedef List<IOSymSeq> Examples;
+    typedef training_corpus::Examples Examples;
     Examples &ex = corpus.examples;
     cached = true;
     std::ostream &log = Config::log();
@@ -30,18 +30,22 @@
 #include <graehl/shared/config.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <vector>
 #include <cctype>
 #include <string>
 #include <ctime>
 #include <carmel/src/fst.h>
 #include <carmel/src/cascade.h>
+#include <carmel/src/path_sampler.h>
+#include <carmel/src/compact_wfst.h>
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/string_to.hpp>
 #include <graehl/shared/split.hpp>
 #include <graehl/shared/split_noquote.hpp>
 #include <boost/config.hpp>
 #include <graehl/shared/random.hpp>
+#include <graehl/shared/lz4stream.hpp>
 
 #define DEBUG_CASCADE 0
 
@@ -115,7 +119,7 @@ static void setOutputFormat(bool* flags, ostream* fstout) {
     */
 }
 
-static void printSeq(Alphabet<StringKey, StringPool>& a, unsigned* seq, unsigned maxSize) {
+static void printSeq(WFST::alphabet_type& a, unsigned* seq, unsigned maxSize) {
 
   for (unsigned i = 0; i < maxSize && seq[i] != 0; ++i) {
     if (i > 0) cout << ' ';
@@ -123,6 +127,46 @@ static void printSeq(Alphabet<StringKey, StringPool>& a, unsigned* seq, unsigned
   }
 }
 
+/// --decode-weights: the precision of the arc weights k-best paths and sums of paths are computed in
+enum decode_weights { decode_double, decode_float, decode_log16 };
+
+static void warn_saturated(unsigned n_saturated) {
+  if (n_saturated)
+    Config::warn() << "--decode-weights=log16: " << n_saturated
+                   << " arc weight(s) beyond e^-256..e^256 were saturated.\n";
+}
+
+template <class W>
+static Weight compact_sum_paths(WFST const& w, bool eps_only, unsigned* n_unconverged,
+                                path_sum_options const& opt) {
+  compact_wfst<W> c(w);
+  warn_saturated(c.n_saturated);
+  return c.sum_paths(eps_only, n_unconverged, opt);
+}
+
+static Weight sum_paths(WFST const& w, decode_weights d, path_sum_options const& opt, bool eps_only = false) {
+  unsigned n_unconverged = 0;
+  Weight s = d == decode_float ? compact_sum_paths<float_cost>(w, eps_only, &n_unconverged, opt)
+             : d == decode_log16 ? compact_sum_paths<log16_cost>(w, eps_only, &n_unconverged, opt)
+                                 : w.sum_paths(eps_only, &n_unconverged, opt);
+  if (n_unconverged)
+    Config::warn() << "Sum of paths: " << n_unconverged
+                   << " cycle(s) still changing after the maximum number of iterations (the sum may be "
+                      "infinite); using "
+                   << s << ".\n";
+  return s;
+}
+
+/// as printSeq: the path's non-epsilon input (or output) symbols, then a newline
+static void printSampledYield(WFST const& wfst, path_sampler::path const& p, LabelType dir) {
+  graehl::word_spacer sp(' ');
+  for (path_sampler::path::const_iterator a = p.begin(), e = p.end(); a != e; ++a) {
+    unsigned id = (*a)->symbol(dir);
+    if (id) cout << sp << wfst.letter(id, dir);
+  }
+  cout << std::endl;
+}
+
 template <class T>
 void readParam(T* t, char const* from, char sw) {
   istringstream is(from);
@@ -222,7 +266,7 @@ typedef std::map<std::string, double> long_opts_t;
 typedef std::map<std::string, std::string> text_long_opts_t;
 
 struct carmel_main {
-  ifstream post_b;
+  std::unique_ptr<istream> post_b;
   graehl::gibbs_opts gopt;
   WFST::path_print printer;
   WFST::train_opts topt;
@@ -240,6 +284,17 @@ struct carmel_main {
               : (flags[(unsigned)':'] ? WFST::cache_forward_backward
                                       : (flags[(unsigned)'?'] ? WFST::cache_forward : WFST::cache_nothing));
     copt.do_prune = !have_opt("cache-no-prune");
+    get_opt("normalize-threads", topt.normalize_threads);
+    get_opt("restart-threads", topt.restart_threads);
+    get_opt("online-em", topt.online_batch);
+    get_opt("online-em-alpha", topt.online_alpha);
+    get_opt("online-em-eval", topt.online_eval);
+    topt.squarem = have_opt("squarem");
+    if (topt.restart_threads > 1 && copt.cache_level <= WFST::cache_forward) {
+      Config::log() << "--restart-threads: caching derivations in memory (as if -:) so restarts can share "
+                       "them.\n";
+      copt.cache_level = WFST::cache_forward_backward;
+    }
     if (have_opt("disk-cache-derivations")) {
       copt.cache_level = WFST::cache_disk;
       copt.disk_cache_filename = set_default_text("disk-cache-derivations", "/tmp/carmel.derivations.XXXXXX");
@@ -319,8 +374,8 @@ struct carmel_main {
 
   istream* open_postb() {
     if (have_opt("post-b")) {
-      post_b.open(text_long_opts["post-b"].c_str(), ifstream::in);
-      return &post_b;
+      post_b.reset(graehl::new_lz4_or_ifstream(text_long_opts["post-b"]));
+      return post_b.get();
     } else
       return NULL;
   }
@@ -376,11 +431,41 @@ struct carmel_main {
     }
   }
 
-  void print_kbest(unsigned kPaths, WFST* result) {
+  decode_weights decode;
+  path_sum_options sum_opt;
+
+  void parse_decode_opts() {
+    get_opt("sum-tolerance", sum_opt.tolerance);
+    std::string d = text_long_opts["decode-weights"];
+    if (d.empty() || d == "double")
+      decode = decode_double;
+    else if (d == "float")
+      decode = decode_float;
+    else if (d == "log16")
+      decode = decode_log16;
+    else
+      throw std::runtime_error("--decode-weights=" + d + ": expected double, float or log16");
+  }
+
+  /// free_arcs: nothing reads result's arcs after this, so the search needn't hold them besides the copy
+  template <class W>
+  static void compact_visit_kbest(WFST& result, unsigned kPaths, wfst_paths_printer& pp, bool free_arcs) {
+    compact_wfst<W> c(result);
+    if (free_arcs) result.clear_arcs();
+    warn_saturated(c.n_saturated);
+    c.visit_kbest(kPaths, pp);
+  }
+
+  void print_kbest(unsigned kPaths, WFST* result, bool last_use = false) {
     unsigned kPathsLeft = kPaths;
     if (result->valid()) {
       wfst_paths_printer pp(*result, cout, flags);
-      result->visit_kbest(kPaths, pp);
+      if (decode == decode_float)
+        compact_visit_kbest<float_cost>(*result, kPaths, pp, last_use);
+      else if (decode == decode_log16)
+        compact_visit_kbest<log16_cost>(*result, kPaths, pp, last_use);
+      else
+        result->visit_kbest(kPaths, pp);
       kPathsLeft -= pp.n_paths;
       if (pp.best_w.isZero())
         ++n_0prob;
@@ -557,7 +642,7 @@ struct carmel_main {
     Weight s = 1;
 
     if (sump) {
-      s = result->sum_acyclic_paths();
+      s = sum_paths(*result, decode, sum_opt);
       if (s.isZero())
         ++pre_n_0prob;
       else
@@ -567,10 +652,10 @@ struct carmel_main {
     prod_sum_pre *= s;
 
     if (have_opt("post-b")) {
-      post_b >> ws;
+      *post_b >> ws;
       std::string buf;
-      getline(post_b, buf);
-      if (!post_b) {
+      getline(*post_b, buf);
+      if (!*post_b) {
         Config::warn() << "--post-b file didn't have as many lines as -b file.\n";
         return false;
       }
@@ -592,7 +677,7 @@ struct carmel_main {
       result->ownAlphabet();
       delete p;
       if (sump) {
-        s = result->sum_acyclic_paths();
+        s = sum_paths(*result, decode, sum_opt);
       }
     }
 
@@ -663,7 +748,7 @@ struct carmel_main {
 
 
   bool shrink(WFST* result, bool print = true, bool do_prune = true, bool openfst_min = false,
-              char const* end = "\n") {
+              char const* end = "\n", bool rmepsilon = false) {
     WFST& w = *result;
     bool changed = false;
     print = print && !flags[(unsigned)'q'];
@@ -671,6 +756,10 @@ struct carmel_main {
       shrink_monitor m("reduce", w, print, changed);
       minimize(result);
     }
+    if (rmepsilon) {
+      shrink_monitor m("rmepsilon", w, print, changed);
+      result->remove_epsilons();
+    }
     if (do_prune) {
       shrink_monitor m("prune", w, print, changed);
       prune(result);
@@ -750,6 +839,7 @@ struct carmel_main {
     parse_cache_opts();
     parse_gibbs_opts();
     parse_fem_opts();
+    parse_decode_opts();
     no_compose = have_opt("no-compose");
   }
 
@@ -791,11 +881,11 @@ struct carmel_main {
     }
     if (!fem_inparam.empty()) {
       Config::log() << "Reading cascade weights from --load-fem-param=" << fem_inparam << endl;
-      std::ifstream i(fem_inparam.c_str());
-      if (!i) {
+      std::unique_ptr<std::istream> i(graehl::new_lz4_or_ifstream(fem_inparam));
+      if (!*i) {
         throw std::runtime_error("Missing --load-fem-param file.\n");
       }
-      fems.read_params(i);
+      fems.read_params(*i);
     }
     fem_normby();
     fem_out_param(fem_early_outparam);
@@ -810,8 +900,8 @@ struct carmel_main {
   void fem_out_param(std::string const& out) {
     if (!fem_outparam.empty()) {
       Config::log() << "Writing cascade weights to --fem-param=" << fem_outparam << endl;
-      std::ofstream o(fem_outparam.c_str());
-      fems.print_params(o);
+      std::unique_ptr<std::ostream> o(graehl::new_lz4_or_ofstream(fem_outparam));
+      fems.print_params(*o);
     }
   }
 
@@ -819,13 +909,13 @@ struct carmel_main {
     fem_out_param(fem_outparam);
     if (!fem_norm.empty()) {
       Config::log() << "Writing forest-em normgroups to --fem-norm=" << fem_norm << endl;
-      std::ofstream o(fem_norm.c_str());
-      fems.fem_norms(o, nms);
+      std::unique_ptr<std::ostream> o(graehl::new_lz4_or_ofstream(fem_norm));
+      fems.fem_norms(*o, nms);
     }
     if (!fem_alpha.empty()) {
       Config::log() << "Writing forest-em alpha to --fem-alpha=" << fem_alpha << endl;
-      std::ofstream o(fem_alpha.c_str());
-      fems.fem_alpha(o, nms);
+      std::unique_ptr<std::ostream> o(graehl::new_lz4_or_ofstream(fem_alpha));
+      fems.fem_alpha(*o, nms);
     }
   }
 
@@ -852,6 +942,12 @@ struct carmel_main {
         out << name << " is acyclic.";
     }
     out << std::endl;
+    if (shortest_distances_used.any()) {
+      out << "Shortest distances (k-best, pruning) for " << name << ": " << shortest_distances_used.topological
+          << " by topological relaxation (acyclic), " << shortest_distances_used.dijkstra << " by Dijkstra"
+          << std::endl;
+      shortest_distances_used.clear();
+    }
   }
 
   void write_trained(std::string const& suffix = "trained") {
@@ -978,7 +1074,7 @@ int
         pruneFlag = 0;
         readParam(&cm.prune_wt, arg, 'p');
       } else if (fstout == NULL) {
-        fstout = NEW ofstream(arg);
+        fstout = graehl::new_lz4_or_ofstream(arg);
         setOutputFormat(flags, fstout);
         if (!*fstout) {
           Config::warn() << "Could not create file " << arg << ".\n";
@@ -1140,7 +1236,7 @@ int
       //    if (parm[i][0]=='-' && parm[i][1] == '\0')
       //              files[i] = &cin;
       //      else
-      files[i] = NEW ifstream(parm[i]);
+      files[i] = graehl::new_lz4_or_ifstream(parm[i]);
 #ifdef DEBUG
 // Config::debug() << "Created file " << i << " from " << parm[i] << " & " << files[i] <<"\n";
 #endif
@@ -1345,10 +1441,13 @@ int
           bool om = long_opts["minimize-compositions"] >= n_compositions
                     || long_opts["minimize-all-compositions"];
           bool nok = !(kPaths > 0 && finalcompose);
+          // (new arcs aren't products of cascade arcs, so not while training a cascade)
+          bool re = (long_opts["rmepsilon-compositions"] >= n_compositions
+                     || long_opts["rmepsilon-all-compositions"]) && cascade.trivial;
 #if DEBUG_CASCADE
           Config::debug() << " (nok=" << nok << ")";
 #endif
-          bool arcs_changed = cm.shrink(result, true, nok, nok && om, ")");
+          bool arcs_changed = cm.shrink(result, true, nok, nok && om, ")", re);
           cascade.done_composing(result, (arcs_changed && long_opts["train-cascade-compress"])
                                              || long_opts["train-cascade-compress-always"]);
           anycomposed = true;
@@ -1378,7 +1477,16 @@ int
             result->unTieGroups();
         }
         if (kPaths > 0) {
-          cm.print_kbest(kPaths, result);
+          // last_use: -c and (without -b) -S, -t, -g, -G, -F read result afterward; with -b, so do the
+          // later inputs if it's one of the chain
+          bool last_use = !flags[(unsigned)'c']
+                          && (flags[(unsigned)'b'] || !(flags[(unsigned)'S'] || flags[(unsigned)'t']
+                                                        || flags[(unsigned)'g'] || flags[(unsigned)'G']
+                                                        || flags[(unsigned)'F']));
+          if (flags[(unsigned)'b'])
+            for (unsigned i = 0; i < nChain; i++)
+              if (result == &chain[i]) last_use = false;
+          cm.print_kbest(kPaths, result, last_use);
         } else if (flags[(unsigned)'x']) {
           result->listAlphabet(cout, kInput);
         } else if (flags[(unsigned)'y']) {
@@ -1408,9 +1516,8 @@ int
                 cout << prob << std::endl;
               }
             } else {
-              List<unsigned> empty_list;
               n_pairs = 1;
-              cout << (prod_prob = result->sumOfAllPaths(empty_list, empty_list)) << std::endl;
+              cout << (prod_prob = sum_paths(*result, cm.decode, cm.sum_opt, true)) << std::endl;
             }
           } else if (flags[(unsigned)'t']) {
             show_seed();
@@ -1443,7 +1550,29 @@ int
             cm.shrink(result, true, true, minimize, "\n");
             //                cm.minimize(result);
             if (maxGenArcs == 0) maxGenArcs = DEFAULT_MAX_GEN_ARCS;
-            if (flags[(unsigned)'G']) {
+            unsigned gen_threads = 0;
+            cm.get_opt("gen-threads", gen_threads);
+            if (cm.have_opt("gen-exact") || gen_threads) {
+              show_seed();
+              bool joint = flags[(unsigned)'G'];
+              path_sampler sampler(*result,
+                                   joint ? path_sampler::joint_walk : path_sampler::conditional_walk);
+              sampler.generate(nGenerate, gen_threads, seed, [&](path_sampler::path const& p) {
+                if (joint && !flags[(unsigned)'@']) {
+                  List<PathArc> l;
+                  List<PathArc>::back_insert_iterator o = l.back_inserter();
+                  PathArc pa;
+                  for (path_sampler::path::const_iterator a = p.begin(), e = p.end(); a != e; ++a) {
+                    result->setPathArc(&pa, **a);
+                    *o++ = pa;
+                  }
+                  printPath(flags, &l);
+                } else {
+                  printSampledYield(*result, p, kInput);
+                  printSampledYield(*result, p, kOutput);
+                }
+              });
+            } else if (flags[(unsigned)'G']) {
               show_seed();
               for (unsigned i = 0; i < nGenerate;) {
                 List<PathArc> l;
@@ -1572,7 +1701,8 @@ void WFSTformatHelp(void) {
 void usageHelp(void) {
   cout << "usage: carmel [switches] [file1 file2 ... filen]\n\ncomposes a seq";
   cout << "uence of weighted finite state transducers and writes the\nresul";
-  cout << "t to the standard output.\n\n-l (default)\tleft associative comp";
+  cout << "t to the standard output.  files (and -F, --post-b, fem params, derivation\nd";
+  cout << "umps, trained outputs) whose names end in .lz4 are read/written as LZ4\nframes.\n\n-l (default)\tleft associative comp";
   cout << "osition ((file1*file2) * file3 ... )\n-r\t\tright associative co";
   cout << "mposition (file1 * (file2*file3) ... )\n-s\t\tthe standard input";
   cout << " is prepended to the sequence of files (for\n\t\tleft associativ";
@@ -1702,6 +1832,13 @@ void usageHelp(void) {
   cout << "\n\t-H\tOne arc per line (by default one state and all its arcs per line)";
   cout << "\n\t-J\tDon't omit output=input or Weight=1";
 
+  cout << "\n\n--rmepsilon-compositions=N : after each of the first N compositions, replace paths of *e*:*e* "
+          "arcs by direct arcs with the same total weight (cycles included), so they don't multiply states "
+          "in later compositions.  only the final state keeps *e*:*e* arcs, and each state gets at most one "
+          "to final.  not with --train-cascade\n"
+          "\n"
+          "--rmepsilon-all-compositions : the same, but for N=infinity\n";
+
 #ifdef USE_OPENFST
   cout << "\n\n--minimize-compositions=N : det/min after each of the first N compositions\n"
           "\n"
@@ -1772,7 +1909,30 @@ void usageHelp(void) {
           "--disk-cache-bufsize=1M : unless 0, replace the default file read buffer with one of this many "
           "bytes (k=1000, K = 1024, M=1024K, etc)"
           "\n--cache-no-prune : don't prune unreachable states in derivation cache (not recommended)."
-          "\n";
+          "\n"
+          "\n--normalize-threads=N : split each EM normalization over up to N threads (only for transducers "
+          "with many normalization groups; the result doesn't depend on N)"
+          "\n"
+          "\n--restart-threads=N : run the -! random restarts (and the initial start) in up to N threads, "
+          "sharing one in-memory derivation cache (implies -:).  the random starting points and the "
+          "final best weights are the same as with N=1, but the log of each start is printed when it "
+          "finishes.  not for --train-cascade, --disk-cache-derivations, or --matrix-fb"
+          "\n"
+          "\n--online-em=B : online (stepwise) EM: update the weights after every B training examples, "
+          "interpolating the new counts into a running average (starting from the initial weights) with step "
+          "size (k+2)^-alpha for the kth update (usually converges in fewer passes over a large corpus).  "
+          "the perplexity reported, tested for convergence and used to keep the best weights is accumulated "
+          "over the pass, each example scored by the weights at the time, unless --online-em-eval.  not for "
+          "--train-cascade or --matrix-fb; -o is ignored"
+          "\n"
+          "\n--online-em-alpha=.7 : online EM step size decay, in (.5,1]; smaller forgets old counts faster"
+          "\n"
+          "\n--online-em-eval=N : online EM: every Nth iteration, make a second pass over the corpus to "
+          "score the weights the iteration ended with (exactly, but at the cost of a forward pass)"
+          "\n"
+          "\n--squarem : accelerate EM (usually fewer iterations than -o) by extrapolating the (log) weights "
+          "along the last 2 EM steps (SQUAREM), falling back to plain EM whenever the extrapolated weights "
+          "are worse.  works with --train-cascade; replaces -o\n";
   cout << "\n"
           "--exponents=2,.1 : comma separated list of exponents, applied left to right to the input WFSTs "
           "(including stdin if -s).  if more inputs than exponents, use (noop) exponent of 1.  this differs "
@@ -1783,9 +1943,27 @@ void usageHelp(void) {
           "files instead of alternating lines, and gives best paths like -b.  also may succeed for "
           "compositions that wouldn't fit in memory under -S\n";
 
+  cout << "\n"
+          "--gen-exact : for -g and -G, sample each path conditioned on reaching the final state (no -L "
+          "limit and no retries), from per-state tables built once: every path has the probability the "
+          "local -g/-G walk gives it, divided by the probability that walk reaches final.  repeatable with "
+          "-R, but not the same sequence of paths as without --gen-exact\n"
+          "\n"
+          "--gen-threads=N : --gen-exact, sampling in N threads, thread t with its own random stream seeded "
+          "from -R and t.  the output (in order) depends only on -R and N\n";
   cout << "\n"
           "--sum : show (before and after --post-b) product of final transducer's sum-of-paths "
-          "(acyclic-correct only), as prob and per-input-ppx.\n"
+          "(cycles included: exactly for cycles of up to 32 states, otherwise iterated to convergence), as "
+          "prob and per-input-ppx.  a jointly normalized WFST should sum to 1.\n"
+          "\n"
+          "--sum-tolerance=1e-9 : --sum and -S (without pairs) iterate a cycle of over 32 states (or one too "
+          "unbalanced to solve exactly) until no state's sum changes by more than this (as a ln ratio)\n"
+          "\n"
+          "--decode-weights=float|log16 : -k/-b best paths, --sum, and -S without pairs are computed on a "
+          "copy of the arcs with float (4 byte) or log16 (2 byte, to within .4% for weights between e^-256 "
+          "and e^256, saturated beyond) weights instead of double.  the printed weights are the reduced "
+          "precision ones, and nearly tied paths may come out in a different order.  training and -S with "
+          "pairs stay in double\n"
 
       ;
 
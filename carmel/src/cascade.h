@@ -9,8 +9,11 @@
 #include <graehl/shared/dynamic_array.hpp>
 #include <carmel/src/fst.h>
 #include <carmel/src/derivations.h>
+#include <carmel/src/normalize_plan.h>
 #include <graehl/shared/slist.h>
 #include <boost/pool/object_pool.hpp>
+#include <graehl/shared/lz4stream.hpp>
+#include <memory>
 
 namespace graehl {
 // WARNING: thread unsafe for gibbs operator[](arc if trivial) identity node
@@ -25,9 +28,9 @@ struct cascade_parameters {
       std::string const& f = filenames[i];
       std::string const& f_trained = suffix.empty() ? f : (f + "." + suffix);
       Config::log() << "Writing " << suffix << ' ' << f << " to " << f_trained << std::endl;
-      std::ofstream of(f_trained.c_str());
-      WFST::output_format(flags, &of);
-      cascade[i]->writeLegible(of, show0);
+      std::unique_ptr<std::ostream> of(graehl::new_lz4_or_ofstream(f_trained));
+      WFST::output_format(flags, of.get());
+      cascade[i]->writeLegible(*of, show0);
     }
   }
 
@@ -391,9 +394,18 @@ struct cascade_parameters {
 
   void normalize(WFST::NormalizeMethods const& methods) {
     assert(methods.size() == cascade.size());
-    for (unsigned i = 0, n = cascade.size(); i < n; ++i) cascade[i]->normalize(methods[i]);
+    for (unsigned i = 0, n = cascade.size(); i < n; ++i) norm_plans.normalize(i, *cascade[i], methods[i]);
+    ++norm_plans.n_normalize;
   }
 
+  // while training, the cascade's arcs are fixed, so normalize() can use precompiled plans
+  normalize_plans norm_plans;
+  void compile_normalize(WFST::NormalizeMethods const& methods, unsigned threads = 1) {
+    norm_plans.threads = threads;
+    norm_plans.compile(cascade, methods);
+  }
+  void drop_normalize_plans() { norm_plans.clear(); }
+
 
   void randomize(WFST::NormalizeMethods const& methods) {
     EXCEPT_FOR_NONE(i)
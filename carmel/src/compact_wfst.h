@@ -0,0 +1,224 @@
+#ifndef CARMEL_COMPACT_WFST_H
+#define CARMEL_COMPACT_WFST_H
+
+/// decode-only copies of a WFST's arcs with reduced precision weights (--decode-weights=float or log16).
+/// k-best / Viterbi paths (graehl::bestPaths) and sums of paths (sum_paths_to) run on compact_wfst<W> through
+/// the graph adaptor interface of graehl/shared/graph.h, as they do on WFST::graph_view.  arcs are stored by
+/// source state in flat arrays, the labels and destination (12 bytes) apart from the weights, so a search
+/// reads 4 (float_cost) or 2 (log16_cost) bytes of weight per arc instead of 8.  training and everything
+/// else keep Weight.
+///
+/// the copy is independent of the WFST's arcs (carmel -k frees those once the copy exists, if nothing reads
+/// them later), but names its labels by the WFST's alphabets (for printing)
+
+#include <carmel/src/fst.h>
+#include <graehl/shared/graph.h>
+#include <graehl/shared/kbest.h>
+#include <boost/cstdint.hpp>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace graehl {
+
+/// an arc's cost (-ln weight) as a float
+struct float_cost {
+  float c;
+  static float_cost of(FLOAT_TYPE cost, unsigned&) {
+    float_cost r;
+    r.c = (float)cost;
+    return r;
+  }
+  FLOAT_TYPE cost() const { return c; }
+};
+
+/// an arc's cost (-ln weight) in 16 bits, in steps of 1/kScale: within 1/256 for costs in [-256,256), so
+/// weights within .4%.  costs beyond that range saturate (and are counted); a 0 weight stays 0
+struct log16_cost {
+  boost::int16_t q;
+  enum { kScale = 128, kMin = -0x8000, kMax = 0x7FFE, kZero = 0x7FFF };
+  static log16_cost of(FLOAT_TYPE cost, unsigned& n_saturated) {
+    log16_cost r;
+    if (!(cost < std::numeric_limits<FLOAT_TYPE>::infinity()))  // 0 weight (or nan)
+      r.q = kZero;
+    else {
+      FLOAT_TYPE x = std::floor(cost * kScale + .5);
+      if (x > kMax || x < kMin) {
+        ++n_saturated;
+        x = x > kMax ? kMax : kMin;
+      }
+      r.q = (boost::int16_t)x;
+    }
+    return r;
+  }
+  FLOAT_TYPE cost() const {
+    return q == kZero ? std::numeric_limits<FLOAT_TYPE>::infinity() : q * ((FLOAT_TYPE)1 / kScale);
+  }
+};
+
+template <class W>
+class compact_wfst {
+ public:
+  struct arc {
+    unsigned in, out, dest;
+  };
+  typedef arc const* arc_handle;
+
+  unsigned final;
+  unsigned n_saturated;  // arcs whose weight didn't fit in W (log16_cost)
+
+  explicit compact_wfst(WFST const& wfst) : final(wfst.final), n_saturated() {
+    unsigned n = wfst.numStates();
+    csr.first.reserve(n + 1);
+    std::size_t m = wfst.numArcs();
+    csr.arcs.reserve(m);
+    weights.reserve(m);
+    FSTArc::group_t const none = FSTArc::no_group;
+    for (unsigned s = 0; s < n; ++s) {
+      csr.start_state();
+      State::Arcs const& as = wfst.states[s].arcs;
+      for (State::Arcs::const_iterator a = as.const_begin(), e = as.const_end(); a != e; ++a) {
+        arc x = {a->in, a->out, a->dest};
+        csr.arcs.push_back(x);
+        weights.push_back(W::of(a->weight.getCost(), n_saturated));
+        if (!groups.empty() || a->groupId != FSTArc::no_group) {  // only once some arc has a group
+          groups.resize(csr.arcs.size() - 1, none);
+          groups.push_back(a->groupId);
+        }
+      }
+    }
+    csr.finish();
+    if (!groups.empty()) groups.resize(csr.arcs.size(), none);
+    build_reverse();
+  }
+
+  unsigned num_states() const { return csr.num_states(); }
+  std::size_t num_arcs() const { return csr.arcs.size(); }
+  FLOAT_TYPE cost(arc_handle a) const { return weights[id(a)].cost(); }
+  Weight weight(arc_handle a) const { return Weight(cost(a), cost_weight()); }
+  /// a (temporary) WFST arc with a's labels, destination, group and (reduced precision) weight
+  FSTArc fst_arc(arc_handle a) const {
+    std::size_t i = id(a);
+    FSTArc::group_t g = groups.empty() ? (FSTArc::group_t)FSTArc::no_group : groups[i];
+    return FSTArc(a->in, a->out, a->dest, weight(a), g);
+  }
+
+  struct skip_labeled {
+    static bool skip(arc const& a) { return a.in || a.out; }
+  };
+  /// graph adaptors (see graehl/shared/graph.h): csr_graph_view with the arcs' (reduced precision) costs;
+  /// with EpsOnly, only the *e* : *e* arcs
+  template <bool EpsOnly>
+  struct basic_graph_view
+      : csr_graph_view<arc, unsigned, typename std::conditional<EpsOnly, skip_labeled, skip_no_arcs>::type> {
+    typedef csr_graph_view<arc, unsigned,
+                           typename std::conditional<EpsOnly, skip_labeled, skip_no_arcs>::type> base;
+    compact_wfst const* c;
+    explicit basic_graph_view(compact_wfst const& c) : base(c.csr.first, c.csr.arcs), c(&c) {}
+    FLOAT_TYPE cost(typename base::arc_iterator a) const { return c->cost(a.i); }
+    GraphArc graph_arc(unsigned src, arc_handle a) const {
+      return GraphArc(src, a->dest, c->cost(a), (void*)a);
+    }
+  };
+  typedef basic_graph_view<false> graph_view;
+  typedef basic_graph_view<true> egraph_view;
+  graph_view graph() const { return graph_view(*this); }
+  egraph_view egraph() const { return egraph_view(*this); }
+
+  /// the arcs arriving at each state, in the order WFST::reverse_graph_view has them
+  struct reverse_graph_view {
+    struct entry {
+      unsigned src, arc;
+    };
+    compact_wfst const* c;
+    explicit reverse_graph_view(compact_wfst const& c) : c(&c) {}
+    typedef entry const* arc_handle;
+    typedef entry const* arc_iterator;
+    unsigned num_states() const { return c->num_states(); }
+    arc_iterator arcs_begin(unsigned s) const { return c->rentries.data() + c->rfirst[s]; }
+    arc_iterator arcs_end(unsigned s) const { return c->rentries.data() + c->rfirst[s + 1]; }
+    static unsigned dest(arc_iterator a) { return a->src; }
+    FLOAT_TYPE cost(arc_iterator a) const { return c->weights[a->arc].cost(); }
+    static arc_handle handle(arc_iterator a) { return a; }
+    GraphArc graph_arc(unsigned src, arc_handle a) const {
+      return GraphArc(src, a->src, cost(a), (void*)forward(a));
+    }
+    /// the forward (graph_view) arc
+    compact_wfst::arc_handle forward(arc_handle a) const { return c->at(a->arc); }
+  };
+  reverse_graph_view reverse_graph() const { return reverse_graph_view(*this); }
+
+  /// as WFST::visit_kbest: v sees each path's arcs as (temporary) FSTArcs, with the reduced precision weights
+  template <class Visitor>
+  void visit_kbest(unsigned k, Visitor& v, bool throw_on_cycle = true) const {
+    arc_visitor<Visitor> wrap(*this, v);
+    graehl::bestPaths(graph(), reverse_graph(), 0, final, k, wrap, throw_on_cycle);
+  }
+
+  struct weight_of {
+    compact_wfst const* c;
+    Weight operator()(arc_handle a) const { return c->weight(a); }
+  };
+
+  /// as WFST::sum_paths
+  Weight sum_paths(bool eps_only = false, unsigned* n_unconverged = 0,
+                   path_sum_options const& opt = path_sum_options()) const {
+    if (n_unconverged) *n_unconverged = 0;
+    unsigned n = num_states();
+    if (!n || final >= n) return Weight();
+    std::vector<Weight> w(n);
+    weight_of wt = {this};
+    unsigned nu = eps_only ? sum_paths_to(egraph(), wt, 0, final, w.data(), opt)
+                           : sum_paths_to(graph(), wt, 0, final, w.data(), opt);
+    if (n_unconverged) *n_unconverged = nu;
+    return w[0];
+  }
+
+ private:
+  csr_graph<arc, unsigned> csr;
+  std::vector<W> weights;  // parallel to csr.arcs
+  std::vector<FSTArc::group_t> groups;  // parallel to arcs, or empty if no arc has a group
+  std::vector<unsigned> rfirst;  // reverse_graph_view: state s's arriving arcs are rentries[rfirst[s]..)
+  std::vector<typename reverse_graph_view::entry> rentries;
+
+  std::size_t id(arc_handle a) const { return a - csr.arcs.data(); }
+  arc_handle at(std::size_t i) const { return csr.arcs.data() + i; }
+
+  /// (as WFST::reverse_arcs)
+  void build_reverse() {
+    unsigned n = num_states();
+    rfirst.assign(n + 2, 0);
+    std::vector<arc> const& arcs = csr.arcs;
+    for (std::size_t i = 0, m = arcs.size(); i < m; ++i) ++rfirst[arcs[i].dest + 2];
+    for (unsigned i = 2; i <= n + 1; ++i) rfirst[i] += rfirst[i - 1];
+    rentries.resize(arcs.size());
+    for (unsigned s = n; s-- > 0;)  // later sources first, as reverseGraph(makeGraph()) has them
+      for (unsigned i = csr.first[s]; i < csr.first[s + 1]; ++i) {
+        typename reverse_graph_view::entry& e = rentries[rfirst[arcs[i].dest + 1]++];
+        e.src = s;
+        e.arc = i;
+      }
+    rfirst.pop_back();
+  }
+
+  template <class V>
+  struct arc_visitor {
+    compact_wfst const& c;
+    V* pv;
+    bool SIDETRACKS_ONLY;
+    arc_visitor(compact_wfst const& c, V& v) : c(c), pv(&v), SIDETRACKS_ONLY(v.SIDETRACKS_ONLY) {}
+    void start_path(unsigned k, double cost) { pv->start_path(k, Weight(cost, cost_weight())); }
+    void end_path() { pv->end_path(); }
+    void visit_best_arc(GraphArc const& a) {
+      FSTArc x = c.fst_arc((arc_handle)a.data);
+      pv->visit_best_arc(x);
+    }
+    void visit_sidetrack_arc(GraphArc const& a) { visit_best_arc(a); }
+  };
+};
+
+}
+
+#endif
@@ -190,7 +190,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   HashTable<TrioKey, unsigned> stateMap(2 * (a.numStates() + b.numStates()));  // assign state numbers
   // to composite states in the order they are first visited
 
-  List<TrioID> queue;
+  PoolList<TrioID>::type queue;
   unsigned sourceState = ~0;
 #ifdef OLDCOMPOSEARC
   unsigned* pDest;
@@ -214,7 +214,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
   }
   queue.push(trioID);
 
-  List<HalfArc>* matches;
+  State::HalfArcs* matches;
 
   if (preserveGroups) {  // use simpler 2 state filter since e transitions cannot be merged anyhow
     /* 2 state filter:
@@ -237,9 +237,8 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
       State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
       qa->indexBy(kOutput);
       qb->indexBy(kInput);
-      const HashTable<UnsignedKey, List<HalfArc> >& aindex = *qa->index;
-      for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ll = aindex.begin(); ll != aindex.end();
-           ++ll) {
+      const State::Index& aindex = *qa->index;
+      for (State::Index::const_iterator ll = aindex.begin(); ll != aindex.end(); ++ll) {
         HalfArcState mediate;
         mediate.l_hiddenLetter = ll->first;
         mediate.r_source = triSource.qb;
@@ -248,7 +247,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             out = EMPTY;
             triDest.filter = 0;
             triDest.qb = triSource.qb;
-            for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
+            for (State::HalfArcs::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
                  l != end; ++l) {
               HalfArc const& la = *l;  // arc from a
               weight = la->weight;
@@ -258,7 +257,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             }
           }
         } else if ((matches = find_second(*qb->index, (UnsignedKey)map[mediate.l_hiddenLetter]))) {
-          for (List<HalfArc>::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
+          for (State::HalfArcs::const_iterator l = ll->second.const_begin(), end = ll->second.const_end();
                l != end; ++l) {
             HalfArc const& la = *l;
             mediate.l_dest = la->dest;
@@ -277,7 +276,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
                 triDest.qa = mediate.l_dest;
                 in = EMPTY;
                 triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
+                for (State::HalfArcs::const_iterator r = matches->const_begin(), end = matches->const_end();
                      r != end; ++r) {
                   HalfArc const& ra = *r;  // arc from b
                   Assert(map[la->out] == ra->in);
@@ -300,7 +299,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
         in = EMPTY;
         triDest.qa = triSource.qa;
         triDest.filter = 1;
-        for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end(); r != end;
+        for (State::HalfArcs::const_iterator r = matches->const_begin(), end = matches->const_end(); r != end;
              ++r) {
           HalfArc const& ra = *r;
           Assert(ra->in == EMPTY);
@@ -336,7 +335,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
       if (larger->size > WFST::indexThreshold) {
         larger->indexBy(larger == qa ? kOutput : kInput);  // create hash table
         if (larger == qb) {  // qb (rhs transducer) is larger
-          for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
+          for (State::Arcs::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
                ++l) {
             in = l->in;
             triDest.qa = l->dest;
@@ -351,7 +350,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               if (triSource.filter == 0)
                 if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
                   triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
+                  for (State::HalfArcs::const_iterator r = matches->const_begin(), end = matches->const_end();
                        r != end; ++r) {
                     Assert((*r)->in == EMPTY);
                     out = (*r)->out;
@@ -363,7 +362,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             } else {
               if ((matches = find_second(*qb->index, (UnsignedKey)map[l->out]))) {
                 triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
+                for (State::HalfArcs::const_iterator r = matches->const_begin(), end = matches->const_end();
                      r != end; ++r) {
                   Assert(map[l->out] == (*r)->in);
                   out = (*r)->out;  // FIXME: uninit
@@ -378,7 +377,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             in = EMPTY;
             triDest.qa = triSource.qa;
             triDest.filter = 2;
-            for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
+            for (State::HalfArcs::const_iterator r = matches->const_begin(), end = matches->const_end();
                  r != end; ++r) {
               Assert((*r)->in == EMPTY);
               out = (*r)->out;
@@ -390,7 +389,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
         } else {  // qa (lhs transducer) is larger
           // FIXME: total duplicated code from above case, except switching order of in/out.  a macro could
           // factor this w/ no runtime cost
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
+          for (State::Arcs::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
                ++r) {
             out = r->out;
             triDest.qb = r->dest;
@@ -405,7 +404,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               if (triSource.filter == 0)
                 if ((matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
                   triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
+                  for (State::HalfArcs::const_iterator l = matches->const_begin(), end = matches->const_end();
                        l != end; ++l) {
                     Assert((*l)->out == EMPTY);
                     in = (*l)->in;
@@ -417,7 +416,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             } else {
               triDest.filter = 0;
               if ((matches = find_second(*qa->index, (UnsignedKey)revMap[r->in]))) {
-                for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
+                for (State::HalfArcs::const_iterator l = matches->const_begin(), end = matches->const_end();
                      l != end; ++l) {
                   Assert(map[(*l)->out] == r->in);
                   in = (*l)->in;
@@ -432,7 +431,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             out = EMPTY;
             triDest.qb = triSource.qb;
             triDest.filter = 1;
-            for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
+            for (State::HalfArcs::const_iterator l = matches->const_begin(), end = matches->const_end();
                  l != end; ++l) {
               Assert((*l)->out == EMPTY);
               in = (*l)->in;
@@ -443,7 +442,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
           }
         }
       } else {  // both states too small to bother hashing
-        for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
+        for (State::Arcs::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
              ++l) {
           in = l->in;
           triDest.qa = l->dest;
@@ -456,7 +455,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
               COMPOSEARC_GROUP(cascade.record1(&*l));
             }
             if (triSource.filter == 0) {
-              for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
+              for (State::Arcs::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
                    r != end; ++r) {
                 if (r->in == EMPTY) {
                   out = r->out;
@@ -469,7 +468,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
             }
           } else {
             triDest.filter = 0;
-            for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
+            for (State::Arcs::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
                  r != end; ++r) {
               if (map[l->out] == r->in) {
                 out = r->out;
@@ -484,7 +483,7 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
           in = EMPTY;
           triDest.qa = triSource.qa;
           triDest.filter = 2;
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
+          for (State::Arcs::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
                ++r) {
             if (r->in == EMPTY) {
               out = r->out;
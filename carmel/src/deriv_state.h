@@ -0,0 +1,45 @@
+#ifndef GRAEHL_CARMEL__DERIV_STATE_H
+#define GRAEHL_CARMEL__DERIV_STATE_H
+
+// the key of the derivation lattice's state map (derivations.h)
+
+#include <graehl/shared/hashtable_fwd.hpp>
+#include <graehl/shared/hash_functions.hpp>
+#include <graehl/shared/print_read.hpp>
+#include <boost/cstdint.hpp>
+
+namespace graehl {
+
+// TODO: epsilon filter needed so training sums over subseqs of *e*:o and i:*e* don't care about order?  don't
+// think so.
+struct deriv_state {
+  typedef deriv_state self_type;
+  TO_OSTREAM_PRINT
+  template <class O>
+  void print(O& os) const {
+    os << '(';
+    os << i << ' ' << s << ' ' << o;
+    os << ')';
+  }
+  uint32_t i, s, o;  // input,state,output
+  uint32_t hash() const {
+    // return hash_quads_64(&i,sizeof(deriv_state)/sizeof(i));
+    return hash3(i, s, o);
+    // hash_bytes_32((void *)this,sizeof(deriv_state));
+  }
+  MEMBER_HASH
+  bool operator!=(deriv_state const& r) const { return !(*this == r); }
+  bool operator==(deriv_state const& r) const { return r.i == i && r.s == s && r.o == o; }
+
+  deriv_state() {}
+  deriv_state(uint32_t i, uint32_t s, uint32_t o) : i(i), s(s), o(o) {}
+};
+
+// inline uint32_t hash_value(deriv_state const& d) { return d.hash(); }
+}
+// above would suffice for boost::hash, but we're still 'flexible' and want to put in the same namespace as
+// hashtable impl so it gets found by default, so:
+
+// BEGIN_HASH_VAL(graehl::deriv_state) { return x.hash(); } END_HASH
+
+#endif
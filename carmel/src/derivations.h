@@ -37,41 +37,7 @@
 #include <boost/cstdint.hpp>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/io.hpp>
-
-namespace graehl {
-
-// TODO: epsilon filter needed so training sums over subseqs of *e*:o and i:*e* don't care about order?  don't
-// think so.
-struct deriv_state {
-  typedef deriv_state self_type;
-  TO_OSTREAM_PRINT
-  template <class O>
-  void print(O& os) const {
-    os << '(';
-    os << i << ' ' << s << ' ' << o;
-    os << ')';
-  }
-  uint32_t i, s, o;  // input,state,output
-  uint32_t hash() const {
-    // return hash_quads_64(&i,sizeof(deriv_state)/sizeof(i));
-    return hash3(i, s, o);
-    // hash_bytes_32((void *)this,sizeof(deriv_state));
-  }
-  MEMBER_HASH
-  bool operator!=(deriv_state const& r) const { return !(*this == r); }
-  bool operator==(deriv_state const& r) const { return r.i == i && r.s == s && r.o == o; }
-
-  deriv_state() {}
-  deriv_state(uint32_t i, uint32_t s, uint32_t o) : i(i), s(s), o(o) {}
-};
-
-// inline uint32_t hash_value(deriv_state const& d) { return d.hash(); }
-}
-// above would suffice for boost::hash, but we're still 'flexible' and want to put in the same namespace as
-// hashtable impl so it gets found by default, so:
-
-// BEGIN_HASH_VAL(graehl::deriv_state) { return x.hash(); } END_HASH
-
+#include <carmel/src/deriv_state.h>
 
 namespace graehl {
 
@@ -92,6 +58,7 @@ struct arcs_table : public dynamic_array<arc_counts> {
     assert(a.data_as<unsigned>() < this->size());
     return (*(arcs_type*)this)[a.data_as<unsigned>()];
   }
+  Weight& weight(GraphArc const& a) const { return ac(a).weight(); }
 
   void operator()(unsigned s, FSTArc& a) {
     this->push_back();
@@ -139,6 +106,181 @@ struct arcs_table : public dynamic_array<arc_counts> {
 #undef ARCS_TABLE_EACH
 };
 
+// the EM parameter table: arc_counts rows (FSTArc *, src) plus one contiguous column per per-arc Weight, all
+// indexed by the same arc id.  each M-step sweep streams through only the columns it touches, and the sweeps
+// that always run back to back are fused into a single pass.  the parameters themselves are the weights
+// column, copied from the FSTArc weights on construction; load_weights() and store_weights() sync the two
+// where training hands the WFST to code that reads or writes its arcs (cascade update, normalize, output).
+// several tables over the same WFST can so train independently (parallel random restarts)
+struct em_arcs_table : public arcs_table<arc_counts> {
+  typedef arcs_table<arc_counts> rows_type;
+  typedef fixed_array<Weight> column;
+  column counts;
+  column prior_counts;
+  column scratch;  // old weight during maximize; per-example counts for the matrix forward/backward
+  column em_weight;  // raw EM weight (pre-overrelax), or composed weight before estimate (cascade)
+  column best_weight;
+  mutable column weights;  // the parameters
+  column stepwise;  // online EM: running average of corpus-scaled counts
+
+  em_arcs_table(WFST& x, bool per_arc_prior = false, Weight global_prior = 1.)
+      : rows_type(x, per_arc_prior, global_prior) {
+    unsigned n = this->size();
+    counts.init(n);
+    prior_counts.init(n);
+    scratch.init(n);
+    em_weight.init(n);
+    best_weight.init(n);
+    weights.init(n);
+    for (unsigned i = 0; i != n; ++i) {
+      Weight const& w = (*this)[i].weight();
+      weights[i] = w;
+      prior_counts[i] = per_arc_prior ? global_prior + w : global_prior;
+    }
+  }
+
+  // weights from the FSTArc weights
+  void load_weights() {
+    for (unsigned i = 0, n = this->size(); i != n; ++i) weights[i] = (*this)[i].weight();
+  }
+  // FSTArc weights from weights
+  void store_weights() const {
+    for (unsigned i = 0, n = this->size(); i != n; ++i) (*this)[i].weight() = weights[i];
+  }
+
+  Weight& weight(unsigned i) const { return weights[i]; }
+  Weight& weight(GraphArc const& a) const { return weight(id(a)); }
+  bool locked(unsigned i) const { return WFST::isLocked((*this)[i].groupId()); }
+  unsigned id(GraphArc const& a) const {
+    assert(a.data_as<unsigned>() < this->size());
+    return a.data_as<unsigned>();
+  }
+
+#define EM_ARCS_EACH(i) for (unsigned i = 0, N = this->size(); i != N; ++i)
+
+  void clear_counts() { EM_ARCS_EACH(i) counts[i].setZero(); }
+  void clear_scratch() { EM_ARCS_EACH(i) scratch[i].setZero(); }
+  void add_weighted_scratch(Weight w) {
+    EM_ARCS_EACH(i)
+    if (!scratch[i].isZero()) counts[i] += w * scratch[i];
+  }
+
+  // for cascade, use before update->estimate so cascade can recover counts later (estimate doesn't use
+  // em_weight)
+  void save_counts() { EM_ARCS_EACH(i) em_weight[i] = weight(i); }
+  // use after estimate if you got a new global best
+  void save_best_counts() { EM_ARCS_EACH(i) best_weight[i] = em_weight[i]; }
+  void save_best() { EM_ARCS_EACH(i) best_weight[i] = weight(i); }
+  void use_best_weight() { EM_ARCS_EACH(i) weight(i) = best_weight[i]; }
+  void keep_em_weight() { EM_ARCS_EACH(i) weight(i) = em_weight[i]; }
+  void swap_em_scaled() { EM_ARCS_EACH(i) std::swap(em_weight[i], weight(i)); }
+  void save_old_weights() { EM_ARCS_EACH(i) scratch[i] = weight(i); }
+
+  // online (stepwise) EM: stepwise = (1-rate)*stepwise + rate*scale*counts; weight gets (unnormalized)
+  // stepwise+prior, and counts are cleared for the next mini-batch.  locked arcs are untouched.  the average
+  // starts from the initial weights, so arcs unused by the first mini-batches don't drop to 0 (which would
+  // make later examples impossible)
+  void start_stepwise() {
+    stepwise.reinit(this->size());
+    EM_ARCS_EACH(i) stepwise[i] = weight(i);
+  }
+  void stepwise_update(FLOAT_TYPE rate, FLOAT_TYPE scale) {
+    Weight keep = 1 - rate, add = rate * scale;
+    EM_ARCS_EACH(i) {
+      if (locked(i)) continue;
+      Weight& m = stepwise[i];
+      m = m * keep + counts[i] * add;
+      weight(i) = m + prior_counts[i];
+      counts[i].setZero();
+      NANCHECK(m);
+    }
+  }
+
+  // scratch gets previous weight; weight gets (unnormalized) counts+prior.  locked arcs are untouched.  note:
+  // it's not possible for a cascade composed arc to have a locked groupid
+  void prep_new_weights(Weight scale_prior) {
+    EM_ARCS_EACH(i) {
+      if (locked(i)) continue;
+      Weight& w = weight(i);
+      scratch[i] = w;
+      w = counts[i] + prior_counts[i] * scale_prior;
+      NANCHECK(counts[i]);
+      NANCHECK(prior_counts[i]);
+      NANCHECK(w);
+    }
+  }
+
+  // overrelax weight() and store raw EM weight in em_weight.  scratch has the old weight (prep_new_weights).
+  // POST: need normalization again
+  void overrelax(FLOAT_TYPE delta_scale) {
+    EM_ARCS_EACH(i) {
+      Weight& w = weight(i);
+      em_weight[i] = w;
+      NANCHECK(w);
+      if (!locked(i) && scratch[i].isPositive()) {
+        w = scratch[i] * ((em_weight[i] / scratch[i]).pow(delta_scale));
+        NANCHECK(w);
+      }
+    }
+  }
+
+  Weight max_change() const {
+    Weight maxChange;
+    EM_ARCS_EACH(i)
+    if (!locked(i)) {
+      Weight change = absdiff(weight(i), scratch[i]);
+      if (change > maxChange) maxChange = change;
+    }
+    return maxChange;
+  }
+
+  // overrelax(1) (em_weight gets the normalized weight) and max_change() in one pass
+  Weight keep_em_max_change() {
+    Weight maxChange;
+    EM_ARCS_EACH(i) {
+      Weight const& w = weight(i);
+      em_weight[i] = w;
+      NANCHECK(w);
+      if (!locked(i)) {
+        Weight change = absdiff(w, scratch[i]);
+        if (change > maxChange) maxChange = change;
+      }
+    }
+    return maxChange;
+  }
+
+  // the old arc_counts debug line: the row's arc and weight, then its scratch and counts columns
+  void print(std::ostream& o, unsigned i) const {
+    arc_counts const& ac = (*this)[i];
+    int pGroup;
+    if (!WFST::isNormal(pGroup = ac.groupId())) o << pGroup << ' ';
+    o << ac.src << "->" << *ac.arc << " weight " << weight(i) << " scratch: " << scratch[i] << " counts "
+      << counts[i] << '\n';
+  }
+
+  // o << row(i) prints as print(o, i).  (o << (*this)[i] has only the row, without the columns)
+  struct printed_row {
+    em_arcs_table const* table;
+    unsigned i;
+    friend std::ostream& operator<<(std::ostream& o, printed_row const& r) {
+      r.table->print(o, r.i);
+      return o;
+    }
+  };
+  printed_row row(unsigned i) const {
+    printed_row r = {this, i};
+    return r;
+  }
+
+  void dump(std::ostream& o, char const* header = "") const {
+    o << "\n" << header << "\n";
+    EM_ARCS_EACH(i)
+    o << row(i);
+  }
+
+#undef EM_ARCS_EACH
+};
+
 struct wfst_io_index : boost::noncopyable {
   typedef arc_counts counts_type;
   typedef dynamic_array<unsigned> for_io;  // id in arcs_table
@@ -174,7 +316,12 @@ struct derivations {
   bool no_goal;
   bool cache_backward;
 
+#ifndef USE_STD_HASH_MAP
+  // probed for every state reached; no entry is referenced across inserts
+  typedef FlatHashTable<deriv_state, state_id> state_to_id;
+#else
   typedef HashTable<deriv_state, state_id> state_to_id;
+#endif
   state_to_id id_of_state;
   typedef fixed_array<deriv_state> id_to_state;
   void fill_id_to_state(id_to_state& f) {
@@ -295,7 +442,7 @@ struct derivations {
                     return t[a.data_as<unsigned>()];*/
       return t.ac(a);
     }
-    Weight operator()(GraphArc const& a) const { return t.ac(a).weight(); }
+    Weight operator()(GraphArc const& a) const { return t.weight(a); }
   };
 
   // FIXME: allow storying r.graph() as primary, free up graph() (for gibbs)
@@ -428,7 +575,7 @@ struct derivations {
     return prob;
   }
 
-  // update expected counts and return prob (sum of paths)
+  // update expected counts (em_arcs_table counts column) and return prob (sum of paths)
   template <class arcs_table>
   Weight collect_counts(arcs_table& t) {
     //        update_weights(t);
@@ -440,9 +587,9 @@ struct derivations {
       arcs_type const& arcs = g[s].arcs;
       for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
         GraphArc const& a = *i;
-        arc_counts& ac = wf.ac(a);
-        Weight arc_contrib = ac.weight() * f[a.src] * b[a.dest];
-        ac.counts += arc_contrib * weight / prob;
+        unsigned id = t.id(a);
+        Weight arc_contrib = t.weight(id) * f[a.src] * b[a.dest];
+        t.counts[id] += arc_contrib * weight / prob;
       }
     }
     return prob;
@@ -1,6 +1,7 @@
 #include <graehl/shared/config.h>
 #include <cctype>
 #include <carmel/src/fst.h>
+#include <carmel/src/normalize_plan.h>
 #include <graehl/shared/kbest.h>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/genio.h>
@@ -34,13 +35,13 @@ unsigned WFST::generate(unsigned* inSeq, unsigned* outSeq, unsigned minArcs, uns
       return 1;
     }
     unsigned whichInput = (unsigned)(states[s].index->size() * randomFloat());
-    const HashTable<UnsignedKey, List<HalfArc> >& hat = *states[s].index;
-    for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ha = hat.begin(); ha != hat.end(); ++ha)
+    const State::Index& hat = *states[s].index;
+    for (State::Index::const_iterator ha = hat.begin(); ha != hat.end(); ++ha)
       if (!whichInput--) {
         Weight which = randomFloat();
         Weight cum;
 
-        List<HalfArc>::const_iterator a, begin = ha->second.const_begin(), end = ha->second.const_end();
+        State::HalfArcs::const_iterator a, begin = ha->second.const_begin(), end = ha->second.const_end();
 
         for (a = begin; a != end; ++a) {
           cum += (*a)->weight;
@@ -84,163 +85,52 @@ std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>&
 }
 
 void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups) {
-  norm_group_by group = method.group;
-
-  if (group == NONE) return;
-  if (group == CONDITIONAL) indexInput();
-
-  graehl::mean_field_scale const& scale = method.scale;
-
-  // NEW plan:
-  // step 1: compute sum of counts for non-locked arcs, and divide it by (1-(sum of locked arcs)) to reserve
-  // appropriate counts for the locked arcs
-  // step 2: for tied arc groups, add these inferred counts to the group state counts total.  also sum group
-  // arc counts total.
-  // step 3: assign tied arc weights; trouble: tied arcs sharing space with inflexible tied arcs.  under- or
-  // over- allocation can result ...
-  //   ... alternative: give locked arcs implied counts in the tie group; norm-group having tie-group arcs,
-  //   with highest locked arc sum R divides unscaled tie group state counts total by (1-R) instead of
-  //   dividing individual state counts by (1-sum).  this ensures that tied arcs are kept small enough to make
-  //   room for locked ones in ALL states and should leave some room for normal arcs as well
-  // step 4: give normal arcs their share of what's left, if anything
-
-  Weight addc = method.add_count;
-  unsigned pGroup;
-  HashTable<UnsignedKey, Weight> groupArcTotal;
-  HashTable<UnsignedKey, Weight> groupStateTotal;
-  HashTable<UnsignedKey, Weight> groupMaxLockedSum;
-// global pass 1: compute the sum of unnormalized weights for each normalization group.  sum for each arc in
-// a tie group, its weight and its normalization group's weight.
-#include <graehl/shared/warning_push.h>
-  GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-#include <graehl/shared/warning_pop.h>
-#ifdef DEBUGNORMALIZE
-    Config::debug() << "Normgroup=" << g;
-#endif
-    Weight sum, locked_sum;  // =0, sum of probability of all arcs that has this input
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
-      Weight& w = a.weight;
-      w += addc;
-      if (isLocked(a.groupId))  // note: training does not set any counts for locked arcs.  so this is the
-        // original weight
-        locked_sum += w;
-      else {
-        sum += w;
-      }
-    }
-#ifdef DEBUGNORMALIZE
-    Config::debug() << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
-#endif
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc const& a = **g;
-      if (isTied(pGroup = a.groupId)) {
-        groupArcTotal[pGroup] += a.weight;  // default init is to 0
-        groupStateTotal[pGroup] += sum;
-        Weight& m = groupMaxLockedSum[pGroup];
-        if (locked_sum > m) m = locked_sum;
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupMaxLockedSum[pGroup]);
-#ifdef DEBUGNORMALIZE
-        Config::debug() << "Tiegroup=" << pGroup << " Normgroup=" << g
-                        << " tie_weight=" << groupArcTotal[pGroup]
-                        << " sum_state_weight=" << groupStateTotal[pGroup] << " max_locked=" << m << std::endl;
-#endif
-      }
-    }
-  }
-
+  if (method.group == NONE) return;
+  normalize_plan plan(*this, method.group);
+  plan.normalize(method, uniform_zero_normgroups);
+}
 
-// global pass 2: assign weights
+void normalize_plan::build(WFST& w, WFST::norm_group_by g) {
+  x = &w;
+  group = g;
+  arcs.clear();
+  group_begin.clear();
+  tie.clear();
+  tied_at.clear();
+  tied_group.clear();
+  arc_id.clear();
+  n_ties = 0;
+  if (group == WFST::NONE) return;
+  if (group == WFST::CONDITIONAL) w.indexInput();
+  typedef HashTable<UnsignedKey, unsigned> TI;
+  TI tie_index;
 #include <graehl/shared/warning_push.h>
   GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
+  for (NormGroupIter gi(group, w); gi.moreGroups(); gi.nextGroup()) {
 #include <graehl/shared/warning_pop.h>
-    Weight normal_sum;  //=0
-    Weight reserved;  // =0
-    Assert(reserved.isZero() && normal_sum.isZero());
-    // pass 2a: assign tied (and locked) arcs their weights, taking 'reserved' weight from the normal arcs in
-    // their group
-    // tied arc weight = sum (over arcs in tie group) of weight / sum (over arcs in tie group) of
-    // norm-group-total-weight
-    // also, compute sum of normal arcs
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
-      if (isTied(pGroup = a.groupId)) {  // tied:
-        Weight groupNorm
-            = *find_second(groupStateTotal,
-                           (UnsignedKey)pGroup);  // can be 0 if no counts at all for any states of group
-        Weight gmax = *find_second(groupMaxLockedSum, (UnsignedKey)pGroup);
-        NANCHECK(gmax);
-        Weight one(1.);
-        if (gmax > one) {
-          a.weight.setZero();
-        } else {
-          if (!gmax.isZero())
-            groupNorm /= (one - gmax);  // as described in NEW plan above: ensure tied arcs leave room for the
-          // worst case competing locked arcs sum in any norm-group
-          NANCHECK(groupNorm);
-
-          Weight groupTotal = *find_second(groupArcTotal, (UnsignedKey)pGroup);
-          NANCHECK(groupTotal);
-          if (!groupTotal.isZero()) {  // then groupNorm non0 also
-            a.weight = scale(groupTotal) / scale(groupNorm);
-
-            reserved += a.weight;
-          } else
-            a.weight.setZero();
-          NANCHECK(reserved);
-        }
-      } else if (isLocked(pGroup)) {  // locked:
-        reserved += a.weight;
-        NANCHECK(reserved);
-      } else {  // normal
-        normal_sum += a.weight;
+    unsigned gid = group_begin.size();
+    group_begin.push_back(arcs.size());
+    for (gi.beginArcs(); gi.moreArcs(); gi.nextArc()) {
+      FSTArc* a = *gi;
+      unsigned pGroup = a->groupId;
+      unsigned t;
+      if (WFST::isLocked(pGroup))
+        t = LOCKED;
+      else if (WFST::isNormal(pGroup))
+        t = NORMAL;
+      else {
+        TI::insert_result_type i = tie_index.insert(TI::value_type(pGroup, n_ties));
+        if (i.second) ++n_ties;
+        t = i.first->second;
+        tied_at.push_back(arcs.size());
+        tied_group.push_back(gid);
       }
+      arcs.push_back(a);
+      tie.push_back(t);
     }
-
-#ifdef DEBUGNORMALIZE
-    if (reserved > 1.001)
-      Config::warn() << "Warning: sum of reserved arcs for " << g << " = " << reserved
-                     << " - should not exceed 1.0\n";
-#endif
-
-    // pass 2b: give normal arcs their share of however much is left
-    Weight fraction_remain = 1.;
-    fraction_remain -= reserved;
-    NANCHECK(fraction_remain);
-    bool something_left_for_normal = !fraction_remain.isZero();
-    if (something_left_for_normal && (uniform_zero_normgroups || !normal_sum.isZero())) {
-      NANCHECK(normal_sum);
-      Weight scaled_sum = scale(normal_sum);
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) {
-          a.weight = fraction_remain * scale(a.weight) / scaled_sum;
-          NANCHECK(a.weight);
-        }
-      }
-    } else  // nothing left, sorry
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) a.weight.setZero();
-      }
-  }
-
-#ifdef CHECKNORMALIZE
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-    Weight sum;
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) sum += (*g)->weight;
-#define NORM_EPSILON .01
-    if (sum > 1 + NORM_EPSILON || sum < 1 - NORM_EPSILON)
-      Config::warn() << "Warning: sum of normalized arcs for " << g << " = " << sum
-                     << " - should equal 1.0\n";
   }
-#endif
-
-  if (group == CONDITIONAL) indexFlush();  // free up by-input index we created at start
+  group_begin.push_back(arcs.size());
+  if (group == WFST::CONDITIONAL) w.indexFlush();  // free up by-input index we created at start
 }
 
 void WFST::assignWeights(const WFST& source) {
@@ -248,15 +138,15 @@ void WFST::assignWeights(const WFST& source) {
   unsigned s;
   unsigned pGroup;
   for (s = 0; s < source.numStates(); ++s) {
-    const List<FSTArc>& arcs = source.states[s].arcs;
-    for (List<FSTArc>::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
+    const State::Arcs& arcs = source.states[s].arcs;
+    for (State::Arcs::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
       if (isTied(pGroup = a->groupId)) groupWeight[pGroup] = a->weight;
   }
   Weight* pWeight;
   for (s = 0; s < numStates(); ++s) {
     states[s].flush();
-    List<FSTArc>& arcs = states[s].arcs;
-    for (List<FSTArc>::erase_iterator a = arcs.erase_begin(), end = arcs.erase_end(); a != end;) {
+    State::Arcs& arcs = states[s].arcs;
+    for (State::Arcs::erase_iterator a = arcs.erase_begin(), end = arcs.erase_end(); a != end;) {
       if (isTied(pGroup = a->groupId)) {
         if ((pWeight = find_second(groupWeight, (UnsignedKey)pGroup))) {
           a->weight = *pWeight;
@@ -273,7 +163,7 @@ void WFST::assignWeights(const WFST& source) {
 
 void WFST::unTieGroups() {
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = no_group;
   }
@@ -281,7 +171,7 @@ void WFST::unTieGroups() {
 
 void WFST::lockArcs() {
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = 0;
   }
@@ -290,7 +180,7 @@ void WFST::lockArcs() {
 unsigned WFST::numberArcsFrom(unsigned label) {
   Assert(label > 0);
   for (unsigned s = 0; s < numStates(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a)
       a->groupId = label++;
   }
@@ -303,7 +193,7 @@ void WFST::invert() {
   unsigned temp;
   in_alph().swap(out_alph());
   for (unsigned s = 0; s < states.size(); ++s) {
-    for (List<FSTArc>::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
+    for (State::Arcs::val_iterator a = states[s].arcs.val_begin(), end = states[s].arcs.val_end(); a != end;
          ++a) {
       // XXX should use SWAP here instead?
       temp = a->in;
@@ -324,7 +214,7 @@ Graph WFST::makeGraph()
   GraphState* g = NEW GraphState[numStates()];
   GraphArc gArc;
   for (unsigned i = 0, N = numStates(); i < N; ++i) {
-    for (List<FSTArc>::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
+    for (State::Arcs::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
          ++l) {
       gArc.src = i;
       gArc.dest = l->dest;
@@ -351,7 +241,7 @@ Graph WFST::makeEGraph()
   GraphState* g = NEW GraphState[numStates()];
   GraphArc gArc;
   for (unsigned i = 0; i < numStates(); ++i)
-    for (List<FSTArc>::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
+    for (State::Arcs::val_iterator l = states[i].arcs.val_begin(), end = states[i].arcs.val_end(); l != end;
          ++l)
       if (l->in == 0 && l->out == 0) {
         gArc.src = i;
@@ -368,6 +258,25 @@ Graph WFST::makeEGraph()
   return ret;
 }
 
+WFST::reverse_arcs::reverse_arcs(WFST const& wfst) : first(wfst.numStates() + 2, 0) {
+  unsigned const n = wfst.numStates();
+  for (unsigned s = 0; s < n; ++s)
+    for (State::Arcs::const_iterator a = wfst.states[s].arcs.const_begin(), end = wfst.states[s].arcs.const_end();
+         a != end; ++a)
+      ++first[a->dest + 2];
+  for (unsigned i = 2; i <= n + 1; ++i) first[i] += first[i - 1];
+  entries.resize(first[n + 1]);
+  for (unsigned s = n; s-- > 0;) {  // later sources first, as reverseGraph(makeGraph()) has them
+    State::Arcs& arcs = const_cast<State&>(wfst.states[s]).arcs;
+    for (State::Arcs::val_iterator a = arcs.val_begin(), end = arcs.val_end(); a != end; ++a) {
+      entry& e = entries[first[a->dest + 1]++];
+      e.src = s;
+      e.arc = &*a;
+    }
+  }
+  first.pop_back();
+}
+
 #include <algorithm>
 // for std::sort
 
@@ -390,9 +299,6 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
   if (max_states == UNLIMITED && all_paths) return;
   unsigned n_states = numStates();
 
-  Graph for_graph = makeGraph();
-  Graph rev_graph = reverseGraph(for_graph);
-
   bool* remove = NEW bool[n_states];
   FLOAT_TYPE worst_d_dist = keep_paths_within_ratio.getLogImp();
   FLOAT_TYPE* for_dist = NEW FLOAT_TYPE[n_states];
@@ -400,8 +306,8 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
   // todo: efficiency: could use indirected compare on array of integers, instead of moving around
   // FLOAT_TYPE+integer
   PFI* best_path_cost = NEW PFI[n_states];
-  shortestDistancesFrom(for_graph, 0, for_dist, NULL);
-  shortestDistancesFrom(rev_graph, final, rev_dist, NULL);
+  shortestDistancesFrom(graph(), 0, for_dist);
+  shortestDistancesFrom(reverse_graph(), final, rev_dist);
   FLOAT_TYPE best_path = for_dist[final];
   FLOAT_TYPE worst_path = best_path + worst_d_dist;
   Assert(fabs(best_path - rev_dist[0]) < 1e-5);
@@ -435,7 +341,7 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
       else {
         remove[st] = false;
         State& s = states[st];
-        for (List<FSTArc>::erase_iterator a(s.arcs.erase_begin()), end = s.arcs.erase_end(); a != end;) {
+        for (State::Arcs::erase_iterator a(s.arcs.erase_begin()), end = s.arcs.erase_end(); a != end;) {
           FLOAT_TYPE best_path_this_arc = (-a->weight.getLogImp()) + for_dist[st] + rev_dist[a->dest];
 #ifdef DEBUGPRUNE
           Config::debug() << "FSTArc " << st << ": ";
@@ -461,8 +367,6 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
   delete[] for_dist;
   delete[] rev_dist;
   delete[] remove;
-  delete[] rev_graph.states;
-  delete[] for_graph.states;
 }
 
 void WFST::reduce() {
@@ -473,34 +377,24 @@ void WFST::reduce() {
     return;
   }
 
-  Graph g = makeGraph();
-  GraphState* graph = g.states;
-  Graph revG = reverseGraph(g);
-  GraphState* revGraph = revG.states;
-  Assert(nStates == g.nStates && g.nStates == revG.nStates);
+  graph_view g(graph());
+  reverse_graph_view rev(reverse_graph());
+  dfs_visitor reach;
+  depth_first_search<graph_view> forward(g);
+  forward.search_from(0, reach);
+  depth_first_search<reverse_graph_view> backward(rev);
+  backward.search_from(final, reach);
 
-  bool* visitedForward = NEW bool[nStates];
-  bool* visitedBackward = NEW bool[nStates];
-  // bool *discard = NEW bool[nStates];
+  bool* discard = NEW bool[nStates];
   unsigned i;
-  for (i = 0; i < nStates; ++i) {
-    visitedForward[i] = false;
-    visitedBackward[i] = false;
-  }
-
-  depthFirstSearch(g, 0, visitedForward, NULL);
-  depthFirstSearch(revG, final, visitedBackward, NULL);
-
-
-  // bool *discard = visitedForward;
-  for (i = 0; i < nStates; ++i) visitedForward[i] = !(visitedForward[i] && visitedBackward[i]);
+  for (i = 0; i < nStates; ++i) discard[i] = !(forward.seen(i) && backward.seen(i));
 
   // Begin additions by Yaser to fix a bug where when a state is discarded, the tieGroup is not updated
   // when states are discarded, their repsective arcs must be removed from tieGroup
   /* jon: the below by yaser makes no sense.  tie groups are not explicit lists
      for ( i = 0 ; i < nStates ; ++i ) {
      discard[i] = !(visitedForward[i] && visitedBackward[i]);
-     for ( List<FSTArc>::iterator a(states[i].arcs.begin()), end = states[i].arcs.end() ; a !=end ; ++a ) {
+     for ( State::Arcs::iterator a(states[i].arcs.begin()), end = states[i].arcs.end() ; a !=end ; ++a ) {
      if ((discard[i])
      || !(visitedForward[a->dest] && visitedBackward[(a->dest)])) { // if a state should be discarded remove
      its arcs from tie group, also an FSTArc must be removed if its destination state is discarded.
@@ -510,17 +404,161 @@ void WFST::reduce() {
      }
      // end of Yaser's additions - Oct. 12 2000
      */
-  removeMarkedStates(visitedForward);
+  removeMarkedStates(discard);
 
   for (i = 0; i < numStates(); ++i) {
     states[i].remove_epsilons_to(i);
   }
 
-  delete[] visitedBackward;
-  delete[] visitedForward;
-  // delete[] discard;
-  delete[] revGraph;
-  delete[] graph;
+  delete[] discard;
+}
+
+namespace {
+struct epsilon_arc {
+  unsigned dest;
+  Weight weight;
+};
+typedef csr_graph<epsilon_arc> epsilon_graph;  // the *e*:*e* arcs
+
+typedef std::vector<std::pair<unsigned, Weight> > closure;  // (state, sum of epsilon paths to it)
+}
+
+bool WFST::remove_epsilons(unsigned max_cycle) {
+  if (!valid()) return true;
+  unsigned n = numStates();
+  epsilon_graph eg;
+  eg.first.reserve(n + 1);
+  for (unsigned s = 0; s < n; ++s) {
+    eg.start_state();
+    if (s == final) continue;  // paths through final stay: to final by one arc, then final's own
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), e = states[s].arcs.const_end(); a != e;
+         ++a)
+      if (!a->in && !a->out) {
+        epsilon_arc x = {a->dest, a->weight};
+        eg.arcs.push_back(x);
+      }
+  }
+  eg.finish();
+  if (eg.arcs.empty()) return true;
+  epsilon_graph::graph_view g = eg.graph();
+
+  // closures by strongly connected component, sinks first: within a component C, (I-A)^-1 (A: C's internal
+  // epsilon weights), applied to what leaves C (itself, and the finished closures of the components after)
+  strong_components scc(n);
+  depth_first_search<epsilon_graph::graph_view> dfs(g);
+  for (unsigned s = 0; s < n; ++s)
+    if (g.has_arcs(s)) dfs.search_from(s, scc);
+  std::vector<closure> closures(n);  // empty (meaning just {(s,1)}) for states without epsilon arcs
+  std::vector<Weight> sum(n);
+  std::vector<unsigned> touched, local(n);
+  std::vector<double> a, inv, pot;
+  std::vector<Weight> aw;
+  std::vector<closure> leaving;
+  unsigned const* component_states = scc.states.data();
+  for (unsigned c = 0, nc = scc.n_components(); c < nc; ++c) {
+    unsigned const *begin = component_states + scc.first[c], *end = component_states + scc.first[c + 1];
+    unsigned k = (unsigned)(end - begin);
+    if (k == 1 && !g.has_arcs(*begin)) continue;
+    if (k > max_cycle) {
+      Config::warn() << "Not removing epsilons: a cycle of " << k
+                     << " states connected by *e*:*e* arcs (more than " << max_cycle << ").\n";
+      return false;
+    }
+    for (unsigned i = 0; i < k; ++i) local[begin[i]] = i;
+    aw.assign(k * k, Weight());
+    leaving.assign(k, closure());
+    for (unsigned i = 0; i < k; ++i) {
+      unsigned q = begin[i];
+      sum[q] = 1;
+      touched.push_back(q);
+      for (epsilon_graph::graph_view::arc_iterator x = g.arcs_begin(q), e = g.arcs_end(q); x != e; ++x) {
+        unsigned d = x->dest;
+        if (scc.component[d] == c) {
+          aw[i * k + local[d]] += x->weight;
+          continue;
+        }
+        closure const& cd = closures[d];
+        if (cd.empty()) {
+          if (sum[d].isZero()) touched.push_back(d);
+          sum[d] += x->weight;
+        } else
+          for (closure::const_iterator j = cd.begin(), je = cd.end(); j != je; ++j) {
+            if (sum[j->first].isZero()) touched.push_back(j->first);
+            sum[j->first] += x->weight * j->second;
+          }
+      }
+      for (std::vector<unsigned>::const_iterator t = touched.begin(), te = touched.end(); t != te; ++t) {
+        if (!sum[*t].isZero()) leaving[i].push_back(closure::value_type(*t, sum[*t]));
+        sum[*t].setZero();
+      }
+      touched.clear();
+    }
+    // (I-A)^-1 after rescaling A by scale_component, so weights far from 1 don't over/underflow
+    scale_result scaled = scale_component(aw, k, pot, a);
+    if (scaled == scale_underflows) {
+      Config::warn() << "Not removing epsilons: the *e*:*e* weights around a cycle span too wide a range "
+                        "to sum in double precision.\n";
+      return false;
+    }
+    if (scaled != scale_ok || !invert_identity_minus(a, k, inv)) {
+      Config::warn() << "Not removing epsilons: the paths around a cycle of *e*:*e* arcs have an infinite "
+                        "sum.\n";
+      return false;
+    }
+    for (unsigned i = 0; i < k; ++i) {
+      for (unsigned j = 0; j < k; ++j) {
+        double m = inv[i * k + j];
+        if (!(m > 0)) continue;
+        Weight wm = Weight(m) * Weight(pot[j] - pot[i], ln_weight());
+        for (closure::const_iterator l = leaving[j].begin(), le = leaving[j].end(); l != le; ++l) {
+          if (sum[l->first].isZero()) touched.push_back(l->first);
+          sum[l->first] += wm * l->second;
+        }
+      }
+      closure& ci = closures[begin[i]];
+      for (std::vector<unsigned>::const_iterator t = touched.begin(), te = touched.end(); t != te; ++t) {
+        if (!sum[*t].isZero()) ci.push_back(closure::value_type(*t, sum[*t]));
+        sum[*t].setZero();
+      }
+      touched.clear();
+    }
+  }
+
+  // every new arc list is made from the old arcs before any is replaced
+  std::vector<std::vector<FSTArc> > replaced(n);
+  for (unsigned p = 0; p < n; ++p) {
+    closure const& cp = closures[p];
+    std::vector<FSTArc>& arcs = replaced[p];
+    for (closure::const_iterator l = cp.begin(), le = cp.end(); l != le; ++l) {
+      unsigned q = l->first;
+      Weight d = l->second;
+      if (q == final) {
+        arcs.push_back(FSTArc(0, 0, final, d));
+        continue;
+      }
+      State::Arcs const& qarcs = states[q].arcs;
+      for (State::Arcs::const_iterator x = qarcs.const_begin(), e = qarcs.const_end(); x != e; ++x)
+        if (x->in || x->out) {
+          arcs.push_back(*x);
+          if (q != p || !d.isOne()) {
+            arcs.back().weight *= d;
+            arcs.back().groupId = no_group;
+          }
+        }
+    }
+  }
+  for (unsigned p = 0; p < n; ++p) {
+    if (closures[p].empty()) continue;
+    State& st = states[p];
+    st.flush();
+    st.arcs.clear();
+    st.size = 0;
+    std::vector<FSTArc> const& arcs = replaced[p];
+    for (std::vector<FSTArc>::const_reverse_iterator x = arcs.rbegin(), e = arcs.rend(); x != e; ++x)
+      st.addArc(*x);  // (at the front)
+  }
+  reduce();
+  return true;
 }
 
 void WFST::consolidateArcs(bool sum, bool clamp) {
@@ -22,11 +22,14 @@
 #include <algorithm>
 #include <graehl/shared/kbest.h>
 #include <boost/config.hpp>
+#include <boost/shared_ptr.hpp>
 #include <graehl/shared/config.h>
 #include <graehl/shared/mean_field_scale.hpp>
 #include <graehl/shared/size_mega.hpp>
 #include <graehl/shared/debugprint.hpp>
 #include <graehl/shared/gibbs_opts.hpp>
+#include <graehl/shared/string_to.hpp>
+#include <graehl/shared/string_builder.hpp>
 
 namespace graehl {
 
@@ -51,7 +54,7 @@ struct cascade_parameters;  // in cascade.h, but we avoid circular dependency by
 
 class WFST {
  public:
-  typedef Alphabet<StringKey, StringPool> alphabet_type;
+  typedef Alphabet<StringKey, ArenaStringPool> alphabet_type;
   typedef unsigned state_id;
   enum { DEFAULT_PER_LINE, STATE, ARC } /*Per_Line */;
   enum { DEFAULT_ARC_FORMAT, BRIEF, FULL } /*Arc_Format*/;
@@ -68,6 +71,8 @@ class WFST {
     graehl::word_spacer sp;
     state_id src;
     Weight w;
+    string_builder line;  // the text so far, written to out() a line at a time
+    Weight::out_format wf;  // out()'s
     path_print() : O(), I(), Q(), AT(), W(), E(), pout(&Config::out()) {}
     path_print(bool const* flags) : pout(&Config::out()) { set_flags(flags); }
     void set_flags(bool const* flags) {
@@ -85,30 +90,44 @@ class WFST {
       sp.reset();
       output.clear();
       w.setOne();
+      line.clear();
+      wf = Weight::get_out_format(*pout);
     }
     bool needs_weight() const { return AT || (!W && (O || I)); }
 
     void finish(WFST const& wfst) {
-      std::ostream& out = *pout;
-      using namespace std;
       if (AT) {
-        out << endl;
+        end_line();
         sp.reset();
-        for (Output::const_iterator i = output.begin(), e = output.end(); i != e; ++i)
-          out << sp << wfst.outLetter(*i);
-        out << endl;
+        for (Output::const_iterator i = output.begin(), e = output.end(); i != e; ++i) {
+          sp.append(line);
+          line(wfst.outLetter(*i));
+        }
+        end_line();
       } else {
-        if (!W) out << sp << w;
-        out << endl;
+        if (!W) {
+          sp.append(line);
+          w.append(line, wf);
+        }
+        end_line();
       }
     }
-    static void out_maybe_quote(char const* str, ostream& out, bool quote) {
+    /// line << endl
+    void end_line() {
+      line('\n');
+      pout->write(line.data(), line.size());
+      pout->flush();
+      line.clear();
+    }
+    template <class Out>
+    static void out_maybe_quote(char const* str, Out& out, bool quote) {
       if (quote)
         out << str;
       else
         outWithoutQuotes(str, out);
     }
-    static void outWithoutQuotes(const char* str, ostream& out) {
+    template <class Out>
+    static void outWithoutQuotes(const char* str, Out& out) {
       if (*str != '\"') {
         out << str;
         return;
@@ -129,22 +148,24 @@ class WFST {
     void arc(WFST const& w, PathArc const& p) { arc(p); }
     void arc(WFST const& wfst, FSTArc const* a) { arc(wfst, *a); }
     void arc(WFST const& wfst, FSTArc const& arc) {
-      std::ostream& out = *pout;
       w *= arc.weight;
       if (AT) {
         unsigned inid = arc.in, outid = arc.out;
         if (outid != WFST::epsilon_index) output.push_back(outid);
-        if (inid != WFST::epsilon_index) out << sp << wfst.inLetter(inid);
+        if (inid != WFST::epsilon_index) {
+          sp.append(line);
+          line(wfst.inLetter(inid));
+        }
       } else {
         if (O || I) {
           unsigned id = O ? arc.out : arc.in;
           if (!(E && id == WFST::epsilon_index)) {
-            out << sp;
-            out_maybe_quote(O ? wfst.outLetter(id) : wfst.inLetter(id), out, !Q);
+            sp.append(line);
+            out_maybe_quote(O ? wfst.outLetter(id) : wfst.inLetter(id), line, !Q);
           }
         } else {
-          out << sp;
-          wfst.printArc(arc, src, out);
+          sp.append(line);
+          wfst.appendArc(line, arc, src, wf);
         }
       }
       src = (state_id)arc.dest;
@@ -173,7 +194,8 @@ class WFST {
 
   void initAlphabet() {
     initAlphabet(kInput);
-    initAlphabet(kOutput);
+    owner_alph[kOutput] = 1;  // one arena holds both alphabets' strings
+    alph[kOutput] = NEW alphabet_type(EPSILON_SYMBOL, WILDCARD_SYMBOL, *alph[kInput]);
   }
 
   void init() {
@@ -484,7 +506,39 @@ class WFST {
   alphabet_type stateNames;
   state_id final;  // final state number - initial state always number 0
   // bool is_final(state_id stateid) const { return stateid==final; }
-  typedef dynamic_array<State> StateVector;
+  /// the states, whose arc lists take their nodes from an arena that's freed all at once in clear() (and
+  /// the destructor), rather than node by node into the per-thread pool, which never shrinks
+  struct StateVector : dynamic_array<State> {
+    typedef dynamic_array<State> base;
+    using base::push_back;
+    ~StateVector() { base::clear(); }  // before arena
+    void push_back() {
+      base::push_back();
+      own_arcs(size() - 1);
+    }
+    template <class T0>
+    void push_back(T0 const& t0) {
+      base::push_back(t0);
+      own_arcs(size() - 1);
+    }
+    void resize(size_type n) {
+      size_type const from = size();
+      base::resize(n);
+      own_arcs(from);
+    }
+    void clear() {
+      base::clear();
+      arena.release();
+    }
+    std::size_t arc_bytes() const { return arena.bytes(); }
+
+   private:
+    node_arena arena;
+    void own_arcs(size_type from) {  // (a state copied with its arcs keeps them where they are)
+      for (size_type n = size(); from < n; ++from)
+        if ((*this)[from].arcs.empty()) (*this)[from].arcs.set_allocator(State::Arcs::allocator_type(&arena));
+    }
+  };
   // note: std::vector<State> doesn't work with State::state_adder because copies by value are made during
   // readLegible
 
@@ -497,6 +551,8 @@ class WFST {
   // WFST & operator = (WFST &) {std::cerr <<"Unauthorized use of assignemnt operator\n";;return *this;}
   bool readLegible(istream&, bool alwaysNamed = false);  // returns false on failure (bad input)
   bool readLegible(const string& str, bool alwaysNamed = false);
+  // text in memory; seekable: whether error messages may show the text before the error
+  bool readLegible(char const* begin, char const* end, bool alwaysNamed = false, bool seekable = true);
   void writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON = false);  // for graphviz
   void writeLegible(ostream&, bool include_zero = false);
   void writeLegibleFilename(std::string const& name, bool include_zero = false);
@@ -516,11 +572,18 @@ class WFST {
     return o << p;
   }
   std::ostream& printArc(const FSTArc& a, unsigned source, std::ostream& o, bool weight = true) const {
-    o << '(' << stateName(source) << " -> " << stateName(a.dest) << ' ' << inLetter(a.in) << " : "
-      << outLetter(a.out);
-    if (weight) o << " / " << a.weight;
-    o << ")";
-    return o;
+    string_builder b;
+    appendArc(b, a, source, Weight::get_out_format(o), weight);
+    return o.write(b.data(), b.size());
+  }
+  /// printArc's text, with the weight in format wf
+  void appendArc(string_builder& b, const FSTArc& a, unsigned source, Weight::out_format wf,
+                 bool weight = true) const {
+    b('(');
+    appendStateName(b, source)(" -> ");
+    appendStateName(b, a.dest)(' ')(inLetter(a.in))(" : ")(outLetter(a.out));
+    if (weight) a.weight.append(b(" / "), wf);
+    b(')');
   }
 
   template <class T>
@@ -716,7 +779,7 @@ class WFST {
       if (len > max || states[s].arcs.isEmpty()) return ~0;
       // choose random arc:
       Weight arcsum;
-      typedef List<FSTArc> LA;
+      typedef State::Arcs LA;
       typedef LA::const_iterator LAit;
       const LA& arcs = states[s].arcs;
       LAit start = arcs.const_begin(), end = arcs.const_end();
@@ -759,13 +822,11 @@ class WFST {
   // yourself when you are done with it
 
 
-  // Visitor needs to accept GraphArc (from makeGraph ... (FSTArc *)->data gives WFST FSTArc - see kbest.h for
+  // Visitor needs to accept GraphArc (as from makeGraph ... (FSTArc *)->data gives WFST FSTArc - see kbest.h for
   // visitor description.  deprecated for visit_kbest
   template <class Visitor>
   void bestPaths(unsigned k, Visitor& v, bool throw_on_cycle = true) {
-    Graph graph = makeGraph();
-    graehl::bestPaths(graph, 0, final, k, v, throw_on_cycle);
-    freeGraph(graph);
+    graehl::bestPaths(graph(), reverse_graph(), 0, final, k, v, throw_on_cycle);
   }
 
   // if you prefer to use a visitor that deals with FST arcs rather than graph arcs
@@ -955,6 +1016,11 @@ class WFST {
     return alphabet(dir)[i].c_str();
   }
 
+  /// b << stateName(i)
+  string_builder& appendStateName(string_builder& b, unsigned i) const {
+    Assert(i < numStates());
+    return named_states ? b(stateNames[i].c_str()) : b(i);
+  }
   // NB: uses static (must use or copy before next call) return string buffer if !named_states
   const char* stateName(unsigned i) const {
     Assert(i < numStates());
@@ -1078,6 +1144,12 @@ class WFST {
     double learning_rate_growth_factor;
     int ran_restarts;
     random_restart_acceptor ra;
+    unsigned normalize_threads;
+    unsigned restart_threads;
+    unsigned online_batch;  // if nonzero, online EM: update parameters after each mini-batch of this many examples
+    double online_alpha;  // online EM step size (k+2)^-alpha for the kth update (from 0)
+    unsigned online_eval;  // nonzero: every this many online EM iterations, score the weights exactly
+    bool squarem;  // SQUAREM extrapolation after every 2 EM steps
 
     train_opts() { set_defaults(); }
     void set_defaults() {
@@ -1086,6 +1158,12 @@ class WFST {
       learning_rate_growth_factor = 1.;
       ran_restarts = 0;
       ra = random_restart_acceptor();
+      normalize_threads = 1;
+      restart_threads = 1;
+      online_batch = 0;
+      online_alpha = .7;
+      online_eval = 0;
+      squarem = false;
     }
   };
 
@@ -1113,6 +1191,12 @@ class WFST {
   void invert();  // switch input letters for output letters
   void reduce();  // eliminate all states not along a path from
   // initial state to final state
+  /// replace *e*:*e* paths by direct arcs with the same total (log semiring, cycles included): every state
+  /// gets copies of the non-epsilon arcs of the states its epsilon paths reach, weighted by the sum of those
+  /// paths, and a single *e*:*e* arc to final if final is among them.  only the final state keeps its own
+  /// epsilon arcs.  then reduce().  \return false (and changes nothing) if an epsilon cycle has more than
+  /// max_cycle states or its paths' sum diverges
+  bool remove_epsilons(unsigned max_cycle = 256);
   void consolidateArcs(bool sum = true, bool clamp = true);  // combine identical arcs, with combined weight =
   // sum, or just max if sum=false.  sum clamped to
   // max of 1 if clamp=true
@@ -1154,35 +1238,33 @@ class WFST {
     return a;
   }
 
-  // FIXME: you could run out of memory translating the FST into a graph just to report a summary.  topo sort
-  // and arc propagation from graph.h aren't that complicated to repeat (or abstract)
-
   // *p_n_back_edges = 0 iff no cycles (optional output arg)
   Weight numNoCyclePaths(unsigned* p_n_back_edges = 0) {
     if (!valid()) return Weight();
     fixed_array<Weight> nPaths(numStates());
-    Graph g = makeGraph();
-    countNoCyclePaths(g, nPaths.begin(), 0, p_n_back_edges);
-    delete[] g.states;
+    countNoCyclePaths(graph(), nPaths.begin(), 0, p_n_back_edges);
     Weight ret = nPaths[final];
     return ret;
   }
 
   bool isEmpty() { return states.empty(); }
 
-  struct weight_for_cost {
-    typedef Weight result_type;
-    Weight operator()(GraphArc const& a) const { return Weight(a.weight, cost_weight()); }
+  struct arc_weight {
+    Weight const& operator()(FSTArc const* a) const { return a->weight; }
   };
 
-  Weight sum_acyclic_paths() {
+  /// the sum of the weights of all paths, cycles included (sum_paths_to in graehl/shared/graph.h); with
+  /// eps_only, of only the paths reading and writing nothing (*e* : *e* arcs).  *n_unconverged: the number of
+  /// strongly connected components still changing after opt.max_sweeps (e.g. diverging: infinite sum)
+  Weight sum_paths(bool eps_only = false, unsigned* n_unconverged = 0,
+                   path_sum_options const& opt = path_sum_options()) const {
+    if (n_unconverged) *n_unconverged = 0;
+    if (!valid()) return Weight();
     fixed_array<Weight> w(numStates());
-    w[0] = 1;
-    Graph g = makeGraph();
-    weight_for_cost f;
-    propagate_paths(g, f, w, 0);
-    delete[] g.states;
-    return w[final];
+    unsigned n = eps_only ? sum_paths_to(egraph(), arc_weight(), 0, final, w.begin(), opt)
+                          : sum_paths_to(graph(), arc_weight(), 0, final, w.begin(), opt);
+    if (n_unconverged) *n_unconverged = n;
+    return w[0];
   }
 
   static void setIndexThreshold(unsigned t) { WFST::indexThreshold = t; }
@@ -1194,6 +1276,105 @@ class WFST {
   // to the FSTArc it corresponds to in the WFST
   Graph makeEGraph();  // same as makeGraph, but restricted to *e* / *e* arcs
 
+  // the same graphs without the copy: graph adaptors (see graehl/shared/graph.h) reading states in place.
+  // graph_arc(...).data is the FSTArc *, as for makeGraph
+  template <bool EpsOnly>
+  struct basic_graph_view {
+    WFST const* wfst;
+    explicit basic_graph_view(WFST const& wfst) : wfst(&wfst) {}
+    typedef FSTArc* arc_handle;
+    struct arc_iterator {
+      State::Arcs::const_iterator i, end;
+      arc_iterator(State::Arcs::const_iterator i, State::Arcs::const_iterator end) : i(i), end(end) { skip(); }
+      void skip() {
+        if (EpsOnly)
+          while (i != end && (i->in || i->out)) ++i;
+      }
+      arc_iterator& operator++() {
+        ++i;
+        skip();
+        return *this;
+      }
+      bool operator==(arc_iterator const& o) const { return i == o.i; }
+      bool operator!=(arc_iterator const& o) const { return i != o.i; }
+    };
+    unsigned num_states() const { return wfst->numStates(); }
+    arc_iterator arcs_begin(unsigned s) const {
+      State::Arcs const& a = wfst->states[s].arcs;
+      return arc_iterator(a.const_begin(), a.const_end());
+    }
+    arc_iterator arcs_end(unsigned s) const {
+      State::Arcs const& a = wfst->states[s].arcs;
+      return arc_iterator(a.const_end(), a.const_end());
+    }
+    static unsigned dest(arc_iterator a) { return a.i->dest; }
+    static FLOAT_TYPE cost(arc_iterator a) { return a.i->weight.getCost(); }
+    static arc_handle handle(arc_iterator a) { return const_cast<FSTArc*>(&*a.i); }
+    static GraphArc graph_arc(unsigned src, arc_handle a) {
+      return GraphArc(src, a->dest, a->weight.getCost(), (void*)a);
+    }
+  };
+  typedef basic_graph_view<false> graph_view;
+  typedef basic_graph_view<true> egraph_view;
+  graph_view graph() const { return graph_view(*this); }
+  egraph_view egraph() const { return egraph_view(*this); }
+
+  /// for each state, the arcs arriving there and their sources: the reverse graph as an index rather than a
+  /// copy.  per state, in the order reverseGraph(makeGraph()) would give.  invalid once arcs change.
+  /// deliberately not cached in the WFST: each caller (bestPaths, prunePaths, reduce, training's topo sort)
+  /// needs it once per call (copies of a view share one), most change the arcs right after, and arcs are
+  /// changed in too many places (State, composition, reading) to clear a cache reliably; a stale one would
+  /// point at freed FSTArcs
+  struct reverse_arcs {
+    struct entry {
+      state_id src;
+      FSTArc* arc;
+    };
+    std::vector<std::size_t> first;  // state s's entries are [first[s], first[s+1])
+    std::vector<entry> entries;
+    explicit reverse_arcs(WFST const& wfst);
+  };
+
+  template <bool EpsOnly>
+  struct basic_reverse_graph_view {
+    boost::shared_ptr<reverse_arcs const> r;  // shared by copies
+    explicit basic_reverse_graph_view(WFST const& wfst) : r(new reverse_arcs(wfst)) {}
+    typedef reverse_arcs::entry const* arc_handle;
+    struct arc_iterator {
+      arc_handle i, end;
+      arc_iterator(arc_handle i, arc_handle end) : i(i), end(end) { skip(); }
+      void skip() {
+        if (EpsOnly)
+          while (i != end && (i->arc->in || i->arc->out)) ++i;
+      }
+      arc_iterator& operator++() {
+        ++i;
+        skip();
+        return *this;
+      }
+      bool operator==(arc_iterator const& o) const { return i == o.i; }
+      bool operator!=(arc_iterator const& o) const { return i != o.i; }
+    };
+    unsigned num_states() const { return (unsigned)r->first.size() - 1; }
+    arc_iterator arcs_begin(unsigned s) const { return arc_iterator(at(r->first[s]), at(r->first[s + 1])); }
+    arc_iterator arcs_end(unsigned s) const { return arc_iterator(at(r->first[s + 1]), at(r->first[s + 1])); }
+    static unsigned dest(arc_iterator a) { return a.i->src; }
+    static FLOAT_TYPE cost(arc_iterator a) { return a.i->arc->weight.getCost(); }
+    static arc_handle handle(arc_iterator a) { return a.i; }
+    static GraphArc graph_arc(unsigned src, arc_handle a) {
+      return GraphArc(src, a->src, a->arc->weight.getCost(), (void*)a->arc);
+    }
+    /// the forward (graph_view) arc
+    static FSTArc* forward(arc_handle a) { return a->arc; }
+
+   private:
+    arc_handle at(std::size_t i) const { return r->entries.data() + i; }
+  };
+  typedef basic_reverse_graph_view<false> reverse_graph_view;
+  typedef basic_reverse_graph_view<true> reverse_egraph_view;
+  reverse_graph_view reverse_graph() const { return reverse_graph_view(*this); }
+  reverse_egraph_view reverse_egraph() const { return reverse_egraph_view(*this); }
+
   // untested
   void ownAlphabet() {
     ownAlphabet(kInput);
@@ -1248,6 +1429,12 @@ class WFST {
     states.clear();
     destroy();
   }
+  /// frees every arc at once, keeping the (now arcless) states, their names and the alphabets
+  void clear_arcs() {
+    unsigned n = numStates();
+    states.clear();
+    states.resize(n);
+  }
   ~WFST() { destroy(); }
   struct setRandom {
     void operator()(Weight* w) const { w->setRandomFraction(); }
@@ -1359,9 +1546,9 @@ class NormGroupIter {
   State* begin;
   State* state;
   State* end;
-  typedef HashTable<UnsignedKey, List<HalfArc> >::iterator Cit;
-  typedef List<HalfArc>::const_iterator Cit2;
-  typedef List<FSTArc>::val_iterator Jit;
+  typedef State::Index::iterator Cit;
+  typedef State::HalfArcs::const_iterator Cit2;
+  typedef State::Arcs::val_iterator Jit;
   Cit Ci;
   Cit2 Ci2, Cend;
   Jit Ji, Jend;
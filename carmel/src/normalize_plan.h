@@ -0,0 +1,404 @@
+#ifndef GRAEHL_CARMEL__NORMALIZE_PLAN_H
+#define GRAEHL_CARMEL__NORMALIZE_PLAN_H
+
+/* WFST::normalize, precompiled.
+
+   the norm groups of a WFST (per state, or per (state,input) for conditional) are flattened once into a
+   CSR: arcs[group_begin[g]..group_begin[g+1]) are the arcs of group g, in NormGroupIter order.  tie groups
+   are renumbered densely; tie[k] is the dense tie index of arcs[k], or NORMAL/LOCKED.  normalize() is then
+   two linear passes over those arrays (no hashing, no per-state input index).  the group passes may be
+   split over threads; the tie-group sums are accumulated in a single serial pass over the tied arcs (in plan
+   order) so results are identical for any number of threads.
+
+   the weights normalized are either the FSTArc weights themselves, or (after index_arcs) a column of
+   parameters indexed by arcs_table id, which lets several parameter sets share one plan
+   (normalize_column, with caller-provided scratch).  maximize() is the whole EM M-step on such a table
+   (counts+prior, normalize, keep em_weight and the max change) fused into the same two passes.
+
+   the plan holds FSTArc pointers, so it's only valid as long as the WFST's arcs aren't added, removed, or
+   regrouped (true for the duration of training).
+*/
+
+#include <carmel/src/fst.h>
+#include <graehl/shared/dynamic_array.hpp>
+#include <graehl/shared/array.hpp>
+#include <graehl/shared/time_report.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <boost/cstdint.hpp>
+
+namespace graehl {
+
+struct normalize_plan {
+  enum { NORMAL = (unsigned)-1, LOCKED = (unsigned)-2 };
+  typedef fixed_array<Weight> weights;
+
+  // per-normalize sums
+  struct scratch {
+    weights sum, locked_sum;  // per norm group
+    weights tie_arc_total, tie_state_total, tie_max_locked;  // per tie group
+    weights change;  // per norm group, for maximize()
+  };
+
+  WFST* x;
+  WFST::norm_group_by group;
+  dynamic_array<FSTArc*> arcs;
+  dynamic_array<unsigned> group_begin;  // size n_groups()+1
+  dynamic_array<unsigned> tie;  // parallel to arcs
+  dynamic_array<unsigned> tied_at;  // index into arcs of each tied arc, in plan order
+  dynamic_array<unsigned> tied_group;  // norm group of each tied_at
+  dynamic_array<unsigned> arc_id;  // parallel to arcs, after index_arcs
+  unsigned n_ties;
+  unsigned threads;
+  scratch sums;
+
+  normalize_plan() : x(), group(WFST::NONE), n_ties(), threads(1) {}
+  normalize_plan(WFST& x, WFST::norm_group_by group, unsigned threads = 1) : threads(threads) {
+    build(x, group);
+  }
+
+  bool built_for(WFST const& w, WFST::norm_group_by g) const { return x == &w && group == g; }
+  unsigned n_groups() const { return group_begin.empty() ? 0 : group_begin.size() - 1; }
+  unsigned n_arcs() const { return arcs.size(); }
+
+  void build(WFST& w, WFST::norm_group_by g);
+
+  // Table: arcs_table (t[i].arc is the FSTArc * for id i)
+  template <class Table>
+  void index_arcs(Table const& t) {
+    typedef HashTable<FSTArc const*, unsigned> ids;
+    ids id;
+    for (unsigned i = 0, n = t.size(); i != n; ++i) id[t[i].arc] = i;
+    arc_id.clear();
+    arc_id.reserve(arcs.size());
+    for (unsigned k = 0, n = arcs.size(); k != n; ++k) arc_id.push_back(*find_second(id, (FSTArc const*)arcs[k]));
+  }
+
+  struct fst_weight {
+    FSTArc* const* arcs;
+    Weight& operator()(unsigned k) const { return arcs[k]->weight; }
+  };
+
+  struct column_weight {
+    Weight* w;
+    unsigned const* id;
+    Weight& operator()(unsigned k) const { return w[id[k]]; }
+  };
+
+  // same result as the hashing WFST::normalize it replaced
+  void normalize(WFST::NormalizeMethod const& method, bool uniform_zero_normgroups = false) {
+    fst_weight w = {arcs.begin()};
+    normalize(w, sums, threads, method, uniform_zero_normgroups);
+  }
+
+  // normalize w[id] (id as in the arcs_table passed to index_arcs) instead of the FSTArc weights.  only reads
+  // the plan, so may be called concurrently (with different w and s)
+  void normalize_column(Weight* w, scratch& s, unsigned nthreads, WFST::NormalizeMethod const& method,
+                        bool uniform_zero_normgroups = false) const {
+    assert(arc_id.size() == arcs.size());
+    column_weight cw = {w, arc_id.begin()};
+    normalize(cw, s, nthreads, method, uniform_zero_normgroups);
+  }
+
+  // the M-step for an em_arcs_table t (after index_arcs(t)): each unlocked arc's weight becomes its
+  // counts+prior (old weight to scratch), is normalized, and is kept as em_weight.  same result as
+  // prep_new_weights, normalize_column, keep_em_max_change; returns the max change
+  template <class Table>
+  Weight maximize(Table& t, scratch& s, unsigned nthreads, WFST::NormalizeMethod const& method) const {
+    assert(arc_id.size() == arcs.size());
+    column_weight cw = {t.weights.begin(), arc_id.begin()};
+    em_prep<Table> prep = {this, &t};
+    em_keep<Table> keep = {this, &t, &s};
+    s.change.reinit(n_groups());
+    normalize(cw, s, nthreads, method, false, prep, keep);
+    Weight maxChange;
+    for (unsigned g = 0, N = n_groups(); g != N; ++g)
+      if (s.change[g] > maxChange) maxChange = s.change[g];
+    return maxChange;
+  }
+
+  // NEW plan:
+  // step 1: compute sum of counts for non-locked arcs, and divide it by (1-(sum of locked arcs)) to reserve
+  // appropriate counts for the locked arcs
+  // step 2: for tied arc groups, add these inferred counts to the group state counts total.  also sum group
+  // arc counts total.
+  // step 3: assign tied arc weights; trouble: tied arcs sharing space with inflexible tied arcs.  under- or
+  // over- allocation can result ...
+  //   ... alternative: give locked arcs implied counts in the tie group; norm-group having tie-group arcs,
+  //   with highest locked arc sum R divides unscaled tie group state counts total by (1-R) instead of
+  //   dividing individual state counts by (1-sum).  this ensures that tied arcs are kept small enough to
+  //   make room for locked ones in ALL states and should leave some room for normal arcs as well
+  // step 4: give normal arcs their share of what's left, if anything
+  template <class W>
+  void normalize(W const& w, scratch& s, unsigned nthreads, WFST::NormalizeMethod const& method,
+                 bool uniform_zero_normgroups) const {
+    normalize(w, s, nthreads, method, uniform_zero_normgroups, no_prep(), no_keep());
+  }
+
+  // Prep(k) runs just before arc k is summed; Keep(g) just after group g is assigned
+  template <class W, class Prep, class Keep>
+  void normalize(W const& w, scratch& s, unsigned nthreads, WFST::NormalizeMethod const& method,
+                 bool uniform_zero_normgroups, Prep const& prep, Keep const& keep) const {
+    if (group == WFST::NONE) return;
+    assert(method.group == group);
+    unsigned N = n_groups();
+    s.sum.reinit(N);
+    s.locked_sum.reinit(N);
+    s.tie_arc_total.reinit(n_ties);
+    s.tie_state_total.reinit(n_ties);
+    s.tie_max_locked.reinit(n_ties);
+
+    // global pass 1: compute the sum of unnormalized weights for each normalization group.  sum for each arc
+    // in a tie group, its weight and its normalization group's weight.
+    sum_pass<W, Prep> s1 = {this, &w, &s, method.add_count, &prep};
+    for_group_ranges(s1, nthreads);
+    for (unsigned k = 0, nk = tied_at.size(); k != nk; ++k) {
+      unsigned t = tie[tied_at[k]], g = tied_group[k];
+      s.tie_arc_total[t] += w(tied_at[k]);
+      s.tie_state_total[t] += s.sum[g];
+      Weight& m = s.tie_max_locked[t];
+      if (s.locked_sum[g] > m) m = s.locked_sum[g];
+      NANCHECK(s.tie_state_total[t]);
+      NANCHECK(s.tie_max_locked[t]);
+    }
+
+    // global pass 2: assign weights
+    assign_pass<W, Keep> s2 = {this, &w, &s, &method.scale, uniform_zero_normgroups, &keep};
+    for_group_ranges(s2, nthreads);
+
+#ifdef CHECKNORMALIZE
+    for (unsigned g = 0; g < N; ++g) {
+      Weight sum;
+      for (unsigned k = group_begin[g], e = group_begin[g + 1]; k != e; ++k) sum += w(k);
+#define NORM_EPSILON .01
+      if (sum > 1 + NORM_EPSILON || sum < 1 - NORM_EPSILON)
+        Config::warn() << "Warning: sum of normalized arcs for norm group " << g << " = " << sum
+                       << " - should equal 1.0\n";
+    }
+#endif
+  }
+
+ private:
+  template <class F>
+  void for_group_ranges(F const& f, unsigned nthreads) const {
+    unsigned N = n_groups(), nt = nthreads;
+    enum { min_groups_per_thread = 1024 };
+    if (nt > N / min_groups_per_thread) nt = N / min_groups_per_thread;
+    if (nt <= 1) {
+      f(0, N);
+      return;
+    }
+    thread_group workers;
+    for (unsigned t = 0; t < nt; ++t)
+      workers.create_thread(f, (unsigned)((uint64_t)N * t / nt), (unsigned)((uint64_t)N * (t + 1) / nt));
+    workers.join_all();
+  }
+
+  struct no_prep {
+    void operator()(unsigned) const {}
+  };
+  struct no_keep {
+    void operator()(unsigned) const {}
+  };
+
+  template <class Table>
+  struct em_prep {
+    normalize_plan const* p;
+    Table* t;
+    void operator()(unsigned k) const {
+      if (p->tie[k] == LOCKED) return;
+      unsigned i = p->arc_id[k];
+      Weight& w = t->weights[i];
+      t->scratch[i] = w;
+      w = t->counts[i] + t->prior_counts[i];
+      NANCHECK(w);
+    }
+  };
+
+  template <class Table>
+  struct em_keep {
+    normalize_plan const* p;
+    Table* t;
+    scratch* s;
+    void operator()(unsigned g) const {
+      Weight maxChange;
+      for (unsigned k = p->group_begin[g], e = p->group_begin[g + 1]; k != e; ++k) {
+        unsigned i = p->arc_id[k];
+        Weight const& w = t->weights[i];
+        t->em_weight[i] = w;
+        NANCHECK(w);
+        if (p->tie[k] != LOCKED) {
+          Weight change = absdiff(w, t->scratch[i]);
+          if (change > maxChange) maxChange = change;
+        }
+      }
+      s->change[g] = maxChange;
+    }
+  };
+
+  template <class W, class Prep>
+  struct sum_pass {
+    normalize_plan const* p;
+    W const* w;
+    scratch* s;
+    Weight addc;
+    Prep const* prep;
+    void operator()(unsigned gbegin, unsigned gend) const {
+      for (unsigned g = gbegin; g != gend; ++g) {
+        Weight sum, locked_sum;  // =0, sum of probability of all arcs that has this input
+        for (unsigned k = p->group_begin[g], e = p->group_begin[g + 1]; k != e; ++k) {
+          (*prep)(k);
+          Weight& wk = (*w)(k);
+          wk += addc;
+          if (p->tie[k] == LOCKED)  // note: training does not set any counts for locked arcs.  so this is the
+            // original weight
+            locked_sum += wk;
+          else
+            sum += wk;
+        }
+#ifdef DEBUGNORMALIZE
+        Config::debug() << "Normgroup=" << g << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
+#endif
+        s->sum[g] = sum;
+        s->locked_sum[g] = locked_sum;
+      }
+    }
+  };
+
+  template <class W, class Keep>
+  struct assign_pass {
+    normalize_plan const* p;
+    W const* w;
+    scratch* s;
+    mean_field_scale const* scale;
+    bool uniform_zero_normgroups;
+    Keep const* keep;
+    void operator()(unsigned gbegin, unsigned gend) const {
+      Weight const one(1.);
+      mean_field_scale const& sc = *scale;
+      for (unsigned g = gbegin; g != gend; ++g) {
+        unsigned kbegin = p->group_begin[g], kend = p->group_begin[g + 1];
+        Weight normal_sum;  //=0
+        Weight reserved;  // =0
+        // pass 2a: assign tied (and locked) arcs their weights, taking 'reserved' weight from the normal arcs
+        // in their group
+        // tied arc weight = sum (over arcs in tie group) of weight / sum (over arcs in tie group) of
+        // norm-group-total-weight
+        // also, compute sum of normal arcs
+        for (unsigned k = kbegin; k != kend; ++k) {
+          Weight& wk = (*w)(k);
+          unsigned t = p->tie[k];
+          if (t == NORMAL)
+            normal_sum += wk;
+          else if (t == LOCKED) {
+            reserved += wk;
+            NANCHECK(reserved);
+          } else {
+            Weight groupNorm = s->tie_state_total[t];  // can be 0 if no counts at all for any states of group
+            Weight gmax = s->tie_max_locked[t];
+            NANCHECK(gmax);
+            if (gmax > one) {
+              wk.setZero();
+            } else {
+              if (!gmax.isZero())
+                groupNorm /= (one - gmax);  // as described in NEW plan above: ensure tied arcs leave room for
+              // the worst case competing locked arcs sum in any norm-group
+              NANCHECK(groupNorm);
+              Weight groupTotal = s->tie_arc_total[t];
+              NANCHECK(groupTotal);
+              if (!groupTotal.isZero()) {  // then groupNorm non0 also
+                wk = sc(groupTotal) / sc(groupNorm);
+                reserved += wk;
+              } else
+                wk.setZero();
+              NANCHECK(reserved);
+            }
+          }
+        }
+
+#ifdef DEBUGNORMALIZE
+        if (reserved > 1.001)
+          Config::warn() << "Warning: sum of reserved arcs for norm group " << g << " = " << reserved
+                         << " - should not exceed 1.0\n";
+#endif
+
+        // pass 2b: give normal arcs their share of however much is left
+        Weight fraction_remain = 1.;
+        fraction_remain -= reserved;
+        NANCHECK(fraction_remain);
+        bool something_left_for_normal = !fraction_remain.isZero();
+        if (something_left_for_normal && (uniform_zero_normgroups || !normal_sum.isZero())) {
+          NANCHECK(normal_sum);
+          Weight scaled_sum = sc(normal_sum);
+          for (unsigned k = kbegin; k != kend; ++k)
+            if (p->tie[k] == NORMAL) {
+              Weight& wk = (*w)(k);
+              wk = fraction_remain * sc(wk) / scaled_sum;
+              NANCHECK(wk);
+            }
+        } else  // nothing left, sorry
+          for (unsigned k = kbegin; k != kend; ++k)
+            if (p->tie[k] == NORMAL) (*w)(k).setZero();
+        (*keep)(g);
+      }
+    }
+  };
+};
+
+// one normalize_plan per cascade member, compiled at the start of training and dropped at the end (after
+// which normalize() falls back to WFST::normalize), with time spent for the training log
+struct normalize_plans {
+  fixed_array<normalize_plan> plans;
+  unsigned threads;
+  unsigned n_normalize;
+  time_change build_time, normalize_time;
+
+  normalize_plans() : threads(1) { clear(); }
+
+  template <class Xs>
+  void compile(Xs const& xs, WFST::NormalizeMethods const& methods) {
+    clear();
+    build_time.resume();
+    plans.reinit(xs.size());
+    for (unsigned i = 0, n = xs.size(); i < n; ++i) {
+      plans[i].threads = threads;
+      plans[i].build(*xs[i], methods[i].group);
+    }
+    build_time.stop();
+  }
+
+  void clear() {
+    plans.clear();
+    n_normalize = 0;
+    build_time.reset();
+    normalize_time.reset();
+  }
+
+  void normalize(unsigned i, WFST& x, WFST::NormalizeMethod const& method) {
+    if (method.group == WFST::NONE) return;
+    normalize_time.resume();
+    if (i < plans.size() && plans[i].built_for(x, method.group))
+      plans[i].normalize(method);
+    else
+      x.normalize(method);
+    normalize_time.stop();
+  }
+
+  template <class O>
+  void print(O& o) const {
+    unsigned ng = 0, na = 0, nt = 0;
+    for (unsigned i = 0, n = plans.size(); i < n; ++i) {
+      ng += plans[i].n_groups();
+      na += plans[i].n_arcs();
+      nt += plans[i].n_ties;
+    }
+    o << "Normalization: " << n_normalize << " passes took " << normalize_time << " (plan of " << ng
+      << " norm groups, " << na << " arcs, " << nt << " tie groups built in " << build_time << ")";
+  }
+  typedef normalize_plans self_type;
+  TO_OSTREAM_PRINT
+};
+
+
+}
+
+#endif
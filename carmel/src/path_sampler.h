@@ -0,0 +1,220 @@
+#ifndef CARMEL_PATH_SAMPLER_H
+#define CARMEL_PATH_SAMPLER_H
+
+/// exact random paths (-g / -G with --gen-exact): the same local walks as WFST::generate (-g: a uniformly
+/// chosen input symbol, then one of its arcs in proportion to weight) and WFST::randomPath (-G: an arc in
+/// proportion to weight), but conditioned on reaching final.  with q(a) the walk's probability of taking arc
+/// a from state s and beta(s) the probability that the walk from s reaches final (final absorbs:
+/// beta(final)=1), the conditioned walk takes a with probability q(a)*beta(dest a)/beta(s), so no sample is
+/// ever rejected.  those per state distributions are built once into alias tables (Vose), so a step costs one
+/// uniform draw.
+///
+/// beta is the sum of the walk's paths to final (sum_paths_to in graehl/shared/graph.h), solved one strongly
+/// connected component at a time.  the sampler points into the WFST's arcs: don't change them while
+/// it's in use.
+
+#include <carmel/src/fst.h>
+#include <graehl/shared/graph.h>
+#include <graehl/shared/random.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace graehl {
+
+class path_sampler {
+ public:
+  enum walk {
+    joint_walk,  // -G
+    conditional_walk  // -g
+  };
+  typedef std::vector<FSTArc const*> path;
+
+  path_sampler(WFST const& wfst, walk how, path_sum_options const& opt = path_sum_options())
+      : final(wfst.final) {
+    if (!wfst.numStates() || !wfst.valid()) throw std::runtime_error("path_sampler: WFST has no final state");
+    walk_graph g(wfst, how);
+    beta.assign(wfst.numStates(), Weight());
+    if (unsigned n_unconverged = sum_paths_to(g.graph(), walk_prob(), 0, final, beta.data(), opt))
+      Config::warn() << "path_sampler: probabilities of reaching final in " << n_unconverged
+                     << " cycle(s) still changing after " << opt.max_sweeps
+                     << " sweeps; sampling with the current estimate.\n";
+    if (beta[0].isZero())
+      throw std::runtime_error("path_sampler: no path from the start state reaches final");
+    build_tables(g);
+  }
+
+  /// the probability (under the unconditioned walk) of reaching final from the start state
+  Weight reach_final() const { return beta[0]; }
+
+  /// replaces p with a random path from the start state to final.  r: unit uniform double generator
+  template <class R>
+  void sample(R& r, path& p) const {
+    p.clear();
+    for (unsigned s = 0; s != final;) {
+      choice const* c = &choices[first[s]];
+      double u = r() * (first[s + 1] - first[s]);
+      std::size_t i = (std::size_t)u;
+      if (i == first[s + 1] - first[s]) --i;
+      FSTArc const* a = (u - i < c[i].prob) ? c[i].arc : c[i].alias;
+      p.push_back(a);
+      s = a->dest;
+    }
+  }
+
+  /// calls f(path) for n sampled paths, in order.  with threads>1, the paths are sampled in parallel in
+  /// rounds and path i uses the stream of thread i%threads, so the output depends only on (seed, threads)
+  template <class F>
+  void generate(unsigned n, unsigned threads, random_seed_type seed, F const& f) const {
+    if (threads < 2) {
+      graehl::random r(seed);
+      path p;
+      for (unsigned i = 0; i < n; ++i) {
+        sample(r, p);
+        f(p);
+      }
+      return;
+    }
+    std::vector<graehl::random> streams;
+    for (unsigned t = 0; t < threads; ++t) streams.push_back(graehl::random(stream_seed(seed, t)));
+    std::vector<path> paths(std::min(n, kRound * threads));
+    for (unsigned done = 0; done < n;) {
+      unsigned m = std::min(n - done, (unsigned)paths.size());
+      {
+        thread_group g;
+        for (unsigned t = 0; t < threads; ++t)
+          g.create_thread([this, &streams, &paths, t, threads, m] {
+            for (unsigned i = t; i < m; i += threads) sample(streams[t], paths[i]);
+          });
+        g.join_all();
+      }
+      for (unsigned i = 0; i < m; ++i) f(paths[i]);
+      done += m;
+    }
+  }
+
+  /// thread t's seed; thread 0 uses seed itself, so --gen-threads=1 is the single threaded sequence
+  static random_seed_type stream_seed(random_seed_type seed, unsigned t) {
+    return seed ^ (random_seed_type)(t * 2654435769U);
+  }
+
+ private:
+  enum { kRound = 4096 };  // paths per thread per round
+
+  struct choice {
+    double prob;  // keep arc with this probability, else take alias
+    FSTArc const* arc;
+    FSTArc const* alias;
+  };
+
+  struct walk_arc {
+    unsigned dest;
+    Weight q;
+    FSTArc const* fst_arc;
+  };
+  /// the walk as a graph whose arc weights are the local probabilities q; final has no arcs (the walk stops
+  /// there)
+  struct walk_graph : csr_graph<walk_arc> {
+    walk_graph(WFST const& wfst, walk how) {
+      unsigned n = wfst.numStates();
+      first.reserve(n + 1);
+      std::vector<Weight> insum;
+      std::vector<unsigned> inputs;
+      if (how == conditional_walk) insum.resize(wfst.alphabet(kInput).size());
+      for (unsigned s = 0; s < n; ++s) {
+        start_state();
+        if (s == wfst.final) continue;
+        State::Arcs const& as = wfst.states[s].arcs;
+        typedef State::Arcs::const_iterator It;
+        if (how == joint_walk) {
+          Weight sum;
+          for (It a = as.const_begin(), e = as.const_end(); a != e; ++a) sum += a->weight;
+          for (It a = as.const_begin(), e = as.const_end(); a != e; ++a)
+            add(*a, sum.isZero() ? Weight() : a->weight / sum);
+        } else {
+          for (It a = as.const_begin(), e = as.const_end(); a != e; ++a) {
+            Weight& w = insum[a->in];
+            if (w.isZero() && std::find(inputs.begin(), inputs.end(), a->in) == inputs.end())
+              inputs.push_back(a->in);
+            w += a->weight;
+          }
+          Weight k((FLOAT_TYPE)inputs.size());
+          for (It a = as.const_begin(), e = as.const_end(); a != e; ++a) {
+            Weight const& w = insum[a->in];
+            add(*a, w.isZero() ? Weight() : a->weight / (w * k));
+          }
+          for (std::vector<unsigned>::const_iterator i = inputs.begin(), e = inputs.end(); i != e; ++i)
+            insum[*i].setZero();
+          inputs.clear();
+        }
+      }
+      finish();
+    }
+    void add(FSTArc const& a, Weight q) {
+      walk_arc x = {a.dest, q, &a};
+      arcs.push_back(x);
+    }
+  };
+  struct walk_prob {
+    Weight const& operator()(walk_arc const* a) const { return a->q; }
+  };
+
+  unsigned final;
+  std::vector<Weight> beta;  // probability of reaching final
+  std::vector<std::size_t> first;  // state s's table is choices[first[s]..first[s+1])
+  std::vector<choice> choices;
+
+  void build_tables(walk_graph const& wg) {
+    walk_graph::graph_view g = wg.graph();
+    unsigned n = g.num_states();
+    first.resize(n + 1);
+    choices.clear();
+    std::vector<unsigned> small, large;
+    for (unsigned s = 0; s < n; ++s) {
+      first[s] = choices.size();
+      if (s == final || beta[s].isZero()) continue;
+      double sum = 0;
+      for (walk_graph::graph_view::arc_iterator a = g.arcs_begin(s), e = g.arcs_end(s); a != e; ++a) {
+        double p = (a->q * beta[a->dest] / beta[s]).getReal();
+        if (p > 0) {
+          choice c = {p, a->fst_arc, a->fst_arc};
+          choices.push_back(c);
+          sum += p;
+        }
+      }
+      build_alias(&choices[first[s]], choices.size() - first[s], sum, small, large);
+    }
+    first[n] = choices.size();
+  }
+
+  /// Vose's alias method: c[i].prob (summing to sum) becomes the probability of keeping c[i].arc rather than
+  /// c[i].alias once slot i is drawn uniformly
+  static void build_alias(choice* c, std::size_t n, double sum, std::vector<unsigned>& small,
+                          std::vector<unsigned>& large) {
+    small.clear();
+    large.clear();
+    for (std::size_t i = 0; i < n; ++i) {
+      c[i].prob *= n / sum;
+      (c[i].prob < 1 ? small : large).push_back((unsigned)i);
+    }
+    while (!small.empty() && !large.empty()) {
+      unsigned l = small.back(), g = large.back();
+      small.pop_back();
+      c[l].alias = c[g].arc;
+      c[g].prob -= 1 - c[l].prob;
+      if (c[g].prob < 1) {
+        large.pop_back();
+        small.push_back(g);
+      }
+    }
+    typedef std::vector<unsigned>::const_iterator It;
+    for (It i = small.begin(), e = small.end(); i != e; ++i) c[*i].prob = 1;
+    for (It i = large.begin(), e = large.end(); i != e; ++i) c[*i].prob = 1;
+  }
+};
+
+}
+
+#endif
@@ -50,7 +50,8 @@ namespace graehl {
 
 struct State {
 
-  typedef List<FSTArc> Arcs;
+  typedef ArenaList<FSTArc>::type Arcs;  // a WFST's come from its StateVector's arena
+  typedef PoolList<HalfArc>::type HalfArcs;
 
   // note: loses tie groups.
   // openfst.org MutableFst<LogArc>, (or StdArc) eg StdVectorFst<StdArc>
@@ -106,7 +107,7 @@ struct State {
 #ifdef BIDIRECTIONAL
   int hitcount;  // how many times index is used, negative for index on input, positive for index on output
 #endif
-  typedef HashTable<UnsignedKey, List<HalfArc> > Index;
+  typedef HashTable<UnsignedKey, HalfArcs> Index;
 
   template <class IOMap>
   void index_io(IOMap& m) const {
@@ -169,7 +170,7 @@ struct State {
 // if you distrust ht[key], I guess: //#define QUEERINDEX
 #ifdef QUEERINDEX
         if (!(list = find_second(*index, (UnsignedKey)l->out)))
-          add(*index, (UnsignedKey)l->out, List<HalfArc>(&(*l)));
+          add(*index, (UnsignedKey)l->out, HalfArcs(&(*l)));
         else
           list->push_front(&(*l));
 #else
@@ -189,7 +190,7 @@ struct State {
     for (Arcs::val_iterator l = arcs.val_begin(), end = arcs.val_end(); l != end; ++l) {
 #ifdef QUEERINDEX
       if (!(list = find_second(*index, (UnsignedKey)l->in)))
-        add(*index, (UnsignedKey)l->in, List<HalfArc>(&(*l)));
+        add(*index, (UnsignedKey)l->in, HalfArcs(&(*l)));
       else
         list->push_front(&(*l));
 #else
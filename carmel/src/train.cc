@@ -8,6 +8,14 @@
 #include <graehl/shared/periodic.hpp>
 #include <graehl/shared/segments.hpp>
 #include <graehl/shared/time_space_report.hpp>
+#include <graehl/shared/thread_group.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #define GRAEHL__DEBUG_PRINT_MAIN
 #include <graehl/shared/debugprint.hpp>
 //#define DEBUGTRAIN
@@ -64,15 +72,14 @@ struct WeightAccum {
   }
 };
 
-template <class a>
-void print_stats(arcs_table<a> const& t, char const* header) {
+void print_stats(em_arcs_table const& t, char const* header) {
 
   Config::debug() << header;
   WeightAccum a_w;
   WeightAccum a_c;
-  for (typename arcs_table<a>::const_iterator i = t.begin(), e = t.end(); i != e; ++i) {
-    a_w(i->weight());
-    a_c(i->counts);
+  for (unsigned i = 0, e = t.size(); i != e; ++i) {
+    a_w(t.weight(i));
+    a_c(t.counts[i]);
   }
   Config::debug() << "(sum,n,nonzero): weights=" << a_w << " counts=" << a_c << "\n";
 }
@@ -116,116 +123,11 @@ void matrix_reverse_io(Weight*** w, int max_i, int max_o) {
     }
 }
 
-namespace for_arcs {
-
-// for cascade, use before update->estimate so cascade can recover counts later (estimate doesn't use
-// em_weight)
-struct save_counts {
-  void operator()(arc_counts& a) const { a.em_weight = a.weight(); }
-};
-
-// use after estimate if you got a new global best
-struct save_best_counts {
-  void operator()(arc_counts& a) const { a.best_weight = a.em_weight; }
-};
-
-
-// scratch gets previous weight
-struct prep_new_weights {
-  Weight scale_prior;
-  prep_new_weights(Weight scale_prior) : scale_prior(scale_prior) {}
-  void operator()(arc_counts& a) const {
-    if (!WFST::isLocked((a.arc)->groupId)) {  // if the group is tied, then the group number is zero, then the
-      // old weight does not change. Otherwise update as follows
-      // note: it's not possible for a cascade composed arc to have a locked groupid, so don't bother not
-      // testing
-      a.scratch
-          = a.weight();  // old weight - Yaser: this is needed only to calculate change in weight later on ..
-      // FIXME: in cascade, do we want a change per component transducer weight change convergence criteria?
-      a.weight() = a.counts + a.prior_counts * scale_prior;  // new (unnormalized weight)
-
-      NANCHECK(a.counts);
-      NANCHECK(a.prior_counts);
-      NANCHECK(a.weight());
-      NANCHECK(a.scratch);
-    }
-  }
-};
-
-// overrelax weight() and store raw EM weight in em_weight.  after pre_norm_counts, scratch has old .  also
-// after WFST::normalize.  POST: need normalization again.
-struct overrelax {
-  FLOAT_TYPE delta_scale;
-  overrelax(FLOAT_TYPE delta_scale) : delta_scale(delta_scale) {}
-  void operator()(arc_counts& a) const {
-    a.em_weight = a.weight();
-    NANCHECK(a.em_weight);
-    if (delta_scale > 1.)
-      if (!WFST::isLocked(a.groupId()))
-        if (a.scratch.isPositive()) {
-          a.weight() = a.scratch * ((a.em_weight / a.scratch).pow(delta_scale));
-          NANCHECK(a.scratch);
-          NANCHECK(a.weight());
-        }
-  }
-};
-
-struct max_change {
-  Weight maxChange;
-  void operator()(arc_counts& a) {
-    if (!WFST::isLocked(a.groupId())) {
-      Weight change = absdiff(a.weight(), a.scratch);
-      if (change > maxChange) maxChange = change;
-    }
-  }
-  Weight get() const { return maxChange; }
-};
-
-struct save_best {
-  void operator()(arc_counts& a) const { a.best_weight = a.weight(); }
-};
-
-struct swap_em_scaled {
-  void operator()(arc_counts& a) const { std::swap(a.em_weight, a.weight()); }
-};
-
-struct keep_em_weight {
-  void operator()(arc_counts& a) const { a.weight() = a.em_weight; }
-};
-
-struct use_best_weight {
-  void operator()(arc_counts& a) const { a.weight() = a.best_weight; }
-};
-
-
-struct clear_count {
-  void operator()(arc_counts& a) const { a.counts.setZero(); }
-};
-
-struct clear_scratch {
-  void operator()(arc_counts& a) const { a.scratch.setZero(); }
-};
-
-struct add_weighted_scratch {
-  Weight w;
-  add_weighted_scratch(Weight w) : w(w) {}
-  void operator()(arc_counts& a) const {
-    if (!a.scratch.isZero()) a.counts += w * a.scratch;
-#ifdef DEBUG
-    NANCHECK(a.counts);
-    NANCHECK(a.scratch);
-#endif
-  }
-};
-
-}  // ns
-
-
 struct forward_backward : public cached_derivs<arc_counts> {
   typedef cached_derivs<arc_counts> cache_t;
   cascade_parameters& cascade;
   unsigned n_in, n_out, n_st;
-  typedef arcs_table<arc_counts> arcs_t;
+  typedef em_arcs_table arcs_t;
   training_corpus* trn;
 
   arcs_t arcs;
@@ -272,7 +174,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
       assert(a.dest() == d || a.src == d);  // first: forward, second: reverse
       Weight& to = m[i + d_i][o + d_o][d];
       Weight const& from = m[i][o][s];
-      Weight const& w = a.weight();
+      Weight const& w = arcs.weight(dw->id);
 #ifdef DEBUGFB
       Config::debug() << "w[" << i + d_i << "][" << o + d_o << "][" << d << "] += "
                       << "w[" << i << "][" << o << "][" << s << "] * weight(" << *dw << ") =" << to << " + "
@@ -289,9 +191,9 @@ struct forward_backward : public cached_derivs<arc_counts> {
                            unsigned d_i, unsigned d_o) {
     if (!fio) return;
     for (matrix_io_index::for_io::const_iterator dw = fio->begin(), e = fio->end(); dw != e; ++dw) {
-      arc_counts& a = arcs[dw->id];
-      assert(a.dest() == dw->dest);
-      a.scratch += f[i][o][s] * a.weight() * b[i + d_i][o + d_o][dw->dest];
+      unsigned id = dw->id;
+      assert(arcs[id].dest() == dw->dest);
+      arcs.scratch[id] += f[i][o][s] * arcs.weight(id) * b[i + d_i][o + d_o][dw->dest];
     }
   }
 
@@ -308,6 +210,21 @@ struct forward_backward : public cached_derivs<arc_counts> {
   // unweighted_corpus_prob: ignore per-example weight, product over corpus of p(example)
   Weight estimate(Weight& unweighted_corpus_prob);
 
+  // like estimate, but with no online updates: the corpus prob under the current weights.  (online estimate's
+  // corpus prob is accumulated while the weights change, so it doesn't score the weights it leaves)
+  Weight evaluate(Weight& unweighted_corpus_prob) {
+    unsigned batch = online_batch;
+    online_batch = 0;
+    try {
+      Weight p = estimate(unweighted_corpus_prob);
+      online_batch = batch;
+      return p;
+    } catch (...) {
+      online_batch = batch;
+      throw;
+    }
+  }
+
  private:
   // these take an initialize unweighted_corpus_prob and counts, and accumulate over the training corpus
   Weight weighted_corpus_prob;
@@ -317,7 +234,7 @@ struct forward_backward : public cached_derivs<arc_counts> {
     unweighted_corpus_prob = &unweighted_corpus_prob_accum;
     weighted_corpus_prob.setOne();
     cache_t::foreach_deriv(*this);
-    Config::log() << '\n';
+    if (!quiet) Config::log() << '\n';
     return weighted_corpus_prob;
   }
   Weight estimate_matrix(Weight& unweighted_corpus_prob_accum);
@@ -325,10 +242,82 @@ struct forward_backward : public cached_derivs<arc_counts> {
  public:
   void operator()(unsigned n, derivations& derivs)  // for foreach_deriv
   {
-    training_progress_scale(n, corpus().size());
+    if (!quiet) training_progress_scale(n, corpus().size());
     Weight prob = derivs.collect_counts(arcs);
     *unweighted_corpus_prob *= prob;
     weighted_corpus_prob *= prob.pow(derivs.weight);
+    if (online_batch && ++in_batch == online_batch) online_step();
+  }
+
+  // call before training with online_batch.  returns false (and disables it) if online EM isn't possible
+  bool set_online(WFST::NormalizeMethods const& methods_) {
+    if (!online_batch) return false;
+    char const* why = use_matrix ? "--matrix-fb"
+                                 : !cascade.trivial ? "--train-cascade"
+                                                    : methods_[0].group == WFST::NONE ? "no normalization" : 0;
+    if (why) {
+      Config::warn() << "Online EM not supported with " << why << "; using batch EM." << std::endl;
+      online_batch = 0;
+      return false;
+    }
+    methods = &methods_;
+    Config::log() << "Online EM: updating weights every " << online_batch
+                  << " examples, step size (k+2)^-" << online_alpha << " for update k.\n";
+    return true;
+  }
+
+  // before each random restart
+  void reset_online() {
+    if (!online_batch) return;
+    online_steps = 0;
+    arcs.start_stepwise();
+  }
+
+  void online_step() {
+    FLOAT_TYPE rate = std::pow(online_steps + 2., -online_alpha);
+    ++online_steps;
+    arcs.stepwise_update(rate, (FLOAT_TYPE)size() / in_batch);
+    in_batch = 0;
+    normalize_weights(*methods);
+  }
+
+  void normalize_weights(WFST::NormalizeMethods const& methods) {
+    if (!cascade.trivial) {
+      cascade.normalize(methods);
+      return;
+    }
+    if (!plan) return;
+    timed_normalize t(norm_stats);
+    plan->normalize_column(arcs.weights.begin(), plan_sums, plan_threads, methods[0]);
+  }
+
+  // the M-step for a trivial cascade, fused over the normalize plan
+  Weight maximize_weights(WFST::NormalizeMethod const& method) {
+    timed_normalize t(norm_stats);
+    return plan->maximize(arcs, plan_sums, plan_threads, method);
+  }
+
+  // the main forward_backward's normalizations are timed and counted with the cascade's own
+  struct timed_normalize {
+    normalize_plans* stats;
+    timed_normalize(normalize_plans* stats) : stats(stats) {
+      if (stats) stats->normalize_time.resume();
+    }
+    ~timed_normalize() {
+      if (!stats) return;
+      stats->normalize_time.stop();
+      ++stats->n_normalize;
+    }
+  };
+
+  // cascade operations on the composed WFST's arcs, with arcs.weights kept in sync
+  void cascade_update() {
+    cascade.update();
+    if (!cascade.trivial) arcs.load_weights();
+  }
+  void random_restart(WFST::NormalizeMethods const& methods) {
+    cascade.random_restart(methods);
+    if (cascade.trivial) arcs.load_weights();
   }
 
   // return max change
@@ -341,20 +330,16 @@ struct forward_backward : public cached_derivs<arc_counts> {
     e_forward_topo.clear();
     e_backward_topo.clear();
     {
-      Graph eGraph = x.makeEGraph();
-      TopoSort t(eGraph, &e_forward_topo);
+      basic_topo_sort<WFST::egraph_view> t(x.egraph(), &e_forward_topo);
       t.order_crucial();
       int b = t.get_n_back_edges();
       if (b > 0)
         Config::warn() << "Warning: empty-label subgraph has " << b
                        << " cycles!  Training may not propogate counts properly" << std::endl;
       if (include_backward) {
-        Graph revEGraph = reverseGraph(eGraph);
-        TopoSort t(revEGraph, &e_backward_topo);
+        basic_topo_sort<WFST::reverse_egraph_view> t(x.reverse_egraph(), &e_backward_topo);
         t.order_crucial();
-        freeGraph(revEGraph);
       }
-      freeGraph(eGraph);
     }
   }
 
@@ -363,17 +348,48 @@ struct forward_backward : public cached_derivs<arc_counts> {
   //    serialize_batch<derivations> cached_derivs;
   bool prune;
   std::string odf;
+  bool quiet;  // no progress dots
+
+  // online (stepwise) EM: if online_batch, estimate() also updates the parameters after every online_batch
+  // examples, with step size (online_steps+2)^-online_alpha; maximize() then only reports the change
+  unsigned online_batch;
+  double online_alpha;
+  unsigned online_steps, in_batch;
+  WFST::NormalizeMethods const* methods;
+
+  // for a trivial cascade, arcs.weights are normalized by plan (in plan_threads) instead of cascade.normalize
+  normalize_plan const* plan;
+  normalize_plan::scratch plan_sums;
+  unsigned plan_threads;
+  normalize_plans* norm_stats;  // null for a forward_backward sharing another's plan
 
   forward_backward(WFST& x, cascade_parameters& cascade, bool per_arc_prior, Weight global_prior,
                    bool include_backward, WFST::train_opts const& opts, training_corpus& corpus)
       : cache_t(x, cascade, corpus, opts.cache)
       , cascade(cascade)
       , arcs(x, per_arc_prior, global_prior)
-      , mio(arcs) {
+      , mio(arcs)
+      , quiet(false)
+      , online_batch(opts.online_batch)
+      , online_alpha(opts.online_alpha)
+      , online_steps()
+      , in_batch()
+      , methods()
+      , plan()
+      , plan_threads(1)
+      , norm_stats() {
     WFST::deriv_cache_opts const& copt = opts.cache;
     odf = copt.out_derivfile;
     prune = copt.prune();
     cascade.set_composed(&x);
+    normalize_plans& plans = cascade.norm_plans;
+    if (cascade.trivial && !plans.plans.empty() && plans.plans[0].x == &x) {
+      normalize_plan& p = plans.plans[0];
+      p.index_arcs(arcs);
+      plan = &p;
+      plan_threads = p.threads;
+      norm_stats = &plans;
+    }
     trn = NULL;
     f = b = NULL;
     remove_bad_training = true;
@@ -410,6 +426,32 @@ struct forward_backward : public cached_derivs<arc_counts> {
     }
   }
 
+  // a quiet forward_backward over o's cached derivations with its own copy of the parameters, so that it can
+  // train concurrently with others like it.  requires o.shareable()
+  forward_backward(forward_backward& o, normalize_plan const& plan)
+      : cache_t(o)
+      , cascade(o.cascade)
+      , arcs(o.x)
+      , mio(arcs)
+      , quiet(true)
+      , online_batch(o.online_batch)
+      , online_alpha(o.online_alpha)
+      , online_steps()
+      , in_batch()
+      , methods(o.methods)
+      , plan(&plan)
+      , plan_threads(1)
+      , norm_stats() {
+    std::copy(o.arcs.prior_counts.begin(), o.arcs.prior_counts.end(), arcs.prior_counts.begin());
+    trn = o.trn;
+    f = b = NULL;
+    remove_bad_training = o.remove_bad_training;
+    use_matrix = false;
+    cache = cache_backward = true;
+    prune = o.prune;
+    n_st = o.n_st;
+  }
+
   void matrix_dump(unsigned m_i, unsigned m_o) {
     assert(use_matrix && f && b);
     Config::debug() << "\nForwardProb/BackwardProb:\n";
@@ -448,107 +490,181 @@ struct forward_backward : public cached_derivs<arc_counts> {
 
   void save_best() {
     if (!cascade.trivial)
-      arcs.visit(for_arcs::save_best_counts());  // from em_weight, which is just weight() pre-estimate.
+      arcs.save_best_counts();  // from em_weight, which is just weight() pre-estimate.
     // pre-normalization?
     else
-      arcs.visit(for_arcs::save_best());  // post-norm weights otherwise
+      arcs.save_best();  // post-norm weights otherwise
   }
 
-  void load_best() { arcs.visit(for_arcs::use_best_weight()); }
+  // also to the FSTArc weights, for cascade.use_counts_final
+  void load_best() {
+    arcs.use_best_weight();
+    arcs.store_weights();
+  }
 
   ~forward_backward() { cleanup(); }
 };
 
 
-Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, bool weight_is_prior_count,
-                   Weight smoothFloor, Weight converge_arc_delta, Weight converge_perplexity_ratio,
-                   train_opts const& opts) {
-  cascade_parameters cascade;
-  return train(cascade, corpus, methods, weight_is_prior_count, smoothFloor, converge_arc_delta,
-               converge_perplexity_ratio, opts);
-}
-
-
-/* I want NONE normalization to lock the given transducer.  but that's not happening excpet in the simple
-   single-iteration code.
-
-   Things that can change arc weight via arc_counts::weight():
-
-   normalization.  no, cascade skips NONE
-
-   prep_new_weights (pre-normalization).  also old to scratch.
-   but we surround maximize with save_none/load_none.  need to verify!
-
-   keep_em_weight: from em_weight
-
-   use_best_weight: from best_weight
-
-
-   max_change: diff to scratch
-
-   save_best_counts: best_weight from em_weight (for cascade)
-
-   save_counts: to em_weight
-
-   save_best: to best_weight
-
-   on 2nd iter, save_counts.  fine.
-
-   cascade.update: just sets composed weights from chain
+/// SQUAREM acceleration (Varadhan & Roland 2008, "Simple and globally convergent methods for accelerating
+/// the convergence of any EM algorithm") over the normalized cascade parameters: after two EM steps
+/// t0->t1->t2, jump to t0 + 2s r + s^2 v (r=t1-t0, v=t2-2t1+t0, s=|r|/|v| clamped to [1,max_step]) and
+/// renormalize.  the extrapolation is of log weights, so it stays positive, and renormalizing is the
+/// projection back onto the parameter simplex.  the caller must reject() an extrapolation that worsens
+/// perplexity, which resumes from t2.  the parameters are the table's weights, or for --train-cascade the
+/// arcs of the (normalized) cascade members, and the composed table's weights (the counts that normalize to
+/// t2) are kept for reject()
+struct squarem {
+  typedef fixed_array<Weight> weights;
+  dynamic_array<Weight*> params;  // non-locked, normalized
+  weights t0, t1, t2;
+  weights composed2;  // fb.arcs weights after the EM step to t2
+  unsigned steps;  // EM steps (0 or 1) since the last extrapolation
+  bool extrapolated;  // current params came from an extrapolation (perplexity not yet checked)
+  double step, max_step;  // last and max step length s; max_step grows x4 when reached
+
+  squarem(forward_backward& fb, WFST::NormalizeMethods const& methods) {
+    cascade_parameters& cascade = fb.cascade;
+    em_arcs_table& arcs = fb.arcs;
+    if (cascade.trivial) {
+      if (methods[0].group != WFST::NONE)
+        for (unsigned i = 0, n = arcs.size(); i != n; ++i)
+          if (!arcs.locked(i)) params.push_back(&arcs.weights[i]);
+    } else
+      for (unsigned i = 0, n = cascade.size(); i < n; ++i)
+        if (methods[i].group != WFST::NONE) cascade.cascade[i]->visit_arcs(*this);
+    unsigned n = params.size();
+    t0.init(n);
+    t1.init(n);
+    t2.init(n);
+    reset();
+  }
+  void operator()(unsigned, FSTArc& a) {
+    if (!WFST::isLocked(a.groupId)) params.push_back(&a.weight);
+  }
+  void reset() {
+    steps = 0;
+    extrapolated = false;
+    step = max_step = 1;
+  }
 
-   estimate: fine (clear_count, collect_counts)
+  // instead of fb.maximize (so, after estimate).  returns the EM step's max change
+  Weight maximize(forward_backward& fb, WFST::NormalizeMethods const& methods) {
+    extrapolated = false;
+    save(steps ? t1 : t0);
+    Weight change = fb.maximize(methods, 1);
+    if (!steps) {
+      steps = 1;
+      return change;
+    }
+    steps = 0;
+    save(t2);
+    em_arcs_table& arcs = fb.arcs;
+    composed2.reinit(arcs.size());
+    for (unsigned i = 0, n = arcs.size(); i != n; ++i) composed2[i] = arcs.weight(i);
+    step = step_length();
+    if (step > 1) {
+      extrapolate();
+      fb.normalize_weights(methods);
+      extrapolated = true;
+    }
+    return change;
+  }
 
+  void reject(forward_backward& fb) {
+    load(t2);
+    em_arcs_table& arcs = fb.arcs;
+    for (unsigned i = 0, n = arcs.size(); i != n; ++i) arcs.weight(i) = composed2[i];
+    reset();
+  }
 
-*/
-Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, NormalizeMethods const& methods,
-                   bool weight_is_prior_count, Weight smoothFloor, Weight converge_arc_delta,
-                   Weight converge_perplexity_ratio, train_opts const& opts, bool restore_old_weights) {
-  std::ostream& log = Config::log();
-  graehl::time_space_report ts(log, "Training took ");
-  cascade.set_composed(this);
-  cascade.normalize(methods);
-  unsigned ran_restarts = opts.ran_restarts;
-  double learning_rate_growth_factor = opts.learning_rate_growth_factor;
-  random_restart_acceptor ra = opts.ra;
-  forward_backward fb(*this, cascade, weight_is_prior_count, smoothFloor, true, opts, corpus);
-  Weight corpus_p;
-  // irrawaddy28: Commented the next line. If not commented, EM exits before any training has started!
-  // if (~~opts.max_iter) return fb.estimate(corpus_p).ppxper(corpus.totalEmpiricalWeight);
+ private:
+  void save(weights& t) const {
+    for (unsigned i = 0, n = params.size(); i != n; ++i) t[i] = *params[i];
+  }
+  void load(weights const& t) const {
+    for (unsigned i = 0, n = params.size(); i != n; ++i) *params[i] = t[i];
+  }
+  bool finite(unsigned i) const { return !(t0[i].isZero() || t1[i].isZero() || t2[i].isZero()); }
+
+  double step_length() {
+    double rr = 0, vv = 0;
+    for (unsigned i = 0, n = params.size(); i != n; ++i)
+      if (finite(i)) {
+        double l0 = t0[i].getLn(), l1 = t1[i].getLn(), r = l1 - l0, v = t2[i].getLn() - l1 - r;
+        rr += r * r;
+        vv += v * v;
+      }
+    if (vv == 0) return 1;
+    double s = std::sqrt(rr / vv);
+    if (!(s > 1)) return 1;
+    if (s >= max_step) {
+      s = max_step;
+      max_step *= 4;
+    }
+    return s;
+  }
 
-  // when you just want frac counts or a single iteration:
-  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0)) {
-    if (opts.max_iter == 0)
-      log << "0 iterations specified for training; output weights will be unnormalized fractional counts "
-             "(except locked arcs).\n";
-    cascade.update();
-    Weight p = fb.estimate(corpus_p);
-    log << "Corpus ";
-    corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
-                              corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
-    if (opts.max_iter == 0) {
-      fb.arcs.visit(for_arcs::prep_new_weights(1.0));
-      cascade.distribute_counts();
-    } else {
-      fb.maximize(methods, 1);
-      cascade.use_counts_final(methods);  // also updates composed xdcr weights
+  void extrapolate() const {
+    for (unsigned i = 0, n = params.size(); i != n; ++i) {
+      Weight& w = *params[i];
+      if (!finite(i)) continue;  // w is t2
+      double l0 = t0[i].getLn(), l1 = t1[i].getLn(), r = l1 - l0, v = t2[i].getLn() - l1 - r;
+      w.setLn(l0 + step * (2 * r + step * v));
     }
-    log << "\n";
-    return p.ppxper(corpus.totalEmpiricalWeight);
   }
+};
 
-  // multiple iterations and keep the best of possibly many random restarts
+/// EM from the current weights of a forward_backward, once per random restart, keeping the best weights (by
+/// corpus perplexity) seen over all of them.  run_parallel runs the restarts concurrently, each in its own
+/// forward_backward (own parameter table and counts) sharing the derivations cached by the first
+struct em_restarts {
+  cascade_parameters& cascade;
+  training_corpus& corpus;
+  WFST::NormalizeMethods const& methods;
+  Weight converge_arc_delta, converge_perplexity_ratio;
+  WFST::train_opts const& opts;
+  double learning_rate_growth_factor;
+  bool using_cascade;
+  squarem* sq;  // if --squarem
+
+  // shared by all restarts (guarded by best_mutex if parallel):
+  WFST::random_restart_acceptor ra;
   Weight bestPerplexity;
-  bestPerplexity.setInfinity();
-  bool using_cascade = !cascade.trivial;
-  if (using_cascade) {
-    if (learning_rate_growth_factor != 1) {
-      Config::warn() << "Overrelaxed EM not supported for --train-cascade.  Disabling (growth factor=1)."
-                     << std::endl;
-      learning_rate_growth_factor = 1;
+  bool have_good_weights;
+  forward_backward* best_fb;  // holder of the best weights so far
+
+  em_restarts(cascade_parameters& cascade, training_corpus& corpus, WFST::NormalizeMethods const& methods,
+              Weight converge_arc_delta, Weight converge_perplexity_ratio, WFST::train_opts const& opts)
+      : cascade(cascade)
+      , corpus(corpus)
+      , methods(methods)
+      , converge_arc_delta(converge_arc_delta)
+      , converge_perplexity_ratio(converge_perplexity_ratio)
+      , opts(opts)
+      , learning_rate_growth_factor(opts.learning_rate_growth_factor)
+      , using_cascade(!cascade.trivial)
+      , sq()
+      , ra(opts.ra)
+      , have_good_weights(false)
+      , best_fb()
+      , parallel(false)
+      , first_judged(false)
+      , best_restart() {
+    bestPerplexity.setInfinity();
+    if (using_cascade) {
+      if (learning_rate_growth_factor != 1) {
+        Config::warn() << "Overrelaxed EM not supported for --train-cascade.  Disabling (growth factor=1)."
+                       << std::endl;
+        learning_rate_growth_factor = 1;
+      }
     }
   }
-  bool have_good_weights = false;
-  for (unsigned restart_no = 0;; ++restart_no) {
+
+  void run(forward_backward& fb, unsigned restart_no, std::ostream& log) {
+    fb.reset_online();
+    if (sq) sq->reset();
+    Weight corpus_p;
     unsigned train_iter = 0;
     Weight lastChange = 10;
     Weight lastPerplexity;
@@ -564,16 +680,16 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
 #endif
 #ifdef DEBUG
 #define DWSTAT(a) print_stats(arcs, a)
-      arcs_table<arc_counts> const& arcs = fb.arcs;
+      em_arcs_table const& arcs = fb.arcs;
 #else
 #define DWSTAT(a)
 #endif
       //            DWSTAT("Before estimate");
       bool cascade_counts = using_cascade && !first_time;
       if (cascade_counts)
-        fb.arcs.visit(for_arcs::save_counts());  // so you can later save_best_counts if you like the ppx
-      cascade.update();
-      if (~opts.max_iter && train_iter > opts.max_iter && have_good_weights) {
+        fb.arcs.save_counts();  // so you can later save_best_counts if you like the ppx
+      fb.cascade_update();
+      if (~opts.max_iter && train_iter > opts.max_iter && good_weights()) {
         log << "Maximum number of iterations (" << opts.max_iter
             << ") reached before convergence criteria was met - greatest arc weight change was " << lastChange
             << "\n";
@@ -581,6 +697,8 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       }
       Weight p = fb.estimate(corpus_p);  // lastPerplexity.isInfinity() // only delete no-path training the
       // first time, in case we screw up with our learning rate
+      if (fb.online_batch && opts.online_eval && train_iter % opts.online_eval == 0)
+        p = fb.evaluate(corpus_p);  // score (and maybe save_best) the updated weights exactly
       Weight newPerplexity = p.ppxper(corpus.totalEmpiricalWeight);
       DWSTAT("\nAfter estimate");
       log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
@@ -588,20 +706,30 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       //            per-example-perplexity="<<newPerplexity.as_base(2);
       corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
                                 corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
-      if (newPerplexity < bestPerplexity
-          && (!using_cascade || cascade_counts)) {  // because of how I'm saving only composed counts, we
-        // can't actually get back to our initial starting point
-        // (iter 1)
-        log << " (new best)";
-        bestPerplexity = newPerplexity;
-        have_good_weights = true;
-        fb.save_best();
+      if ((!using_cascade || cascade_counts)  // because of how I'm saving only composed counts, we
+          // can't actually get back to our initial starting point (iter 1), or to a SQUAREM extrapolation
+          && !(using_cascade && sq && sq->extrapolated)) {
+        lock_best lock(*this);
+        // in parallel, ties go to the lower restart, as running the restarts in order would have it
+        bool best = newPerplexity < bestPerplexity
+                    || (parallel && newPerplexity == bestPerplexity && restart_no < best_restart);
+        if (parallel)
+          mark_improvement(restart_no, newPerplexity, log);
+        else if (best)
+          log << " (new best)";
+        if (best) {
+          bestPerplexity = newPerplexity;
+          best_restart = restart_no;
+          have_good_weights = true;
+          fb.save_best();
+          best_fb = &fb;
+        }
       }
       Weight pp_ratio_scaled;
       if (first_time) {
 
         log << std::endl;
-        if (!ra.accept(newPerplexity, bestPerplexity, restart_no, &log)) {
+        if (!accept(newPerplexity, restart_no, log)) {
           log << "Random start was insufficiently promising; trying another." << std::endl;
           break;  // to next random restart
         }
@@ -613,17 +741,24 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
 #ifdef DEBUG_ADAPTIVE_EM
         log << " last-perplexity=" << lastPerplexity << ' ';
         if (learning_rate > 1) {
-          fb.arcs.visit(for_arcs::swap_em_scaled());
+          fb.arcs.swap_em_scaled();
           Weight d;
           Weight em_pp = fb.estimate(d);
           log << "unscaled-EM-perplexity=" << em_pp;
-          fb.arcs.visit(for_arcs::swap_em_scaled());
+          fb.arcs.swap_em_scaled();
           if (em_pp > lastPerplexity)
             Config::warn() << " - last EM worsened perplexity, from " << lastPerplexity << " to " << em_pp
                            << ", which is theoretically impossible." << std::endl;
         }
 #endif
         log << std::endl;
+        if (sq && sq->extrapolated && newPerplexity > lastPerplexity) {
+          log << "SQUAREM extrapolation (step length " << sq->step
+              << ") worsened perplexity; continuing from the last EM step." << std::endl;
+          sq->reject(fb);
+          last_was_reset = true;
+          continue;
+        }
       }
       if (!last_was_reset) {
         if (pp_ratio_scaled >= converge_perplexity_ratio) {
@@ -631,13 +766,13 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
             log << "Failed to improve (relaxation rate too high); starting again at learning rate 1"
                 << std::endl;
             learning_rate = 1;
-            fb.arcs.visit(for_arcs::keep_em_weight());
+            fb.arcs.keep_em_weight();
             last_was_reset = true;
             continue;
           }
           log << "Converged - per-example perplexity ratio exceeds " << converge_perplexity_ratio << " after "
               << train_iter << " iterations.\n";
-          if (!have_good_weights)
+          if (!good_weights())
             log << "Because of the --train-cascade implementation, we need another iteration even though "
                    "we've converged.\n";
           else
@@ -648,22 +783,287 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
         last_was_reset = false;
       //            DWSTAT("Before maximize");
-      lastChange = fb.maximize(methods, learning_rate);
-      if (lastChange <= converge_arc_delta && have_good_weights) {
+      if (sq) {
+        lastChange = sq->maximize(fb, methods);
+        if (sq->extrapolated) log << "SQUAREM extrapolation, step length " << sq->step << std::endl;
+      } else
+        lastChange = fb.maximize(methods, learning_rate);
+      if (lastChange <= converge_arc_delta && good_weights()) {
         log << "Converged - maximum weight change less than " << converge_arc_delta << " after " << train_iter
             << " iterations.\n";
         break;
       }
       lastPerplexity = newPerplexity;
     }
-    if (ran_restarts > 0) {
-      --ran_restarts;
-      cascade.random_restart(methods);
-      log << "\nRandom restart - " << ran_restarts << " remaining.\n";
+  }
+
+  /// parallel restarts need: more than one restart and thread; a single (not --train-cascade) normalized
+  /// transducer; and derivations cached in memory with backward structure (-:)
+  bool parallel_ok(forward_backward const& fb) const {
+    unsigned nthreads = opts.restart_threads;
+    if (nthreads <= 1 || opts.ran_restarts <= 0) return false;
+    char const* why = using_cascade
+                          ? "--train-cascade"
+                          : sq ? "--squarem"
+                          : methods[0].group == WFST::NONE
+                                ? "no normalization"
+                                : !fb.shareable() ? "derivations not cached in memory with -:" : 0;
+    if (why)
+      Config::warn() << "Running random restarts sequentially, not in " << nthreads << " threads (" << why
+                     << ")." << std::endl;
+    return !why;
+  }
+
+  void run_parallel(forward_backward& fb) {
+    std::ostream& log = Config::log();
+    unsigned n_starts = opts.ran_restarts + 1, nthreads = std::min(opts.restart_threads, n_starts);
+    parallel = true;
+    // the random starting points are drawn up front (in restart order, as if sequential), so they depend
+    // only on -R and not on the thread schedule.  they're held as the best_weight of per-restart tables.
+    fixed_array<forward_backward*> workers(nthreads);
+    for (unsigned t = 0; t < nthreads; ++t) workers[t] = new forward_backward(fb, *fb.plan);
+    starts.reinit(n_starts);
+    for (unsigned r = 0; r < n_starts; ++r) {
+      if (r) fb.random_restart(methods);
+      starts[r].reinit(fb.arcs.size());
+      for (unsigned i = 0, n = fb.arcs.size(); i != n; ++i) starts[r][i] = fb.arcs.weight(i);
+    }
+    log << "Running " << n_starts << " EM starts (" << opts.ran_restarts << " random restarts) in " << nthreads
+        << " threads.\n";
+    next_start = 0;
+    reports.reinit(n_starts);
+    thread_group threads;
+    for (unsigned t = 0; t < nthreads; ++t) threads.create_thread(restart_worker(*this, *workers[t]));
+    threads.join_all();
+    print_reports(log);
+    if (error) std::rethrow_exception(error);
+    // the main fb gets the overall best, for load_best
+    if (best_fb) {
+      em_arcs_table::column const& best = best_fb->arcs.best_weight;
+      std::copy(best.begin(), best.end(), fb.arcs.best_weight.begin());
+    }
+    for (unsigned t = 0; t < nthreads; ++t) delete workers[t];
+  }
+
+ private:
+  bool parallel;
+  std::mutex best_mutex;
+  std::condition_variable first_judged_cv;
+  bool first_judged;  // restart 0's start perplexity is known to ra
+  fixed_array<fixed_array<Weight> > starts;
+  std::atomic<unsigned> next_start;
+  std::exception_ptr error;
+  unsigned best_restart;
+
+  /// a parallel restart's log, printed after all have finished, in restart order.  each iteration that
+  /// improved on the restart's own best left a kMark (in place of " (new best)") and its perplexity in
+  /// improved; print_reports decides which were new overall bests, as if the restarts had run in order
+  struct restart_report {
+    std::string text;
+    Weight best;
+    std::vector<Weight> improved;
+    restart_report() { best.setInfinity(); }
+  };
+  static char const kMark = '\001';
+  fixed_array<restart_report> reports;
+
+  void mark_improvement(unsigned restart_no, Weight ppx, std::ostream& log) {
+    restart_report& r = reports[restart_no];
+    if (!(ppx < r.best)) return;
+    r.best = ppx;
+    r.improved.push_back(ppx);
+    log << kMark;
+  }
+
+  void print_reports(std::ostream& log) {
+    Weight best;
+    best.setInfinity();
+    for (unsigned i = 0, n = reports.size(); i < n; ++i) {
+      restart_report const& r = reports[i];
+      std::size_t pos = 0;
+      for (std::size_t m = 0; m < r.improved.size(); ++m) {
+        std::size_t mark = r.text.find(kMark, pos);
+        log.write(r.text.data() + pos, mark - pos);
+        if (r.improved[m] < best) {
+          log << " (new best)";
+          best = r.improved[m];
+        }
+        pos = mark + 1;
+      }
+      log.write(r.text.data() + pos, r.text.size() - pos);
+    }
+    log << std::flush;
+  }
+
+  struct lock_best {
+    std::unique_lock<std::mutex> lock;
+    lock_best(em_restarts& em) : lock(em.best_mutex, std::defer_lock) {
+      if (em.parallel) lock.lock();
+    }
+  };
+
+  bool good_weights() {
+    lock_best lock(*this);
+    return have_good_weights;
+  }
+
+  // ra compares other restarts' first iteration to restart 0's, so they wait for that
+  bool accept(Weight newPerplexity, unsigned restart_no, std::ostream& log) {
+    lock_best lock(*this);
+    if (parallel && restart_no)
+      first_judged_cv.wait(lock.lock, [this] { return first_judged; });
+    bool r = ra.accept(newPerplexity, bestPerplexity, restart_no, &log);
+    if (!restart_no) {
+      first_judged = true;
+      if (parallel) first_judged_cv.notify_all();
+    }
+    return r;
+  }
+
+  struct restart_worker {
+    em_restarts& em;
+    forward_backward& fb;
+    restart_worker(em_restarts& em, forward_backward& fb) : em(em), fb(fb) {}
+    void operator()() const {
+      for (unsigned r; (r = em.next_start++) < em.starts.size();) {
+        std::ostringstream log;
+        log.copyfmt(Config::log());  // Weight output format
+        log << "\nRestart " << r << " (" << (r ? "random start" : "initial weights") << "):\n";
+        try {
+          std::copy(em.starts[r].begin(), em.starts[r].end(), fb.arcs.weights.begin());
+          em.run(fb, r, log);
+        } catch (...) {
+          lock_best lock(em);
+          em.reports[r].text = log.str();
+          if (!em.error) em.error = std::current_exception();
+          em.next_start = em.starts.size();
+          if (!r) {
+            em.first_judged = true;  // don't leave the others waiting
+            em.first_judged_cv.notify_all();
+          }
+          return;
+        }
+        em.reports[r].text = log.str();
+      }
+    }
+  };
+};
+
+Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, bool weight_is_prior_count,
+                   Weight smoothFloor, Weight converge_arc_delta, Weight converge_perplexity_ratio,
+                   train_opts const& opts) {
+  cascade_parameters cascade;
+  return train(cascade, corpus, methods, weight_is_prior_count, smoothFloor, converge_arc_delta,
+               converge_perplexity_ratio, opts);
+}
+
+
+/* I want NONE normalization to lock the given transducer.  but that's not happening excpet in the simple
+   single-iteration code.
+
+   Things that can change arc weight via arc_counts::weight():
+
+   normalization.  no, cascade skips NONE
+
+   prep_new_weights (pre-normalization).  also old to scratch.
+   but we surround maximize with save_none/load_none.  need to verify!
+
+   keep_em_weight: from em_weight
+
+   use_best_weight: from best_weight
+
+
+   max_change: diff to scratch
+
+   save_best_counts: best_weight from em_weight (for cascade)
+
+   save_counts: to em_weight
+
+   save_best: to best_weight
+
+   on 2nd iter, save_counts.  fine.
+
+   cascade.update: just sets composed weights from chain
+
+   estimate: fine (clear_count, collect_counts)
+
+
+*/
+Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, NormalizeMethods const& methods,
+                   bool weight_is_prior_count, Weight smoothFloor, Weight converge_arc_delta,
+                   Weight converge_perplexity_ratio, train_opts const& opts, bool restore_old_weights) {
+  std::ostream& log = Config::log();
+  graehl::time_space_report ts(log, "Training took ");
+  cascade.set_composed(this);
+  cascade.compile_normalize(methods, opts.normalize_threads);
+  cascade.normalize(methods);
+  unsigned ran_restarts = opts.ran_restarts;
+  forward_backward fb(*this, cascade, weight_is_prior_count, smoothFloor, true, opts, corpus);
+  Weight corpus_p;
+  // irrawaddy28: Commented the next line. If not commented, EM exits before any training has started!
+  // if (~~opts.max_iter) return fb.estimate(corpus_p).ppxper(corpus.totalEmpiricalWeight);
+
+  // when you just want frac counts or a single iteration:
+  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0)) {
+    if (opts.max_iter == 0)
+      log << "0 iterations specified for training; output weights will be unnormalized fractional counts "
+             "(except locked arcs).\n";
+    fb.cascade_update();
+    Weight p = fb.estimate(corpus_p);
+    log << "Corpus ";
+    corpus_p.print_ppx_symbol(log, corpus.n_input, corpus.n_output,
+                              corpus.n_pairs);  // FIXME: newPerplexity is training-example-weighted
+    if (opts.max_iter == 0) {
+      fb.arcs.prep_new_weights(1.0);
+      fb.arcs.store_weights();
+      cascade.distribute_counts();
     } else {
-      break;
+      fb.maximize(methods, 1);
+      fb.arcs.store_weights();
+      cascade.use_counts_final(methods);  // also updates composed xdcr weights
+    }
+    log << "\n";
+    cascade.drop_normalize_plans();
+    return p.ppxper(corpus.totalEmpiricalWeight);
+  }
+
+  // multiple iterations and keep the best of possibly many random restarts
+  em_restarts em(cascade, corpus, methods, converge_arc_delta, converge_perplexity_ratio, opts);
+  if (fb.set_online(methods) && em.learning_rate_growth_factor != 1) {
+    Config::warn() << "Overrelaxed EM (-o) not supported for online EM.  Disabling (growth factor=1)."
+                   << std::endl;
+    em.learning_rate_growth_factor = 1;
+  }
+  std::unique_ptr<squarem> sq;
+  if (opts.squarem) {
+    if (fb.online_batch)
+      Config::warn() << "--squarem not supported for online EM; ignoring it." << std::endl;
+    else {
+      sq.reset(new squarem(fb, methods));
+      em.sq = sq.get();
+      Config::log() << "SQUAREM acceleration over " << sq->params.size() << " parameters.\n";
+      if (em.learning_rate_growth_factor != 1) {
+        Config::warn() << "Overrelaxed EM (-o) replaced by --squarem.  Disabling (growth factor=1)."
+                       << std::endl;
+        em.learning_rate_growth_factor = 1;
+      }
+    }
+  }
+  if (em.parallel_ok(fb)) {
+    em.run_parallel(fb);
+  } else {
+    for (unsigned restart_no = 0;; ++restart_no) {
+      em.run(fb, restart_no, log);
+      if (ran_restarts > 0) {
+        --ran_restarts;
+        fb.random_restart(methods);
+        log << "\nRandom restart - " << ran_restarts << " remaining.\n";
+      } else {
+        break;
+      }
     }
   }
+  Weight bestPerplexity = em.bestPerplexity;
 
   log << "Setting weights to model with lowest per-example-perplexity ( = "
          "prod[modelprob(example)]^(-1/num_examples) = 2^(-log_2(p_model(corpus))/N) = "
@@ -671,6 +1071,8 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
 
   fb.load_best();
   cascade.use_counts_final(methods);  // also updates composed xdcr weights
+  log << cascade.norm_plans << std::endl;
+  cascade.drop_normalize_plans();
 
   ts.report();  // show memory held
   return bestPerplexity;
@@ -760,13 +1162,18 @@ void forward_backward::matrix_fb(IOSymSeq& s) {
 
 
 Weight forward_backward::estimate(Weight& unweighted_corpus_prob) {
-  arcs.visit(for_arcs::clear_count());
+  arcs.clear_counts();
+  if (online_batch) {
+    arcs.save_old_weights();  // for maximize()'s max_change
+    in_batch = 0;
+  }
   unweighted_corpus_prob = 1;
   Weight p;
   if (use_matrix)
     p = estimate_matrix(unweighted_corpus_prob);
   else
     p = estimate_cached(unweighted_corpus_prob);
+  if (online_batch && in_batch) online_step();  // the last, partial, mini-batch
   throw_if_no_derivation();
   return p;
 }
@@ -782,7 +1189,7 @@ Weight forward_backward::estimate_matrix(Weight& unweighted_corpus_prob) {
 
   IOPair io;
 
-  List<IOSymSeq>::erase_iterator seq = corpus().examples.erase_begin(),
+  training_corpus::Examples::erase_iterator seq = corpus().examples.erase_begin(),
                                  lastExample = corpus().examples.erase_end();
   //#ifdef DEBUGTRAIN
   int train_example_no = 0;  // Yaser 7-13-2000
@@ -823,7 +1230,7 @@ Weight forward_backward::estimate_matrix(Weight& unweighted_corpus_prob) {
     letIn = seq->i.let;
     letOut = seq->o.let;
 
-    arcs.visit(for_arcs::clear_scratch());
+    arcs.clear_scratch();
 
     // accumulate counts for each arc's contribution throughout all uses it has in explaining the training
     for (i = 0; i <= nIn; ++i)  // go over all symbols in input in the training pair
@@ -848,7 +1255,7 @@ Weight forward_backward::estimate_matrix(Weight& unweighted_corpus_prob) {
           matrix_count(find_second(fs, io), s, i, o, 0, 0);
         }
 
-    arcs.visit(for_arcs::add_weighted_scratch(seq->weight / fin));
+    arcs.add_weighted_scratch(seq->weight / fin);
     //        Weight mult=seq->weight;
     //        EACHDW(if (!dw->scratch.isZero()) dw->counts += mult*(dw->scratch / fin););
 
@@ -879,8 +1286,7 @@ void WFST::train_prune() {
 std::ostream& operator<<(std::ostream& o, arc_counts const& ac) {
   int pGroup;
   if (!WFST::isNormal(pGroup = ac.groupId())) o << pGroup << ' ';
-  o << ac.src << "->" << *ac.arc << " weight " << ac.weight() << " scratch: " << ac.scratch << " counts "
-    << ac.counts << '\n';
+  o << ac.src << "->" << *ac.arc << " weight " << ac.weight() << '\n';
   return o;
 }
 
@@ -896,29 +1302,32 @@ Weight forward_backward::maximize(WFST::NormalizeMethods const& methods, FLOAT_T
 #else
 #define DUMPDW(h)
 #endif
+  if (online_batch) return arcs.max_change();  // estimate already updated the weights
   DUMPDW("Weights before prior smoothing");
+  if (cascade.trivial) {
+    if (methods[0].group == WFST::NONE) {  // weights are fixed
+      arcs.save_counts();  // em_weight
+      return Weight();
+    }
+    Weight change = maximize_weights(methods[0]);
+    DUMPDW("Weights after normalization");
+    if (delta_scale > 1.) {
+      arcs.overrelax(delta_scale);
+      normalize_weights(methods);
+      return arcs.max_change();  // find maximum change for convergence
+    }
+    return change;
+  }
   cascade.save_none(methods);
   //    arcs.pre_norm_counts(corpus.totalEmpiricalWeight);
-  arcs.visit(for_arcs::prep_new_weights(1.0));
+  arcs.prep_new_weights(1.0);
+  arcs.store_weights();
   //    DUMPDW("Weights before normalization");
   //    DWSTAT("Before normalize");
-  cascade.use_counts(methods);  // doesn't actually put weights back into x for nontrivial cascade, which is
-  // why the following is skipped for cascades.  update prior to estimate puts
-  // the weights in place.
+  cascade.use_counts(methods);  // doesn't actually put weights back into x for nontrivial cascade; the
+  // cascade_update prior to estimate puts the weights in place.
   cascade.load_none(methods);
-  if (cascade.trivial) {
-    DUMPDW("Weights after normalization");
-    //        DWSTAT("After normalize");
-    arcs.visit(for_arcs::overrelax(delta_scale));
-    //    arcs.overrelax();
-    // find maximum change for convergence
-    if (delta_scale > 1.) x.normalize(methods[0]);
-    //    return arcs.max_change();
-    for_arcs::max_change c;
-    arcs.visit(c);
-    return c.get();
-  } else
-    return 10;
+  return 10;
 }
 
 Weight WFST::sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq) {
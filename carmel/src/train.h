@@ -25,22 +25,19 @@ struct arc_counts_base {
 };
 
 
+// EM row for a deriv arc.  the per-arc Weights (counts, prior, scratch, ...) live in parallel columns of
+// em_arcs_table (derivations.h), not here
 struct arc_counts : public arc_counts_base {
-  Weight scratch;
-  Weight em_weight;
-  Weight best_weight;
-  Weight counts;
-  Weight prior_counts;
   unsigned src;  // this allows collecting per-arc counts from fwd/backwd
   void set(unsigned s, FSTArc* a, Weight prior) {
     arc_counts_base::set(s, a, prior);
-    prior_counts = prior;
     src = s;
   }
 };
 
 typedef arc_counts_base gibbs_counts;
 
+// the row alone; em_arcs_table::row(i) prints it with its counts and scratch columns
 std::ostream& operator<<(std::ostream& o, arc_counts const& ac);
 
 
@@ -163,7 +160,7 @@ class training_corpus : boost::noncopyable {
 
   void count() {
     clear_counts();
-    for (List<IOSymSeq>::const_iterator i = examples.const_begin(), end = examples.const_end(); i != end; ++i)
+    for (Examples::const_iterator i = examples.const_begin(), end = examples.const_end(); i != end; ++i)
       count(*i);
   }
 
@@ -180,7 +177,8 @@ class training_corpus : boost::noncopyable {
 
   //    bool cache_derivations;
   unsigned maxIn, maxOut;  // highest index (N-1) of input,output symbols respectively.
-  List<IOSymSeq> examples;
+  typedef PoolList<IOSymSeq>::type Examples;
+  Examples examples;
   // Weight smoothFloor;
   unsigned n_pairs;
   FLOAT_TYPE totalEmpiricalWeight;  // # of examples, if each is weighted equally
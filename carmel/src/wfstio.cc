@@ -11,6 +11,14 @@
 #include <graehl/shared/input_error.hpp>
 #include <graehl/shared/assoc_container.hpp>
 #include <graehl/shared/graphviz.hpp>
+#include <graehl/shared/lz4stream.hpp>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <vector>
 
 namespace graehl {
 
@@ -149,6 +157,274 @@ bufoverflow:
 #undef CHECKBUFOVERFLOW
 }
 
+/// readLegible's input, scanned in memory instead of a char at a time through an istream.  every operation
+/// readLegible uses (>> char, get, unget, skip_comment, getString, >> unsigned, >> Weight) moves the read
+/// position and sets eof/fail exactly as the istream one would, so a file parses the same and a bad one gets
+/// the same show_error_context (from an istream over the same bytes, at the same position and state).
+class LegibleInput {
+ public:
+  LegibleInput(char const* begin, char const* end, bool seekable)
+      : b(begin), p(begin), e(end), state(std::ios_base::goodbit), seekable(seekable) {}
+
+  explicit operator bool() const { return !(state & (std::ios_base::failbit | std::ios_base::badbit)); }
+  bool good() const { return !state; }
+
+  LegibleInput& operator>>(char& c) {
+    if (skipSpace()) c = *p++;
+    return *this;
+  }
+
+  LegibleInput& get(char& c) {
+    if (!sentry()) return *this;
+    if (p == e)
+      state |= std::ios_base::eofbit | std::ios_base::failbit;
+    else
+      c = *p++;
+    return *this;
+  }
+
+  LegibleInput& unget() {
+    state &= ~std::ios_base::eofbit;
+    if (!sentry()) return *this;
+    if (p == b)
+      state |= std::ios_base::badbit;
+    else
+      --p;
+    return *this;
+  }
+
+  /// istr >> group, where readLegible has seen the first char is a digit
+  LegibleInput& operator>>(unsigned& u) {
+    if (!skipSpace()) return *this;
+    unsigned long long v = 0;
+    char const* digits = p;
+    for (; p < e && *p >= '0' && *p <= '9'; ++p)
+      if ((v = v * 10 + (*p - '0')) > UINT_MAX) v = (unsigned long long)UINT_MAX + 1;
+    if (p == e) state |= std::ios_base::eofbit;
+    if (p == digits || v > UINT_MAX) {
+      state |= std::ios_base::failbit;
+      u = p == digits ? 0 : UINT_MAX;
+    } else
+      u = (unsigned)v;
+    return *this;
+  }
+
+  /// plain decimal weights (and e^x) directly; anything fancier (10^x, ln/log suffix, at EOF, ...) by
+  /// Weight's own reader on an istream over the text
+  LegibleInput& operator>>(Weight& w) {
+    if (!skipSpace()) return *this;
+    double d;
+    char const* q = 0;
+    if (*p == 'e') {
+      if (p + 1 < e && p[1] == '^' && (q = plainNumber(p + 2, d))) w.setLn((Weight::float_type)d);
+    } else if ((q = plainNumber(p, d)) && d != 10)
+      w.setReal(d);
+    else
+      q = 0;
+    if (q) {
+      p = q;
+      return *this;
+    }
+    LegibleBuf buf(*this);
+    std::istream in(&buf);
+    try {
+      in >> w;
+    } catch (...) {
+      sync(buf, in);
+      throw;
+    }
+    sync(buf, in);
+    return *this;
+  }
+
+  LegibleInput& skipComment(char comment_char) {
+    char c;
+    for (;;) {
+      if (!(*this >> c).good()) break;
+      if (c == comment_char) {
+        if (!sentry()) break;
+        char const* nl = (char const*)std::memchr(p, '\n', e - p);
+        if (nl)
+          p = nl + 1;
+        else {
+          p = e;
+          state |= std::ios_base::eofbit;
+          break;
+        }
+      } else {
+        unget();
+        break;
+      }
+    }
+    return *this;
+  }
+
+  /// getString(istream &, buf): the next symbol (quoted and *special* ones with their delimiters, the latter
+  /// lowercased) into buf, returning NULL on failure or '(' / ')'
+  char* getString(char* buf) {
+    std::size_t const kMax = DEFAULTSTRBUFSIZE - 2;
+    char c = 0;
+    if (!(*this >> c)) return 0;
+    char const* start = p - 1, * stop = start + kMax, * s = p;
+    switch (c) {
+      case '"':
+      case '*': {
+        bool l = false;  // 1 if backslash was last character (in a quoted string)
+        for (; s < stop; ++s) {
+          if (s == e) {
+            p = e;
+            state |= std::ios_base::eofbit | std::ios_base::failbit;
+            return 0;
+          }
+          if (*s == c && (c == '*' || !l)) break;
+          l = *s == '\\' ? !l : false;
+        }
+        // no closing quote in kMax chars: like getString, the symbol is those, buf[kMax] (left over from an
+        // earlier symbol) and nothing else; reading goes on from the middle of the quoted string
+        p = s == stop ? s : s + 1;
+        std::size_t const n = p - start;
+        std::memcpy(buf, start, n);
+        buf[s == stop ? n + 1 : n] = '\0';
+        if (c == '*')
+          for (char* t = buf + 1; t < buf + n; ++t)
+            if (*t != '*') *t = tolower(*t);
+        return buf;
+      }
+      case '(':
+      case ')':
+        return 0;
+      default: {
+        char const* end;  // of the symbol
+        for (;; ++s) {
+          if (s == e) {
+            state |= std::ios_base::eofbit | std::ios_base::failbit;
+            p = end = e;
+            break;
+          }
+          if (s >= stop) {
+            p = s + 1;
+            std::cerr << "Symbol too long (over 0 characters): ";
+            return 0;
+          }
+          if (*s == '\n' || *s == '\t' || *s == ' ') {
+            end = s;
+            p = s + 1;
+            break;
+          }
+          if (*s == '!' || *s == ')') {
+            p = end = s;
+            break;
+          }
+        }
+        if (end[-1] == DOS_CR_CHAR) --end;
+        std::memcpy(buf, start, end - start);
+        buf[end - start] = '\0';
+        return buf + (end - start);
+      }
+    }
+  }
+
+  void showErrorContext(std::ostream& out) const {
+    LegibleBuf buf(*this);
+    std::istream in(&buf);
+    in.setstate(state);
+    show_error_context(in, out);
+  }
+
+ private:
+  /// the whole text, positioned where we are; seekable if the original stream was
+  struct LegibleBuf : std::streambuf {
+    bool seekable;
+    explicit LegibleBuf(LegibleInput const& t) : seekable(t.seekable) {
+      setg(const_cast<char*>(t.b), const_cast<char*>(t.p), const_cast<char*>(t.e));
+    }
+    char const* at() const { return gptr(); }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+      char* to = (dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr()) + off;
+      if (!seekable || !(which & std::ios_base::in) || to < eback() || to > egptr()) return pos_type(off_type(-1));
+      setg(eback(), to, egptr());
+      return pos_type(to - eback());
+    }
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+      return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+  };
+
+  void sync(LegibleBuf const& buf, std::istream const& in) {
+    p = buf.at();
+    state = in.rdstate();
+  }
+
+  /// an istream sentry: fails (setting failbit) unless good
+  bool sentry() {
+    if (!state) return true;
+    state |= std::ios_base::failbit;
+    return false;
+  }
+
+  /// sentry for formatted input, which also skips whitespace
+  bool skipSpace() {
+    if (!sentry()) return false;
+    while (p < e && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) ++p;
+    if (p < e) return true;
+    state |= std::ios_base::eofbit | std::ios_base::failbit;
+    return false;
+  }
+
+  /// [+-]digits[.digits][e[+-]digits] at s followed by something num_get wouldn't take: d = its value, and
+  /// the end.  else NULL
+  char const* plainNumber(char const* s, double& d) const {
+    char const* q = s;
+    if (q < e && (*q == '+' || *q == '-')) ++q;
+    char const* digits = q;
+    while (q < e && isdigit(*q)) ++q;
+    bool some = q > digits;
+    if (q < e && *q == '.')
+      for (digits = ++q; q < e && isdigit(*q); ++q) some = true;
+    if (!some) return 0;
+    if (q < e && (*q == 'e' || *q == 'E')) {
+      ++q;
+      if (q < e && (*q == '+' || *q == '-')) ++q;
+      for (digits = q; q < e && isdigit(*q);) ++q;
+      if (q == digits) return 0;
+    }
+    if (q == e || isdigit(*q) || *q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-' || *q == 'l')
+      return 0;
+    char num[64];
+    if (q - s >= (std::ptrdiff_t)sizeof(num)) return 0;
+    std::memcpy(num, s, q - s);
+    num[q - s] = '\0';
+    errno = 0;
+    d = std::strtod(num, 0);
+    if (errno == ERANGE || d == HUGE_VAL || d == -HUGE_VAL) return 0;
+    return q;
+  }
+
+  char const* b, * p, * e;
+  std::ios_base::iostate state;
+  bool seekable;
+};
+
+/// the rest of in; false if in can't seek (show_error_context then can't either)
+static bool readRest(istream& in, std::vector<char>& text) {
+  std::streamoff const at = in.tellg();
+  std::size_t n = 0;
+  if (at >= 0 && in.seekg(0, std::ios_base::end)) {
+    std::streamoff const end = in.tellg();
+    in.seekg(at);
+    if (end > at) text.resize((std::size_t)(end - at));
+  }
+  for (;;) {
+    if (n == text.size()) text.resize(n + std::max(n, (std::size_t)1 << 16));
+    std::streamsize got = in.rdbuf()->sgetn(&text[n], text.size() - n);
+    if (got <= 0) break;
+    n += got;
+  }
+  text.resize(n);
+  in.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+  return at >= 0;
+}
+
 WFST::WFST(const char* buf) {
   named_states = 0;
   init();
@@ -338,7 +614,15 @@ unsigned WFST::getStateIndex(const char* buf) {
 static const char COMMENT_CHAR = '%';
 
 // FIXME: need to destroy old data or switch this to a constructor
-bool WFST::readLegible(istream& istr, bool alwaysNamed) {
+bool WFST::readLegible(istream& in, bool alwaysNamed) {
+  std::vector<char> text;
+  bool const seekable = readRest(in, text);
+  char const* b = text.empty() ? 0 : &text[0];
+  return readLegible(b, b + text.size(), alwaysNamed, seekable);
+}
+
+bool WFST::readLegible(char const* begin, char const* end, bool alwaysNamed, bool seekable) {
+  LegibleInput istr(begin, end, seekable);
   alphabet_type& in = alphabet(kInput), & out = alphabet(kOutput);
   State::arc_adder arc_add(states);
   StringKey finalName;
@@ -349,8 +633,8 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     char c;
     char buf[DEFAULTSTRBUFSIZE], buf2[DEFAULTSTRBUFSIZE];
     //        string buf,buf2; // FIXME: rewrite getString to use growing buffer?
-    skip_comment(istr, COMMENT_CHAR);
-    REQUIRE(getString(istr, buf));
+    istr.skipComment(COMMENT_CHAR);
+    REQUIRE(istr.getString(buf));
     finalName = buf;
 
     if (!alwaysNamed) {
@@ -369,10 +653,10 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     //        Assert( *in.find(EPSILON_SYMBOL)==0 && *out.find(EPSILON_SYMBOL)==0 );
     while (istr >> c) {
       // begin line:
-      skip_comment(istr, COMMENT_CHAR);
+      istr.skipComment(COMMENT_CHAR);
       REQUIRE(c == '(');
       // start state:
-      REQUIRE(getString(istr, buf));
+      REQUIRE(istr.getString(buf));
 
       stateNumber = getStateIndex(buf);
       if (!~stateNumber) goto INVALID;
@@ -386,7 +670,7 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
         if (c == ')') break;
 
         // dest state:
-        REQUIRE(getString(istr, buf));
+        REQUIRE(istr.getString(buf));
         destState = getStateIndex(buf);
         if (!~destState) goto INVALID;
 
@@ -408,7 +692,7 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
             weight = 1.0;
           } else {
             char* e;
-#define GETBUF(buf) REQUIRE(e = getString(istr, buf))
+#define GETBUF(buf) REQUIRE(e = istr.getString(buf))
             GETBUF(buf);
             PEEKC;
             if (ENDIOW) {  // ... weight) or ... symbol)
@@ -454,7 +738,7 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
           if (c == '!') {  // lock weight
             PEEKC;
             if (isdigit(c)) {
-              unsigned group;
+              unsigned group = 0;
               REQUIRE(istr >> group);
               to_add.setGroup(group);
             } else {
@@ -499,15 +783,14 @@ bool WFST::readLegible(istream& istr, bool alwaysNamed) {
     goto INVALID;
   }
 INVALID:
-  show_error_context(istr, cerr);
+  istr.showErrorContext(cerr);
   if (named_states) finalName.kill();
   invalidate();
   return 0;
 }
 
 bool WFST::readLegible(const string& str, bool alwaysNamed) {
-  istringstream istr(str);
-  return (readLegible(istr, alwaysNamed));
+  return readLegible(str.data(), str.data() + str.size(), alwaysNamed);
 }
 
 static ostream& writeQuoted(ostream& os, const char* s) {
@@ -557,7 +840,7 @@ void WFST::writeGraphViz(ostream& os) {
   writeQuoted(os, stateName(0));
 
   for (unsigned s = 0; s < numStates(); s++) {
-    for (List<FSTArc>::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end();
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end();
          a != end; ++a) {
       os << newl;
       writeQuoted(os, stateName(s));
@@ -586,42 +869,59 @@ void WFST::writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON) {
 }
 
 void WFST::writeLegibleFilename(std::string const& name, bool include_zero) {
-  std::ofstream of(name.c_str());
-  writeLegible(of, include_zero);
+  std::unique_ptr<std::ostream> of(graehl::new_lz4_or_ofstream(name));
+  writeLegible(*of, include_zero);
 }
 
 
+/// OUTARCWEIGHT, appended to b
+static void appendArcWeight(string_builder& b, FSTArc const& a, bool brief, Weight::out_format wf) {
+  unsigned pGroup = a.groupId;
+  if (!brief || ~pGroup || a.weight != 1.0) a.weight.append(b(' '), wf);
+  if (~pGroup) {
+    b('!');
+    if (pGroup > 0) b(pGroup);
+  }
+}
+
 void WFST::writeLegible(ostream& os, bool include_zero) {
   bool brief = get_arc_format(os) == BRIEF;
   bool onearc = get_per_line(os) == ARC;
+  Weight::out_format const wf = Weight::get_out_format(os);
+  std::size_t const kFlushBytes = 1 << 16;
   unsigned i;
-  const char* inLet, *outLet, *destState;
+  const char* inLet, *outLet;
 
   if (!valid()) return;
-  os << stateName(final);
+  string_builder b(kFlushBytes + DEFAULTSTRBUFSIZE);
+  appendStateName(b, final);
   for (i = 0; i < numStates(); i++) {
-    if (!onearc) os << "\n(" << stateName(i);
-    for (List<FSTArc>::const_iterator a = states[i].arcs.const_begin(), end = states[i].arcs.const_end();
+    if (!onearc) appendStateName(b("\n("), i);
+    for (State::Arcs::const_iterator a = states[i].arcs.const_begin(), end = states[i].arcs.const_end();
          a != end; ++a) {
 
       if (include_zero || a->weight.isPositive()) {
-        if (onearc) os << "\n(" << stateName(i);
-        destState = stateName(a->dest);
-        os << " (" << destState;
+        if (onearc) appendStateName(b("\n("), i);
+        appendStateName(b(" ("), a->dest);
         if (!brief || a->in || a->out) {  // omit *e* *e* labels
           inLet = inLetter(a->in);
           outLet = outLetter(a->out);
-          os << " " << inLet;
-          if (!brief || strcmp(inLet, outLet)) os << " " << outLet;
+          b(' ')(inLet);
+          if (!brief || strcmp(inLet, outLet)) b(' ')(outLet);
         }
-        OUTARCWEIGHT(os, a);
-        os << ")";
-        if (onearc) os << ")";
+        appendArcWeight(b, *a, brief, wf);
+        b(')');
+        if (onearc) b(')');
       }
     }
-    if (!onearc) os << ")";
+    if (!onearc) b(')');
+    if (b.size() >= kFlushBytes) {
+      os.write(b.data(), b.size());
+      b.clear();
+    }
   }
-  os << "\n";
+  b('\n');
+  os.write(b.data(), b.size());
 }
 
 void WFST::listAlphabet(ostream& ostr, LabelType dir) {
@@ -0,0 +1,80 @@
+#!/bin/bash
+# golden outputs for sampling, sums of paths, epsilon removal, reduced precision decoding and the EM
+# variants: each case's output must match its golden.* file byte for byte, and the cases that should agree
+# with each other (thread counts, epsilon removal) must.  training cases compare only the per-iteration
+# corpus probabilities (to 6 digits), not the trained weights.
+# usage: golden-tests.sh [carmel]   (GOLDEN=write golden-tests.sh [carmel] regenerates golden.*)
+cd `dirname $0`
+B=${1:-../bin/$HOST/carmel}
+t=${TMPDIR:-/tmp}/carmel.golden.$$
+mkdir -p $t
+fail=0
+check() {  # what file1 file2: the two outputs must be the same
+  if ! cmp -s $2 $3; then
+    echo "FAIL: $1"
+    fail=1
+  fi
+}
+golden() {  # golden suffix file
+  g=golden.$1
+  if [ "$GOLDEN" = write ]; then
+    cp $2 $g
+  else
+    check "$g" $2 $g
+  fi
+}
+sums() {  # the sum of paths lines of carmel's log
+  grep '^Sum (all paths)'
+}
+iterations() {  # each EM iteration's corpus probability (restart after restart)
+  sed -n 's/^\(i=[0-9]*\) .* probability=\(2^[^ ]*\) .*/\1 \2/p'
+}
+
+# --gen-exact: the same paths for the same -R; --gen-threads=1 is the single threaded sequence
+$B -R 7 --gen-exact -OEG 15 train.a > $t/gen 2>/dev/null
+$B -R 7 --gen-threads=1 -OEG 15 train.a > $t/gen1 2>/dev/null
+$B -R 7 --gen-threads=3 -OEg 15 jpron-asciikana.transducer > $t/gen3 2>/dev/null
+$B -R 7 --gen-threads=3 -OEg 15 jpron-asciikana.transducer > $t/gen3b 2>/dev/null
+golden gen-exact $t/gen
+check "--gen-threads=1 differs from --gen-exact" $t/gen $t/gen1
+golden gen-threads3 $t/gen3
+check "--gen-threads=3 isn't repeatable" $t/gen3 $t/gen3b
+
+# --sum with cycles: kbest.small.cycle sums to 848484.545...
+$B --sum -k 1 kbest.small.cycle 2>&1 >/dev/null | sums > $t/sum
+golden sum-cycle $t/sum
+grep -q 'product of probs=848484\.545' $t/sum || { echo "FAIL: kbest.small.cycle sum isn't 848484.545"; fail=1; }
+
+# --rmepsilon-all-compositions: same sum of paths, with *e*:*e* cycles removed
+$B --sum -k 5 eps-cycle.wfst xyz.identity > $t/eps 2>$t/eps.log
+$B --rmepsilon-all-compositions --sum -k 5 eps-cycle.wfst xyz.identity > $t/rmeps 2>$t/rmeps.log
+sums < $t/eps.log > $t/eps.sum
+sums < $t/rmeps.log > $t/rmeps.sum
+golden rmepsilon-k5 $t/rmeps
+golden rmepsilon-sum $t/rmeps.sum
+check "--rmepsilon-all-compositions changed the sum of paths" $t/eps.sum $t/rmeps.sum
+
+# --decode-weights: k-best paths and sums on float and log16 copies of the weights
+for d in float log16; do
+  $B --decode-weights=$d --sum -IEQ -k 20 angela.knight.kbest.wfst > $t/$d 2>$t/$d.log
+  $B --decode-weights=$d --sum -k 1 kbest.small.cycle 2>&1 >/dev/null | sums >> $t/$d
+  golden decode-$d $t/$d
+done
+
+# EM variants on span.spell: SQUAREM, online EM, and random restarts in threads (the same restarts, and
+# the same trained weights, whatever the number of threads)
+T="-t span.spell.corpus span.spell.wfst"
+$B -R 3 -M 10 --squarem $T 2>&1 >/dev/null | iterations > $t/squarem
+golden squarem $t/squarem
+$B -R 3 -M 4 --online-em=10 $T 2>&1 >/dev/null | iterations > $t/online
+golden online-em $t/online
+$B -R 3 -M 4 -! 2 --restart-threads=1 $T > $t/r1 2>$t/r1.log
+$B -R 3 -M 4 -! 2 --restart-threads=3 $T > $t/r3 2>$t/r3.log
+iterations < $t/r3.log > $t/r3.it
+golden restart-threads $t/r3.it
+iterations < $t/r1.log | cmp -s - $t/r3.it || { echo "FAIL: --restart-threads=1 and 3 ran different restarts"; fail=1; }
+check "--restart-threads=1 and 3 trained different weights" $t/r1 $t/r3
+
+rm -rf $t
+[ $fail = 0 ] && echo "golden-tests: ok"
+exit $fail
@@ -0,0 +1,50 @@
+#!/bin/bash
+# transducer/path writer round trip: for every combination of the -Z -B -D -H -J output formats, a
+# transducer that has been written once (which renumbers its states) must come out the same when read
+# back and written again, and so must its k-best paths.  and the output must not change: write-golden.wfst
+# written in each format, and its k-best paths, must match the write-golden.* files byte for byte.
+# usage: write-roundtrip.sh [carmel]   (GOLDEN=write write-roundtrip.sh [carmel] regenerates write-golden.*)
+cd `dirname $0`
+B=${1:-../bin/$HOST/carmel}
+t=${TMPDIR:-/tmp}/carmel.roundtrip.$$
+mkdir -p $t
+letters=ZBDHJ
+fail=0
+for f in wfst2 jpron.transducer epron-jpron.1.transducer asciikana-katakana.transducer vowel-separator.transducer; do
+  for m in `seq 0 31`; do
+    flags=
+    for b in 0 1 2 3 4; do
+      [ $((m >> b & 1)) = 1 ] && flags=$flags${letters:$b:1}
+    done
+    flags=${flags:+-$flags}
+    $B $flags $f > $t/once 2>/dev/null
+    $B $flags $t/once > $t/w 2>/dev/null
+    $B $flags $t/w > $t/ww 2>/dev/null
+    $B $flags -k 20 $t/once > $t/k 2>/dev/null
+    $B $flags -k 20 $t/w > $t/kw 2>/dev/null
+    for x in w k; do
+      if ! cmp -s $t/$x $t/${x}w; then
+        echo "FAIL: $f $flags ($x)"
+        fail=1
+      fi
+    done
+  done
+done
+rm -rf $t
+golden() {  # golden suffix carmel-args...
+  g=write-golden.$1
+  shift
+  if [ "$GOLDEN" = write ]; then
+    $B "$@" > $g 2>/dev/null
+  elif ! $B "$@" 2>/dev/null | cmp -s - $g; then
+    echo "FAIL: $g (carmel $*)"
+    fail=1
+  fi
+}
+for x in "" Z B D H J; do
+  golden out${x:+-$x} ${x:+-$x} write-golden.wfst
+done
+golden k10 -k 10 write-golden.wfst
+golden k10-ZJ -ZJ -k 10 write-golden.wfst
+[ $fail = 0 ] && echo "write-roundtrip: ok"
+exit $fail
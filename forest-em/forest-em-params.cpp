@@ -54,8 +54,12 @@ ForestEmParams::validate_parameters()
   // forest-em files
   if (byid_output_file && !byid_rule_file)
     throw std::runtime_error("Must provide byid-rule-file.");
-  if (max_iter && !forests_file)
+  if (max_iter && !forests_file && binary_forests_file.empty())
     throw std::runtime_error("Missing forests-file.");
+  if (forests_file && !binary_forests_file.empty())
+    throw std::runtime_error("Give only one of forests-file and binary-forests-file.");
+  if (!write_binary_forests.empty() && !forests_file)
+    throw std::runtime_error("write-binary-forests needs forests-file.");
   if (!normgroups_file && (max_iter || normalize_initial))
     throw std::runtime_error("Missing normgroups-file.\n");
 }
@@ -99,8 +103,13 @@ ForestEmParams::perform_forest_em()
   if (log_level)
     forests.print_info(log());
 
-  if (forests_file) {
-    forests.read_forests(*forests_file);
+  if (forests_file || !binary_forests_file.empty()) {
+    if (forests_file)
+      forests.read_forests(*forests_file);
+    else
+      forests.read_forests_binary(binary_forests_file);
+    if (!write_binary_forests.empty())
+      forests.write_forests_binary(write_binary_forests);
     if (log_level) {
       forests.print_stats(log());
       log() << std::endl;
@@ -111,8 +120,12 @@ ForestEmParams::perform_forest_em()
     forests.prepare(*this);
     if (gopt.iter)
       forests.run_gibbs();
-    else if (max_iter)
-      overrelaxed_em(forests, max_iter, converge_ratio, random_restarts, converge_delta, 1, log(), log_level);
+    else if (max_iter) {
+      em_state state(random_restarts);
+      if (!resume_state_file.empty())
+        forests.resume_em(state);
+      overrelaxed_em(forests, state, max_iter, converge_ratio, converge_delta, 1, log(), log_level);
+    }
   }
 
 
@@ -122,9 +135,11 @@ ForestEmParams::perform_forest_em()
   if (outcounts_file)
     forests.write_counts(*outcounts_file, outcounts_file.name);
 
-  if (outviterbi_file || out_per_forest_counts_file || out_score_per_forest) {
+  if (outviterbi_file || outkbest_file || out_per_forest_counts_file || out_score_per_forest) {
     if (outviterbi_file)
       forests.prep_final_viterbi(*outviterbi_file);
+    if (outkbest_file)
+      forests.prep_final_kbest(*outkbest_file, kbest);
     if (out_per_forest_counts_file)
       forests.prep_final_per_forest_counts(*out_per_forest_counts_file);
     if (out_score_per_forest)
@@ -1,7 +1,7 @@
 #ifndef GRAEHL_TT__FOREST_EM_PARAMS_HPP
 #define GRAEHL_TT__FOREST_EM_PARAMS_HPP
 
-#define FOREST_EM_VERSION "v20"
+#define FOREST_EM_VERSION "v25"
 
 #include <graehl/shared/em.hpp>
 #include <graehl/shared/myassert.h>
@@ -38,21 +38,25 @@ struct ForestEmParams {
   unsigned watch_rule;
   unsigned watch_depth;
   unsigned forest_tick_period;
+  unsigned threads;
   Weight prior_counts;
   bool help, human_probs, normalize_initial, initial_1_params, checkpoint_parameters, zero_zerocounts;
   std::string tempfile_prefix, byid_prob_field, byid_count_field;
+  std::string binary_forests_file, write_binary_forests;
   bool viterbi_enable, per_forest_counts_enable;
   size_t viterbi_per, per_forest_counts_per;
+  unsigned kbest;
   std::string checkpoint_prefix;
+  std::string save_state_file, resume_state_file;
   Weight count_report_threshold, prob_report_threshold;
   bool count_report_enable;
   unsigned random_seed;
   Weight add_k_smoothing;
   size_t max_forest_nodes, max_normgroup_size, prealloc_params;
   unsigned watch_period;
-  istream_arg initparam_file, priorcounts_file, byid_rule_file;
-  ifstream_arg rules_file, forests_file, normgroups_file; // can't be STDIN
-  ostream_arg outviterbi_file, out_score_per_forest, out_per_forest_counts_file, outparam_file, log_file, byid_output_file, outcounts_file;
+  istream_arg initparam_file, priorcounts_file, byid_rule_file, forests_file, normgroups_file;
+  ifstream_arg rules_file; // can't be STDIN or compressed: FileLines seeks to each line
+  ostream_arg outviterbi_file, outkbest_file, out_score_per_forest, out_per_forest_counts_file, outparam_file, log_file, byid_output_file, outcounts_file;
   std::ostream *log_stream;
   std::string cmdline_str;
 #if __cplusplus < 201103L
@@ -79,11 +83,17 @@ struct ForestEmParams {
          "specify a 32-bit unsigned random seed for exact repeatability")
         ("use-double-precision,U", bool_switch(&double_precision),
          "use double-precision floats (8 bytes instead of 4) for params and counts")
+        ("threads,j", defaulted_value(&threads),
+         "E-step (EM count collection) threads, each over its own share of the forests; each holds a private copy of the counts (one per parameter).  forests must be --binary-forests-file or fit in one swap batch")
         ;
     OD training("Training options (use '-' to specify STDIN)");
     training.add_options()
         ("forests-file,f", defaulted_value(&forests_file),
-         "derivation forests (required)")
+         "derivation forests (required unless --binary-forests-file) " GRAEHL_GZ_USAGE)
+        ("binary-forests-file", defaulted_value(&binary_forests_file),
+         "instead of --forests-file, mmap (read only, shareable by concurrent runs) forests saved by --write-binary-forests")
+        ("write-binary-forests", defaulted_value(&write_binary_forests),
+         "after parsing --forests-file, save the forests here in binary for later --binary-forests-file runs")
         ("normgroups-file,n", defaulted_value(&normgroups_file),
          "Normalization groups file (required) - e.g. ((1 2 20) (30 31))")
         ("max-forest-nodes,m", defaulted_value(&max_forest_nodes),
@@ -114,6 +124,11 @@ struct ForestEmParams {
          "Write unnormalized em counts here (1-based)")
         ("outviterbi-file,v", defaulted_value(&outviterbi_file),
          "Write one-per-line 'prob <viterbi derivation forest>' e.g. 'e^-10.5 (1 (2 3))'")
+        ("outkbest-file", defaulted_value(&outkbest_file),
+         "Write the --kbest best derivations of each forest, best first, one per line as for --outviterbi-file, with an empty line after each forest's")
+        ("kbest", defaulted_value(&kbest),
+         "How many derivations per forest --outkbest-file lists (fewer if the forest has fewer).  above 1, "
+         "recurses once per nesting level: forests nested deeper than ~20000 nodes need a larger stack (ulimit -s)")
         ("out-per-forest-counts-file,E", defaulted_value(&out_per_forest_counts_file),
          "Write one-line-per-example '(ruleid:rulecounts ...)' e.g. '(2:e^-10.5 5:e^0 6:e^2.4)'")
         ("out-per-forest-inside-sum,S", defaulted_value(&out_score_per_forest),
@@ -147,6 +162,10 @@ struct ForestEmParams {
          "Store 'viterbi' files per <checkpoint-prefix>, for every Vth forest (0 = disable)")
         ("checkpoint-per-forest-counts,Z", defaulted_value(&per_forest_counts_per),
          "Store 'per-forest-counts' files per <checkpoint-prefix>, for every Zth forest (0 = disable)")
+        ("save-state", defaulted_value(&save_state_file),
+         "every watch-period EM or Gibbs iterations (every iteration if watch-period is 0), overwrite this binary file with what's needed to continue training: iteration, restart, current and best params, Gibbs sample and counts, and random generator state")
+        ("resume-state", defaulted_value(&resume_state_file),
+         "continue exactly (same results as if never stopped) from a --save-state file; give the same forests, normgroups and other options as the run that saved it")
         ("rules-file,R", defaulted_value(&rules_file),
          "(optional) rule description file, one rule per line, starting index 1; used by watch-rule")
         ("log-file,l", defaulted_value(&log_file),
@@ -202,6 +221,8 @@ struct ForestEmParams {
     outparam_file = ostream_arg();
     outcounts_file = ostream_arg();
     outviterbi_file = ostream_arg();
+    outkbest_file = ostream_arg();
+    kbest = 10;
     out_per_forest_counts_file = ostream_arg();
     initparam_file = istream_arg();
     priorcounts_file = istream_arg();
@@ -215,6 +236,7 @@ struct ForestEmParams {
     per_forest_counts_per = 0;
     log_file = graehl::stderr_arg();
     forest_tick_period = 10000;
+    threads = 1;
     byid_rule_file = istream_arg();
     byid_prob_field="emprob";
     byid_count_field="emcount";
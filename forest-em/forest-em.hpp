@@ -25,6 +25,8 @@
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/weight.h>
 #include <forest-em/forest.hpp>
+#include <forest-em/forest-kbest.hpp>
+#include <forest-em/mapped-forests.hpp>
 #include <forest-em/forest-em-params.hpp>
 
 #include <graehl/shared/em.hpp>
@@ -41,8 +43,16 @@
 #include <graehl/shared/memmap.hpp>
 #include <graehl/shared/swapbatch.hpp>
 #include <graehl/shared/gibbs.hpp>
+#include <graehl/shared/thread_group.hpp>
 
+#include <boost/cstdint.hpp>
+#include <cstdio>
+#include <fstream>
 #include <map>
+#include <vector>
+#include <exception>
+#include <memory>
+#include <boost/scoped_ptr.hpp>
 
 namespace graehl {
 
@@ -60,6 +70,7 @@ struct FForests : public gibbs_base {
   typedef typename NormGroup::iterator NormGroupIter;
 
   typedef SwapBatch<Forest> ForestBatches;
+  typedef MappedForests<Forest> ForestFile;
   std::string tempfile_prefix;
   typedef std::size_t size_t;
   size_t max_nodes;
@@ -89,13 +100,19 @@ struct FForests : public gibbs_base {
   prob_t prob_report_threshold;
   bool viterbi_enable, per_forest_counts_enable;
   std::ostream &logstream;
-  ForestBatches forests;
+  boost::scoped_ptr<ForestBatches> forests; // text forests, parsed into swap files
+  std::size_t forest_batch_bytes;
+  ForestFile mapped_forests; // or binary forests, mmapped read only
   FileLines rule_names;
   Norms norm_groups;
   size_t max_norm_ruleid, max_forest_ruleid;
   std::ofstream viterbi_o, per_forest_counts_o;
   std::ostream *viterbi_out, *per_forest_counts_out, *per_forest_inside_out;
   bool viterbi_go, per_forest_counts_go, per_forest_inside_go;
+  forest_kbest<Float> kbest;
+  std::ostream *kbest_out;
+  bool kbest_go;
+  unsigned kbest_k;
   double total_logprob;
   unsigned forest_no;
   typename Forest::prepare_inside_outside *forest_prep;
@@ -112,7 +129,10 @@ struct FForests : public gibbs_base {
   void print_stats(std::ostream &out = std::cerr) const {
     BACKTRACE;
     out << n_nodes << " forest nodes total (" << n_nodes*sizeof(ForestNode)<<" bytes), max #nodes " << max_nodes << ", average " << n_nodes * (1. / total_forests) << "\n";
-    forests.print_stats(out);
+    if (mapped_forests.is_open())
+      mapped_forests.print_stats(out);
+    else
+      forests->print_stats(out);
     out << "\n ";
     norm_groups.print_stats(out);
     out << "\n largest rule index was " << max_forest_ruleid << ".\n";
@@ -151,18 +171,43 @@ struct FForests : public gibbs_base {
     size_t &fmaxrule = Forest::max_ruleid; // static global return value
     SetLocal<size_t> g1(fmaxrule, 0);
     size_accum<size_t> total_size;
+    forests.reset(new ForestBatches(tempfile_prefix + ".forests.swap.", forest_batch_bytes, false));
     try {
-      forests.read_all_enumerate(in, make_both_functors_byref(total_size, ticker));
+      forests->read_all_enumerate(in, make_both_functors_byref(total_size, ticker));
     } catch (std::exception &e) {
-      throw_input_error(in, e.what(),"forest", forests.size()+1);
+      throw_input_error(in, e.what(),"forest", forests->size()+1);
       //            return false;
     }
     max_forest_ruleid = fmaxrule;
     max_nodes = total_size.maximum();
-    total_forests = forests.size();
+    total_forests = forests->size();
     n_nodes = total_size;
     return true;
   }
+  void read_forests_binary(std::string const& path) {
+    BACKTRACE;
+    mapped_forests.open(path);
+    forest_file_header const& h = mapped_forests.info();
+    max_forest_ruleid = h.max_ruleid;
+    max_nodes = h.max_nodes;
+    total_forests = h.n_forests;
+    n_nodes = h.n_nodes;
+  }
+  void write_forests_binary(std::string const& path) {
+    BACKTRACE;
+    logstream << "Writing binary forests to " << path << "\n";
+    ForestFile::save(path, *forests, total_forests, n_nodes, max_forest_ruleid, max_nodes);
+  }
+  template <class F>
+  void enumerate_forests(F f) {
+    if (mapped_forests.is_open())
+      mapped_forests.enumerate(f);
+    else
+      forests->enumerate(f);
+  }
+  Forest forest(unsigned i) {
+    return mapped_forests.is_open() ? mapped_forests[i] : (*forests)[i];
+  }
   std::string dump_suffix() const
   {
     using boost::lexical_cast;
@@ -258,7 +303,7 @@ struct FForests : public gibbs_base {
       viterbi_enable(false),
       per_forest_counts_enable(false),
       logstream(_log),
-      forests(tempfile_prefix + ".forests.swap.", _n_nodes*sizeof(ForestNode), false),
+      forest_batch_bytes(_n_nodes*sizeof(ForestNode)),
                                                             rule_names(_rule_names),
                                                             norm_groups(tempfile_prefix + ".normgroups.swap.", _max_norm*sizeof(NormIndex)),
                                                             max_norm_ruleid(0)
@@ -266,7 +311,7 @@ struct FForests : public gibbs_base {
                                                             , zero_zerocounts(false)
   {
     n_nodes = max_nodes = total_forests = 0; // set in read_forests.
-    per_forest_counts_go = per_forest_inside_go = viterbi_go = false;
+    per_forest_counts_go = per_forest_inside_go = viterbi_go = kbest_go = false;
     gibbs = gopt.iter>0;
     per_forest_inside_go = false;
     BACKTRACE;
@@ -275,6 +320,7 @@ struct FForests : public gibbs_base {
     else
       ticker.init(NULL);
     ticker.set_period(tick_period);
+    n_threads = 1;
   }
   ~FForests() {
     BACKTRACE;
@@ -285,6 +331,9 @@ struct FForests : public gibbs_base {
   //TODO: have usual EM checkpoint type options applicable in gibbs as well (via init_run and init_iteration ?)
   //TODO: move ForestEmParams::perform_forest_em logic here instead?
   void prepare(ForestEmParams const& p) {
+    n_threads = p.threads;
+    save_state_file = p.save_state_file;
+    resume_state_file = p.resume_state_file;
     prepare(p, p.prior_counts, p.checkpoint_prefix, p.checkpoint_parameters, p.watch_rule, p.watch_period, p.watch_depth,
             (bool)p.random_restarts, p.count_report_enable
             , p.count_report_threshold, p.prob_report_threshold, p.viterbi_enable, p.viterbi_per
@@ -494,7 +543,16 @@ struct FForests : public gibbs_base {
     logstream << "Running final viterbi forests decoding.\n";
   }
 
-  // call after prep_final_per_forest_counts and/or prep_final_viterbi
+  // assumes you already prepare_em
+  void prep_final_kbest(std::ostream &out, unsigned k)
+  {
+    kbest_go = true;
+    kbest_out=&out;
+    kbest_k = k;
+    logstream << "Running final " << k << "-best forests decoding.\n";
+  }
+
+  // call after prep_final_per_forest_counts, prep_final_viterbi and/or prep_final_kbest
   void final_iteration()
   {
     SetLocal<bool> g2(collect_counts, false);
@@ -548,6 +606,8 @@ struct FForests : public gibbs_base {
       f.write_viterbi(*viterbi_out, sumptrees);
       *viterbi_out << '\n';
     }
+    if (kbest_go)
+      kbest.write(*kbest_out, f, sumptrees, kbest_k);
     if (per_forest_inside_go) {
       *per_forest_inside_out << sumptrees << '\n';
     }
@@ -572,11 +632,113 @@ struct FForests : public gibbs_base {
   }
   void estimate_visit()
   {
+    if (parallel_estep()) {
+      estimate_visit_parallel();
+      return;
+    }
     begin_visit();
-    forests.enumerate(boost::ref(*this));
+    enumerate_forests(boost::ref(*this));
     end_visit();
   }
 
+  unsigned n_threads; // E-step worker threads (--threads)
+ private:
+  // worker threads only for a plain counting pass (viterbi/per-forest outputs are written in forest order), and
+  // only while every forest stays put in memory (mmapped, or text forests that fit in a single swap batch)
+  bool parallel_estep() const {
+    return FOREST_HAVE_THREADLOCAL && n_threads > 1 && collect_counts && !viterbi_go && !kbest_go && !per_forest_counts_go
+        && !per_forest_inside_go && (mapped_forests.is_open() || forests->n_batches() == 1);
+  }
+
+  /// a contiguous range of forests for one E-step thread, with its own inside/outside scratch and private
+  /// counts (Forest's static buffers are thread local)
+  struct estep_shard {
+    unsigned begin, end;
+    auto_array<inside_t> inside, outside;
+    auto_array<count_t> counts;
+    count_overflows overflows;
+    typename Forest::accumulate_counts counts_accum;
+    double total_logprob;
+    std::vector<unsigned> zeroprob; // forest_no of each 0 probability forest
+    std::exception_ptr error;
+
+    estep_shard(unsigned begin, unsigned end, size_t max_nodes, size_t rulespace)
+        : begin(begin), end(end), inside(max_nodes), outside(max_nodes), counts(rulespace) {
+      counts_accum = Forest::prepare_accumulate(counts.begin(), &overflows);
+    }
+    void run(Forests& fs) {
+      try {
+        count_t zero;
+        zero.setZero();
+        enumerate(counts, value_setter(zero));
+        counts_accum.reset_stats();
+        total_logprob = 0;
+        zeroprob.clear();
+        typename Forest::prepare_inside_outside prep(counts.begin(), fs.rule_weights.begin(), inside.begin(),
+                                                     outside.begin(), 0);
+        for (unsigned i = begin; i < end; ++i) {
+          Forest& f = fs.estep_forests[i];
+          inside_t sumptrees = f.compute_inside();
+          f.collect_counts(counts_accum);
+          if (inside[0].isZero())
+            zeroprob.push_back(i + 1);
+          else
+            total_logprob += sumptrees.getLn();
+        }
+        counts_accum.finish_counts();
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<Forest> estep_forests; // every forest, for random access by the shards
+  std::vector<std::unique_ptr<estep_shard> > estep_shards;
+
+  void make_estep_shards() {
+    enumerate_forests([this](Forest& f) { estep_forests.push_back(f); });
+    unsigned n = estep_forests.size(), n_shards = std::min(n_threads, n);
+    for (unsigned t = 0; t < n_shards; ++t)
+      estep_shards.emplace_back(new estep_shard((unsigned)((std::size_t)n * t / n_shards),
+                                                (unsigned)((std::size_t)n * (t + 1) / n_shards), max_nodes, rulespace));
+  }
+
+  // same counts and logprob as begin_visit; enumerate_forests(*this); end_visit, up to summation order
+  void estimate_visit_parallel() {
+    BACKTRACE;
+    if (estep_shards.empty())
+      make_estep_shards();
+    count_t weighted_prior = prior_count*total_forests;
+    enumerate(counts, value_setter(weighted_prior));
+    total_logprob = 0;
+    counts_accum.reset_stats();
+    n_zeroprob = 0;
+    {
+      thread_group workers;
+      for (unsigned t = 0; t < estep_shards.size(); ++t) {
+        estep_shard* shard = estep_shards[t].get();
+        workers.create_thread([this, shard] { shard->run(*this); });
+      }
+      workers.join_all();
+    }
+    for (unsigned t = 0; t < estep_shards.size(); ++t) {
+      estep_shard& shard = *estep_shards[t];
+      if (shard.error)
+        std::rethrow_exception(shard.error);
+      counts_accum.merge(shard.counts_accum, rulespace);
+      total_logprob += shard.total_logprob;
+      for (unsigned z = 0; z < shard.zeroprob.size(); ++z) {
+        if (first_time)
+          logstream << "Warning: 0 probability for forest #" << shard.zeroprob[z] << std::endl;
+        ++n_zeroprob;
+      }
+    }
+    forest_no = estep_forests.size();
+    counts_accum.finish_counts();
+    DBPC3("Done collecting counts:", forest_no, total_logprob/forest_no);
+    counts_accum.print(logstream);
+  }
+ public:
+
   // renormalizes parameters; learning_rate may be ignored, but is intended to magnify the delta from the previous parameter set to the normalized new parameter set.  should return largest absolute change to any parameter.  should also save the un-magnified (raw normalized counts) version for undo_maximize (if you only use learning_rate==1, then you don't need to do anything but normalize)
   bool firsttime;
   void watch_report() {
@@ -670,6 +832,117 @@ struct FForests : public gibbs_base {
       logstream << std::endl;
     }
   }
+
+  // --save-state: every watch-period iterations, enough to continue (--resume-state) exactly as if never
+  // interrupted.  the forests, norm groups and options are not saved; the resumed run must be given the same ones
+  std::string save_state_file, resume_state_file;
+  bool on_state_iteration(unsigned i) const
+  {
+    return !save_state_file.empty() && (watch_period == 0 || i % watch_period == 0);
+  }
+  // catches resuming with other forests, norm groups, precision or mode - which would silently mean something else
+  template <class A>
+  void serialize_state_header(A &a)
+  {
+    char const* magic = "femstat1";
+    boost::uint64_t const want[] = {(boost::uint64_t)rulespace, (boost::uint64_t)total_forests,
+                                    sizeof(Float) | (unsigned)gibbs << 8 | (unsigned)save_best_enable << 9
+                                    | (unsigned)watching_group << 10};
+    bool ok = true;
+    for (unsigned i = 0; i < 8; ++i) {
+      char c = magic[i];
+      a & c;
+      ok = ok && c == magic[i];
+    }
+    for (unsigned i = 0; i < 3; ++i) {
+      boost::uint64_t x = want[i];
+      a & x;
+      ok = ok && x == want[i];
+    }
+    if (!ok)
+      throw std::runtime_error(resume_state_file + " isn't a --save-state file from this run (forests, normgroups, precision, --crp, -r and -w must match)");
+  }
+  template <class A, class Array>
+  static void serialize_same_size(A &a, Array &w)
+  {
+    std::size_t n = w.size();
+    a & n;
+    if (n != w.size())
+      throw std::runtime_error("--resume-state file has a different number of parameters");
+    for (typename Array::iterator i = w.begin(), e = w.end(); i != e; ++i)
+      a & *i;
+  }
+  template <class A>
+  void serialize_em_state(A &a, em_state &s)
+  {
+    serialize_state_header(a);
+    a & s & restart & iteration & firsttime;
+    serialize_same_size(a, rule_weights);
+    if (save_best_enable)
+      serialize_same_size(a, best_weights);
+    if (watching_group) // watch_report sorts it, which changes the order normalization sums it in
+      serialize_same_size(a, *watch_group);
+    serialize_random_state(a);
+  }
+  // written under a temporary name then renamed, so being killed mid-write leaves the last state intact
+  std::string state_tmp() const { return save_state_file + ".tmp"; }
+  void commit_state(std::ofstream &o)
+  {
+    o.close();
+    if (!o || std::rename(state_tmp().c_str(), save_state_file.c_str()))
+      throw std::runtime_error("couldn't write --save-state file " + save_state_file);
+  }
+  void open_resume_state(std::ifstream &i)
+  {
+    i.open(resume_state_file.c_str(), std::ios::binary);
+    if (!i)
+      throw std::runtime_error("couldn't open --resume-state file " + resume_state_file);
+  }
+  static void truncated_state(std::string const& path)
+  {
+    throw std::runtime_error("--resume-state file " + path + " is truncated");
+  }
+  // for overrelaxed_em
+  void checkpoint(em_state const& s) {
+    BACKTRACE;
+    if (!on_state_iteration(iteration))
+      return;
+    std::ofstream o(state_tmp().c_str(), std::ios::binary);
+    ostream_archive a(o);
+    em_state saved(s);
+    try {
+      serialize_em_state(a, saved);
+    } catch (simple_archive_error &) { // o is bad now; commit_state reports it
+    }
+    commit_state(o);
+  }
+  // call after prepare (which may have randomized params, consuming the same random numbers as the saved run)
+  void resume_em(em_state &s) {
+    BACKTRACE;
+    std::ifstream i;
+    open_resume_state(i);
+    istream_archive a(i);
+    try {
+      serialize_em_state(a, s);
+    } catch (simple_archive_error &) {
+      truncated_state(resume_state_file);
+    }
+    logstream << "Resuming EM from " << resume_state_file << " after restart " << restart+1 << " iteration " << iteration << "\n";
+  }
+  // for gibbs_base
+  void checkpoint_iteration(unsigned i)
+  {
+    if (!on_state_iteration(i))
+      return;
+    std::ofstream o(state_tmp().c_str(), std::ios::binary);
+    ostream_archive a(o);
+    try {
+      serialize_state_header(a);
+      gibbs_base::serialize_state(a);
+    } catch (simple_archive_error &) { // o is bad now; commit_state reports it
+    }
+    commit_state(o);
+  }
   // swaps estimated counts for current parameters
   void swap_counts() {
     BACKTRACE;
@@ -715,7 +988,19 @@ struct FForests : public gibbs_base {
   {
     assert(gibbs);
     to_gibbs();
-    gibbs_base::run_starts(*this);
+    if (resume_state_file.empty())
+      gibbs_base::run_starts(*this);
+    else {
+      std::ifstream i;
+      open_resume_state(i);
+      istream_archive a(i);
+      try {
+        serialize_state_header(a);
+        gibbs_base::run_starts(*this, &a);
+      } catch (simple_archive_error &) {
+        truncated_state(resume_state_file);
+      }
+    }
     gibbs_base::print_all(*this);
     from_gibbs();
   }
@@ -749,7 +1034,7 @@ struct FForests : public gibbs_base {
   block_t *blockp;
   void resample_block(unsigned block)
   {
-    Forest &f = forests[block];
+    Forest f = forest(block);
     f.compute_inside(inside.begin(), *this);
     if (gopt.expectation) {
       unimplemented("--expectation in forest-em not yet implemented");
@@ -0,0 +1,166 @@
+#ifndef GRAEHL_TT__FOREST_KBEST_HPP
+#define GRAEHL_TT__FOREST_KBEST_HPP
+
+/// k best derivation trees of a forest (under the current rule weights), lazily (Huang+Chiang) with
+/// graehl/shared/lazy_forest_kbest.hpp.  lazy_forest only has unary and binary hyperedges, so an AND node
+/// (rule r, children c1..cn) becomes a left branching chain: P1=r(c1), Pj=(Pj-1, cj), and the node itself is
+/// Pn.  a partial Pj carries the product r*c1*...*cj, which is the same left fold compute_viterbi does, so the
+/// first best has exactly the viterbi probability.  an OR node gets one unary hyperedge per alternative whose
+/// derivation is the alternative's own.  the lazy nodes and derivations are kept and reused from forest to
+/// forest.
+
+#include <forest-em/forest.hpp>
+#include <graehl/shared/lazy_forest_kbest.hpp>
+#include <boost/noncopyable.hpp>
+#include <cstddef>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+namespace graehl {
+
+template <class Float = FLOAT_TYPE>
+struct forest_kbest : boost::noncopyable {
+  typedef FForest<Float> Forest;
+  typedef typename Forest::prob_t prob_t;
+  typedef typename Forest::inside_t inside_t;
+
+  /// left=0: leaf r.  right=0: P1=r(left).  otherwise Pj: left is the partial Pj-1 and right the jth child
+  struct deriv {
+    prob_t p;
+    unsigned rule;
+    deriv const *left, *right;
+    friend bool derivation_better_than(deriv const* a, deriv const* b) { return a->p > b->p; }
+  };
+  typedef deriv const* derivation_type;
+
+  struct factory : lazy_kbest_derivation_factory_base {
+    typedef deriv const* derivation_type;
+    static derivation_type NONE() { return (derivation_type)0; }
+    static derivation_type PENDING() { return (derivation_type)1; }
+
+    prob_t const* rule_weights;
+    std::deque<deriv> derivs;  // (stable addresses) only the first n_derivs belong to the current forest
+    std::size_t n_derivs;
+    factory() : rule_weights(), n_derivs() {}
+
+    derivation_type derive(unsigned rule, derivation_type left, derivation_type right) {
+      if (n_derivs == derivs.size()) derivs.push_back(deriv());
+      deriv& d = derivs[n_derivs++];
+      d.rule = rule;
+      d.left = left;
+      d.right = right;
+      if (right)
+        d.p = left->p * right->p;
+      else {
+        d.p = rule_weights[rule];
+        if (left) d.p *= left->p;
+      }
+      return &d;
+    }
+    derivation_type make_worse(derivation_type prototype, derivation_type old_child, derivation_type new_child,
+                               lazy_kbest_index_type changed_child_index) {
+      if (prototype == old_child) return new_child;  // OR alternative
+      return changed_child_index ? derive(prototype->rule, prototype->left, new_child)
+                                 : derive(prototype->rule, new_child, prototype->right);
+    }
+  };
+
+  typedef lazy_forest<factory> lazy_node;
+  typedef typename lazy_node::Environment environment;
+
+  /// write the k best derivations of f, one per line as 'prob/sum=pct% tree' (tree as in
+  /// Forest::write_viterbi), then an empty line.  sum is f's inside probability.  uses Forest::rule_weights
+  void write(std::ostream& o, Forest const& f, inside_t sum, unsigned k) {
+    build(f);
+    for (unsigned i = 0; i < k; ++i) {
+      derivation_type d = nodes[0].get_best(env, i);
+      if (d == factory::NONE()) break;
+      o << d->p << '/' << sum << '=' << 100 * (d->p / sum).getReal() << "% ";
+      print(o, d);
+      o << '\n';
+    }
+    o << '\n';
+  }
+
+  /// without recursion: a stack of the subtrees still to print, with 0 for a pending ')'
+  void print(std::ostream& o, derivation_type d) const {
+    std::vector<derivation_type>& todo = print_stack;
+    todo.assign(1, d);
+    for (bool first = true; !todo.empty(); first = false) {
+      d = todo.back();
+      todo.pop_back();
+      if (!d) {
+        o << ')';
+        continue;
+      }
+      if (!first) o << ' ';
+      if (!d->left) {
+        o << d->rule;
+        continue;
+      }
+      o << '(' << d->rule;
+      todo.push_back(0);
+      for (; d->right; d = d->left) todo.push_back(d->right);  // Pj's child cj, last child first
+      todo.push_back(d->left);  // P1=r(c1)
+    }
+  }
+
+ private:
+  environment env;
+  std::vector<lazy_node> nodes;  // forest node i's at i; the partial Pj after the forest's nodes
+  std::size_t n_nodes;
+  mutable std::vector<derivation_type> print_stack;  // print's scratch
+
+  void build(Forest const& f) {
+    std::size_t n = f.size();
+    while (nodes.size() < 2 * n) nodes.emplace_back(env);  // at most one Pj per child
+    n_nodes = n;
+    env.derivation_factory.rule_weights = Forest::rule_weights;
+    env.derivation_factory.n_derivs = 0;
+    env.stats.clear();
+    f.visit_postorder([this, &f](ForestNode* p) { add_node(f, p); });
+  }
+
+  lazy_node& fresh(std::size_t i) {
+    lazy_node& l = nodes[i];
+    l.pq.clear();
+    l.memo.clear();
+    return l;
+  }
+  lazy_node& node(Forest const& f, ForestNode* p) { return nodes[f.toi(Forest::resolve(p))]; }
+
+  void add_node(Forest const& f, ForestNode* p) {
+    if (p->is_backref()) return;
+    lazy_node& l = fresh(f.toi(p));
+    ForestNode *c = p + 1, *e = p->next();
+    unsigned rule = p->label();
+    if (IS_OR_INT(rule)) {
+      for (; c != e; c = c->next()) {
+        lazy_node& alt = node(f, c);
+        l.add(alt.first_best(), &alt);
+      }
+      l.sort(env);
+      return;
+    }
+    factory& df = env.derivation_factory;
+    if (c == e) {
+      l.add_first_sorted(env, df.derive(rule, 0, 0));
+      return;
+    }
+    lazy_node *left = &node(f, c), *right = 0;
+    derivation_type d = df.derive(rule, left->first_best(), 0);
+    for (c = c->next(); c != e; c = c->next()) {
+      lazy_node& partial = fresh(n_nodes++);
+      partial.add_first_sorted(env, d, left, right);
+      left = &partial;
+      right = &node(f, c);
+      d = df.derive(rule, d, right->first_best());
+    }
+    l.add_first_sorted(env, d, left, right);
+  }
+};
+
+}
+
+#endif
@@ -2,11 +2,13 @@
 #define GRAEHL_TT__FOREST_HPP
 
 #include <fstream>
+#include <boost/cstdint.hpp>
 #include <cstring>
+#include <memory>
+#include <vector>
 #include <graehl/shared/gibbs.hpp>
 #include <graehl/shared/random.hpp>
 #include <graehl/shared/os.hpp>
-#include <graehl/shared/intorpointer.hpp>
 #include <graehl/shared/debugprint.hpp>
 #include <graehl/shared/dynamic_array.hpp>
 #include <graehl/shared/genio.h>
@@ -16,25 +18,34 @@
 #undef THREADLOCAL
 #define THREADLOCAL
 // disable THREADLOCAL since we have non-pod (should group them all via a single pointer)
+#if GRAEHL_CPP11
+// C++11 thread_local allows non-pod, so each E-step thread (--threads) gets its own FForest statics
+#define FOREST_THREADLOCAL thread_local
+#define FOREST_HAVE_THREADLOCAL 1
+#else
+#define FOREST_THREADLOCAL
+#define FOREST_HAVE_THREADLOCAL 0
+#endif
 #include <graehl/shared/graphviz.hpp>
 #include <graehl/shared/funcs.hpp>
 #include <graehl/shared/stackalloc.hpp>
 #ifdef GRAEHL_TEST
 #include <graehl/shared/test.hpp>
 #endif
+#ifndef FOREST_COUNT_SPILL_LN
+#define FOREST_COUNT_SPILL_LN 4
+#endif
 #define STATIC_HASHER
 #define STATIC_HASH_EQUAL
 #include <graehl/shared/2hash.h>
 
 
-/// we really want two types of indices; rule, and forest node.  but i decided to use absolute pointers for
-/// forest nodes, so LSB=0, and 2n+1 for rule indices.  more natural choice might be positive/negative or
-/// MSB=0/1.  due to pointer arithmetic, relative offsets to A* (difference = # of bytes rather than # of As,
-/// aka index) would be cumbersome, but doable.  division and multiplication by constants should be collapsed
-/// anyhow.
-
-#define MAX_FOREST_DEPTH 100000
-// forests can only be this deep.  could easily fix.
+/// we really want two types of indices; rule, and forest node.  a ForestNode's 32 bit label l holds either:
+/// 2*rule+1 (odd; rule 0 = OR), or 2*offset (even) for a backref to a shared node, where offset is the
+/// (negative) distance in nodes from this node back to the shared one.  sibling links (d_next) are offsets
+/// in nodes too, so a forest is position independent: the nodes can be written to a file and mmapped read
+/// only at any address.  this limits rule ids to < 2^31, and a forest's span (and so backref distance) to
+/// < 2^30 nodes.
 
 /// I/O format: http://twiki.isi.edu/NLP/DerivationTrees
 /// note 0 is not a legit rule ID, sorry (actually used for OR)
@@ -58,19 +69,42 @@
 namespace graehl {
 
 struct ForestNode {
-  typedef IntOrPointer<ForestNode> Label;
-  ForestNode* next;  // next sibling; terminated by external bound: when next=bound, no more children.
-  // or in other words: all my descendants come in memory on (this,this->next)
-  Label l;
-  bool is_backref() const { return l.is_pointer(); }
+  // position independent: the sibling and backref links are offsets (in nodes) from the node itself, so
+  // forests can be saved to a file and mmapped (read only, at any address) without relocating
+  typedef boost::int32_t offset_type;
+  offset_type d_next;  // next sibling is this+d_next; terminated by external bound: when next=bound, no more
+  // children.  or in other words: all my descendants come in memory on (this,this->next())
+  boost::uint32_t l;  // 2*rule+1 (rule 0 = OR), or 2*(offset of the shared node, which precedes this one)
+
+  ForestNode* next() const { return const_cast<ForestNode*>(this) + d_next; }
+  void set_next(ForestNode const* n) { d_next = (offset_type)(n - this); }
+  bool is_backref() const { return !(l & 1); }
+  ForestNode* backref() const {
+    Assert(is_backref());
+    return const_cast<ForestNode*>(this) + (offset_type)l / 2;
+  }
+  void set_backref(ForestNode const* shared) { l = (boost::uint32_t)((offset_type)(shared - this) * 2); }
   unsigned label() const {
     Assert(!is_backref());
-    return l.integer();
+    return l >> 1;
+  }
+  void set_label(unsigned rule) { l = 2 * rule + 1; }
+  enum { max_rule = 0x7FFFFFFF };  // 2*rule+1 must fit in l
+  /// for parsers: a GENIO exception unless rule fits set_label
+  static void check_rule(boost::uint64_t rule) {
+    if (rule > (boost::uint64_t)max_rule)
+      GENIO_THROW2("Forest: rule id too large (the most is 2147483647): ",
+                   boost::lexical_cast<std::string>(rule));
   }
   bool is_or() const { return IS_OR_INT(label()); }
-  bool is_leaf() const { return next == this + 1; }
+  bool is_leaf() const { return d_next == 1; }
   GENIO_print {
-    o << "(next=+" << next - this << ',' << l << ')';
+    o << "(next=+" << d_next << ',';
+    if (is_backref())
+      o << "backref=" << (offset_type)l / 2;
+    else
+      o << label();
+    o << ')';
     return GENIOGOOD;
   }
 };
@@ -83,7 +117,7 @@ CREATE_INSERTER(ForestNode);
 // FIXME: presently must be same type for normalization to work
 template <class Float = FLOAT_TYPE>
 struct FForest {
-  static THREADLOCAL gibbs_base* gibbs;
+  static FOREST_THREADLOCAL gibbs_base* gibbs;
   static inline gibbs_base& g() { return *gibbs; }
   typedef FForest<Float> Forest;
   typedef logweight<Float> inside_t;  // for inside/outside.
@@ -93,18 +127,18 @@ struct FForest {
   ForestNode* nodes;
   typedef ForestNode* iterator;
   iterator begin() const { return nodes; }
-  iterator& end() { return nodes->next; }
-  iterator end() const { return nodes->next; }
+  iterator end() const { return nodes->next(); }
+  void set_end(ForestNode* e) { nodes->set_next(e); }
   // made static so we can open swapbatch in read-only mode (just as well could be member var otherwise)
-  static THREADLOCAL inside_t *inside, *norm_outside;  // changed "outside" to "norm_outside" denoting that
+  static FOREST_THREADLOCAL inside_t *inside, *norm_outside;  // changed "outside" to "norm_outside" denoting that
   // the value is actually outside/inside[0] (so count +=
   // inside*norm_outside)
-  static THREADLOCAL count_t* counts;
-  static THREADLOCAL prob_t* rule_weights;
+  static FOREST_THREADLOCAL count_t* counts;
+  static FOREST_THREADLOCAL prob_t* rule_weights;
 
-  static THREADLOCAL size_t max_ruleid;  // static global return value
-  static THREADLOCAL std::ostream* viterbi_out;
-  static THREADLOCAL ForestNode** viterbi;
+  static FOREST_THREADLOCAL size_t max_ruleid;  // static global return value
+  static FOREST_THREADLOCAL std::ostream* viterbi_out;
+  static FOREST_THREADLOCAL ForestNode** viterbi;
 
 
   /// you own this space:
@@ -114,7 +148,7 @@ struct FForest {
   template <class I>
   char* read(I& in, char* beginspace, char* endspace) {
     nodes = (ForestNode*)beginspace;
-    end() = (ForestNode*)endspace;
+    set_end((ForestNode*)endspace);
 
     typedef char charT;
     typedef std::char_traits<charT> Traits;
@@ -127,7 +161,7 @@ struct FForest {
       return (char*)end();
   }
 
-  void safe_destroy() { end() = nodes; }
+  void safe_destroy() { set_end(nodes); }
 
   // template <class T>
   // std::ios_base::iostate read(T& in)
@@ -135,7 +169,7 @@ struct FForest {
   GENIO_read {
     DBP_INC_VERBOSE;
     self_destruct<Forest> suicide(this);
-    List<ForestNode**> open_parens;
+    List<ForestNode*> open_parens;
     //      open_parens.push(&end);
     ForestNode* stop = nodes;  // points one past end of nodes
     char c;
@@ -144,7 +178,7 @@ struct FForest {
 
     bool follows_paren = false;
     //            bool opened=false;
-    unsigned rule_id;
+    boost::uint64_t rule_id;
 #ifdef XXXDEBUG
 #define GOTOFAIL \
   do {           \
@@ -180,8 +214,12 @@ struct FForest {
             backrefs(backref_id) = stop;
           } else {
             //                        if (backref_id >= backrefs.size()) GOTOFAIL;
-            stop->l = backrefs[backref_id];
-#define STOPNEXT stop = stop->next = stop + 1
+            stop->set_backref(backrefs[backref_id]);
+#define STOPNEXT              \
+  do {                        \
+    stop->set_next(stop + 1); \
+    ++stop;                   \
+  } while (0)
             STOPNEXT;
             Assert(backrefs[backref_id] < end() && backrefs[backref_id] >= nodes);
           }
@@ -189,7 +227,7 @@ struct FForest {
           break;
         case '(':
           follows_paren = true;
-          open_parens.push(&stop->next);
+          open_parens.push(stop);
           break;
         case '1':
         case '2':
@@ -202,8 +240,9 @@ struct FForest {
         case '9':
           in.unget();
           in >> rule_id;
+          ForestNode::check_rule(rule_id);
           if (max_ruleid < rule_id) max_ruleid = rule_id;
-          stop->l = rule_id;
+          stop->set_label((unsigned)rule_id);
           if (!follows_paren) {
             STOPNEXT;
           } else {
@@ -218,11 +257,11 @@ struct FForest {
             GOTOFAIL;
           }
           follows_paren = false;
-          stop->l = OR_INT;
+          stop->set_label(OR_INT);
           ++stop;
           break;
         case ')':
-          *(open_parens.top()) = stop;
+          open_parens.top()->set_next(stop);
           open_parens.pop();
           break;
         default:
@@ -232,7 +271,7 @@ struct FForest {
           break;
       }
     }
-    end() = stop;
+    set_end(stop);
     DBPC2("Successfully read forest", *this);
     suicide.cancel();
     return GENIOGOOD;
@@ -260,9 +299,9 @@ struct FForest {
   void set_out_of_space() { nodes = 0; }
   ForestNode* next_unused_space() const { return end(); }
   bool is_backref(unsigned i) const { return nodes[i].is_backref(); }
-  unsigned backref(unsigned i) const { return toi(nodes[i].l.pointer()); }
-  unsigned backref(ForestNode* p) const { return toi(p->l.pointer()); }
-  unsigned next(unsigned i) const { return toi(nodes[i].next); }
+  unsigned backref(unsigned i) const { return toi(nodes[i].backref()); }
+  unsigned backref(ForestNode* p) const { return toi(p->backref()); }
+  unsigned next(unsigned i) const { return toi(nodes[i].next()); }
 
   bool is_leaf(unsigned i) const { return nodes[i].is_leaf(); }
   GENIO_print { return print(o, nodes); }
@@ -273,9 +312,7 @@ struct FForest {
   {
     fixed_array<unsigned> backref_ids(this->size());
     assign_backref_ids(backref_ids.begin());
-    //      dynamic_array<ForestNode *> ends(DEFAULT_DEPTH);
-    ForestNode* ends[MAX_FOREST_DEPTH];  // FIXME: duh, make it grow, or use List=stack+depth counter
-    ends[0] = this->end();
+    std::vector<ForestNode*> ends(1, this->end());  // ends[depth]: where the subforest open at depth ends
     unsigned depth = 0;
     bool first = true;
     for (ForestNode* p = start_from; p != end(); ++p) {
@@ -293,7 +330,7 @@ struct FForest {
       }
 
       if (id) {
-        Assert(p->l.is_integer());
+        Assert(!p->is_backref());
         o << '#' << id;
       }
       if (p->is_backref()) {
@@ -301,8 +338,8 @@ struct FForest {
         Assert(back_id);
         o << '#' << back_id;
       } else {  // integer
-        unsigned rule = p->l.integer();
-        ForestNode* next = p->next;
+        unsigned rule = p->label();
+        ForestNode* next = p->next();
         if (next == p + 1) {  // leaf
           if (id) o << '(';
           Assert(!IS_OR_INT(rule));
@@ -310,8 +347,8 @@ struct FForest {
           if (id) o << ')';
         } else {
           o << '(';
-          Assert(depth < MAX_FOREST_DEPTH - 1);  // FIXME
-          ends[++depth] = next;  // there is one ')' output for every depth--, and depth starts and ends at 0.
+          if (++depth == ends.size()) ends.push_back(next);
+          ends[depth] = next;  // there is one ')' output for every depth--, and depth starts and ends at 0.
           // one ++depth for every '(' output => balanced
           PRINT_OR_INT(o, rule);
         }
@@ -323,7 +360,7 @@ struct FForest {
 #undef PRINT_OR_INT
   void reset(ForestNode* _begin, ForestNode* _end) {
     nodes = _begin;
-    end() = _end;
+    set_end(_end);
   }
   void reset(ForestNode* _begin) { nodes = _begin; }
   FForest() : nodes(0) {}
@@ -337,10 +374,14 @@ struct FForest {
     return compute_inside();
   }
   inside_t compute_inside() {
-    outside_order.clear_nodestroy();
     DBPC4("Prepared to compute inside", toi(nodes), toi(end()), *this);
     DBP_ADD_VERBOSE(20);
-    inside_rec(nodes);
+    Ancestries& order = outside_order;
+    order.reserve(size());  // at most one edge into each node
+    record_edges edges(order.begin());
+    rule_weight_map w;
+    visit_postorder([this, &edges, &w](ForestNode* p) { inside_node(p, w, edges); });
+    order.set_size(edges.o - order.begin());
     return inside[0];
   }
   struct prepare_inside_outside {
@@ -356,7 +397,49 @@ struct FForest {
         , guardc(counts, _counts)
         , guardv(viterbi, _viterbi) {}
   };
-  typedef HashTable<unsigned, count_t> count_overflows;
+  /// double precision totals for the rules whose float counts got too big to take more additions
+  /// (isNearAddOneLimit): accumulate_counts moves such a count here and restarts it from 0.  dense pages,
+  /// allocated on first use, index the rules (no hashing in the inner loop), and the list of rules moved so
+  /// far lets finish_counts visit just those
+  struct count_overflows {
+    typedef logweight<double> total_t;
+    enum { kPageBits = 12, kPageSize = 1 << kPageBits };
+
+    void add(unsigned rule, count_t c) {
+      total_t& t = at(rule);
+      if (t.isZero()) rules.push_back(rule);
+      t += total_t(c);
+    }
+    /// f(rule, total) for every rule added to since the last visit_and_clear
+    template <class F>
+    void visit_and_clear(F& f) {
+      for (std::size_t i = 0, n = rules.size(); i < n; ++i) {
+        total_t& t = at(rules[i]);
+        f.visit(rules[i], t);
+        t.setZero();
+      }
+      rules.clear();
+    }
+
+   private:
+    total_t& at(unsigned rule) {
+      std::size_t page = rule >> kPageBits;
+      if (page >= pages.size()) pages.resize(page + 1);
+      if (!pages[page]) {
+        pages[page].reset(new total_t[kPageSize]);
+        for (unsigned i = 0; i < kPageSize; ++i) pages[page][i].setZero();
+      }
+      return pages[page][rule & (kPageSize - 1)];
+    }
+    std::vector<std::unique_ptr<total_t[]> > pages;
+    std::vector<unsigned> rules;
+  };
+  /// float counts move to double (count_overflows) once past e^FOREST_COUNT_SPILL_LN, far below where a float
+  /// sum stops taking additions (isNearAddOneLimit): each float partial sum then stays short, so its rounding
+  /// error does too.  double counts (-U) only move near their limit
+  static bool must_spill(count_t const& c) {
+    return sizeof(Float) == sizeof(float) ? c.getLn() > (Float)FOREST_COUNT_SPILL_LN : c.isNearAddOneLimit();
+  }
   struct accumulate_counts {
     count_t total_overflow;
     unsigned n_overflows;
@@ -374,36 +457,41 @@ struct FForest {
     }
     count_t* counts;
     count_overflows* overflows;
-    typedef typename count_overflows::iterator oit;
     inline void operator()(unsigned rule, inside_t inside, inside_t norm_outside) {
+      add(rule, inside * norm_outside);
+    }
+    inline void add(unsigned rule, count_t count) {
       DBP_VERBOSE(2);
-      if (counts[rule].isNearAddOneLimit()) {
-        (*overflows)[rule] += counts[rule];  // default 0 init!
-        /*
-          std::pair <oit,bool> iret=overflows->insert(make_pair(rule,counts[rule]));
-          if (!iret.second)
-          iret.first->second += counts[rule];
-        */
+      if (must_spill(counts[rule])) {
+        overflows->add(rule, counts[rule]);
         ++n_overflows;
-        DBPC5("overflow #", n_overflows, rule, counts[rule], (*overflows)[rule]);
-
-        counts[rule] = inside * norm_outside;
+        DBPC4("overflow #", n_overflows, rule, counts[rule]);
+        counts[rule] = count;
       } else {
-        counts[rule] += inside * norm_outside;
+        counts[rule] += count;
+      }
+    }
+    /// add counts finished by another thread's accumulate_counts.  only its n_overflows carries over: its
+    /// overflowed rules have big counts, which spill here again, so our finish_counts counts those rules (and
+    /// their totals) once
+    void merge(accumulate_counts const& o, unsigned n_rules) {
+      for (unsigned rule = 0; rule < n_rules; ++rule) {
+        count_t const& c = o.counts[rule];
+        if (must_spill(c))  // big partial totals are summed in double
+          overflows->add(rule, c);
+        else if (!c.isZero())
+          add(rule, c);
       }
+      n_overflows += o.n_overflows;
     }
-    void visit(unsigned rule, count_t overflow_count) {
+    void visit(unsigned rule, typename count_overflows::total_t const& overflow_count) {
       DBP_VERBOSE(1);
       DBPC4("combine overflow", rule, counts[rule], overflow_count);
-      counts[rule] += overflow_count;
+      counts[rule] = overflow_count + typename count_overflows::total_t(counts[rule]);  // rounded once
       total_overflow += overflow_count;
       ++n_rule_overflows;
     }
-    void finish_counts() {
-      // TODO: make process/delete generic?
-      overflows->visit_key_val(*this);
-      overflows->clear();
-    }
+    void finish_counts() { overflows->visit_and_clear(*this); }
   };
   static accumulate_counts prepare_accumulate(count_t* c, count_overflows* o) {
     accumulate_counts a;
@@ -427,7 +515,7 @@ struct FForest {
     for (unsigned i = 0, end = size(); i != end; ++i) {
       const ForestNode& node = nodes[i];
       if (!node.is_backref()) {  // node, not a ref to node
-        unsigned rulei = node.l.integer();
+        unsigned rulei = node.label();
         if (!IS_OR_INT(rulei)) {  // and-node, not or
           DBPC6("adding counts for node # -> rule #", i, rulei, inside[i], norm_outside[i],
                 inside[i] * norm_outside[i]);
@@ -462,7 +550,7 @@ struct FForest {
         ForestNode* child = i->child;
         //            unsigned p=i->parent.integer();
         //            unsigned c=i->child.integer();
-        unsigned rulei = p->l.integer();
+        unsigned rulei = p->label();
         if (IS_OR_INT(rulei)) {
           DBPC4("norm_outside+=(parent=OR)", toi(p), toi(child), norm_outside[toi(p)]);
           norm_outside[toi(child)] += norm_outside[toi(p)];
@@ -485,7 +573,7 @@ struct FForest {
         }
       }
     }
-    Assert(nodes->l.is_integer());  // can't be pointer to another node; it's the root
+    Assert(!nodes->is_backref());  // can't be pointer to another node; it's the root
     DBPC2("final normalized outside(/ inside[0])", array<inside_t>(norm_outside, oe));
     return true;
   }
@@ -495,14 +583,90 @@ struct FForest {
     Ancestry() {}
     Ancestry(const Ancestry& o) : parent(o.parent), child(o.child) {}
   };
-  typedef dynamic_array<Ancestry> Ancestries;  // FIXME: could make this faster by preallocing maximum #
-  // needed (definitely max = max # nodes (instead of useless
-  // check: size < capacity)
-  static THREADLOCAL Ancestries outside_order;  // read backwards (reverse iterated), gives an order of adding
-  // outside scores from parent to child ... topological sort on
-  // ancestor relation (must know parent outside first)
-  // also record leaves with c=NULL
-  static void record_ancestry(ForestNode* p, ForestNode* c) { outside_order.push_back(Ancestry(p, c)); }
+  typedef dynamic_array<Ancestry> Ancestries;
+  // every (parent, child) edge, with backrefs resolved to the shared child, parents in the order compute_inside
+  // finished them.  read backwards (reverse iterated), gives an order of adding outside scores from parent to
+  // child: topological sort on ancestor relation (must know parent outside first)
+  static FOREST_THREADLOCAL Ancestries outside_order;
+  struct OpenNode {
+    ForestNode *node, *end;
+  };
+  typedef dynamic_array<OpenNode> OpenNodes;
+  static FOREST_THREADLOCAL OpenNodes open_nodes;  // visit_postorder scratch
+
+  static ForestNode* resolve(ForestNode* p) { return p->is_backref() ? p->backref() : p; }
+
+  /// calls f(p) for every node p (backrefs too) after all of p's children, in the same order as a recursive
+  /// traversal would finish them, but without recursion: the nodes are in preorder, so one forward pass
+  /// keeping a stack of the still open subforests suffices (however deep the forest)
+  template <class F>
+  void visit_postorder(F const& f) const {
+    OpenNodes& open = open_nodes;
+    open.reserve(size());  // used as a raw stack, no size bookkeeping
+    OpenNode *base = open.begin(), *top = base;
+    for (ForestNode *p = nodes, *e = end(); p != e; ++p) {
+      ForestNode* n = p->next();
+      if (n == p + 1) {  // leaf or backref: the last node of every subforest, so those end here
+        f(p);
+        while (top != base && top[-1].end == n) f((--top)->node);
+      } else {
+        top->node = p;
+        top->end = n;
+        ++top;
+      }
+    }
+    Assert(top == base);
+  }
+
+  struct rule_weight_map {
+    prob_t const& operator()(unsigned rule) const { return rule_weights[rule]; }
+  };
+
+  struct no_edges {
+    void operator()(ForestNode*, ForestNode*) const {}
+  };
+  struct record_edges {
+    Ancestry* o;
+    explicit record_edges(Ancestry* o) : o(o) {}
+    void operator()(ForestNode* p, ForestNode* c) { *o++ = Ancestry(p, resolve(c)); }
+  };
+
+  // inside[b] from its children's (already computed) inside, calling edge(b, child) for each child.
+  // w(ruleid)=Weight
+  template <class W, class E>
+  void inside_node(ForestNode* b, W const& w, E& edge) {
+    inside_t* ins = inside;
+    size_t i = toi(b);
+    if (b->is_backref()) {
+      DBPC3("shared inside", toi(b->backref()), ins[toi(b->backref())]);
+      ins[i] = ins[toi(b->backref())];
+      return;
+    }
+    ForestNode* parent = b;
+    unsigned rule_or = b->label();
+    ForestNode* e = b->next();
+    ++b;
+    inside_t sum;
+    if (IS_OR_INT(rule_or)) {
+      Assert(e != b);
+      // OR INIT: OR=inside[first-child], OR+=inside[rest] (instead of OR<-0, OR+=inside[child])
+      sum = ins[toi(b)];
+      edge(parent, b);
+      for (b = b->next(); b < e; b = b->next()) {  // 2nd and subsequent children
+        sum += ins[toi(b)];  // OR FOLD
+        edge(parent, b);
+      }
+    } else {  // and-node
+      sum = w(rule_or);  // AND INIT
+      for (; b < e; b = b->next()) {  // all children
+        sum *= ins[toi(b)];  // AND FOLD
+        edge(parent, b);
+      }
+    }
+    ins[i] = sum;
+    DBPC3("done computing inside", i, sum);
+  }
+
   // saves into viterbi: pointer to best sub-Forest to best_or[i] whenever i is an OR-node
   void compute_viterbi(ForestNode** _viterbi, inside_t* _inside, prob_t* _rule_weights) {
     SetLocal<prob_t*> guard1(rule_weights, _rule_weights);
@@ -510,65 +674,46 @@ struct FForest {
     SetLocal<ForestNode**> guard3(viterbi, _viterbi);
     compute_viterbi();
   }
-  void compute_viterbi() { viterbi_rec(nodes); }
-  void viterbi_rec(ForestNode* b) {
-    ForestNode* e = b->next;
-    DBPC4W("computing viterbi", toi(b), toi(e), FForest(b), b);
-    DBP_SCOPE;
+  void compute_viterbi() {
+    visit_postorder([this](ForestNode* p) { viterbi_node(p); });
+  }
+  // same as inside_node but OR takes the best child (recorded in viterbi)
+  void viterbi_node(ForestNode* b) {
     size_t i = toi(b);
-    ForestNode::Label& l = b->l;
-    if (l.is_pointer()) {
-      ForestNode* shared = l.pointer();
-      DBPC3("shared viterbi", toi(shared), inside[toi(shared)]);
-      inside[i] = inside[toi(shared)];
-    } else {
-      unsigned rule_or = l.integer();
-      //            ForestNode *parent=b;
-      if (IS_OR_INT(rule_or)) {
-        ++b;
-        Assert(e != b);
-        ForestNode* n = b->next;
-        viterbi_rec(b);  // moved outside so instead of OR<-0, for children,
-        // OR+=inside[child], do OR=inside[first-child],
-        // OR+=inside[rest] - don't need to do this for AND
-        // NOTE: OR operations only differecence between viterbi_rec and
-        // inside_rec - genericize?  some performance hit if we do.  also
-        // don't need to store ancestries twice, and don't need to print
-        // best (viterbi) tree
-        // OR INIT
-        inside[i] = inside[i + 1];
-        viterbi[i] = b;
-
-        DBPC4("  OR set best ", i, inside[i], inside[i + 1]);
-        for (b = n; b < e; b = n) {  // 2nd and subsequent children
-          n = b->next;
-          viterbi_rec(b);
-          size_t bi = toi(b);
-          inside_t child_best = inside[bi];
-          if (inside[i] < child_best) {
-            // OR FOLD
-            inside[i] = child_best;
-            viterbi[i] = b;
-
-            DBPC6("  OR improved best ", i, inside[i], toi(b), inside[toi(b)], viterbi[i]);
-          } else {
-            DBPC6("  OR didn't improve best ", i, inside[i], toi(b), inside[toi(b)], viterbi[i]);
-          }
-        }
-      } else {  // and-node
-        // AND INIT
-        inside[i] = rule_weights[rule_or];
-        DBPC5("  AND=", i, inside[i], rule_or, rule_weights[rule_or]);
-        ForestNode* n;
-        ++b;
-        for (; b < e; b = n) {  // all children
-          n = b->next;
-          viterbi_rec(b);
-          // AND FOLD
-          inside[i] *= inside[toi(b)];
-          DBPC5("  AND*=", i, inside[i], toi(b), inside[toi(b)]);
+    if (b->is_backref()) {
+      DBPC3("shared viterbi", toi(b->backref()), inside[toi(b->backref())]);
+      inside[i] = inside[toi(b->backref())];
+      return;
+    }
+    unsigned rule_or = b->label();
+    ForestNode* e = b->next();
+    ++b;
+    if (IS_OR_INT(rule_or)) {
+      Assert(e != b);
+      // OR INIT
+      inside[i] = inside[toi(b)];
+      viterbi[i] = b;
+      DBPC4("  OR set best ", i, inside[i], toi(b));
+      for (b = b->next(); b < e; b = b->next()) {  // 2nd and subsequent children
+        inside_t const& child_best = inside[toi(b)];
+        if (inside[i] < child_best) {
+          // OR FOLD
+          inside[i] = child_best;
+          viterbi[i] = b;
+          DBPC6("  OR improved best ", i, inside[i], toi(b), inside[toi(b)], viterbi[i]);
+        } else {
+          DBPC6("  OR didn't improve best ", i, inside[i], toi(b), inside[toi(b)], viterbi[i]);
         }
       }
+    } else {  // and-node
+      // AND INIT
+      inside[i] = rule_weights[rule_or];
+      DBPC5("  AND=", i, inside[i], rule_or, rule_weights[rule_or]);
+      for (; b < e; b = b->next()) {  // all children
+        // AND FOLD
+        inside[i] *= inside[toi(b)];
+        DBPC5("  AND*=", i, inside[i], toi(b), inside[toi(b)]);
+      }
     }
     DBPC3("done computing viterbi ", i, inside[i]);
   }
@@ -576,124 +721,55 @@ struct FForest {
   void write_viterbi(std::ostream& o, ForestNode** _viterbi) {
     SetLocal<ForestNode**> guard3(viterbi, _viterbi);
     SetLocal<std::ostream*> guard4(viterbi_out, &o);
-    write_viterbi_rec(nodes);
+    write_viterbi_tree(nodes);
   }
   void write_viterbi(std::ostream& o, inside_t sum) {
     SetLocal<std::ostream*> guard3(viterbi_out, &o);
     *viterbi_out << inside[0] << '/' << sum << '=' << 100 * (inside[0] / sum).getReal() << "% ";
-    write_viterbi_rec(nodes);
+    write_viterbi_tree(nodes);
   }
   void write_viterbi() {
     *viterbi_out << inside[0] << ' ';
-    write_viterbi_rec(nodes);
+    write_viterbi_tree(nodes);
   }
-  void write_viterbi_rec(ForestNode* b) {
-    ForestNode* e = b->next;
-    DBPC4W("writing viterbi", toi(b), toi(e), FForest(b), b);
-    DBP_SCOPE;
-#ifdef DEBUG
-    size_t i = toi(b);
-#endif
-    ForestNode::Label& l = b->l;
-    if (l.is_pointer()) {
-      ForestNode* shared = l.pointer();
-      DBPC3("writing shared", toi(shared), inside[toi(shared)]);
-      write_viterbi_rec(shared);
-    } else {
-      unsigned rule_or = l.integer();
-      //            ForestNode *parent=b;
-      if (IS_OR_INT(rule_or)) {
-        b = viterbi[toi(b)];
-        DBPC3("OR: writing viterbi", toi(b), toi(viterbi[toi(b)]));
-        write_viterbi_rec(b);
-      } else {  // and-node
-        if (b + 1 == b->next) {
-          DBPC3(" writing viterbi leaf", toi(b), rule_or);
-          *viterbi_out << rule_or;
-        } else {
-          *viterbi_out << '(';
-          // AND INIT
-          *viterbi_out << rule_or;
-          DBPC3("  write AND root", i, rule_or);
-          ForestNode* n;
-          ++b;
-          for (; b < e; b = n) {  // all children
-            n = b->next;
-            *viterbi_out << ' ';
-            write_viterbi_rec(b);
-            // AND FOLD
-            DBPC5(" wrote viterbi child", i, inside[i], toi(b), inside[toi(b)]);
-          }
-
-          *viterbi_out << ')';
-        }
+  /// writes the viterbi derivation under b (through backrefs, and viterbi's choice at OR nodes) without
+  /// recursion: open_nodes holds the children still to be written of each open '('
+  void write_viterbi_tree(ForestNode* b) {
+    std::ostream& o = *viterbi_out;
+    OpenNodes& open = open_nodes;
+    open.reserve(size());  // a derivation nests at most as deep as the forest has nodes
+    OpenNode *base = open.begin(), *top = base;
+    for (;;) {
+      for (;;) {
+        if (b->is_backref())
+          b = b->backref();
+        else if (IS_OR_INT(b->label()))
+          b = viterbi[toi(b)];
+        else
+          break;
       }
-    }
-    DBPC2("done writing viterbi ", i);
-  }
-
-  // TODO: this is same as above except w/ ancestry recording.  make that a type of W visitor?
-  void inside_rec(ForestNode* b) {
-    ForestNode* e = b->next;
-    DBPC4W("computing inside", toi(b), toi(e), FForest(b), b);
-    DBP_SCOPE;
-    size_t i = toi(b);
-    ForestNode::Label& l = b->l;
-    if (l.is_pointer()) {
-      ForestNode* shared = l.pointer();
-      DBPC3("shared inside", toi(shared), inside[toi(shared)]);
-      inside[i] = inside[toi(shared)];
-    } else {
-      unsigned rule_or = l.integer();
-      ForestNode* parent = b;
-      if (IS_OR_INT(rule_or)) {
-        ++b;
-        Assert(e != b);
-        ForestNode* n = b->next;
-        inside_rec(b);  // moved outside so instead of OR<-0, for children,
-        // OR+=inside[child], do OR=inside[first-child],
-        // OR+=inside[rest] - don't need to do this for AND
-        // OR INIT
-        inside[i] = inside[i + 1];
-        DBPC4("  OR=", i, inside[i], inside[i + 1]);
-        for (b = n; b < e; b = n) {  // 2nd and subsequent children
-          n = b->next;
-          inside_rec(b);
-          // OR FOLD
-          inside[i] += inside[toi(b)];
-          DBPC5("  OR+=", i, inside[i], toi(b), inside[toi(b)]);
-        }
-      } else {  // and-node
-        // AND INIT
-        inside[i] = rule_weights[rule_or];
-        DBPC5("  AND=", i, inside[i], rule_or, rule_weights[rule_or]);
-        ForestNode* n;
-        ++b;
-        for (; b < e; b = n) {  // all children
-          n = b->next;
-          inside_rec(b);
-          // AND FOLD
-          inside[i] *= inside[toi(b)];
-          DBPC5("  AND*=", i, inside[i], toi(b), inside[toi(b)]);
-        }
+      DBPC3("writing viterbi", toi(b), b->label());
+      ForestNode* e = b->next();
+      if (e == b + 1)  // leaf
+        o << b->label();
+      else {
+        o << '(' << b->label();
+        top->node = b + 1;
+        top->end = e;
+        ++top;
       }
-      // now queue up parent->child links
-      b = parent + 1;
-      if (b == e) {  // leaf:
-        // record_ancestry(parent); // no longer needed (we visit all nodes without using ancestry)
-      } else {
-        do {  // for children
-          Assert(b < e);
-          ForestNode::Label& l = b->l;
-          if (l.is_pointer())
-            record_ancestry(parent, l.pointer());
-          else
-            record_ancestry(parent, b);
-          b = b->next;
-        } while (b != e);
+      for (;; --top) {
+        if (top == base) return;
+        OpenNode& t = top[-1];
+        if (t.node != t.end) {
+          b = t.node;
+          t.node = b->next();
+          o << ' ';
+          break;
+        }
+        o << ')';
       }
     }
-    DBPC2("done computing inside", inside[i]);
   }
 
   /* for gibbs: */
@@ -710,14 +786,14 @@ struct FForest {
   // possible random-choice speedup: destructively normalize inside into doubles, at most once (bool flag
   // array needed for shared subforests).  flags init is linear time, just like inside computation.  random
   // choice should be faster than inside because only part of forest is visited.
-  static THREADLOCAL inside_t choose_norm;  // made static so we can open swapbatch in read-only mode (just as
+  static FOREST_THREADLOCAL inside_t choose_norm;  // made static so we can open swapbatch in read-only mode (just as
   // well could be member var otherwise)
 
   struct or_iterator {
     ForestNode* p;
     or_iterator(ForestNode* p = NULL) : p(p) {}
     ForestNode* operator*() { return p; }
-    void operator++() { p = p->next; }
+    void operator++() { p = p->next(); }
     bool operator==(or_iterator const& o) const { return p == o.p; }
     bool operator!=(or_iterator const& o) const { return p != o.p; }
   };
@@ -727,23 +803,22 @@ struct FForest {
   /* use compute_inside(b,v) to set inside[i] first via v(ruleid)=prob.
    * choose_random calls v.record(ruleid). */
   {
-    ForestNode* e = b->next;
-    ForestNode::Label& l = b->l;
-    if (l.is_pointer())
-      choose_random(l.pointer(), v);
+    ForestNode* e = b->next();
+    if (b->is_backref())
+      choose_random(b->backref(), v);
     else {
-      unsigned rule_or = l.integer();
+      unsigned rule_or = b->label();
       if (IS_OR_INT(rule_or)) {
         choose_norm.setZero();
         ++b;
         // choose one child:
-        for (ForestNode* i = b; i != e; i = i->next) choose_norm += inside[toi(i)].pow(power);
+        for (ForestNode* i = b; i != e; i = i->next()) choose_norm += inside[toi(i)].pow(power);
         ForestNode *i = b, *n;
         double choice = random01();
         for (;;) {
           choice -= (inside[toi(i)].pow(power) / choose_norm).getReal();
           if (choice < 0) break;
-          n = i->next;
+          n = i->next();
           if (n == e) break;
           i = n;
         }
@@ -751,7 +826,7 @@ struct FForest {
       } else {  // AND
         v.record(rule_or);
         ++b;
-        for (; b < e; b = b->next)  // all children
+        for (; b < e; b = b->next())  // all children
           choose_random(b, v, power);
       }
     }
@@ -761,59 +836,10 @@ struct FForest {
   template <class W>
   void compute_inside(inside_t* ins, W const& w) {
     SetLocal<inside_t*> guard2(inside, ins);
-    compute_inside(nodes, w);
+    no_edges edges;
+    visit_postorder([this, &w, &edges](ForestNode* p) { inside_node(p, w, edges); });
   }
 
-  // w(ruleid)=Weight
-  template <class W>
-  void compute_inside(ForestNode* b, W const& w) {
-    ForestNode* e = b->next;
-    DBP_ADD_VERBOSE(10);
-    //        DBPC4W("computing inside",toi(b),toi(e),FForest(b),b); //FIXME: segfault on OR node child?
-    DBPC3("computing inside", toi(b), toi(e));
-    DBP_SCOPE;
-    size_t i = toi(b);
-    ForestNode::Label& l = b->l;
-    if (l.is_pointer()) {
-      ForestNode* shared = l.pointer();
-      DBPC3("shared inside", toi(shared), inside[toi(shared)]);
-      inside[i] = inside[toi(shared)];
-    } else {
-      unsigned rule_or = l.integer();
-      if (IS_OR_INT(rule_or)) {
-        ++b;
-        Assert(e != b);
-        ForestNode* n = b->next;
-        compute_inside(b, w);  // moved outside so instead of OR<-0, for children,
-        // OR+=inside[child], do OR=inside[first-child],
-        // OR+=inside[rest] - don't need to do this for AND
-        // OR INIT
-        inside[i] = inside[i + 1];
-        DBPC4("  OR=", i, inside[i], inside[i + 1]);
-        for (b = n; b < e; b = n) {  // 2nd and subsequent children
-          n = b->next;
-          compute_inside(b, w);
-          // OR FOLD
-          inside[i] += inside[toi(b)];
-          DBPC5("  OR+=", i, inside[i], toi(b), inside[toi(b)]);
-        }
-      } else {  // and-node
-        // AND INIT
-        inside[i] = w(rule_or);  // proposal prob (used nowhere else)
-        DBPC5("  AND=", i, inside[i], rule_or, w(rule_or));
-        ForestNode* n;
-        ++b;
-        for (; b < e; b = n) {  // all children
-          n = b->next;
-          compute_inside(b, w);
-          // AND FOLD
-          inside[i] *= inside[toi(b)];
-          DBPC5("  AND*=", i, inside[i], toi(b), inside[toi(b)]);
-        }
-      }
-    }
-    DBPC2("done computing inside", inside[i]);
-  }
 };
 
 CREATE_EXTRACTOR_T1(FForest);
@@ -937,7 +963,7 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
   dynamic_array<ForestNode*> backrefs;
 
   bool follows_paren = false;
-  unsigned rule_id;
+  boost::uint64_t rule_id;
   //    bool first_char=true;
 
   f.nodes = a.next<ForestNode>();
@@ -966,8 +992,8 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
           Assert2(backrefs[backref_id], < ANEXT);
           Assert2(backrefs[backref_id], >= f.nodes);
           ALLOCSTOP;
-          stop->l = backrefs[backref_id];
-          stop->next = ANEXT;
+          stop->set_backref(backrefs[backref_id]);
+          stop->set_next(ANEXT);
           in.unget();
         }
         break;
@@ -987,12 +1013,13 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
       case '9':
         in.unget();
         in >> rule_id;
+        ForestNode::check_rule(rule_id);
         if (Forest::max_ruleid < rule_id) Forest::max_ruleid = rule_id;
         ALLOCSTOP;
-        stop->l = rule_id;
+        stop->set_label((unsigned)rule_id);
         if (!follows_paren) {
           // child or leaf-root
-          stop->next = ANEXT;
+          stop->set_next(ANEXT);
           if (open_parens.empty()) goto done;
         } else {
           // root
@@ -1006,12 +1033,12 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
         }
         follows_paren = false;
         ALLOCSTOP;
-        stop->l = OR_INT;
+        stop->set_label(OR_INT);
         break;
       case ')':
         if (open_parens.top() != ANEXT)  // why?  because we haven't allocated ANEXT yet ... would cause rare
           // bug if it's not safe to write one off the end of StackAlloc
-          open_parens.top()->next = ANEXT;
+          open_parens.top()->set_next(ANEXT);
         open_parens.pop();
         if (open_parens.empty()) goto done;
         break;
@@ -1022,7 +1049,7 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
     }
   }
 done:
-  f.end() = ANEXT;  // FIXME: is this now redundant?
+  f.set_end(ANEXT);  // FIXME: is this now redundant?
 #undef ANEXT
   DBPC2("Successfully read forest", f);
   suicide.cancel();
@@ -1068,41 +1095,53 @@ BOOST_AUTO_TEST_CASE(TEST_FOREST) {
     BOOST_CHECK(!memcmp(forest_space, forest_porch, fsize));
   }
 }
-#endif
 
-template <class Float>
-inline std::ostream& operator<<(std::ostream& o, const typename FForest<Float>::Ancestry& a) {
-  o << "(parent=" << *a.parent;
-  if (a.child) {
-    o << " child=";
-    o << *a.child;
-  }
-  o << ')';
-  return o;
+BOOST_AUTO_TEST_CASE(TEST_FOREST_DEEP) {
+  unsigned const depth = 150000;  // printing used to stop at 100000
+  std::string s;
+  for (unsigned i = 0; i < depth; ++i) s += "(1 ";
+  s += "2";
+  s.append(depth, ')');
+  std::vector<ForestNode> space(depth + 2);
+  FForest<> f;
+  f.reset(&space[0], &space[0] + space.size());
+  BOOST_CHECK(test_extract_insert(s, f));
+}
+
+BOOST_AUTO_TEST_CASE(TEST_FOREST_RULE_RANGE) {
+  ForestNode space[4];
+  FForest<> f;
+  f.reset(space, space + 4);
+  BOOST_CHECK(test_extract("(1 2147483647)", f));
+  f.reset(space, space + 4);
+  BOOST_CHECK(!test_extract("(1 2147483648)", f, false));  // would wrap to an OR label
 }
+#endif
 
 #ifdef GRAEHL__SINGLE_MAIN
 template <class Float>
-THREADLOCAL gibbs_base* FForest<Float>::gibbs;
+FOREST_THREADLOCAL gibbs_base* FForest<Float>::gibbs;
+template <class Float>
+FOREST_THREADLOCAL typename FForest<Float>::Ancestries FForest<Float>::outside_order;
 template <class Float>
-THREADLOCAL dynamic_array<typename FForest<Float>::Ancestry> FForest<Float>::outside_order;
+FOREST_THREADLOCAL typename FForest<Float>::OpenNodes FForest<Float>::open_nodes;
 template <class Float>
-THREADLOCAL size_t FForest<Float>::max_ruleid;  // static global return value;
+FOREST_THREADLOCAL size_t FForest<Float>::max_ruleid;  // static global return value;
 template <class Float>
-THREADLOCAL ForestNode**
+FOREST_THREADLOCAL ForestNode**
     FForest<Float>::viterbi;  // records which OR-node subforest is taken (values don't matter otherwise)
 template <class Float>
-THREADLOCAL std::ostream* FForest<Float>::viterbi_out;
+FOREST_THREADLOCAL std::ostream* FForest<Float>::viterbi_out;
 template <class Float>
-THREADLOCAL typename FForest<Float>::inside_t FForest<Float>::choose_norm;
+FOREST_THREADLOCAL typename FForest<Float>::inside_t FForest<Float>::choose_norm;
 template <class Float>
-THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::inside;
+FOREST_THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::inside;
 template <class Float>
-THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::norm_outside;
+FOREST_THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::norm_outside;
 template <class Float>
-THREADLOCAL typename FForest<Float>::prob_t* FForest<Float>::rule_weights;
+FOREST_THREADLOCAL typename FForest<Float>::prob_t* FForest<Float>::rule_weights;
 template <class Float>
-THREADLOCAL typename FForest<Float>::count_t* FForest<Float>::counts;
+FOREST_THREADLOCAL typename FForest<Float>::count_t* FForest<Float>::counts;
 
 #endif
 
@@ -0,0 +1,118 @@
+#ifndef GRAEHL_TT__MAPPED_FORESTS_HPP
+#define GRAEHL_TT__MAPPED_FORESTS_HPP
+
+/// binary forests file: a header, the node index where each forest starts, then every forest's (position
+/// independent) ForestNode array back to back.  written once from parsed text forests
+/// (--write-binary-forests) and mmapped read only by later runs (--binary-forests-file): no parsing, no swap
+/// files, and concurrent runs share one copy in the page cache.  not portable across endianness (checked).
+
+#include <forest-em/forest.hpp>
+#include <graehl/shared/memmap.hpp>
+#include <graehl/shared/byref.hpp>
+#include <boost/cstdint.hpp>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace graehl {
+
+struct forest_file_header {
+  char magic[8];
+  boost::uint32_t node_bytes, endian;
+  boost::uint64_t n_forests, n_nodes, max_ruleid, max_nodes;
+};
+
+template <class Forest>
+struct MappedForests {
+  typedef boost::uint64_t index_type;
+  enum { kEndian = 0x01020304 };
+  static char const* magic() { return "forestem"; }
+
+  MappedForests() : header(), starts(), nodes() {}
+
+  bool is_open() const { return header; }
+  std::size_t size() const { return header ? header->n_forests : 0; }
+  forest_file_header const& info() const { return *header; }
+
+  Forest operator[](std::size_t i) const { return Forest(nodes + starts[i]); }
+
+  template <class F>
+  void enumerate(F f) const {
+    for (std::size_t i = 0, n = size(); i < n; ++i) {
+      Forest forest(nodes + starts[i]);
+      deref(f)(forest);
+    }
+  }
+
+  void print_stats(std::ostream& out) const {
+    out << size() << " forests (" << file.size() << " bytes) mapped read-only from " << path;
+  }
+
+  void open(std::string const& path_) {
+    path = path_;
+    file.open(path, std::ios::in);
+    forest_file_header const* h = (forest_file_header const*)file.data();
+    if (file.size() < sizeof(*h) || std::memcmp(h->magic, magic(), sizeof(h->magic)))
+      throw std::runtime_error(path + " isn't a binary forests file (from forest-em --write-binary-forests)");
+    if (h->node_bytes != sizeof(ForestNode) || h->endian != kEndian)
+      throw std::runtime_error(path + " was written by an incompatible (other endian or version) forest-em");
+    starts = (index_type const*)(h + 1);
+    nodes = (ForestNode*)(starts + h->n_forests + 1);
+    if (file.size() != (std::size_t)((char const*)(nodes + h->n_nodes) - file.data())
+        || starts[h->n_forests] != h->n_nodes)
+      throw std::runtime_error(path + " is truncated");
+    if (h->max_ruleid > (boost::uint64_t)ForestNode::max_rule)
+      throw std::runtime_error(path + " has rule ids over 2147483647, more than a forest node can hold");
+    header = h;
+  }
+
+  /// forests: anything whose enumerate(f) calls f(Forest &) for every forest, e.g. SwapBatch<Forest>
+  template <class Forests>
+  static void save(std::string const& path, Forests& forests, std::size_t n_forests, std::size_t n_nodes,
+                   std::size_t max_ruleid, std::size_t max_nodes) {
+    std::ofstream o(path.c_str(), std::ios::binary);
+    forest_file_header h;
+    std::memcpy(h.magic, magic(), sizeof(h.magic));
+    h.node_bytes = sizeof(ForestNode);
+    h.endian = kEndian;
+    h.n_forests = n_forests;
+    h.n_nodes = n_nodes;
+    h.max_ruleid = max_ruleid;
+    h.max_nodes = max_nodes;
+    o.write((char const*)&h, sizeof(h));
+    o.seekp(sizeof(h) + (n_forests + 1) * sizeof(index_type));
+    writer w(o);
+    forests.enumerate(boost::ref(w));
+    w.starts.push_back(w.at);
+    if (w.starts.size() != n_forests + 1 || w.at != n_nodes)
+      throw std::logic_error("forest count/size mismatch writing " + path);
+    o.seekp(sizeof(h));
+    o.write((char const*)&w.starts[0], w.starts.size() * sizeof(index_type));
+    if (!o) throw std::runtime_error("couldn't write binary forests file " + path);
+  }
+
+ private:
+  struct writer {
+    std::ostream& o;
+    std::vector<index_type> starts;
+    index_type at;
+    explicit writer(std::ostream& o) : o(o), at() {}
+    void operator()(Forest& f) {
+      starts.push_back(at);
+      o.write((char const*)f.begin(), f.size() * sizeof(ForestNode));
+      at += f.size();
+    }
+  };
+
+  mapped_file file;
+  std::string path;
+  forest_file_header const* header;
+  index_type const* starts;
+  ForestNode* nodes;
+};
+
+}
+
+#endif
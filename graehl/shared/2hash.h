@@ -54,6 +54,11 @@
 #include <utility>
 #include <functional>
 #include <memory>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#endif
 
 namespace graehl {
 
@@ -673,6 +678,370 @@ inline V* add(HashTable<K, V, H, P, A>& ht, const K& k, const V& v = V()) {
 }
 
 
+/**
+   FlatHashTable: open addressing (linear probing) drop-in for HashTable with the same interface (insert,
+   insert_result_type, find, find_second, operator[], iterators compared against end(), visit_key_val).
+   SwissTable-style, there's an array of 1-byte control codes parallel to the (key,value) slots: the high bit
+   set means empty or deleted, else the byte is 7 bits of the key's hash, so a probe compares keys only on a
+   likely match and never follows a pointer.  no per-entry allocation, and clear() keeps the capacity, which
+   suits tables reused per sentence (carmel derivations).
+
+   unlike HashTable, an insert that grows the table moves every entry, invalidating pointers to them (inserts
+   that don't grow, and erases, move nothing).  the hash value is remixed, so weak (e.g. identity) hash
+   functions are fine.
+*/
+
+const float FLATHASHLOAD = 0.8f;
+
+template <typename K, typename V>
+struct FlatHashEntry {
+  K first;
+  V second;
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef FlatHashEntry<K, V> self_type;
+  template <class V_init>
+  FlatHashEntry(const K& k, const V_init& v)
+      : first(k), second(v) {}
+  explicit FlatHashEntry(const K& k) : first(k), second() {}
+  template <class O>
+  void print(O& o) const {
+    o << '(' << first << ',' << second << ')';
+  }
+  TO_OSTREAM_PRINT
+};
+
+template <class K, class V, class H = hash<K>, class P = std::equal_to<K>,
+          class A = std::allocator<FlatHashEntry<K, V> > >
+class FlatHashTable;
+
+namespace flat_hash {
+enum { kEmpty = 0x80, kDeleted = 0xFE };
+inline bool full(unsigned char c) {
+  return !(c & 0x80);
+}
+}
+
+template <typename K, typename V>
+class FlatHashIter {
+  unsigned char const* ctrl;
+  unsigned char const* end_ctrl;
+  FlatHashEntry<K, V>* slot;
+  void skip_empty() {
+    for (; ctrl != end_ctrl; ++ctrl, ++slot)
+      if (flat_hash::full(*ctrl)) return;
+    slot = NULL;
+  }
+
+ public:
+  template <class H, class P, class A>
+  FlatHashIter(FlatHashTable<K, V, H, P, A> const& t)
+      : ctrl(t.ctrl), end_ctrl(t.ctrl + t.bucket_count()), slot(t.slots) {
+    skip_empty();
+  }
+  FlatHashIter() : slot() {}
+  void operator++() {
+    if (!slot) return;
+    ++ctrl;
+    ++slot;
+    skip_empty();
+  }
+  bool operator==(void* nocare) const { return slot == NULL; }
+  const FlatHashEntry<K, V>* operator!=(void* nocare) const { return slot; }
+
+  FlatHashEntry<K, V>& operator*() const { return *slot; }
+  FlatHashEntry<K, V>* operator->() const { return slot; }
+};
+
+template <class K, class V, class H, class P, class A>
+class FlatHashTable : private A::template rebind<FlatHashEntry<K, V> >::other {
+ public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef H hasher;
+  typedef P key_equal;
+  typedef FlatHashIter<K, V> iterator;
+  typedef FlatHashIter<K, V> const_iterator;
+
+  typedef std::pair<const K, V> value_type;
+  typedef FlatHashEntry<K, V>* find_result_type;
+  typedef std::pair<find_result_type, bool> insert_result_type;
+
+  hasher hash_function() const { return hash; }
+  key_equal key_eq() const { return m_eq; }
+
+  BOOST_STATIC_CONSTANT(unsigned, DEFAULTHASHSIZE = 8);
+  BOOST_STATIC_CONSTANT(unsigned, MINHASHSIZE = 4);
+
+ protected:
+  typedef FlatHashEntry<K, V> Node;
+  typedef typename A::template rebind<Node>::other base_alloc;
+  typedef typename A::template rebind<unsigned char>::other ctrl_alloc;
+
+  unsigned mask;  // capacity-1; capacity is a power of 2
+  unsigned cnt, ndeleted, growAt;
+  float mLoad;
+  H hash;
+  P m_eq;
+  unsigned char* ctrl;
+  Node* slots;
+  friend class FlatHashIter<K, V>;
+
+  // multiplicative remix: the (well mixed) high 32 bits pick the slot, 7 lower bits are the control tag
+  static uint64_t remix(std::size_t h) { return (uint64_t)h * 0x9E3779B97F4A7C15ULL; }
+  std::size_t home(uint64_t x) const { return (std::size_t)(x >> 32) & mask; }
+  static unsigned char tag(uint64_t x) { return (unsigned char)((x >> 25) & 0x7F); }
+
+  bool equal(const K& k, const K& k2) const { return m_eq(k, k2); }
+
+ public:
+  explicit FlatHashTable(unsigned sz = DEFAULTHASHSIZE, float mLoad = FLATHASHLOAD) { init(sz, mLoad); }
+  FlatHashTable(unsigned sz, const hasher& hf) : hash(hf) { init(sz); }
+  FlatHashTable(unsigned sz, const hasher& hf, const key_equal& eq_) : hash(hf), m_eq(eq_) { init(sz); }
+  FlatHashTable(const FlatHashTable& o)
+      : base_alloc((base_alloc const&)o), mask(o.mask), cnt(o.cnt), ndeleted(o.ndeleted), growAt(o.growAt)
+      , mLoad(o.mLoad), hash(o.hash), m_eq(o.m_eq) {
+    alloc_table(bucket_count());
+    // same slots, tombstones included: a probe sequence may pass through one to reach its key
+    std::memcpy(ctrl, o.ctrl, bucket_count());
+    for (std::size_t i = 0, n = bucket_count(); i < n; ++i)
+      if (flat_hash::full(ctrl[i])) PLACEMENT_NEW(slots + i) Node(o.slots[i]);
+  }
+  ~FlatHashTable() {
+    if (ctrl) {
+      destroy_all();
+      free_table(ctrl, slots, bucket_count());
+      ctrl = NULL;
+    }
+  }
+
+  void swap(FlatHashTable& o) {
+    std::swap(mask, o.mask);
+    std::swap(cnt, o.cnt);
+    std::swap(ndeleted, o.ndeleted);
+    std::swap(growAt, o.growAt);
+    std::swap(mLoad, o.mLoad);
+    std::swap(hash, o.hash);
+    std::swap(m_eq, o.m_eq);
+    std::swap(ctrl, o.ctrl);
+    std::swap(slots, o.slots);
+  }
+
+  const_iterator begin() const { return const_iterator(*this); }
+  iterator begin() { return iterator(*this); }
+  find_result_type end() const { return NULL; }
+
+  template <class F>
+  void visit_key_val(F& f) {
+    for (std::size_t i = 0, n = bucket_count(); i < n; ++i)
+      if (flat_hash::full(ctrl[i])) f.visit(slots[i].first, slots[i].second);
+  }
+
+  // keeps the capacity
+  void clear() {
+    if (!cnt && !ndeleted) return;
+    destroy_all();
+    std::memset(ctrl, flat_hash::kEmpty, bucket_count());
+    cnt = ndeleted = 0;
+  }
+
+  // bool is true if insertion was performed, false if key already existed.  pointer to the key/val pair in
+  // the table is returned
+  insert_result_type insert(const K& first, const V& second) {
+    std::size_t i;
+    if (!find_slot(first, i)) return insert_result_type(slots + i, false);
+    PLACEMENT_NEW(slots + i) Node(first, second);
+    return insert_result_type(slots + i, true);
+  }
+  insert_result_type insert(const K& first) {
+    std::size_t i;
+    if (!find_slot(first, i)) return insert_result_type(slots + i, false);
+    PLACEMENT_NEW(slots + i) Node(first);
+    return insert_result_type(slots + i, true);
+  }
+  insert_result_type insert(const value_type& t) { return insert(t.first, t.second); }
+
+  // use insert instead
+  V* add(const K& first, const V& second = V()) { return &insert(first, second).first->second; }
+
+  find_result_type find(const K& first) const {
+    uint64_t x = remix(hash(first));
+    unsigned char t = tag(x);
+    for (std::size_t i = home(x);; i = (i + 1) & mask) {
+      unsigned char c = ctrl[i];
+      if (c == t && equal(slots[i].first, first)) return slots + i;
+      if (c == flat_hash::kEmpty) return NULL;
+    }
+  }
+  V* find_second(const K& first) const {
+    find_result_type p = find(first);
+    return p ? &p->second : NULL;
+  }
+  value_type* find_value(const K& first) const { return (value_type*)find(first); }
+
+  V& operator[](const K& first) { return insert(first).first->second; }
+  V const& operator[](const K& first) const { return *find_second(first); }
+
+  bool erase(const K& first) {
+    find_result_type p = find(first);
+    if (!p) return 0;
+    std::size_t i = p - slots;
+    p->~Node();
+    // a tombstone is needed only if some probe sequence continues past i
+    if (ctrl[(i + 1) & mask] == flat_hash::kEmpty)
+      ctrl[i] = flat_hash::kEmpty;
+    else {
+      ctrl[i] = flat_hash::kDeleted;
+      ++ndeleted;
+    }
+    --cnt;
+    return 1;
+  }
+
+  std::size_t bucket_count() const { return (std::size_t)mask + 1; }
+  std::size_t max_bucket_count() const { return 0x7FFFFFFF; }
+  int size() const { return cnt; }
+  bool empty() const { return !cnt; }
+  int growWhen() const { return growAt; }
+  float load_factor() const { return (float)cnt / (float)bucket_count(); }
+  float max_load_factor() const { return mLoad; }
+  void max_load_factor(float mLoad_) {
+    mLoad = mLoad_;
+    set_growAt();
+  }
+  void rehash(unsigned request) {
+    if (request > cnt) rehash_pow2(pow2Bound(request));
+  }
+  // capacity for n entries without growing
+  void reserve(unsigned n) {
+    if (n > growAt) rehash((unsigned)(n / mLoad) + 1);
+  }
+
+ protected:
+  void init(unsigned sz = DEFAULTHASHSIZE, float mLoad_ = FLATHASHLOAD) {
+    mLoad = mLoad_ > .95f ? .95f : mLoad_;
+    mask = (sz < MINHASHSIZE ? MINHASHSIZE : pow2Bound(sz)) - 1;
+    cnt = ndeleted = 0;
+    set_growAt();
+    alloc_table(bucket_count());
+    std::memset(ctrl, flat_hash::kEmpty, bucket_count());
+  }
+  void set_growAt() {
+    growAt = (unsigned)(mLoad * bucket_count());
+    if (growAt >= bucket_count()) growAt = mask;  // always leave an empty slot
+  }
+
+  // true: i is a free slot, now marked used by first (caller constructs the entry).  false: i holds first
+  bool find_slot(const K& first, std::size_t& i) {
+    uint64_t x = remix(hash(first));
+    unsigned char t = tag(x);
+    std::size_t reuse = (std::size_t)-1;
+    for (i = home(x);; i = (i + 1) & mask) {
+      unsigned char c = ctrl[i];
+      if (c == t && equal(slots[i].first, first)) return false;
+      if (c == flat_hash::kEmpty) break;
+      if (c == flat_hash::kDeleted && reuse == (std::size_t)-1) reuse = i;
+    }
+    if (reuse != (std::size_t)-1) {
+      i = reuse;
+      --ndeleted;
+    } else if (cnt + ndeleted >= growAt) {
+      // mostly tombstones: clean up in place; else double
+      rehash_pow2(ndeleted > cnt / 2 ? bucket_count() : 2 * bucket_count());
+      i = free_slot(x);
+    }
+    ctrl[i] = t;
+    ++cnt;
+    return true;
+  }
+
+  // empty slot for a key not in the table (no tombstones)
+  std::size_t free_slot(uint64_t x) const {
+    std::size_t i = home(x);
+    while (ctrl[i] != flat_hash::kEmpty) i = (i + 1) & mask;
+    return i;
+  }
+
+  void rehash_pow2(std::size_t request) {
+    std::size_t oldn = bucket_count();
+    unsigned char* oldctrl = ctrl;
+    Node* oldslots = slots;
+    mask = (unsigned)request - 1;
+    set_growAt();
+    alloc_table(request);
+    std::memset(ctrl, flat_hash::kEmpty, request);
+    for (std::size_t j = 0; j < oldn; ++j)
+      if (flat_hash::full(oldctrl[j])) {
+        Node& e = oldslots[j];
+        uint64_t x = remix(hash(e.first));
+        std::size_t i = free_slot(x);
+        ctrl[i] = tag(x);
+        PLACEMENT_NEW(slots + i) Node(std::move(e));
+        e.~Node();
+      }
+    ndeleted = 0;
+    free_table(oldctrl, oldslots, oldn);
+  }
+
+  void destroy_all() {
+    for (std::size_t i = 0, n = bucket_count(); i < n; ++i)
+      if (flat_hash::full(ctrl[i])) slots[i].~Node();
+  }
+  void alloc_table(std::size_t n) {
+    ctrl = ctrl_alloc().allocate(n);
+    slots = this->allocate(n);
+  }
+  void free_table(unsigned char* c, Node* s, std::size_t n) {
+    ctrl_alloc().deallocate(c, n);
+    this->deallocate(s, n);
+  }
+};
+
+template <class K, class V, class H, class P, class A>
+struct hash_traits<FlatHashTable<K, V, H, P, A> > {
+  typedef FlatHashTable<K, V, H, P, A> HT;
+  typedef typename HT::find_result_type find_result_type;
+  typedef typename HT::insert_result_type insert_result_type;
+};
+
+template <class K, class V, class H, class P, class A>
+struct map_traits<FlatHashTable<K, V, H, P, A> > {
+  typedef FlatHashTable<K, V, H, P, A> type;
+  typedef typename type::find_result_type find_result_type;
+  typedef typename type::insert_result_type insert_result_type;
+};
+
+template <class K, class V, class H, class P, class A>
+inline void swap(FlatHashTable<K, V, H, P, A>& a, FlatHashTable<K, V, H, P, A>& b) {
+  a.swap(b);
+}
+
+template <class K, class V, class H, class P, class A>
+inline V* find_second(const FlatHashTable<K, V, H, P, A>& ht, const K& first) {
+  return ht.find_second(first);
+}
+
+template <class K, class V, class H, class P, class A>
+inline V* add(FlatHashTable<K, V, H, P, A>& ht, const K& k, const V& v = V()) {
+  return ht.add(k, v);
+}
+
+template <class K, class V, class H, class P, class A>
+inline typename FlatHashTable<K, V, H, P, A>::insert_result_type insert(FlatHashTable<K, V, H, P, A>& ht,
+                                                                        const K& first, const V& v = V()) {
+  return ht.insert(first, v);
+}
+
+template <class K, class V, class H, class P, class A, class C, class T>
+inline std::basic_ostream<C, T>& operator<<(std::basic_ostream<C, T>& out, const FlatHashTable<K, V, H, P, A>& t) {
+  out << "begin" << std::endl;
+  for (typename FlatHashTable<K, V, H, P, A>::const_iterator i = t.begin(); i != t.end(); ++i)
+    out << *i << std::endl;
+  out << "end" << std::endl;
+  return out;
+}
+
+
 template <class K>
 inline std::size_t hash_value_dispatch(K const& k) {
   return hash_value(k);  // argument dependent lookup
@@ -700,6 +1069,32 @@ struct hash<const char*> {
   std::size_t operator()(const char* s) const { return cstr_hash(s); }
 };
 
+#ifdef GRAEHL_TEST
+struct collide_hash {  // every key probes from the same slot
+  std::size_t operator()(unsigned) const { return 0; }
+};
+
+BOOST_AUTO_TEST_CASE(TEST_FLAT_HASH_TABLE_ERASE_COPY) {
+  typedef FlatHashTable<unsigned, unsigned, collide_hash> T;
+  T t;
+  for (unsigned i = 1; i <= 5; ++i) t[i] = 10 * i;
+  BOOST_CHECK(t.erase(2));  // leaves a tombstone in the middle of the probe chain
+  T c(t);
+  BOOST_CHECK_EQUAL(c.size(), 4);
+  BOOST_CHECK(!c.find(2));
+  for (unsigned i = 3; i <= 5; ++i) {
+    BOOST_REQUIRE(c.find(i));
+    BOOST_CHECK_EQUAL(*c.find_second(i), 10 * i);
+  }
+  BOOST_CHECK(c.insert(2, 20).second);
+  BOOST_CHECK(!c.insert(5, 0).second);  // not a duplicate of 5 in 2's old slot
+  BOOST_CHECK_EQUAL(c.size(), 5);
+  for (unsigned i = 6; i <= 100; ++i) c[i] = i;  // grows (rehash drops the tombstones)
+  for (unsigned i = 1; i <= 100; i += 11) BOOST_CHECK(c.find(i));
+  BOOST_CHECK_EQUAL(t.size(), 4);
+}
+#endif
+
 }  // ns
 
 #endif  // graehl HashTable
@@ -37,7 +37,6 @@ struct FSTArc {
   bool is_epsilon(LabelType dir) const { return symbol(dir) == epsilon; }
 
   unsigned dest;
-  Weight weight;
   typedef unsigned group_t;
 
   BOOST_STATIC_CONSTANT(unsigned, no_group = (unsigned)-1);
@@ -46,12 +45,13 @@ struct FSTArc {
   BOOST_STATIC_CONSTANT(unsigned, wildcard = 1);
 
   group_t groupId;
+  Weight weight;  // last, after the 4 unsigned: no padding (24 bytes, not 32, for double weights)
 
   //    enum {no_group=-1,locked_group=0};
 
   FSTArc() {}
   FSTArc(unsigned i, unsigned o, unsigned d, Weight w, group_t g = no_group)
-      : in(i), out(o), dest(d), weight(w), groupId(g) {}
+      : in(i), out(o), dest(d), groupId(g), weight(w) {}
   void clear_group() { groupId = no_group; }
   struct clear_group_f {
     void operator()(unsigned src, FSTArc& a) const { a.clear_group(); }
@@ -36,7 +36,7 @@ namespace graehl {
 
 static const int MAX_TRACE_DEPTH = 64;
 
-void print_stackframe(std::ostream &o) {
+inline void print_stackframe(std::ostream &o) {
 #ifdef HAVE_LINUX_BACKTRACE
   void *trace[MAX_TRACE_DEPTH];
 
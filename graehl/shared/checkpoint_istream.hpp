@@ -17,10 +17,61 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <graehl/shared/byref.hpp>
 
 namespace graehl {
 
+/// true if tellg/seekg work on in's streambuf (boost::iostreams filters throw instead)
+inline bool seekable_istream(std::istream &in) {
+  try {
+    return in.rdbuf()->pubseekoff(0, std::ios::cur, std::ios::in) != std::streampos(-1);
+  } catch (std::exception &) {
+    return false;
+  }
+}
+
+/** the since-last-checkpoint putback buffer: wraps an unseekable (e.g.
+    decompressing) streambuf, keeping everything read since the last tellg()
+    so a seekg() back to that position works. tellg() is the checkpoint -
+    earlier input is released.
+*/
+struct checkpoint_streambuf : std::streambuf {
+  enum { chunk = 64 * 1024 };
+  explicit checkpoint_streambuf(std::streambuf *src) : src(src), base(0), checkpoint(0) {}
+
+ protected:
+  int_type underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    std::size_t cur = buf.size(), keep = cur - (std::size_t)(checkpoint - base);
+    buf.erase(0, cur - keep);
+    base = checkpoint;
+    buf.resize(keep + chunk);
+    std::streamsize got = src->sgetn(&buf[keep], chunk);
+    buf.resize(keep + (std::size_t)(got > 0 ? got : 0));
+    setg(&buf[0], &buf[0] + keep, &buf[0] + buf.size());
+    return got > 0 ? traits_type::to_int_type(*gptr()) : traits_type::eof();
+  }
+
+  pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode) {
+    if (dir == std::ios::cur && off == 0) return checkpoint = tell();
+    return dir == std::ios::beg ? seekpos(off, std::ios::in) : pos_type(off_type(-1));
+  }
+
+  pos_type seekpos(pos_type pos, std::ios::openmode) {
+    std::streamoff p = pos;
+    if (p < base || p > base + (std::streamoff)buf.size()) return pos_type(off_type(-1));
+    setg(eback(), eback() + (p - base), egptr());
+    return pos;
+  }
+
+ private:
+  std::streamoff tell() const { return base + (eback() ? gptr() - eback() : 0); }
+  std::streambuf *src;
+  std::string buf;  // input from absolute offset base on
+  std::streamoff base, checkpoint;
+};
+
 template <class C>
 struct checkpoint_istream_control;
 
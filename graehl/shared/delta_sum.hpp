@@ -91,6 +91,10 @@ struct delta_sum_f {
     x = x0;
     s = tmax = 0;
   }
+  template <class A>
+  void serialize(A& a) {
+    a & x & tmax & s;
+  }
   bool empty() const { return tmax == 0; }
   D avg() const { return tmax > 0 ? s / tmax : x; }
   D avg(D t) const {
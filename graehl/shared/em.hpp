@@ -58,6 +58,38 @@ struct WeightAccum {
 */
 typedef std::pair<double, unsigned> ParamDelta;
 
+/// everything overrelaxed_em carries from one iteration to the next.  Exec::checkpoint sees it after every
+/// maximize; handing a saved copy back to overrelaxed_em (with resumed set) continues exactly where it left off
+struct em_state {
+  double best_alp; // alp=average log prob = (logprob1 +...+ logprobn )/ n (negative means 0 probability, 0 = 1 probability)
+  double last_alp;
+  double learning_rate;
+  ParamDelta max_delta_param;
+  int ran_restarts; // remaining
+  unsigned train_iter;
+  bool very_first_time, first_time, last_was_reset;
+  bool resumed; // don't start_restart before the first iteration
+  explicit em_state(int ran_restarts = 0)
+      : best_alp(-HUGE_VAL), ran_restarts(ran_restarts), very_first_time(true), resumed(false) {
+    start_restart();
+  }
+  void start_restart() {
+    train_iter = 0;
+    max_delta_param = ParamDelta();
+    last_alp = -HUGE_VAL;
+    learning_rate = 1;
+    first_time = true;
+    last_was_reset = false;
+  }
+  template <class A>
+  void serialize(A &a) {
+    a & best_alp & last_alp & learning_rate & max_delta_param.first & max_delta_param.second & ran_restarts
+        & train_iter & very_first_time & first_time & last_was_reset;
+    if (A::is_loading)
+      resumed = true;
+  }
+};
+
 
 template <class C, class T> inline
 std::basic_ostream<C, T>& operator <<(std::basic_ostream<C, T> &out, ParamDelta const& p)
@@ -86,6 +118,8 @@ struct EM_executor {
   // if you're doing random restarts, transfer the current parameters to safekeeping
   void save_best() {}
   void restore_best() {} // called when EM is (completely) finished
+  // called after each maximize with the loop's own state; save it (and your parameters) to resume later
+  void checkpoint(em_state const& s) {}
 };
 
 
@@ -105,25 +139,27 @@ inline void print_alp(std::ostream &logs, double N, double alp)
 }
 
 template <class Exec>
-double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_relative_avg_logprob_epsilon = .0001, int ran_restarts = 0, double converge_param_delta = 0, double learning_rate_growth_factor = 1, std::ostream &logs = Config::log(), unsigned log_level = 1)
+double overrelaxed_em(Exec &exec, em_state &s, unsigned max_iter = 10000, double converge_relative_avg_logprob_epsilon = .0001, double converge_param_delta = 0, double learning_rate_growth_factor = 1, std::ostream &logs = Config::log(), unsigned log_level = 1)
 {
   DBP_INC_VERBOSE;
-  double best_alp=-HUGE_VAL; // alp=average log prob = (logprob1 +...+ logprobn )/ n (negative means 0 probability, 0 = 1 probability)
+  double &best_alp = s.best_alp;
   if (max_iter == 0)
     return best_alp;
 
   double &rel_eps = converge_relative_avg_logprob_epsilon;
-  bool very_first_time = true;
+  bool &very_first_time = s.very_first_time;
   double N = exec.size();
   while (1) { // random restarts
-    unsigned train_iter = 0;
-    ParamDelta max_delta_param;
-    double last_alp;
-
-    last_alp=-HUGE_VAL;
-    double learning_rate = 1;
-    bool first_time = true;
-    bool last_was_reset = false;
+    if (s.resumed)
+      s.resumed = false;
+    else
+      s.start_restart();
+    unsigned &train_iter = s.train_iter;
+    ParamDelta &max_delta_param = s.max_delta_param;
+    double &last_alp = s.last_alp;
+    double &learning_rate = s.learning_rate;
+    bool &first_time = s.first_time;
+    bool &last_was_reset = s.last_was_reset;
     //        exec.maximize(1); // may not be desireable if you wanted just 1 iteration to compute counts = inside*outside but you should do that outside this framework
     for ( ; ; ) {
       ++train_iter;
@@ -193,11 +229,12 @@ double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_rel
       }
 
       last_alp = new_alp;
+      exec.checkpoint(s);
     } // for
     exec.converge_em();
-    if (ran_restarts > 0) {
-      --ran_restarts;
-      logs << "\nRandom restart - " << ran_restarts << " remaining.\n";
+    if (s.ran_restarts > 0) {
+      --s.ran_restarts;
+      logs << "\nRandom restart - " << s.ran_restarts << " remaining.\n";
       exec.randomize();
     } else {
       break;
@@ -215,6 +252,13 @@ double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_rel
   return best_alp;
 }
 
+template <class Exec>
+double overrelaxed_em(Exec &exec, unsigned max_iter = 10000, double converge_relative_avg_logprob_epsilon = .0001, int ran_restarts = 0, double converge_param_delta = 0, double learning_rate_growth_factor = 1, std::ostream &logs = Config::log(), unsigned log_level = 1)
+{
+  em_state s(ran_restarts);
+  return overrelaxed_em(exec, s, max_iter, converge_relative_avg_logprob_epsilon, converge_param_delta, learning_rate_growth_factor, logs, log_level);
+}
+
 }
 
 #endif
@@ -21,6 +21,9 @@
 #if GRAEHL_USE_GZSTREAM
 #include <graehl/shared/gzstream.hpp>
 #endif
+#if GRAEHL_USE_LZ4
+#include <graehl/shared/lz4stream.hpp>
+#endif
 
 namespace graehl {
 
@@ -35,6 +38,12 @@ struct call_set_new_gz {
   static void gz(Filearg& x, std::string const& s) {
     throw std::runtime_error("can't open .gz as fstream");
   }
+#if GRAEHL_USE_LZ4
+  template <class Filearg>
+  static void lz4(Filearg& x, std::string const& s) {
+    throw std::runtime_error("can't open .lz4 as fstream");
+  }
+#endif
 #if USE_BOOST_BZ2STREAM
   template <class Filearg>
   static void bz2(Filearg& x, std::string const& s) {
@@ -49,6 +58,12 @@ struct call_set_new_gz<std::ostream> {
   static void gz(Filearg& x, std::string const& s) {
     x.template set_new<ogzstream>(s, fail_out);
   }
+#if GRAEHL_USE_LZ4
+  template <class Filearg>
+  static void lz4(Filearg& x, std::string const& s) {
+    x.template set_new<olz4stream>(s, fail_out);
+  }
+#endif
 #if USE_BOOST_BZ2STREAM
   template <class Filearg>
   static void bz2(Filearg& x, std::string const& s) {
@@ -63,6 +78,12 @@ struct call_set_new_gz<std::istream> {
   static void gz(Filearg& x, std::string const& s) {
     x.template set_new<igzstream>(s, fail_in);
   }
+#if GRAEHL_USE_LZ4
+  template <class Filearg>
+  static void lz4(Filearg& x, std::string const& s) {
+    x.template set_new<ilz4stream>(s, fail_in);
+  }
+#endif
 #if USE_BOOST_BZ2STREAM
   template <class Filearg>
   static void bz2(Filearg& x, std::string const& s) {
@@ -99,8 +120,27 @@ void file_arg<Stream>::set_gzfile(std::string const& s, bool /*large_buf*/)
   }
 }
 #endif
+#if GRAEHL_USE_LZ4
+template <class Stream>
+void file_arg<Stream>::set_lz4(std::string const& s, bool /*large_buf*/)
+// lz4_decompressor holds a whole (up to 4MB) block already
+{
+  std::string fail_msg;
+  try {
+    call_set_new_gz<Stream>::lz4(*this, s);
+  } catch (std::exception& e) {
+    fail_msg.append("-exception: ").append(e.what());
+    throw_fail(s, fail_msg);
+  }
+}
+#define GRAEHL_INSTANTIATE_SET_LZ4(Stream) template void file_arg<Stream>::set_lz4(std::string const&, bool)
+#else
+#define GRAEHL_INSTANTIATE_SET_LZ4(Stream)
+#endif
+
 #define GRAEHL_INSTANTIATE_SET_GZFILE(Stream) \
-  template void file_arg<Stream>::set_gzfile(std::string const&, bool)
+  template void file_arg<Stream>::set_gzfile(std::string const&, bool); \
+  GRAEHL_INSTANTIATE_SET_LZ4(Stream)
 
 GRAEHL_INSTANTIATE_SET_GZFILE(std::istream);
 GRAEHL_INSTANTIATE_SET_GZFILE(std::ostream);
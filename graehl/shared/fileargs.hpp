@@ -41,7 +41,7 @@
 #define GRAEHL_USE_GZSTREAM 1
 #endif
 #ifndef GRAEHL_USE_LZ4
-#define GRAEHL_USE_LZ4 0
+#define GRAEHL_USE_LZ4 1
 #endif
 
 #ifndef BOOST_FILESYSTEM_NO_DEPRECATED
@@ -479,9 +479,7 @@ struct file_arg {
 
   void set_bz2(std::string const& s, bool large_buf = kDefaultLargeBuf);
 
-  void set_lz4(std::string const& s, bool large_buf = kDefaultLargeBuf) {
-    throw_fail(".lz4 support unimplimented");
-  }
+  void set_lz4(std::string const& s, bool large_buf = kDefaultLargeBuf);
 
   // warning: if you specify the wrong values for read and file_only, you could assign the wrong type of
   // pointer and crash!
@@ -91,7 +91,7 @@ struct filter_file_streambuf : boost::iostreams::filtering_streambuf<Mode> {
 
   filter_file_streambuf() {}
   filter_file_streambuf(const char* name,
-                        std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default)
+                        std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default)
       : file_(name, mode | std::ios_base::binary) {
     opened();
   }
@@ -102,11 +102,11 @@ struct filter_file_streambuf : boost::iostreams::filtering_streambuf<Mode> {
 
   bool is_open() { return file_.is_open(); }
 
-  void open(const char* name, std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default) {
+  void open(const char* name, std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default) {
     file_.open(name, mode | std::ios_base::binary);
     opened();
   }
-  void open(std::string const& name, std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default) {
+  void open(std::string const& name, std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default) {
     open(name.c_str(), mode);
   }
 
@@ -128,7 +128,7 @@ struct filter_file_stream : boost::iostreams::filtering_stream<Mode> {
   Stream file_;
 
   filter_file_stream() {}
-  filter_file_stream(const char* name, std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default)
+  filter_file_stream(const char* name, std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default)
       : file_(name, mode | std::ios_base::binary) {
     opened();
   }
@@ -139,11 +139,11 @@ struct filter_file_stream : boost::iostreams::filtering_stream<Mode> {
 
   bool is_open() { return file_.is_open(); }
 
-  void open(const char* name, std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default) {
+  void open(const char* name, std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default) {
     file_.open(name, mode | std::ios_base::binary);
     opened();
   }
-  void open(std::string const& name, std::ios_base::openmode mode = fstream_for_mode<Mode>::ios_mode_default) {
+  void open(std::string const& name, std::ios_base::openmode mode = (std::ios_base::openmode)fstream_for_mode<Mode>::ios_mode_default) {
     open(name.c_str(), mode);
   }
 
@@ -155,6 +155,7 @@ struct filter_file_stream : boost::iostreams::filtering_stream<Mode> {
   void opened() {
     Base::push(Filter());
     Base::push(file_);
+    if (!file_) this->setstate(std::ios::failbit);  // so !stream means couldn't open, as for fstream
   }
 };
 
@@ -474,6 +474,14 @@ class fixed_array : public auto_array<T, Alloc> {
     }
   }
 
+  template <class A>
+  void serialize(A& a) {
+    size_type sz = this->size();
+    a& sz;
+    if (A::is_loading) reinit(sz);
+    for (T *i = this->begin(), *e = this->end(); i != e; ++i) a& *i;
+  }
+
   template <class charT, class Traits, class Reader>
   std::ios_base::iostate read(std::basic_istream<charT, Traits>& in, Reader read) {
     this->destroy();
@@ -32,6 +32,8 @@
    resample_block(blocki): for blocki=[0,n_pairs): choose new random sample[blocki] using p^power (this->power, don't forget to use it :)
    print_sample(sample):
    print_param(out,parami): like out<<gps[i] but customized
+   checkpoint_iteration(i) (optional): called after each iteration; may write serialize_state(archive) so that a
+     later run_starts(*this,&archive) - after defining the same params - continues bit-for-bit from there
 
    void print_counts(bool final=false,char const* name="") {
      print_counts_default(*this,final,name);
@@ -87,6 +89,8 @@
 #include <graehl/shared/print_width.hpp>
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/debugprint.hpp>
+#include <graehl/shared/random.hpp>
+#include <graehl/shared/simple_serialize.hpp>
 #include <boost/math/distributions/normal.hpp>
 
 //#define DEBUG_GIBBS
@@ -224,6 +228,11 @@ struct gibbs_param
   {
     o<<norm<<'\t'<<sumcount<<" prior="<<prior;
   }
+  template <class A>
+  void serialize(A &a)
+  {
+    a & prior & norm & sumcount;
+  }
 };
 
 struct gibbs_base
@@ -312,6 +321,11 @@ struct gibbs_base
     }
 
     unsigned size() const { return id.size(); }
+    template <class A>
+    void serialize(A &a)
+    {
+      a & prob & id & wt;
+    }
     bool have_weights() const
     {
       if (wt.size()==id.size())
@@ -468,6 +482,10 @@ struct gibbs_base
  private:
   normsum_t ccount, csum, pcount, psum; // for computing true cache model probs
   unsigned iter, Ni; // i=0 is random init sample.  i=1...Ni are the (gibbs resampled) samples
+  unsigned run_i; // current restart
+  gibbs_stats best_stats; // of restarts [0,run_i)
+  saved_counts_t best_counts;
+  blocks_t best_sample;
   double time; // at i=gopt.burnin, t=0.  at tmax = nI-gopt.burnin, we have the final sample.
   gibbs_opts::temps temp;
   scale_t scales;
@@ -799,23 +817,28 @@ struct gibbs_base
 
  private:
   //actual impl:
+  // resumed: continue after the (loaded) iteration iter instead of starting from the prior
   template <class G>
-  gibbs_stats run(unsigned runi, G &imp)
+  gibbs_stats run(unsigned runi, G &imp, bool resumed = false)
   {
-    stats.clear(n_sym, n_blocks);
     Ni = gopt.iter;
-    restore_p0(); // sets counts to prior, and normsums so prob is right
+    if (!resumed) {
+      stats.clear(n_sym, n_blocks);
+      restore_p0(); // sets counts to prior, and normsums so prob is right
+    }
     imp.init_run(runi);
-    iter = 0;
-    time = 0;
-    if (gopt.print_every!=0 && gopt.print_counts_sparse==0) {
-      out<<"# ";
-      print_counts(imp, true,"(prior counts)");
+    if (!resumed) {
+      iter = 0;
+      time = 0;
+      if (gopt.print_every!=0 && gopt.print_counts_sparse==0) {
+        out<<"# ";
+        print_counts(imp, true,"(prior counts)");
+      }
+      clear_blocks();
+      iteration(imp, gopt.random_start || (runi&&gopt.expectation)); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
+      //FIXME: isn't really random!  get the same sample after every iteration
     }
-    clear_blocks();
-    iteration(imp, gopt.random_start || (runi&&gopt.expectation)); // initial sample; randomize deltas when doing expectation to prevent deterministic hillclimb
-    //FIXME: isn't really random!  get the same sample after every iteration
-    for (iter = 1; iter<=Ni; ++iter) {
+    for (++iter; iter<=Ni; ++iter) {
       time = (double)iter-(double)gopt.burnin; //very funny: unsigned arithmetic -> double (unsigned maximum) if you're sloppy
       if (time<0) time = 0;
       iteration(imp, false);
@@ -874,43 +897,71 @@ struct gibbs_base
       propose_new_priors();
     record_iteration(p);
     maybe_print_periodic(imp);
+    imp.checkpoint_iteration(iter);
   }
   unsigned beststart;
  public:
+  void checkpoint_iteration(unsigned i) {}
+
+  /// the sampler's whole state between iterations, including the global random generator (but not the
+  /// defined params' structure, which the impl must rebuild identically before resuming)
+  template <class A>
+  void serialize_state(A &a)
+  {
+    a & run_i & iter & time & gps & normsum & pcount & psum & prior_scale.cumulative & sample & stats;
+    a & beststart & best_stats & best_counts & best_sample;
+    serialize_random_state(a);
+  }
+
   template <class G>
   gibbs_stats run_starts(G &imp)
+  {
+    return run_starts(imp, (istream_archive *)0);
+  }
+
+  /// resume: if not null, load serialize_state from it and continue that run
+  template <class G, class Archive>
+  gibbs_stats run_starts(G &imp, Archive *resume)
   {
     init_cache();
     saved_counts_t priors;
-    saved_counts_t best_counts;
-    blocks_t best_sample(n_blocks);
-    gibbs_stats best;
+    best_sample.reinit(n_blocks);
     unsigned re = gopt.restarts;
     bool restart_priors = re>0 && gopt.prior_inference_restart_fresh;
     prior_scale.init_cumulative();
     if (restart_priors)
       save_priors(priors);
-    for (unsigned r = 0; r<=re; ++r) {
+    unsigned r = 0;
+    bool resuming = resume;
+    if (resuming) {
+      serialize_state(*resume);
+      r = run_i;
+      log<<"Resuming Gibbs sampling run "<<r<<" after i="<<iter<<"\n";
+    }
+    for (; r<=re; ++r) {
+      run_i = r;
       graehl::time_space_report(log,"Gibbs sampling run: ");
       if (re>0) log<<"(random restart "<<r<<" of "<<re<<"): ";
-      if (r>0&&restart_priors)
+      if (r>0&&restart_priors&&!resuming)
         restore_priors(priors);
       log<<"\n";
-      gibbs_stats const& s = run(r, imp);
-      if (r==0 || s.better(best, gopt)) {
+      gibbs_stats const& s = run(r, imp, resuming);
+      resuming = false;
+      if (r==0 || s.better(best_stats, gopt)) {
         beststart = r;
         log << "\nNew best: "<<s<<"\n";
-        best = s;
+        best_stats = s;
         finalize_cumulative_counts();
         save_counts(best_counts);
         best_sample.swap(sample);
       }
     }
     best_sample.swap(sample);
+    best_sample.clear();
     if (re>0)
       restore_probs(best_counts); //TESTME: used to erroneously be restore_counts! was this accidentally doing something good in start-selection?
     free_cache();
-    return best;
+    return best_stats;
   }
 
   //logging:
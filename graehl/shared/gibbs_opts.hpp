@@ -314,6 +314,11 @@ struct gibbs_stats
   {
     return gopt.argmax_final ? finalprob>o.finalprob : (gopt.argmax_sum ? sumprob>o.sumprob : allprob>o.allprob);
   }
+  template <class A>
+  void serialize(A &a)
+  {
+    a & N & n_sym & n_blocks & sumprob & allprob & finalprob;
+  }
 };
 
 }
@@ -25,18 +25,6 @@ std::ostream& operator<<(std::ostream& out, const GraphArc& a) {
   return out << ')';
 }
 
-void (*dfsFunc)(unsigned, unsigned) = NULL;
-void (*dfsExitFunc)(unsigned, unsigned) = NULL;
-
-void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
-                      void (*func)(unsigned state, unsigned pred)) {
-  dfsGraph = graph;
-  dfsVis = visited;
-  dfsFunc = func;
-  dfsExitFunc = NULL;
-  dfsRec(startState, DFS_NO_PREDECESSOR);
-}
-
 // g's arcs are reversed and added to graph dest
 void add_reversed_arcs(GraphState* rev, GraphState const* src, unsigned n, bool data_point_to_forward) {
   for (unsigned i = 0; i < n; ++i) {
@@ -71,144 +59,15 @@ Graph reverseGraph(Graph g, bool data_point_to_forward)
   return ret;
 }
 
-Graph dfsGraph;
-bool* dfsVis;
-
-
-void dfsRec(unsigned state, unsigned pred) {
-
-  if (dfsVis[state]) return;
-
-
-  dfsVis[state] = true;
-  if (dfsFunc) dfsFunc(state, pred);
-
-  const List<GraphArc>& arcs = dfsGraph.states[state].arcs;
-  for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l)
-    dfsRec(l->dest, state);
-  if (dfsExitFunc) dfsExitFunc(state, pred);
-}
-
-
 FLOAT_TYPE* DistToState::weights = NULL;
 DistToState** DistToState::stateLocations = NULL;
 FLOAT_TYPE DistToState::unreachable = HUGE_VAL;
 
-inline bool operator<(DistToState lhs, DistToState rhs) {
-  return DistToState::weights[lhs.state] > DistToState::weights[rhs.state];
-}
-
-inline bool operator==(DistToState lhs, DistToState rhs) {
-  return DistToState::weights[lhs.state] == DistToState::weights[rhs.state];
-}
-
-inline bool operator==(DistToState lhs, FLOAT_TYPE rhs) {
-  return DistToState::weights[lhs.state] == rhs;
-}
-
-Graph shortestPathTreeTo(Graph g, unsigned dest, FLOAT_TYPE* dist)
-// returns graph (need to delete[] ret.states yourself)
-// computes best paths from all states to single destination, storing tree of arcs taken in *pathTree, and
-// distances to dest in *dist
-{
-  unsigned i;
-
-  GraphArc** taken = NEW /*const*/ GraphArc * [g.nStates];
-
-  Graph pg;
-  pg.nStates = g.nStates;
-  pg.states = NEW GraphState[pg.nStates];
-
-  Graph rev_graph = reverseGraph(g);
-#ifdef DEBUGKBEST
-  Config::debug() << "rev_graph = \n" << rev_graph << "\n\nTaken\n";
-#endif
-  shortestDistancesFrom(rev_graph, dest, dist, taken);
-
-  for (i = 0; i < g.nStates; ++i)
-    if (taken[i]) {
-      GraphArc* rev_taken = taken[i]->data_as<GraphArc*>();
-#ifdef DEBUGKBEST
-      Config::debug() << ' ' << i << ' ' << rev_taken;
-#endif
-
-      pg.states[i].arcs.push(*rev_taken);
-    }
-
-
-#ifdef DEBUGKBEST
-  Config::debug() << "\nshortestpathtree graph:\n" << pg;
-#endif
-
-  delete[] rev_graph.states;
-  delete[] taken;
-  return pg;
-}
-
-void shortestDistancesFrom(Graph g, unsigned src, FLOAT_TYPE* dist, GraphArc** taken)
-// computes best paths from single src to all other states
-// if taken == NULL, only compute weights (stored in dist)
-//  otherwise, store pointer to arc taken to get to state s in taken[s]
-{
-  unsigned nStates = g.nStates;
-  unsigned i;
-
-  if (taken)
-    for (i = 0; i < g.nStates; ++i) taken[i] = NULL;
-
-  GraphState* st = g.states;
-
-  unsigned nUnknown = nStates;
-
-  DistToState* distQueue = NEW DistToState[nStates];
-
-  //  FLOAT_TYPE *weights = NEW FLOAT_TYPE[nStates];
-  FLOAT_TYPE* weights = dist;
-
-  for (i = 0; i < nStates; ++i)
-    weights[i] = HUGE_VAL;
-
-  DistToState** stateLocations = NEW DistToState * [nStates];
-  DistToState::weights = weights;
-  DistToState::stateLocations = stateLocations;
-
-  weights[src] = 0;
-  for (i = 1; i < nStates; ++i) {
-    unsigned fillWith;
-    if (i <= src)
-      fillWith = i - 1;
-    else
-      fillWith = i;
-    distQueue[i].state = fillWith;
-    stateLocations[fillWith] = &distQueue[i];
-  }
-  distQueue[0].state = src;
-  stateLocations[src] = &distQueue[0];
-
-
-  FLOAT_TYPE candidate;
-  for (;;) {
-    if ((FLOAT_TYPE)distQueue[0] == HUGE_VAL || nUnknown == 0) {
-      break;
-    }
-    unsigned activeState = distQueue[0].state;
-    //    dist[activeState] = (FLOAT_TYPE)distQueue[0];
-    heapPop(distQueue, distQueue + nUnknown--);
-    List<GraphArc>& arcs = st[activeState].arcs;
-    for (List<GraphArc>::val_iterator a = arcs.val_begin(), end = arcs.val_end(); a != end; ++a) {
-      // future: compare only best arc to any given state
-      unsigned targetState = a->dest;
-      if ((candidate = (a->weight + weights[activeState])) < weights[targetState]) {
-        weights[targetState] = candidate;
-        if (taken) taken[targetState] = &(*a);
-        heapAdjustUp(distQueue, stateLocations[targetState]);
-      }
-    }
-  }
-
+shortest_distance_counts shortest_distances_used;
 
-  delete[] stateLocations;
-  delete[] distQueue;
+Graph shortestPathTreeTo(Graph g, unsigned dest, FLOAT_TYPE* dist, bool* acyclic) {
+  ReversedGraph rev(g);
+  return shortestPathTreeTo(g, rev, dest, dist, (GraphArc**)NULL, acyclic);
 }
 
 
@@ -17,9 +17,13 @@
 #ifndef GRAPH_H
 #define GRAPH_H
 
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <vector>
 #include <iterator>
+#include <limits>
+#include <utility>
 
 #include <graehl/shared/dynamic_array.hpp>
 #include <graehl/shared/config.h>
@@ -125,9 +129,36 @@ inline void swap(GraphState& a, GraphState& b) {
 }
 
 
+/*
+  graph adaptor: shortestDistancesFrom, TopoSort, countNoCyclePaths (and bestPaths in kbest.h) run on any G
+  providing
+
+    unsigned num_states() const;
+    typedef ... arc_iterator;  // forward iterator over the arcs leaving a state
+    arc_iterator arcs_begin(unsigned s) const;
+    arc_iterator arcs_end(unsigned s) const;
+    unsigned dest(arc_iterator) const;
+    FLOAT_TYPE cost(arc_iterator) const;  // lower is better; a path costs the sum of its arcs
+    typedef ... arc_handle;  // pointer naming an arc; NULL for none
+    arc_handle handle(arc_iterator) const;
+    GraphArc graph_arc(unsigned src, arc_handle) const;  // a copy; data identifies the original arc
+
+  Graph is one; carmel's WFST::graph_view reads WFST states in place, without building a Graph.
+*/
 struct Graph {
   GraphState* states;
   unsigned nStates;
+
+  typedef List<GraphArc>::val_iterator arc_iterator;
+  typedef GraphArc* arc_handle;
+  unsigned num_states() const { return nStates; }
+  arc_iterator arcs_begin(unsigned s) const { return states[s].arcs.val_begin(); }
+  arc_iterator arcs_end(unsigned s) const { return states[s].arcs.val_end(); }
+  static unsigned dest(arc_iterator a) { return a->dest; }
+  static FLOAT_TYPE cost(arc_iterator a) { return a->weight; }
+  static arc_handle handle(arc_iterator a) { return &*a; }
+  static GraphArc graph_arc(unsigned, arc_handle a) { return *a; }
+
   template <class W>
   void setwt(W const& w) {
     for (unsigned i = 0; i < nStates; ++i) states[i].setwt(w);
@@ -150,16 +181,186 @@ void add_reversed_arcs(GraphState* destination, GraphState const* src, unsigned
 
 Graph reverseGraph(Graph g, bool data_point_to_forward = true);
 
-extern Graph dfsGraph;
-extern bool* dfsVis;
+/// csr_graph_view's default: follow every arc
+struct skip_no_arcs {
+  template <class Arc>
+  static bool skip(Arc const&) {
+    return false;
+  }
+};
+
+/// graph adaptor (see Graph) over arcs stored by source state in one flat array (compressed sparse rows):
+/// state s's arcs are arcs[first[s]..first[s+1]).  Arc needs a dest member; arcs for which Skip::skip(arc)
+/// holds are passed over.  a handle is the Arc const*.  reads the vectors in place: invalid once they change
+template <class Arc, class Index = std::size_t, class Skip = skip_no_arcs>
+struct csr_graph_view {
+  typedef Arc const* arc_handle;
+  struct arc_iterator {
+    Arc const *i, *end;
+    arc_iterator(Arc const* i, Arc const* end) : i(i), end(end) { skip(); }
+    void skip() {
+      while (i != end && Skip::skip(*i)) ++i;
+    }
+    arc_iterator& operator++() {
+      ++i;
+      skip();
+      return *this;
+    }
+    Arc const& operator*() const { return *i; }
+    Arc const* operator->() const { return i; }
+    bool operator==(arc_iterator const& o) const { return i == o.i; }
+    bool operator!=(arc_iterator const& o) const { return i != o.i; }
+  };
+  std::vector<Index> const* first;
+  std::vector<Arc> const* arcs;
+  csr_graph_view(std::vector<Index> const& first, std::vector<Arc> const& arcs)
+      : first(&first), arcs(&arcs) {}
+  unsigned num_states() const { return (unsigned)first->size() - 1; }
+  arc_iterator arcs_begin(unsigned s) const { return arc_iterator(at((*first)[s]), at((*first)[s + 1])); }
+  arc_iterator arcs_end(unsigned s) const { return arc_iterator(at((*first)[s + 1]), at((*first)[s + 1])); }
+  bool has_arcs(unsigned s) const { return arcs_begin(s) != arcs_end(s); }
+  static unsigned dest(arc_iterator a) { return a.i->dest; }
+  static arc_handle handle(arc_iterator a) { return a.i; }
+
+ private:
+  Arc const* at(std::size_t i) const { return arcs->data() + i; }
+};
 
-void dfsRec(unsigned state, unsigned pred);
+/// the arrays csr_graph_view reads: add each state's arcs in state order, calling start_state() before each
+/// state's (even if it has none) and finish() after the last
+template <class Arc, class Index = std::size_t>
+struct csr_graph {
+  std::vector<Index> first;  // state s's arcs are arcs[first[s]..first[s+1])
+  std::vector<Arc> arcs;
+  typedef csr_graph_view<Arc, Index> graph_view;
+  void start_state() { first.push_back((Index)arcs.size()); }
+  void finish() { first.push_back((Index)arcs.size()); }
+  unsigned num_states() const { return (unsigned)first.size() - 1; }
+  graph_view graph() const { return graph_view(first, arcs); }
+  template <class Skip>
+  csr_graph_view<Arc, Index, Skip> graph() const {
+    return csr_graph_view<Arc, Index, Skip>(first, arcs);
+  }
+};
 
-void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
-                      void (*func)(unsigned state, unsigned pred));
+/// depth_first_search visitor that does nothing; derive and hide what you need
+struct dfs_visitor {
+  void discover(unsigned state, unsigned pred) {}  // first reached, from pred (DFS_NO_PREDECESSOR for a root)
+  void finish(unsigned state, unsigned pred) {}  // after everything reachable from state
+  void back_edge(unsigned state, unsigned dest) {}  // arc to a state still being searched, i.e. a cycle
+  void finished_edge(unsigned state, unsigned dest) {}  // arc to an already finished state
+};
 
-template <class Weight>
-void countNoCyclePaths(Graph g, Weight* nPaths, unsigned src);
+/// depth first search over a graph adaptor G (see Graph).  keeps its own stack rather than recursing, so
+/// chains of any length are fine, and all its state is in the object, so searches may run concurrently.
+/// arcs are followed in arc_iterator order, so the visitor sees what a recursive search would show it.
+/// states stay seen across search_from calls: each is discovered at most once, whatever the roots.  g must
+/// outlive the search
+template <class G>
+class depth_first_search {
+ public:
+  explicit depth_first_search(G const& g) : g(g), mark(g.num_states(), (char)kUnseen) {}
+  bool seen(unsigned s) const { return mark[s] != kUnseen; }
+
+  /// visit (see dfs_visitor) every state reachable from root that's not already seen
+  template <class V>
+  void search_from(unsigned root, V& v) {
+    if (mark[root] != kUnseen) return;
+    open(root, DFS_NO_PREDECESSOR, v);
+    while (!stack.empty()) {
+      frame& f = stack.back();
+      unsigned s = f.state;
+      if (f.arc == g.arcs_end(s)) {
+        unsigned pred = f.pred;
+        mark[s] = kDone;
+        stack.pop_back();
+        v.finish(s, pred);
+        continue;
+      }
+      unsigned d = g.dest(f.arc);
+      ++f.arc;
+      if (mark[d] == kUnseen)
+        open(d, s, v);
+      else if (mark[d] == kOpen)
+        v.back_edge(s, d);
+      else
+        v.finished_edge(s, d);
+    }
+  }
+
+ private:
+  enum { kUnseen, kOpen, kDone };
+  struct frame {
+    unsigned state, pred;
+    typename G::arc_iterator arc;  // next arc to follow
+  };
+  G const& g;
+  std::vector<char> mark;
+  std::vector<frame> stack;
+
+  template <class V>
+  void open(unsigned s, unsigned pred, V& v) {
+    mark[s] = kOpen;
+    v.discover(s, pred);
+    frame f = {s, pred, g.arcs_begin(s)};
+    stack.push_back(f);
+  }
+};
+
+/// dfs visitor calling o(s) as each state s finishes (so in reverse, a topological order), and counting back
+/// edges (if any, there's a cycle and no topological order)
+template <class O>
+struct dfs_postorder : dfs_visitor {
+  O o;
+  unsigned n_back_edges;
+  explicit dfs_postorder(O const& o) : o(o), n_back_edges() {}
+  void finish(unsigned s, unsigned) { o(s); }
+  void back_edge(unsigned, unsigned) { ++n_back_edges; }
+};
+
+/// dfs visitor finding the strongly connected components (Tarjan) of the states it's shown.  components are
+/// numbered as they complete, which is a reverse topological order: an arc never leads from a component to
+/// a later one.  component c's states are states[first[c]..first[c+1])
+struct strong_components : dfs_visitor {
+  enum { kNone = (unsigned)-1 };
+  std::vector<unsigned> component;  // of each state, or kNone if not (yet) visited
+  std::vector<unsigned> states;
+  std::vector<unsigned> first;  // first[n_components()] == states.size()
+
+  explicit strong_components(unsigned n_states)
+      : component(n_states, (unsigned)kNone), first(1, 0), index(n_states), low(n_states), n_discovered() {}
+  unsigned n_components() const { return (unsigned)first.size() - 1; }
+
+  void discover(unsigned s, unsigned) {
+    index[s] = low[s] = n_discovered++;
+    open.push_back(s);
+  }
+  void finish(unsigned s, unsigned pred) {
+    if (low[s] == index[s]) {
+      unsigned c = n_components(), t;
+      do {
+        t = open.back();
+        open.pop_back();
+        component[t] = c;
+        states.push_back(t);
+      } while (t != s);
+      first.push_back((unsigned)states.size());
+    }
+    if (pred != DFS_NO_PREDECESSOR && low[s] < low[pred]) low[pred] = low[s];
+  }
+  void back_edge(unsigned s, unsigned d) { reach(s, d); }
+  void finished_edge(unsigned s, unsigned d) {
+    if (component[d] == (unsigned)kNone) reach(s, d);  // d's component (which includes s) isn't done
+  }
+
+ private:
+  std::vector<unsigned> index, low;  // discovery order, and the least index reachable in the same component
+  std::vector<unsigned> open;  // discovered states not yet in a component
+  unsigned n_discovered;
+  void reach(unsigned s, unsigned d) {
+    if (index[d] < low[s]) low[s] = index[d];
+  }
+};
 
 
 struct backref {
@@ -194,62 +395,42 @@ struct backrefs {
 };
 
 
-class TopoSort {
-  typedef std::front_insert_iterator<List<unsigned> > UnsignedPusher;
-  Graph g;
-  bool* done;
-  bool* begun;
-  UnsignedPusher o;
-  unsigned n_back_edges;
+struct push_front_state {
+  List<unsigned>* l;
+  explicit push_front_state(List<unsigned>* l) : l(l) {}
+  void operator()(unsigned s) const { l->push_front(s); }
+};
+
+/// G: a graph adaptor (see Graph)
+template <class G>
+class basic_topo_sort {
+  G g;
+  depth_first_search<G> dfs;
+  dfs_postorder<push_front_state> v;  // insert at beginning of sorted list (we must come before anything
+  // reachable by us!)
 
  public:
-  bool has_cycle() const { return n_back_edges; }
-  TopoSort(Graph g_, List<unsigned>* l) : g(g_), o(*l), n_back_edges(0) {
-    done = NEW bool[g.nStates];
-    begun = NEW bool[g.nStates];
-    for (unsigned i = 0; i < g.nStates; ++i) done[i] = begun[i] = false;
-  }
+  bool has_cycle() const { return v.n_back_edges; }
+  basic_topo_sort(G const& g_, List<unsigned>* l) : g(g_), dfs(g), v(push_front_state(l)) {}
   void order_all() { order(true); }
   void order_crucial() { order(false); }
   void order(bool all = true) {
-    for (unsigned i = 0; i < g.nStates; ++i)
-      if (all || !g.states[i].arcs.empty()) order_from(i);
-  }
-  unsigned get_n_back_edges() const { return n_back_edges; }
-  void order_from(unsigned s) {
-    if (done[s]) return;
-    if (begun[s]) {  // this state previously started but not finished already = back edge/cycle!
-      ++n_back_edges;
-      return;
-    }
-    begun[s] = true;
-    const List<GraphArc>& arcs = g.states[s].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
-      order_from(l->dest);
-    }
-    done[s] = true;
-
-    // insert at beginning of sorted list (we must come before anything reachable by us!)
-    *o++ = s;
-  }
-  ~TopoSort() {
-    delete[] done;
-    delete[] begun;
+    for (unsigned i = 0, n = g.num_states(); i < n; ++i)
+      if (all || g.arcs_begin(i) != g.arcs_end(i)) order_from(i);
   }
+  unsigned get_n_back_edges() const { return v.n_back_edges; }
+  void order_from(unsigned s) { dfs.search_from(s, v); }
 };
 
+typedef basic_topo_sort<Graph> TopoSort;
+
 struct reverse_topo_order {
   Graph g;
-  bool* done;
-  bool* begun;
+  depth_first_search<Graph> dfs;
   unsigned n_back_edges;
 
  public:
-  reverse_topo_order(Graph g_) : g(g_), n_back_edges(0) {
-    done = NEW bool[g.nStates];
-    begun = NEW bool[g.nStates];
-    for (unsigned i = 0; i < g.nStates; ++i) done[i] = begun[i] = false;
-  }
+  reverse_topo_order(Graph g_) : g(g_), dfs(g), n_back_edges(0) {}
   template <class O>
   void order_all(O o) {
     order(o, true);
@@ -266,24 +447,9 @@ struct reverse_topo_order {
   unsigned get_n_back_edges() const { return n_back_edges; }
   template <class O>
   void order_from(O o, unsigned s) {
-    if (done[s]) return;
-    if (begun[s]) {  // this state previously started but not finished already = back edge/cycle!
-      ++n_back_edges;
-      return;
-    }
-    begun[s] = true;
-    const List<GraphArc>& arcs = g.states[s].arcs;
-    for (List<GraphArc>::const_iterator l = arcs.const_begin(), end = arcs.const_end(); l != end; ++l) {
-      order_from(o, l->dest);
-    }
-    done[s] = true;
-
-    // insert at beginning of sorted list (we must come before anything reachable by us!)
-    o(s);
-  }
-  ~reverse_topo_order() {
-    delete[] done;
-    delete[] begun;
+    dfs_postorder<O&> v(o);
+    dfs.search_from(s, v);
+    n_back_edges += v.n_back_edges;
   }
 };
 
@@ -301,15 +467,230 @@ struct DistToState {
   }
 };
 
-Graph shortestPathTreeTo(Graph g, unsigned dest, FLOAT_TYPE* dist);
-// returns graph (need to delete[] ret.states yourself)
-// computes best paths from all states to single destination, storing tree of arcs taken in *pathTree, and
-// distances to dest in *dist
+inline bool operator<(DistToState lhs, DistToState rhs) {
+  return DistToState::weights[lhs.state] > DistToState::weights[rhs.state];
+}
+
+inline bool operator==(DistToState lhs, DistToState rhs) {
+  return DistToState::weights[lhs.state] == DistToState::weights[rhs.state];
+}
+
+inline bool operator==(DistToState lhs, FLOAT_TYPE rhs) {
+  return DistToState::weights[lhs.state] == rhs;
+}
+
+/// how many shortestDistancesFrom calls took each path (for carmel -c); reset as you like.  atomic so the
+/// counts stay exact when several threads search at once
+struct shortest_distance_counts {
+  std::atomic<unsigned> topological, dijkstra;
+  shortest_distance_counts() : topological(0), dijkstra(0) {}
+  bool any() const { return topological || dijkstra; }
+  void clear() { topological = dijkstra = 0; }
+};
+extern shortest_distance_counts shortest_distances_used;
+
+// appends states reachable from src to post, each after everything reachable from it (so reversed, it's a
+// topological order).  false (post is then no such order) if a back edge is found
+template <class G>
+bool reachablePostorder(G const& g, unsigned src, std::vector<unsigned>& post) {
+  dfs_postorder<push_backer<std::vector<unsigned> > > v(post);
+  depth_first_search<G>(g).search_from(src, v);
+  return !v.n_back_edges;
+}
+
+// as shortestDistancesFrom, but only if the states reachable from src are acyclic (else returns false
+// without touching dist or taken)
+template <class G>
+bool topoShortestDistancesFrom(G const& g, unsigned src, FLOAT_TYPE* dist,
+                               typename G::arc_handle* taken = NULL) {
+  unsigned const n = g.num_states();
+  std::vector<unsigned> post;
+  post.reserve(n);
+  if (!reachablePostorder(g, src, post)) return false;
+  for (unsigned i = 0; i < n; ++i) dist[i] = HUGE_VAL;
+  if (taken)
+    for (unsigned i = 0; i < n; ++i) taken[i] = typename G::arc_handle();
+  dist[src] = 0;
+  for (std::vector<unsigned>::const_reverse_iterator t = post.rbegin(), e = post.rend(); t != e; ++t) {
+    FLOAT_TYPE const d = dist[*t];
+    if (d == HUGE_VAL) continue;
+    for (typename G::arc_iterator a = g.arcs_begin(*t), end = g.arcs_end(*t); a != end; ++a) {
+      FLOAT_TYPE candidate = g.cost(a) + d;
+      unsigned to = g.dest(a);
+      if (candidate < dist[to]) {
+        dist[to] = candidate;
+        if (taken) taken[to] = g.handle(a);
+      }
+    }
+  }
+  return true;
+}
+
+template <class G>
+void dijkstraShortestDistancesFrom(G const& g, unsigned src, FLOAT_TYPE* dist,
+                                   typename G::arc_handle* taken = NULL) {
+  unsigned nStates = g.num_states();
+  unsigned i;
+
+  if (taken)
+    for (i = 0; i < nStates; ++i) taken[i] = typename G::arc_handle();
+
+  unsigned nUnknown = nStates;
+
+  DistToState* distQueue = NEW DistToState[nStates];
+
+  FLOAT_TYPE* weights = dist;
+
+  for (i = 0; i < nStates; ++i) weights[i] = HUGE_VAL;
+
+  DistToState** stateLocations = NEW DistToState * [nStates];
+  DistToState::weights = weights;
+  DistToState::stateLocations = stateLocations;
+
+  weights[src] = 0;
+  for (i = 1; i < nStates; ++i) {
+    unsigned fillWith;
+    if (i <= src)
+      fillWith = i - 1;
+    else
+      fillWith = i;
+    distQueue[i].state = fillWith;
+    stateLocations[fillWith] = &distQueue[i];
+  }
+  distQueue[0].state = src;
+  stateLocations[src] = &distQueue[0];
+
+  FLOAT_TYPE candidate;
+  for (;;) {
+    if ((FLOAT_TYPE)distQueue[0] == HUGE_VAL || nUnknown == 0) {
+      break;
+    }
+    unsigned activeState = distQueue[0].state;
+    heapPop(distQueue, distQueue + nUnknown--);
+    for (typename G::arc_iterator a = g.arcs_begin(activeState), end = g.arcs_end(activeState); a != end;
+         ++a) {
+      // future: compare only best arc to any given state
+      unsigned targetState = g.dest(a);
+      if ((candidate = (g.cost(a) + weights[activeState])) < weights[targetState]) {
+        weights[targetState] = candidate;
+        if (taken) taken[targetState] = g.handle(a);
+        heapAdjustUp(distQueue, stateLocations[targetState]);
+      }
+    }
+  }
+
+  delete[] stateLocations;
+  delete[] distQueue;
+}
 
-void shortestDistancesFrom(Graph g, unsigned src, FLOAT_TYPE* dist, GraphArc** taken = NULL);
 // computes best paths from single src to all other states
 // if taken == NULL, only compute weights (stored in dist)
-//  otherwise, store pointer to arc taken to get to state s in taken[s]
+//  otherwise, store (handle of) arc taken to get to state s in taken[s]
+// if the states reachable from src are acyclic, relaxes arcs once in topological order (linear time, and
+// exact even for negative costs) and returns true; otherwise uses Dijkstra and returns false
+template <class G>
+bool shortestDistancesFrom(G const& g, unsigned src, FLOAT_TYPE* dist, typename G::arc_handle* taken = NULL) {
+  if (topoShortestDistancesFrom(g, src, dist, taken)) {
+    ++shortest_distances_used.topological;
+    return true;
+  }
+  ++shortest_distances_used.dijkstra;
+  dijkstraShortestDistancesFrom(g, src, dist, taken);
+  return false;
+}
+
+/// reverseGraph(g) as a graph adaptor that can name the forward arc for each of its arcs (needed by
+/// shortestPathTreeTo)
+struct ReversedGraph : Graph {
+  explicit ReversedGraph(Graph forward) : Graph(reverseGraph(forward, true)) {}
+  ~ReversedGraph() { delete[] states; }
+  static GraphArc* forward(arc_handle a) { return a->data_as<GraphArc*>(); }
+
+ private:
+  ReversedGraph(ReversedGraph const&);
+  void operator=(ReversedGraph const&);
+};
+
+// whether state s's chain of via (shortest path tree) predecessors, all as near dest as s, includes pred
+inline bool reachedThrough(unsigned s, unsigned pred, unsigned dest, unsigned const* via,
+                           FLOAT_TYPE const* dist) {
+  for (FLOAT_TYPE const d = dist[s]; s != dest && dist[s] == d;) {
+    s = via[s];
+    if (s == pred) return true;
+  }
+  return false;
+}
+
+// returns graph (need to delete[] ret.states yourself)
+// computes best paths from all states to single destination, storing tree of arcs taken in *pathTree, and
+// distances to dest in *dist.  rev is g reversed; rev.forward(arc_handle) gives the G::arc_handle it
+// reverses.  if tree, tree[s] = the arc leaving s in the returned tree (or NULL).  if acyclic, *acyclic =
+// no state that reaches dest is on a cycle.
+//
+// which of several equally short arcs the tree takes decides the order of tied k-best paths.  Dijkstra
+// takes the one toward the state it finished first: the nearer to dest, or of arcs to the same state, the
+// first in rev's list.  if acyclic, rev's arcs are instead relaxed once each in topological order, keeping
+// those same choices; only when two equally near states offer equally short arcs (which Dijkstra's heap
+// order decides) is Dijkstra used after all
+template <class G, class R>
+Graph shortestPathTreeTo(G const& g, R const& rev, unsigned dest, FLOAT_TYPE* dist,
+                         typename G::arc_handle* tree = NULL, bool* acyclic = NULL) {
+  unsigned const n = g.num_states();
+  std::vector<typename R::arc_handle> taken(n);
+  std::vector<unsigned> post;
+  post.reserve(n);
+  bool const dag = reachablePostorder(rev, dest, post);
+  if (acyclic) *acyclic = dag;
+  bool tied = !dag;
+  if (dag) {
+    std::vector<unsigned> via(n);  // rev source of taken[s]
+    for (unsigned i = 0; i < n; ++i) dist[i] = HUGE_VAL;
+    dist[dest] = 0;
+    for (std::vector<unsigned>::const_reverse_iterator t = post.rbegin(), e = post.rend(); t != e && !tied;
+         ++t) {
+      FLOAT_TYPE const d = dist[*t];
+      for (typename R::arc_iterator a = rev.arcs_begin(*t), end = rev.arcs_end(*t); a != end; ++a) {
+        unsigned const to = rev.dest(a);
+        FLOAT_TYPE const candidate = rev.cost(a) + d;
+        if (candidate == dist[to] && candidate != HUGE_VAL) {
+          unsigned const other = via[to];
+          if (d == dist[other] && *t != other) {
+            // of two equally near states, Dijkstra finishes first the one the other was reached through
+            if (reachedThrough(*t, other, dest, &via[0], dist)) continue;
+            if (!reachedThrough(other, *t, dest, &via[0], dist)) {
+              tied = true;
+              break;
+            }
+          } else if (d >= dist[other])
+            continue;
+        } else if (!(candidate < dist[to]))
+          continue;
+        dist[to] = candidate;
+        taken[to] = rev.handle(a);
+        via[to] = *t;
+      }
+    }
+    if (!tied) ++shortest_distances_used.topological;
+  }
+  if (tied) {
+    ++shortest_distances_used.dijkstra;
+    dijkstraShortestDistancesFrom(rev, dest, dist, n ? &taken[0] : NULL);
+  }
+  Graph pg;
+  pg.nStates = n;
+  pg.states = NEW GraphState[n];
+  for (unsigned i = 0; i < n; ++i) {
+    typename G::arc_handle forward = taken[i] ? rev.forward(taken[i]) : typename G::arc_handle();
+    if (tree) tree[i] = forward;
+    if (forward) pg.states[i].arcs.push(g.graph_arc(i, forward));
+  }
+#ifdef DEBUGKBEST
+  Config::debug() << "\nshortestpathtree graph:\n" << pg;
+#endif
+  return pg;
+}
+
+Graph shortestPathTreeTo(Graph g, unsigned dest, FLOAT_TYPE* dist, bool* acyclic = NULL);
 
 
 // if marked[i], remove state i and arcs leading to it
@@ -360,26 +741,25 @@ inline std::ostream& operator<<(std::ostream& out, const Graph& g) {
   return out;
 }
 
-template <class Weight>
-void countNoCyclePaths(Graph g, Weight* nPaths, unsigned src, unsigned* p_n_back_edges = 0) {
+template <class Weight, class G>
+void countNoCyclePaths(G const& g, Weight* nPaths, unsigned src, unsigned* p_n_back_edges = 0) {
   List<unsigned> topo;
 
-  TopoSort sort(g, &topo);
+  basic_topo_sort<G> sort(g, &topo);
   sort.order_from(src);
   if (p_n_back_edges) *p_n_back_edges = sort.get_n_back_edges();
-  for (unsigned i = 0; i < g.nStates; ++i) nPaths[i] = 0;
+  for (unsigned i = 0, n = g.num_states(); i < n; ++i) nPaths[i] = 0;
   nPaths[src] = 1;
   for (List<unsigned>::const_iterator t = topo.const_begin(), end = topo.const_end(); t != end; ++t) {
     unsigned src = *t;
-    const List<GraphArc>& arcs = g.states[src].arcs;
-    for (List<GraphArc>::const_iterator a = arcs.const_begin(), end = arcs.const_end(); a != end; ++a)
-      nPaths[a->dest] += nPaths[src];
+    for (typename G::arc_iterator a = g.arcs_begin(src), end = g.arcs_end(src); a != end; ++a)
+      nPaths[g.dest(a)] += nPaths[src];
   }
 }
 
-template <class Weight>
-Weight countNoCyclePathsTo(Graph g, unsigned src, unsigned dest, unsigned* p_n_back_edges = 0) {
-  Weight* w = new Weight[g.nStates];
+template <class Weight, class G>
+Weight countNoCyclePathsTo(G const& g, unsigned src, unsigned dest, unsigned* p_n_back_edges = 0) {
+  Weight* w = new Weight[g.num_states()];
   countNoCyclePaths(g, w, src, p_n_back_edges);
   Weight wd = w[dest];
   delete[] w;
@@ -418,6 +798,171 @@ void propagate_paths(Graph g, Weight_get const& getwt, Weight_array& w, unsigned
   propagate_paths_in_order(g, rev.rbegin(), rev.rend(), getwt, w);
 }
 
+struct path_sum_options {
+  double tolerance;  // iterate a cycle until a sweep changes no sum by more than a factor of e^tolerance
+  unsigned max_sweeps;  // per strongly connected component
+  unsigned max_closed_form;  // components of up to this many states are solved by matrix inversion instead
+  path_sum_options() : tolerance(1e-9), max_sweeps(10000), max_closed_form(32) {}
+};
+
+/// inv = (I-a)^-1 for k*k row major a, by Gauss-Jordan elimination with partial pivoting.  \return false
+/// unless the inverse exists and is (up to rounding) nonnegative with diagonal >= 1, as it is exactly when
+/// the sum I+a+a^2+... over paths converges for nonnegative a
+inline bool invert_identity_minus(std::vector<double> const& a, unsigned k, std::vector<double>& inv) {
+  std::vector<double> m(k * k);
+  inv.assign(k * k, 0.);
+  for (unsigned i = 0; i < k; ++i) {
+    for (unsigned j = 0; j < k; ++j) m[i * k + j] = (i == j) - a[i * k + j];
+    inv[i * k + i] = 1;
+  }
+  for (unsigned col = 0; col < k; ++col) {
+    unsigned p = col;
+    for (unsigned r = col + 1; r < k; ++r)
+      if (std::fabs(m[r * k + col]) > std::fabs(m[p * k + col])) p = r;
+    double pivot = m[p * k + col];
+    if (!(std::fabs(pivot) > 1e-300)) return false;
+    if (p != col)
+      for (unsigned j = 0; j < k; ++j) {
+        std::swap(m[p * k + j], m[col * k + j]);
+        std::swap(inv[p * k + j], inv[col * k + j]);
+      }
+    for (unsigned j = 0; j < k; ++j) {
+      m[col * k + j] /= pivot;
+      inv[col * k + j] /= pivot;
+    }
+    for (unsigned r = 0; r < k; ++r) {
+      double f = m[r * k + col];
+      if (r == col || f == 0) continue;
+      for (unsigned j = 0; j < k; ++j) {
+        m[r * k + j] -= f * m[col * k + j];
+        inv[r * k + j] -= f * inv[col * k + j];
+      }
+    }
+  }
+  for (unsigned i = 0; i < k; ++i)
+    for (unsigned j = 0; j < k; ++j) {
+      double x = inv[i * k + j];
+      if (!(x >= -1e-9 * k) || !(x < HUGE_VAL) || (i == j && !(x >= 1 - 1e-9 * k))) return false;
+    }
+  return true;
+}
+
+/// ln potentials pot for a strongly connected component's k*k internal arc weights aw (row major), its
+/// longest (max product) path lengths from its first state, and a = aw scaled to D aw D^-1 (D = diag
+/// e^pot) as doubles: every entry is then at most 1, whatever the weights' magnitudes, and
+/// (I-aw)^-1 = D^-1 (I-a)^-1 D.  fails if a cycle's product exceeds 1 (the paths diverge) or a scaled entry
+/// still underflows a double (too wide a span for the closed form)
+enum scale_result { scale_ok, scale_diverges, scale_underflows };
+template <class Weight>
+scale_result scale_component(std::vector<Weight> const& aw, unsigned k, std::vector<double>& pot,
+                     std::vector<double>& a) {
+  pot.assign(k, -HUGE_VAL);
+  pot[0] = 0;
+  for (unsigned round = 0;; ++round) {  // Bellman-Ford, maximizing
+    bool relaxed = false;
+    for (unsigned i = 0; i < k; ++i)
+      if (pot[i] > -HUGE_VAL)
+        for (unsigned j = 0; j < k; ++j) {
+          Weight const& w = aw[i * k + j];
+          if (!w.isZero() && pot[i] + w.getLn() > pot[j]) {
+            pot[j] = pot[i] + w.getLn();
+            relaxed = true;
+          }
+        }
+    if (!relaxed) break;
+    if (round + 1 >= k) return scale_diverges;
+  }
+  double const min_ln = std::log(std::numeric_limits<double>::min());
+  a.assign(k * k, 0.);
+  for (unsigned i = 0; i < k; ++i)
+    for (unsigned j = 0; j < k; ++j) {
+      Weight const& w = aw[i * k + j];
+      if (w.isZero()) continue;
+      double x = w.getLn() + pot[i] - pot[j];
+      if (x < min_ln) return scale_underflows;
+      a[i * k + j] = std::exp(x);
+    }
+  return scale_ok;
+}
+
+/// sum[s] = the sum, over all paths (cycles included) from s to dest, of the product of the arc weights
+/// wt(handle), for every state s reachable from src (the others are untouched); dest's own sum includes the
+/// empty path, 1.
+/// the log (real) semiring shortest distance, done one strongly connected component at a time in reverse
+/// topological order, so a component only sees the finished sums of the components it leads to: an acyclic
+/// state is one evaluation, a component of up to opt.max_closed_form states is solved in closed form
+/// (sum = (I-A)^-1 b, with A its internal arc weights and b what leaves it; A is first rescaled by
+/// scale_component so weights far from 1 don't over/underflow), and a larger one (or one whose paths
+/// diverge, or whose weights span too wide a range for doubles) is swept (Gauss-Seidel, in Weight) until it
+/// stops changing.  \return the number of components that hadn't converged after opt.max_sweeps (their sums
+/// are the last sweep's)
+template <class Weight, class G, class ArcWeight>
+unsigned sum_paths_to(G const& g, ArcWeight const& wt, unsigned src, unsigned dest, Weight* sum,
+                      path_sum_options const& opt = path_sum_options()) {
+  unsigned n = g.num_states();
+  strong_components scc(n);
+  depth_first_search<G> dfs(g);
+  dfs.search_from(src, scc);
+  unsigned n_unconverged = 0;
+  std::vector<unsigned> local(n);  // a state's index in the current component
+  std::vector<double> a, inv, pot;  // k*k, row major (pot: k)
+  std::vector<Weight> aw, b;
+  unsigned const* states = scc.states.data();
+  for (unsigned c = 0, nc = scc.n_components(); c < nc; ++c) {
+    unsigned const *begin = states + scc.first[c], *end = states + scc.first[c + 1];
+    unsigned k = (unsigned)(end - begin);
+    if (k <= opt.max_closed_form) {
+      for (unsigned i = 0; i < k; ++i) local[begin[i]] = i;
+      aw.assign(k * k, Weight());
+      b.assign(k, Weight());
+      for (unsigned i = 0; i < k; ++i) {
+        unsigned s = begin[i];
+        if (s == dest) b[i] = 1;
+        for (typename G::arc_iterator x = g.arcs_begin(s), e = g.arcs_end(s); x != e; ++x) {
+          unsigned d = g.dest(x);
+          if (scc.component[d] == c)
+            aw[i * k + local[d]] += wt(g.handle(x));
+          else
+            b[i] += wt(g.handle(x)) * sum[d];
+        }
+      }
+      if (scale_component(aw, k, pot, a) == scale_ok && invert_identity_minus(a, k, inv)) {
+        for (unsigned i = 0; i < k; ++i) {
+          Weight si;
+          for (unsigned j = 0; j < k; ++j)
+            if (inv[i * k + j] > 0 && !b[j].isZero())
+              si += Weight(inv[i * k + j]) * Weight(pot[j] - pot[i], ln_weight()) * b[j];
+          sum[begin[i]] = si;
+        }
+        continue;
+      }
+    }
+    for (unsigned const* i = begin; i != end; ++i) sum[*i] = Weight();
+    for (unsigned sweep = 0;; ++sweep) {
+      bool changed = false;
+      for (unsigned const* i = begin; i != end; ++i) {
+        unsigned s = *i;
+        Weight si;
+        if (s == dest) si = 1;
+        for (typename G::arc_iterator x = g.arcs_begin(s), e = g.arcs_end(s); x != e; ++x)
+          si += wt(g.handle(x)) * sum[g.dest(x)];
+        if (!changed) {
+          Weight const& old = sum[s];
+          changed = old.isZero() ? !si.isZero() : std::fabs(si.getLn() - old.getLn()) > opt.tolerance;
+        }
+        sum[s] = si;
+      }
+      if (!changed) break;
+      if (sweep + 1 >= opt.max_sweeps) {
+        ++n_unconverged;
+        break;
+      }
+    }
+  }
+  return n_unconverged;
+}
+
+
 
 }
 
@@ -13,13 +13,22 @@
 // limitations under the License.
 #define BOOST_AUTO_TEST_MAIN
 #define MAIN
+// -DHASHBENCH_GRAEHL_ONLY: only graehl HashTable, FlatHashTable and boost::unordered_map
+#ifndef HASHBENCH_GRAEHL_ONLY
 #define HAVE_GOOGLE_DENSE_HASH_MAP
 #define HAVE_SBMT
+#define HAVE_STDEXT_HASH_MAP
+#endif
 //#include "config.h"
 //#include "ttconfig.hpp"
 
+#ifndef HASHBENCH_GRAEHL_ONLY
 #include <graehl/shared/hash.hpp>
+#endif
 #include <graehl/shared/2hash.h>
+#include <carmel/src/deriv_state.h>
+#include <carmel/src/compose.h>
+#include <carmel/src/state.h>
 #ifdef HAVE_SBMT
 # include <sbmt/hash/oa_hashtable.hpp>
 #endif
@@ -151,6 +160,85 @@ void graehl_hash_bench(std::string banner) {
   graehl_hash_bench<H>();
 }
 
+// carmel's key types, in carmel's access patterns:
+// deriv_state (derivations.h): derivation lattice state.  one table per training example, cleared and
+// refilled; each state is looked up (insert-if-absent) once per incoming arc.
+// TrioKey (compose.h): (lhs state, rhs state, epsilon filter) -> composed state.
+// IOPair (state.h): (input,output) letters -> arcs, per state.
+namespace graehl {
+unsigned TrioKey::gAStates = 5000, TrioKey::gBStates = 5000;  // compose.cc, which sets them per compose
+}
+
+template <class K, class V, class H = boost::hash<K>, class P = std::equal_to<K>, class A = std::allocator<K> >
+struct boost_map : boost::unordered_map<K, V, H, P> {
+  typedef boost::unordered_map<K, V, H, P> base;
+  typedef typename base::iterator find_result_type;
+  explicit boost_map(unsigned sz = 8) : base(sz) {}
+  V* find_second(K const& k) {
+    find_result_type i = this->find(k);
+    return i == this->end() ? NULL : &i->second;
+  }
+};
+
+template <class HT, class Key>
+unsigned insert_if_absent(HT& ht, Key const& k, unsigned id) {
+  return ht.insert(typename HT::value_type(k, id)).first->second;
+}
+
+template <template <class, class, class, class, class> class Map>
+void carmel_key_bench(std::string banner) {
+  using namespace graehl;
+  cout << endl << banner << " on carmel keys" << endl;
+  unsigned sum = 0;
+  cout << "deriv_state: 2000 lattices (cleared) of 40x40 positions x 8 states, 3 probes each ";
+  {
+    typedef Map<deriv_state, unsigned, graehl::hash<deriv_state>, std::equal_to<deriv_state>,
+                std::allocator<char> > HT;
+    HT ht(8);
+    boost::progress_timer t;
+    for (unsigned ex = 0; ex < 2000; ++ex) {
+      ht.clear();
+      unsigned id = 0;
+      for (unsigned i = 0; i < 40; ++i)
+        for (unsigned o = 0; o < 40; ++o)
+          for (unsigned s = 0; s < 8; ++s)
+            for (unsigned probe = 0; probe < 3; ++probe) {
+              unsigned r = insert_if_absent(ht, deriv_state(i, (s * 7 + ex + probe) % 8, o), id);
+              if (r == id) ++id;
+              sum += r;
+            }
+    }
+  }
+  cout << "TrioKey: 5000x5000 product, 1M composed states, built then found ";
+  {
+    typedef Map<TrioKey, unsigned, graehl::hash<TrioKey>, std::equal_to<TrioKey>, std::allocator<char> > HT;
+    HT ht(8);
+    boost::progress_timer t;
+    unsigned x = 1;
+    for (unsigned id = 0; id < (1 << 20); ++id) {
+      x = x * 1103515245 + 12345;
+      insert_if_absent(ht, TrioKey((x >> 8) % 5000, (x >> 3) % 5000, x & 1), id);
+    }
+    x = 1;
+    for (unsigned j = 0; j < (1 << 20); ++j) {
+      x = x * 1103515245 + 12345;
+      if (unsigned* f = ht.find_second(TrioKey((x >> 8) % 5000, (x >> 3) % 5000, x & 1))) sum += *f;
+    }
+  }
+  cout << "IOPair: 100k small per-state tables of 6 letter pairs, 20 lookups each ";
+  {
+    typedef Map<IOPair, unsigned, graehl::hash<IOPair>, std::equal_to<IOPair>, std::allocator<char> > HT;
+    boost::progress_timer t;
+    for (unsigned st = 0; st < 100000; ++st) {
+      HT ht(8);
+      for (unsigned a = 0; a < 6; ++a) insert_if_absent(ht, IOPair(st % 97 + a, a * 13), a);
+      for (unsigned q = 0; q < 20; ++q)
+        if (unsigned* f = ht.find_second(IOPair(st % 97 + q % 8, (q % 8) * 13))) sum += *f;
+    }
+  }
+  cout << "(checksum " << sum << ")" << endl;
+}
+
 //#include <sstream>
 int main(int argc, char *argv[])
 {
@@ -177,19 +265,25 @@ int main(int argc, char *argv[])
   google_hash_bench<google::dense_hash_map<int, int, int_hash<int> > >("google::dense_hash_map<..int_hash...>");
 #endif
 
+#ifdef HAVE_GOOGLE_DENSE_HASH_MAP
   hash_bench<google::sparse_hash_map<int, int> >("google::sparse_hash_map");
+#endif
 
+#ifdef HAVE_SBMT
   hash_bench<sbmt::oa_hash_map<int, int> >("sbmt default hash");
 
   hash_bench<sbmt::oa_hash_map<int, int, int_hash<int> > >("sbmt int_hash");
+#endif
 
   hash_bench<boost::unordered_map<int, int> >("boost default hash");
 
   hash_bench<boost::unordered_map<int, int, int_hash<int> > >("boost int_hash");
 
+#ifdef HAVE_STDEXT_HASH_MAP
   hash_bench<stdext::hash_map<int, int> >("gnu_cxx default hash");
 
   hash_bench<stdext::hash_map<int, int, int_hash<int> > >("gnu_cxx int_hash");
+#endif
   //typedef stdext::hash_map<int,int> H;
   {
     graehl_hash_bench<graehl::HashTable<int, int, int_hash<int> > >("2hash int_hash");
@@ -197,5 +291,15 @@ int main(int argc, char *argv[])
   {
     graehl_hash_bench<graehl::HashTable<int, int> >("2hash default hash");
   }
+  {
+    graehl_hash_bench<graehl::FlatHashTable<int, int, int_hash<int> > >("2hash flat int_hash");
+  }
+  {
+    graehl_hash_bench<graehl::FlatHashTable<int, int> >("2hash flat default hash");
+  }
+
+  carmel_key_bench<graehl::HashTable>("2hash");
+  carmel_key_bench<graehl::FlatHashTable>("2hash flat");
+  carmel_key_bench<boost_map>("boost::unordered_map");
   return 0;
 }
@@ -81,43 +81,6 @@ void buildSidetracksHeap(unsigned state, unsigned pred) {
     pathGraph[state] = prev;
 }  // end of buildSidetracksHeap()
 
-// lG: regular graph
-// rG: shortest path tree -> dest
-// dist: array mapping vertex # -> cost to reach dest
-Graph sidetrackGraph(Graph lG, Graph rG, FLOAT_TYPE* dist)
-// This function creates new GraphState[] and because the
-// return Graph points to this newly created Graph, it is NOT deleted. Therefore
-//  the caller function is responsible for deleting this data.
-//
-
-{
-  Assert(lG.nStates == rG.nStates);
-  unsigned nStates = lG.nStates;
-  GraphState* sub = NEW GraphState[nStates];
-  for (unsigned i = 0; i < nStates; ++i)
-    if (dist[i] != HUGE_VAL) {
-      const List<GraphArc>& la = lG.states[i].arcs;
-      for (List<GraphArc>::const_iterator l = la.const_begin(), end = la.const_end(); l != end; ++l) {
-        Assert(i == l->src);
-
-        const List<GraphArc>& ra = rG.states[i].arcs;
-        for (List<GraphArc>::const_iterator r = ra.const_begin(), end = ra.const_end(); r != end; ++r)
-          if (r->data == l->data) goto short_done;
-        if (dist[l->dest] != HUGE_VAL) {
-          GraphArc w = *l;
-          telescope_cost(w, dist);  // w.weight = w.weight - (dist[i] - dist[w.dest]);
-          sub[i].arcs.push(w);
-        }
-      short_done:
-        ;
-      }
-    }
-  Graph ret;
-  ret.nStates = lG.nStates;
-  ret.states = sub;
-  return ret;
-}
-
 void printTree(GraphHeap* t, unsigned n) {
   unsigned i;
   for (i = 0; i < n; ++i) cout << ' ';
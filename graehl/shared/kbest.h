@@ -101,13 +101,16 @@ inline bool operator<(const EdgePath& l, const EdgePath& r) {
 }
 
 
-Graph sidetrackGraph(Graph lG, Graph rG, FLOAT_TYPE* dist);
 void buildSidetracksHeap(unsigned state,
-                         unsigned pred);  // call depthfirstsearch with this; see usage in kbest.cc
+                         unsigned pred);  // on each state of the reversed shortest path tree, preorder from dest
 void freeAllSidetracks();  // must be called after you buildSidetracksHeap
 void printTree(GraphHeap* t, unsigned n);
 void shortPrintTree(GraphHeap* t);
 
+struct build_sidetracks_heaps : dfs_visitor {
+  void discover(unsigned state, unsigned pred) { buildSidetracksHeap(state, pred); }
+};
+
 // you can inherit from this or just provide the same interface
 struct best_paths_visitor {
   enum make_not_anon_16 { SIDETRACKS_ONLY = 0 };
@@ -148,6 +151,31 @@ static inline void untelescope_cost(GraphArc& w, FLOAT_TYPE* dist) {
   w.weight = w.weight + (dist[w.src] - dist[w.dest]);
 }
 
+/// the arcs of g not in the shortest path tree (tree[s] = the tree arc leaving s), between states that reach
+/// the destination, with costs telescoped by dist, in g's order.  need to delete[] ret.states yourself
+template <class G>
+Graph sidetrackGraph(G const& g, typename G::arc_handle const* tree, FLOAT_TYPE* dist) {
+  unsigned nStates = g.num_states();
+  GraphState* sub = NEW GraphState[nStates];
+  for (unsigned i = 0; i < nStates; ++i)
+    if (dist[i] != HUGE_VAL) {
+      for (typename G::arc_iterator a = g.arcs_begin(i), end = g.arcs_end(i); a != end; ++a) {
+        typename G::arc_handle h = g.handle(a);
+        if (h != tree[i] && dist[g.dest(a)] != HUGE_VAL) sub[i].arcs.push(g.graph_arc(i, h));
+      }
+      List<GraphArc>& arcs = sub[i].arcs;
+      arcs.reverse();
+      // (separately, so the costs telescoped are the stored ones, as with a Graph - otherwise fast-math may
+      // fuse the view's cost computation into this and change the rounding that orders equal-cost paths)
+      for (List<GraphArc>::val_iterator w = arcs.val_begin(), end = arcs.val_end(); w != end; ++w)
+        telescope_cost(*w, dist);  // w.weight = w.weight - (dist[i] - dist[w.dest]);
+    }
+  Graph ret;
+  ret.nStates = nStates;
+  ret.states = sub;
+  return ret;
+}
+
 #ifdef GRAEHL__SINGLE_MAIN
 #include "kbest.cc"
 #else
@@ -182,13 +210,18 @@ void insertShortPath(unsigned src, unsigned dest, Visitor& v, taken_arc_type* cy
 /**
    call v(path) for k best paths in graph using Eppstein's algorithm.
 
+   G, R: graph adaptors (see graph.h) for the graph and its reverse, where rev.forward(R::arc_handle) gives
+   the G::arc_handle it reverses (e.g. Graph and ReversedGraph).  only the shortest path tree and the
+   sidetrack arcs are copied.
+
    \param throw_on_cycle: false => avoid checking for cycles but may loop forever (if cycle cost is
    nonpositive).
 */
-template <class Visitor>
-void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v, bool throw_on_cycle = true) {
-  unsigned nStates = graph.nStates;
-  Assert(nStates > 0 && graph.states);
+template <class G, class R, class Visitor>
+void bestPaths(G const& graph, R const& rev, unsigned src, unsigned dest, unsigned k, Visitor& v,
+               bool throw_on_cycle = true) {
+  unsigned nStates = graph.num_states();
+  Assert(nStates > 0);
   Assert(src < nStates);
   Assert(dest < nStates);
 
@@ -201,7 +234,10 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
 
   FLOAT_TYPE* dist = NEW FLOAT_TYPE[nStates];
   unsigned path_no = 1;
-  Graph shortPathGraph = shortestPathTreeTo(graph, dest, dist);
+  bool acyclic;
+  std::vector<typename G::arc_handle> tree(nStates);
+  Graph shortPathGraph = shortestPathTreeTo(graph, rev, dest, dist, &tree[0], &acyclic);
+  if (acyclic) p_cycle_hash = 0;  // no state that reaches dest is on a cycle, so no path can loop
   FLOAT_TYPE path_cost;
 #ifdef DEBUGKBEST
   Config::debug() << "Shortest path graph (" << src << "->" << dest << "): " << k << '\n' << shortPathGraph;
@@ -220,16 +256,11 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
       for (unsigned i = 0; i < nStates; ++i)
         pathGraph[i] = 0;  // necessary because we may not have reduced (removed states that aren't
       // start->state->finish reachable
-      sidetracks = sidetrackGraph(graph, shortPathGraph, dist);
-      bool* visited = NEW bool[nStates];
-      for (unsigned i = 0; i < nStates; ++i) visited[i] = false;
+      sidetracks = sidetrackGraph(graph, &tree[0], dist);
       //      freeAllSidetracks();
       Graph revPathTree = reverseGraph(shortPathGraph);
-      depthFirstSearch(revPathTree, dest, visited, buildSidetracksHeap);  // depthFirstSearch recursively
-      // calls the function passed as the
-      // last argument (in this case
-      // "buildSidetracksHeap")
-      delete[] visited;
+      build_sidetracks_heaps b;
+      depth_first_search<Graph>(revPathTree).search_from(dest, b);
 
       if (pathGraph[src]) {
 #ifdef DEBUGKBEST
@@ -366,6 +397,13 @@ void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v,
   delete[] dist;
 }
 
+template <class Visitor>
+void bestPaths(Graph graph, unsigned src, unsigned dest, unsigned k, Visitor& v, bool throw_on_cycle = true) {
+  Assert(graph.states);
+  ReversedGraph rev(graph);
+  bestPaths(graph, rev, src, dest, k, v, throw_on_cycle);
+}
+
 
 }
 
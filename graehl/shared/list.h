@@ -20,6 +20,7 @@
 #include <iterator>
 #include <graehl/shared/simple_serialize.hpp>
 #include <graehl/shared/container.hpp>
+#include <graehl/shared/node_pool.hpp>
 
 #ifdef USE_SLIST
 #include <graehl/shared/slist.h>
@@ -173,6 +174,27 @@ class List : public STL_LIST<T, A> {
 #endif
 };
 
+/// List whose nodes come from a per-thread node_pool instead of one malloc each
+/// (-DGRAEHL_POOL_LIST=0 for the default allocator)
+#ifndef GRAEHL_POOL_LIST
+#define GRAEHL_POOL_LIST 1
+#endif
+template <class T>
+struct PoolList {
+#if GRAEHL_POOL_LIST
+  typedef List<T, node_pool_allocator<T> > type;
+#else
+  typedef List<T> type;
+#endif
+};
+
+/// List whose nodes come from the node_arena it's given (set_allocator(&arena), while it's empty), or
+/// else from the per-thread node_pool (even with -DGRAEHL_POOL_LIST=0)
+template <class T>
+struct ArenaList {
+  typedef List<T, arena_allocator<T> > type;
+};
+
 struct GListS {
   template <class T> struct container {
     typedef List<T> type;
@@ -16,18 +16,33 @@
 #pragma once
 
 #ifndef LZ4__INLINE
-#if defined(GRAEHL__SINGLE_MAIN)
+#if defined(GRAEHL__SINGLE_MAIN) || defined(GRAEHL__GZSTREAM_MAIN)
 #define LZ4__INLINE 1
 #else
 #define LZ4__INLINE 0
 #endif
 #endif
 
+/** \file
+
+    the bundled lz4.c block codec, in namespace lz4. the definitions are
+    compiled into the GRAEHL__SINGLE_MAIN translation unit only (or wherever
+    LZ4__INLINE=1); everyone else sees just the (extern "C") declarations.
+*/
+
+// lz4.c's own includes would otherwise land inside namespace lz4
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace lz4 {
 #include "lz4.h"
+#if LZ4__INLINE
 #include "lz4.c"
-
-
+#endif
 }
 
 #endif
@@ -11,145 +11,426 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+/** \file
+
+    boost::iostreams filters for the LZ4 frame format (the .lz4 files written
+    by the lz4 command line tool), over the bundled block codec in lz4.c.
+
+    we write: independent blocks of up to 4MB, content checksum, no block
+    checksums, no content size. we read: any number of concatenated frames
+    (and skippable frames) with independent blocks, with or without block
+    checksums, content checksum and content size. linked blocks (lz4 -BD),
+    dictionary ids and the legacy (lz4 -l) format are rejected with an
+    lz4_error.
+
+    ilz4stream/olz4stream are used just like igzstream/ogzstream (see
+    gzstream.hpp); new_lz4_or_ifstream/new_lz4_or_ofstream pick by filename.
+*/
+
 #ifndef GRAEHL__SHARED__LZ4STREAM_H
 #define GRAEHL__SHARED__LZ4STREAM_H
 #pragma once
 
-#include <iostream>
-#include <fstream>
 #include <graehl/shared/lz4.hpp>
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/device/file.hpp>
-#include <boost/iostreams/stream.hpp>
-#include <boost/iostreams/stream_buffer.hpp>
+#include <graehl/shared/filter_file_stream.hpp>
+#include <boost/iostreams/categories.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/cstdint.hpp>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <sstream>
+#endif
 
 namespace graehl {
 
-struct lz4_filter {};
+struct lz4_error : std::ios_base::failure {
+  explicit lz4_error(std::string const& msg) : std::ios_base::failure("lz4: " + msg) {}
+};
+
+namespace lz4_frame {
 
-// see also file_descriptor_sink, mapped_file_sink
-using boost::iostream::file_sink;
+typedef boost::uint32_t U32;
+typedef boost::uint8_t U8;
 
-using boost::iostream::filtering_istream;
-using boost::iostream::filtering_ostream;
+U32 const kMagic = 0x184D2204;
+U32 const kLegacyMagic = 0x184C2102;
+U32 const kSkippableMagic = 0x184D2A50;  // low 4 bits are free
+U32 const kSkippableMask = 0xFFFFFFF0;
+U32 const kUncompressedBit = 0x80000000;
 
-template <class Impl>
-struct ilz4stream : filtering_istream {
- public:
-  void open(std::string const& name, int open_mode = std::ios::in) {
-    assert(!opened);
-    opened = true;
-    push(file_sink(name, open_mode | std::ios::binary));
+// FLG byte
+U8 const kVersion = 0x40, kVersionMask = 0xC0;
+U8 const kIndependent = 0x20, kBlockChecksum = 0x10, kContentSize = 0x08, kContentChecksum = 0x04,
+         kDictId = 0x01;
+
+/// BD byte 4..7 -> 64KB, 256KB, 1MB, 4MB
+inline std::size_t block_max_size(unsigned bd) {
+  return std::size_t(1) << (8 + 2 * ((bd >> 4) & 7));
+}
+
+inline U32 get_le32(char const* p) {
+  U8 const* u = (U8 const*)p;
+  return u[0] | (U32)u[1] << 8 | (U32)u[2] << 16 | (U32)u[3] << 24;
+}
+
+inline void put_le32(char* p, U32 x) {
+  p[0] = (char)x;
+  p[1] = (char)(x >> 8);
+  p[2] = (char)(x >> 16);
+  p[3] = (char)(x >> 24);
+}
+
+/// streaming XXH32 (seed 0 unless given) - the frame format's checksum
+struct xxh32 {
+  enum { P1 = 2654435761U, P2 = 2246822519U, P3 = 3266489917U, P4 = 668265263U, P5 = 374761393U };
+
+  explicit xxh32(U32 seed = 0) { reset(seed); }
+
+  void reset(U32 seed = 0) {
+    v[0] = seed + P1 + P2;
+    v[1] = seed + P2;
+    v[2] = seed;
+    v[3] = seed - P1;
+    this->seed = seed;
+    total = 0;
+    nmem = 0;
   }
 
-  void close() {
-    if (!opened) return;
-    opened = false;
-    pop();
-    pop();
+  void update(char const* p, std::size_t n) {
+    total += n;
+    if (nmem + n < 16) {
+      std::memcpy(mem + nmem, p, n);
+      nmem += (unsigned)n;
+      return;
+    }
+    char const* end = p + n;
+    if (nmem) {
+      unsigned fill = 16 - nmem;
+      std::memcpy(mem + nmem, p, fill);
+      p += fill;
+      stripe(mem);
+      nmem = 0;
+    }
+    for (; p + 16 <= end; p += 16) stripe(p);
+    nmem = (unsigned)(end - p);
+    std::memcpy(mem, p, nmem);
+  }
+
+  U32 digest() const {
+    U32 h = total >= 16 ? rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18) : seed + P5;
+    h += (U32)total;
+    char const* p = mem, *end = mem + nmem;
+    for (; p + 4 <= end; p += 4) h = rotl(h + get_le32(p) * P3, 17) * P4;
+    for (; p < end; ++p) h = rotl(h + (U8)*p * P5, 11) * P1;
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
   }
-};
 
-template <class Impl>
-struct olz4stream : filtering_istream {
- public:
-  void open(std::string const& name, int open_mode = std::ios::in) {
-    assert(!opened);
-    opened = true;
-    push(file_sink(name, open_mode | std::ios::binary));
+  static U32 of(char const* p, std::size_t n) {
+    xxh32 x;
+    x.update(p, n);
+    return x.digest();
   }
 
-  void close() {
-    if (!opened) return;
-    opened = false;
-    pop();
-    pop();
+ private:
+  static U32 rotl(U32 x, int r) { return (x << r) | (x >> (32 - r)); }
+  static U32 round(U32 acc, U32 in) { return rotl(acc + in * P2, 13) * P1; }
+  void stripe(char const* p) {
+    for (unsigned i = 0; i < 4; ++i) v[i] = round(v[i], get_le32(p + 4 * i));
   }
+  U32 v[4], seed;
+  boost::uint64_t total;
+  char mem[16];
+  unsigned nmem;
 };
 
-#if 0
-// ----------------------------------------------------------------------------
-// Internal classes to implement lz4stream. See below for user classes.
-// ----------------------------------------------------------------------------
-
-class lz4streambuf : public std::streambuf {
-private:
-  static const int bufferSize = 47+(1024*256);    // size of data buff
-  // 47 totals 256 bytes under g++ for ilz4stream at the end.
-
-  gzFile file;               // file handle for compressed file
-  char buffer[bufferSize]; // data buffer
-  bool opened;             // open/close state of stream
-  int mode;               // I/O mode
-
-  int flush_buffer();
-  void handle_gzerror(); // throws exception
-public:
-#if defined(_WIN32) && !defined(CYGWIN) && !defined(EOF)
-	enum {
-		EOF = -1
-	};
-#endif
+}  // lz4_frame
 
-  lz4streambuf() : opened(0) {
-    setp( buffer, buffer + (bufferSize-1));
-    setg( buffer + 4,     // beginning of putback area
-          buffer + 4,     // read position
-          buffer + 4);    // end position
-    // ASSERT: both input & output capabilities will not be used together
-  }
-  virtual bool is_open() { return opened; }
-  lz4streambuf* open( const char* name, int open_mode);
-  lz4streambuf* close();
-  virtual ~lz4streambuf() { close(); } /* in a derived class, if your base class has a virtual destructor, your own destructor is automatically virtual. You might need an explicit destructor for other reasons, but there's no need to redeclare a destructor simply to make sure it is virtual. No matter whether you declare it with the virtual keyword, declare it without the virtual keyword, or don't declare it at all, it's still virtual. */
-
-  virtual int overflow( int c = EOF);
-  virtual int underflow();
-  virtual int sync();
-};
+/// boost::iostreams output filter: bytes in, one LZ4 frame out (on close)
+struct lz4_compressor {
+  typedef char char_type;
+  struct category : boost::iostreams::multichar_output_filter_tag,
+                    boost::iostreams::closable_tag,
+                    boost::iostreams::optimally_buffered_tag {};
 
-class lz4streambase : virtual public std::ios { // because istream, ostream also have virtual public ios base. want it shared.
-protected:
-  lz4streambuf buf;
-public:
-  lz4streambase() { init(&buf); }
-  lz4streambase( const char* name, int open_mode);
-  ~lz4streambase();
-  void open( const char* name, int open_mode);
-  void close();
-  lz4streambuf* rdbuf() { return &buf; }
-};
+  enum { kBlockDescriptor = 0x70 };  // 4MB blocks, same as lz4 cli default
+
+  lz4_compressor() : started(false) {}
+
+  std::streamsize optimal_buffer_size() const { return 64 * 1024; }
+
+  template <class Sink>
+  std::streamsize write(Sink& snk, char const* s, std::streamsize n) {
+    using namespace lz4_frame;
+    if (!started) start(snk);
+    std::size_t const blockmax = block_max_size(kBlockDescriptor);
+    checksum.update(s, (std::size_t)n);
+    for (std::streamsize left = n; left;) {
+      std::size_t take = blockmax - in.size();
+      if ((std::streamsize)take > left) take = (std::size_t)left;
+      in.insert(in.end(), s, s + take);
+      s += take;
+      left -= take;
+      if (in.size() == blockmax) write_block(snk);
+    }
+    return n;
+  }
 
-// ----------------------------------------------------------------------------
-// User classes. Use ilz4stream and olz4stream analogously to ifstream and
-// ofstream respectively. They read and write files based on the gz*
-// function interface of the zlib. Files are compatible with gzip compression.
-// ----------------------------------------------------------------------------
-
-class ilz4stream : public lz4streambase, public std::istream {
-public:
-  ilz4stream() : std::istream(&buf) {}
-  ilz4stream( const char* name, int open_mode = std::ios::in)
-    : lz4streambase( name, std::ios::in | open_mode), std::istream( &buf) {}
-  lz4streambuf* rdbuf() { return lz4streambase::rdbuf(); }
-  void open( const char* name, int open_mode = std::ios::in) {
-    lz4streambase::open( name, open_mode);
+  template <class Sink>
+  void close(Sink& snk) {
+    using namespace lz4_frame;
+    if (!started) start(snk);  // empty input is still a (valid, empty) frame
+    if (!in.empty()) write_block(snk);
+    char end[8];
+    put_le32(end, 0);
+    put_le32(end + 4, checksum.digest());
+    put(snk, end, 8);
+    started = false;
   }
+
+ private:
+  template <class Sink>
+  void start(Sink& snk) {
+    using namespace lz4_frame;
+    char header[7];
+    put_le32(header, kMagic);
+    header[4] = (char)(kVersion | kIndependent | kContentChecksum);
+    header[5] = (char)kBlockDescriptor;
+    header[6] = (char)(xxh32::of(header + 4, 2) >> 8);
+    put(snk, header, 7);
+    checksum.reset();
+    in.reserve(block_max_size(kBlockDescriptor));
+    started = true;
+  }
+
+  template <class Sink>
+  void write_block(Sink& snk) {
+    using namespace lz4_frame;
+    int const n = (int)in.size();
+    out.resize(4 + lz4::LZ4_compressBound(n));
+    int z = lz4::LZ4_compress(&in[0], &out[4], n);
+    if (z > 0 && z < n)
+      put_le32(&out[0], (U32)z);
+    else {  // incompressible: store
+      put_le32(&out[0], (U32)n | kUncompressedBit);
+      std::memcpy(&out[4], &in[0], n);
+      z = n;
+    }
+    put(snk, &out[0], 4 + z);
+    in.clear();
+  }
+
+  template <class Sink>
+  static void put(Sink& snk, char const* p, std::streamsize n) {
+    while (n > 0) {
+      std::streamsize w = boost::iostreams::write(snk, p, n);
+      if (w <= 0) throw lz4_error("write failed");
+      p += w;
+      n -= w;
+    }
+  }
+
+  bool started;
+  std::vector<char> in, out;
+  lz4_frame::xxh32 checksum;
 };
 
-class olz4stream : public lz4streambase, public std::ostream {
-public:
-  olz4stream() : std::ostream( &buf) {}
-  olz4stream( const char* name, int mode =  std::ios::out)
-    : lz4streambase( name, std::ios::out | mode), std::ostream( &buf) {}
-  lz4streambuf* rdbuf() { return lz4streambase::rdbuf(); }
-  void open( const char* name, int open_mode = std::ios::out) {
-    lz4streambase::open( name, open_mode);
+/// boost::iostreams input filter: concatenated LZ4 frames in, bytes out
+struct lz4_decompressor {
+  typedef char char_type;
+  struct category : boost::iostreams::multichar_input_filter_tag,
+                    boost::iostreams::closable_tag,
+                    boost::iostreams::optimally_buffered_tag {};
+
+  lz4_decompressor() : in_frame(false), flags(0), block_max(0), pos(0) {}
+
+  std::streamsize optimal_buffer_size() const { return 64 * 1024; }
+
+  template <class Source>
+  std::streamsize read(Source& src, char* s, std::streamsize n) {
+    std::streamsize got = 0;
+    while (got < n) {
+      if (pos == out.size()) {
+        if (!next_block(src)) break;
+        continue;
+      }
+      std::size_t take = out.size() - pos;
+      if ((std::streamsize)take > n - got) take = (std::size_t)(n - got);
+      std::memcpy(s + got, &out[pos], take);
+      pos += take;
+      got += take;
+    }
+    return got ? got : -1;
+  }
+
+  template <class Source>
+  void close(Source&) {
+    in_frame = false;
+    out.clear();
+    pos = 0;
+  }
+
+ private:
+  /// refill out (possibly with nothing, e.g. at a frame boundary); false at clean EOF
+  template <class Source>
+  bool next_block(Source& src) {
+    using namespace lz4_frame;
+    out.clear();
+    pos = 0;
+    char b[8];
+    if (!in_frame) return start_frame(src);
+    need(src, b, 4, "block size");
+    U32 size = get_le32(b);
+    if (!size) {
+      if (flags & kContentChecksum) {
+        need(src, b, 4, "content checksum");
+        if (get_le32(b) != checksum.digest()) throw lz4_error("content checksum mismatch");
+      }
+      in_frame = false;
+      return true;
+    }
+    bool const stored = size & kUncompressedBit;
+    size &= ~kUncompressedBit;
+    if (size > block_max) throw lz4_error("block larger than the frame's maximum block size (corrupt?)");
+    in.resize(size);
+    need(src, &in[0], size, "block");
+    if (flags & kBlockChecksum) {
+      need(src, b, 4, "block checksum");
+      if (get_le32(b) != xxh32::of(&in[0], size)) throw lz4_error("block checksum mismatch");
+    }
+    if (stored)
+      out.swap(in);
+    else {
+      out.resize(block_max);
+      int z = lz4::LZ4_uncompress_unknownOutputSize(&in[0], &out[0], (int)size, (int)block_max);
+      if (z < 0) throw lz4_error("corrupt compressed block");
+      out.resize(z);
+    }
+    if (flags & kContentChecksum) checksum.update(&out[0], out.size());
+    return true;
+  }
+
+  template <class Source>
+  bool start_frame(Source& src) {
+    using namespace lz4_frame;
+    char h[16];
+    std::streamsize got = get(src, h, 4);
+    if (got == 0) return false;
+    if (got != 4) throw lz4_error("truncated frame magic number");
+    U32 const magic = get_le32(h);
+    if ((magic & kSkippableMask) == kSkippableMagic) {
+      need(src, h, 4, "skippable frame size");
+      in.resize(get_le32(h));
+      if (!in.empty()) need(src, &in[0], in.size(), "skippable frame");
+      return true;
+    }
+    if (magic == kLegacyMagic)
+      throw lz4_error("legacy format (lz4 -l) not supported; recompress without -l");
+    if (magic != kMagic) throw lz4_error("not an LZ4 frame (bad magic number)");
+    need(src, h, 2, "frame descriptor");
+    flags = (U8)h[0];
+    unsigned const bd = (U8)h[1];
+    if ((flags & kVersionMask) != kVersion) throw lz4_error("unsupported frame version");
+    if (!(flags & kIndependent))
+      throw lz4_error("linked blocks (lz4 -BD) not supported; recompress with independent blocks");
+    if (flags & kDictId) throw lz4_error("frames with a dictionary id are not supported");
+    if (bd < 0x40 || bd > 0x70 || (bd & 0x8F)) throw lz4_error("bad block descriptor");
+    std::size_t len = 2;
+    if (flags & kContentSize) {
+      need(src, h + 2, 8, "content size");
+      len += 8;
+    }
+    char hc;
+    need(src, &hc, 1, "header checksum");
+    if ((U8)hc != (U8)(xxh32::of(h, len) >> 8)) throw lz4_error("frame header checksum mismatch");
+    block_max = block_max_size(bd);
+    checksum.reset();
+    in_frame = true;
+    return true;
   }
+
+  /// as many of n bytes as src has left
+  template <class Source>
+  static std::streamsize get(Source& src, char* p, std::streamsize n) {
+    std::streamsize got = 0;
+    while (got < n) {
+      std::streamsize r = boost::iostreams::read(src, p + got, n - got);
+      if (r < 0) break;
+      got += r;
+    }
+    return got;
+  }
+
+  template <class Source>
+  static void need(Source& src, char* p, std::streamsize n, char const* what) {
+    if (get(src, p, n) != n) throw lz4_error(std::string("truncated ") + what);
+  }
+
+  bool in_frame;
+  unsigned flags;
+  std::size_t block_max;
+  std::vector<char> in, out;
+  std::size_t pos;
+  lz4_frame::xxh32 checksum;
 };
 
-#endif
+typedef filter_file_stream<lz4_decompressor, boost::iostreams::input, std::ifstream> ilz4stream;
+typedef filter_file_stream<lz4_compressor, boost::iostreams::output, std::ofstream> olz4stream;
+
+inline bool lz4_suffix(std::string const& name) {
+  return name.size() >= 4 && !name.compare(name.size() - 4, 4, ".lz4");
+}
 
+/// new ilz4stream if name ends in .lz4, else new ifstream. check !*result for open failure
+inline std::istream* new_lz4_or_ifstream(std::string const& name) {
+  if (lz4_suffix(name)) return new ilz4stream(name.c_str());
+  return new std::ifstream(name.c_str());
+}
+
+/// new olz4stream if name ends in .lz4, else new ofstream. check !*result for open failure
+inline std::ostream* new_lz4_or_ofstream(std::string const& name) {
+  if (lz4_suffix(name)) return new olz4stream(name.c_str());
+  return new std::ofstream(name.c_str());
+}
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(TEST_LZ4_FRAME) {
+  namespace io = boost::iostreams;
+  using namespace lz4_frame;
+  BOOST_CHECK_EQUAL(xxh32::of("", 0), 0x02CC5D05U);
+  BOOST_CHECK_EQUAL(xxh32::of("abc", 3), 0x32D153FFU);
+  std::string text;
+  for (unsigned i = 0; i < 200000; ++i) text += (char)('a' + i * i % 7);
+  std::string z;
+  {
+    io::filtering_ostream o;
+    o.push(lz4_compressor());
+    o.push(io::back_inserter(z));
+    o << text;
+  }
+  BOOST_CHECK(z.size() < text.size() / 4);
+  BOOST_CHECK_EQUAL(get_le32(&z[0]), kMagic);
+  z += z;  // concatenated frames decode to concatenated content
+  io::filtering_istream i;
+  i.push(lz4_decompressor());
+  i.push(io::array_source(z.data(), z.size()));
+  std::ostringstream back;
+  back << i.rdbuf();
+  BOOST_CHECK(back.str() == text + text);
+}
+#endif
 
 }
 
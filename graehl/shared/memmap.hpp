@@ -386,4 +386,6 @@ BOOST_AUTO_TEST_CASE( TEST_MEMMAP )
 #endif
 
 }
+
+#include <boost/config/abi_suffix.hpp>  // pops abi_prefix.hpp
 #endif
@@ -0,0 +1,360 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    node_pool_allocator: STL allocator for node containers (std::list, slist)
+    that takes single nodes from a per-thread free list carved out of 64KB
+    blocks, so building and destroying a list costs no malloc/free per node.
+
+    a node freed by another thread joins that thread's free list. when a
+    thread exits its free nodes are handed to the next thread that runs out.
+    nodes allocated or freed after the thread's cache is destroyed (e.g. by
+    another thread_local's destructor, or in static destruction) go straight
+    to (or come from) that shared list instead.
+
+    tradeoff: blocks are never returned to the OS: a cleared container's
+    nodes go back on the free list, to be reused by the next one.  so the
+    process keeps its peak node memory until exit.  build with
+    -DGRAEHL_POOL_LIST=0 (see list.h) for the default allocator instead.
+
+    node_arena / arena_allocator: for containers that die together (a WFST's
+    arc lists), nodes from 64KB blocks owned by the arena, which frees them
+    all at once in release() or its destructor.  an arena_allocator not
+    given an arena is a node_pool_allocator.
+*/
+
+#ifndef GRAEHL__SHARED__NODE_POOL_HPP
+#define GRAEHL__SHARED__NODE_POOL_HPP
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#include <list>
+#include <thread>
+#endif
+
+namespace graehl {
+
+template <std::size_t Size, std::size_t Align>
+struct node_pool {
+  enum {
+    kAlign = Align > sizeof(void*) ? Align : sizeof(void*),
+    kSize = (Size + kAlign - 1) / kAlign * kAlign,  // room for the free list link
+    kBlockBytes = 64 * 1024,
+    kPerBlock = kBlockBytes / kSize ? kBlockBytes / kSize : 1
+  };
+
+  static void* allocate() {
+    cache* pc = local();
+    if (!pc) return allocate_shared();
+    cache& c = *pc;
+    if (void* p = c.free) {
+      c.free = *(void**)p;
+      return p;
+    }
+    if (c.next == c.end) {
+      refill(c);
+      return allocate();
+    }
+    void* p = c.next;
+    c.next += kSize;
+    return p;
+  }
+
+  static void deallocate(void* p) {
+    cache* c = local();
+    if (!c) return deallocate_shared(p);
+    *(void**)p = c->free;
+    c->free = p;
+  }
+
+ private:
+  struct cache {
+    void* free;
+    char* next;
+    char* end;
+    bool& destroyed;
+    explicit cache(bool& destroyed) : free(), next(), end(), destroyed(destroyed) {}
+    ~cache() {
+      destroyed = true;
+      for (; next != end; next += kSize) deallocate_to(next);
+      if (!free) return;
+      void* last = free;
+      while (*(void**)last) last = *(void**)last;
+      std::lock_guard<std::mutex> lock(shared().mutex);
+      *(void**)last = shared().orphans;
+      shared().orphans = free;
+    }
+    void deallocate_to(void* p) {
+      *(void**)p = free;
+      free = p;
+    }
+  };
+
+  /// free lists left behind by exited threads
+  struct orphanage {
+    std::mutex mutex;
+    void* orphans;
+    orphanage() : orphans() {}
+  };
+
+  /// this thread's cache, or NULL once it's been destroyed (at thread exit)
+  static cache* local() {
+    static thread_local bool destroyed;  // trivially destructible, so readable after c is gone
+    if (destroyed) return 0;
+    static thread_local cache c(destroyed);
+    return &c;
+  }
+
+  static orphanage& shared() {
+    static orphanage* o = new orphanage;  // never destroyed: nodes may be freed during static destruction
+    return *o;
+  }
+
+  // without a cache: single nodes to and from the orphan list (a node is never given to operator delete,
+  // since it may be inside a block)
+  static void* allocate_shared() {
+    {
+      std::lock_guard<std::mutex> lock(shared().mutex);
+      if (void* p = shared().orphans) {
+        shared().orphans = *(void**)p;
+        return p;
+      }
+    }
+    return ::operator new(kSize);
+  }
+  static void deallocate_shared(void* p) {
+    std::lock_guard<std::mutex> lock(shared().mutex);
+    *(void**)p = shared().orphans;
+    shared().orphans = p;
+  }
+
+  static void refill(cache& c) {
+    {
+      std::lock_guard<std::mutex> lock(shared().mutex);
+      if (shared().orphans) {
+        c.free = shared().orphans;
+        shared().orphans = 0;
+        return;
+      }
+    }
+    c.next = (char*)::operator new(kPerBlock * kSize);
+    c.end = c.next + kPerBlock * kSize;
+  }
+};
+
+template <class T>
+struct node_pool_allocator {
+  typedef T value_type;
+  typedef node_pool<sizeof(T), alignof(T)> pool;
+  template <class U>
+  struct rebind {
+    typedef node_pool_allocator<U> other;
+  };
+
+  node_pool_allocator() {}
+  template <class U>
+  node_pool_allocator(node_pool_allocator<U> const&) {}
+
+  T* allocate(std::size_t n) { return (T*)(n == 1 ? pool::allocate() : ::operator new(n * sizeof(T))); }
+  void deallocate(T* p, std::size_t n) {
+    if (n == 1)
+      pool::deallocate(p);
+    else
+      ::operator delete((void*)p);
+  }
+
+  template <class U>
+  bool operator==(node_pool_allocator<U> const&) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(node_pool_allocator<U> const&) const {
+    return false;
+  }
+};
+
+/// single-size nodes carved from blocks the arena owns.  nodes of any other size (than the first asked
+/// for) are passed to operator new.  not thread safe: allocate and deallocate from one thread at a time
+class node_arena {
+ public:
+  enum { kAlign = alignof(std::max_align_t), kBlockBytes = 64 * 1024 };
+  node_arena() : free_(), next_(), end_(), size_(), blocks_(), n_blocks_() {}
+  ~node_arena() { release(); }
+
+  void* allocate(std::size_t size) {
+    size = round_up(size);
+    if (size != size_) {
+      if (size_) return ::operator new(size);
+      size_ = size;
+    }
+    if (void* p = free_) {
+      free_ = *(void**)p;
+      return p;
+    }
+    if (end_ - next_ < (std::ptrdiff_t)size) refill();
+    void* p = next_;
+    next_ += size;
+    return p;
+  }
+
+  void deallocate(void* p, std::size_t size) {
+    if (round_up(size) != size_) return ::operator delete(p);
+    *(void**)p = free_;
+    free_ = p;
+  }
+
+  /// frees every block at once: all the nodes had better be dead already
+  void release() {
+    while (void* b = blocks_) {
+      blocks_ = *(void**)b;
+      ::operator delete(b);
+    }
+    free_ = 0;
+    next_ = end_ = 0;
+    n_blocks_ = 0;
+  }
+
+  std::size_t bytes() const { return n_blocks_ * (std::size_t)kBlockBytes; }
+
+ private:
+  void* free_;
+  char* next_;
+  char* end_;
+  std::size_t size_;
+  void* blocks_;  // each block starts (kAlign bytes) with a pointer to the one allocated before it
+  std::size_t n_blocks_;
+
+  static std::size_t round_up(std::size_t size) {
+    if (size < sizeof(void*)) size = sizeof(void*);
+    return (size + kAlign - 1) / kAlign * kAlign;
+  }
+  void refill() {
+    std::size_t const bytes = size_ + kAlign > kBlockBytes ? size_ + kAlign : kBlockBytes;
+    char* b = (char*)::operator new(bytes);
+    *(void**)b = blocks_;
+    blocks_ = b;
+    ++n_blocks_;
+    next_ = b + kAlign;
+    end_ = b + bytes;
+  }
+  node_arena(node_arena const&);
+  void operator=(node_arena const&);
+};
+
+/// single nodes from *arena, or if none, as node_pool_allocator.  a container's allocator may change
+/// (e.g. slist::set_allocator) only while it's empty
+template <class T>
+struct arena_allocator {
+  typedef T value_type;
+  template <class U>
+  struct rebind {
+    typedef arena_allocator<U> other;
+  };
+
+  node_arena* arena;
+
+  arena_allocator(node_arena* arena = 0) : arena(arena) {}
+  template <class U>
+  arena_allocator(arena_allocator<U> const& o) : arena(o.arena) {}
+
+  T* allocate(std::size_t n) {
+    return n == 1 && arena ? (T*)arena->allocate(sizeof(T)) : node_pool_allocator<T>().allocate(n);
+  }
+  void deallocate(T* p, std::size_t n) {
+    if (n == 1 && arena)
+      arena->deallocate(p, sizeof(T));
+    else
+      node_pool_allocator<T>().deallocate(p, n);
+  }
+
+  template <class U>
+  bool operator==(arena_allocator<U> const& o) const {
+    return arena == o.arena;
+  }
+  template <class U>
+  bool operator!=(arena_allocator<U> const& o) const {
+    return arena != o.arena;
+  }
+};
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(TEST_NODE_POOL) {
+  typedef std::list<int, node_pool_allocator<int> > L;
+  L l;
+  for (int i = 0; i < 100000; ++i) l.push_back(i);
+  void* last = &l.back();
+  l.clear();
+  l.push_back(1);
+  BOOST_CHECK_EQUAL((void*)&l.front(), last);  // the free list is LIFO
+  L moved;
+  std::thread t([&moved] {
+    L mine;
+    for (int i = 0; i < 1000; ++i) mine.push_back(i);
+    moved.splice(moved.end(), mine);
+    L spare(10, 7);  // freed at thread exit; its nodes go to the orphan list
+  });
+  t.join();
+  BOOST_CHECK_EQUAL(moved.size(), 1000u);
+  BOOST_CHECK_EQUAL(moved.back(), 999);
+  moved.clear();
+  l.assign(3, 5);
+  BOOST_CHECK_EQUAL(l.size(), 3u);
+  std::thread late([] {
+    // constructed before the pool's cache, so destroyed after it: frees into the orphan list
+    static thread_local struct holder {
+      L* l;
+      ~holder() {
+        l->push_back(2);
+        delete l;
+      }
+    } h = {new L};
+    for (int i = 0; i < 100; ++i) h.l->push_back(i);
+  });
+  late.join();
+  L after(200, 1);
+  BOOST_CHECK_EQUAL(after.size(), 200u);
+}
+
+BOOST_AUTO_TEST_CASE(TEST_NODE_ARENA) {
+  node_arena arena;
+  typedef std::list<int, arena_allocator<int> > L;
+  {
+    L l((arena_allocator<int>(&arena)));
+    for (int i = 0; i < 100000; ++i) l.push_back(i);
+    BOOST_CHECK(arena.bytes() >= 100000 * 2 * sizeof(void*));
+    void* last = &l.back();
+    l.pop_back();
+    l.push_back(1);
+    BOOST_CHECK_EQUAL((void*)&l.back(), last);  // the free list is LIFO
+    L pooled;  // no arena: the per-thread pool
+    pooled.push_back(2);
+    BOOST_CHECK_EQUAL(pooled.front(), 2);
+  }
+  arena.release();
+  BOOST_CHECK_EQUAL(arena.bytes(), 0u);
+  L again((arena_allocator<int>(&arena)));
+  again.assign(3, 5);
+  BOOST_CHECK_EQUAL(again.size(), 3u);
+  BOOST_CHECK_EQUAL(arena.bytes(), (std::size_t)node_arena::kBlockBytes);
+}
+#endif
+
+}
+
+#endif
@@ -82,7 +82,11 @@ GCC_DIAG_IGNORE(attributes)
 #include <boost/optional.hpp>
 
 #include <ctime>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <graehl/shared/os.hpp>
+#include <graehl/shared/simple_serialize.hpp>
 
 #ifdef GRAEHL_TEST
 #include <graehl/shared/test.hpp>
@@ -168,6 +172,36 @@ inline void set_random_seed(random_seed_type value = default_random_seed()) {
 #endif
 }
 
+/// exact (text) snapshot of the global generator's state, e.g. for resuming a checkpointed run
+inline std::string random_state() {
+#if GRAEHL_GLOBAL_RANDOM_USE_STD
+  throw std::runtime_error("can't save std::rand state (GRAEHL_GLOBAL_RANDOM_USE_STD)");
+#else
+  std::ostringstream o;
+  o << g_random01.engine();
+  return o.str();
+#endif
+}
+
+inline void set_random_state(std::string const& state) {
+#if GRAEHL_GLOBAL_RANDOM_USE_STD
+  throw std::runtime_error("can't restore std::rand state (GRAEHL_GLOBAL_RANDOM_USE_STD)");
+#else
+  std::istringstream i(state);
+  i >> g_random01.engine();
+  if (!i) throw std::runtime_error("bad saved random generator state");
+#endif
+}
+
+/// simple_serialize the global generator's state
+template <class A>
+void serialize_random_state(A& a) {
+  std::string state;
+  if (A::is_saving) state = random_state();
+  serialize_container(a, state);
+  if (A::is_loading) set_random_state(state);
+}
+
 
 // FIXME: use boost random? and can't necessarily port executable across platforms with different rand syscall
 // :(
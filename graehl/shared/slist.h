@@ -481,6 +481,12 @@ class slist_shared :
   {
     return *this;
   }
+  /// only while empty (nodes go back to the allocator they came from)
+  void set_allocator(allocator_type const& a)
+  {
+    slist_assert(!head);
+    allocator() = a;
+  }
   inline Node *alloc()
   {
     return allocator().allocate(1);
@@ -517,6 +523,7 @@ class slist_shared :
   void swap(self_type& x)
   {
     std::swap(head, x.head);
+    std::swap(allocator(), x.allocator());
   }
 
   // default operator =: shallow
@@ -83,6 +83,32 @@ BOOST_AUTO_UNIT_TEST( alphabet )
   b.verify();
 
 }
+
+BOOST_AUTO_UNIT_TEST( arena_alphabet )
+{
+  Alphabet<StringKey, ArenaStringPool> in("*e*", "*"), out("*e*", "*", in), other;
+  std::string tmp("shared");
+  unsigned i = in.index_of(tmp), o = out.index_of(StringKey("shared"));
+  tmp = "clobbered";
+  BOOST_CHECK(in[i] == "shared" && in[i] == out[o]);
+  BOOST_CHECK(in[i].c_str() == out[o].c_str()); // out interns into in's arena
+  BOOST_CHECK(in[0].c_str() == out[0].c_str() && in.string_pool().strings().size() == 3);
+  BOOST_CHECK(other[other.index_of(std::string("shared"))].c_str() != in[i].c_str());
+  {
+    Alphabet<StringKey, ArenaStringPool> copy(in);
+    BOOST_CHECK(copy[i].c_str() == in[i].c_str()); // copies share the arena too
+  }
+  BOOST_CHECK(in[i] == "shared"); // still there after the copy is gone
+  in.clear();
+  BOOST_CHECK(out[o] == "shared"); // out still holds the arena in detached from
+  in.index_of(std::string("shared"));
+  BOOST_CHECK(in(42) == "42" && *in.find("42") == 42);
+  unsigned e = in.index_of(std::string(""));
+  BOOST_CHECK(!in[e].isDefault() && in[e] == "");
+  in.clear();
+  BOOST_CHECK(in.size() == 0 && !in.find("shared"));
+  BOOST_CHECK(in[in.index_of(std::string("again"))] == "again");
+}
 #ifdef BENCH
 #include <boost/progress.hpp>
 #endif
@@ -23,7 +23,9 @@
 #include <graehl/shared/random.hpp>
 
 #include <graehl/shared/stringkey.h>
+#include <graehl/shared/string_arena.hpp>
 #include <boost/config.hpp>
+#include <boost/shared_ptr.hpp>
 
 #ifdef GRAEHL_TEST
 #include <graehl/shared/test.hpp>
@@ -66,6 +68,7 @@ class StringPool {
     s.kill();
 #endif
   }
+  static void clear() {}
   ~StringPool() {
 #ifdef STRINGPOOL
     for (HT::iterator i = counts.begin(); i != counts.end(); ++i) ((StringKey&)i->first).kill();
@@ -73,11 +76,32 @@ class StringPool {
   }
 };
 
+/// interns into a refcounted StringArena: one copy of each distinct string, freed all at once when the last
+/// pool sharing the arena goes away rather than one at a time.  copies share the arena (so a copied alphabet,
+/// or a machine's input and output alphabets, intern each string once); clear() detaches onto a fresh one
+class ArenaStringPool {
+  boost::shared_ptr<StringArena> arena;
+  ArenaStringPool& operator=(ArenaStringPool const&);  // not assignable
+
+ public:
+  BOOST_STATIC_CONSTANT(bool, is_noop = 0);
+  ArenaStringPool() : arena(new StringArena) {}
+  // keeps "" (unlike the default StringKey) a distinct interned string
+  StringKey borrow(StringKey s) {
+    if (s.isDefault()) return s;
+    return StringKey(arena->c_str(arena->intern(s.str)));
+  }
+  void giveBack(StringKey) {}
+  void clear() { arena.reset(new StringArena); }
+  StringArena const& strings() const { return *arena; }
+};
+
 template <class Sym>
 struct NoStringPool {
   BOOST_STATIC_CONSTANT(bool, is_noop = 1);
   static Sym borrow(const Sym& s) { return s; }
   static void giveBack(const Sym& s) {}
+  static void clear() {}
 };
 
 
@@ -92,6 +116,7 @@ class Alphabet {
   dynamic_array<Sym> names;
   typedef HashTable<Sym, unsigned> SymIndex;
   SymIndex ht;
+  StrPool pool;  // owns the names' storage (if not is_noop)
 
  public:
   const dynamic_array<Sym>& symbols() const { return names; }
@@ -101,14 +126,16 @@ class Alphabet {
     add(c, 0);
     add(d, 1);
   }
+  /// shares (a copy of) o's string pool, e.g. so a machine's output alphabet interns into its input's arena
+  Alphabet(Sym c, Sym d, Alphabet const& o) : pool(o.pool) {
+    add(c, 0);
+    add(d, 1);
+  }
 
-  Alphabet(const Alphabet& a) {
-#ifdef NODELETE
-    memcpy(this, &a, sizeof(Alphabet));
-#else
+  Alphabet(const Alphabet& a) : pool(a.pool) {
     for (unsigned i = 0; i < a.names.size(); ++i) add(a.names[i], i);
-#endif
   }
+  StrPool const& string_pool() const { return pool; }
   template <class S, class StrP>
   bool operator==(const Alphabet<S, StrP>& r) const {
     return r.symbols() == symbols();
@@ -163,7 +190,7 @@ class Alphabet {
     Config::debug() << "\nadding to alphabet: " << s;
 #endif
 
-    if (!StrPool::is_noop) s = StrPool::borrow(s);
+    if (!StrPool::is_noop) s = pool.borrow(s);
     // ht[s]=names.size();
     Assert(names.size() == n);
     graehl::add(ht, s, names.size());
@@ -188,7 +215,7 @@ class Alphabet {
       if (StrPool::is_noop)
         names.push_back(s);
       else
-        names.push_back(*const_cast<Sym*>(&(it.first->first)) = StrPool::borrow(
+        names.push_back(*const_cast<Sym*>(&(it.first->first)) = pool.borrow(
                             s));  // might seem naughty, (can't change hash table keys) but it's still equal.
     }
 #ifdef DEBUG_STRINGPOOL
@@ -207,7 +234,7 @@ class Alphabet {
     if (names.at_grow(iNum).isDefault()) {
       // decimal string for unsigned
       Sym k = static_utoa(iNum);
-      if (!StrPool::is_noop) k = StrPool::borrow(k);
+      if (!StrPool::is_noop) k = pool.borrow(k);
       names[iNum] = k;
       ht[k] = iNum;
       Assert(names.size() > iNum);
@@ -231,7 +258,7 @@ class Alphabet {
         Config::debug() << "removing from alphabet: " << s << std::endl;
 #endif
 #ifndef NODELETE
-        if (!StrPool::is_noop) StrPool::giveBack(s);
+        if (!StrPool::is_noop) pool.giveBack(s);
 #endif
       } else {
         unsigned& rI = ht.find(s)->second;
@@ -246,6 +273,7 @@ class Alphabet {
       giveBackAll();
       names.clear();
       ht.clear();
+      pool.clear();
     }
   }
   /// sets aMap[0..size()) such that o[aMap[i]] == (*this)[i] or else aMap[i]
@@ -265,7 +293,7 @@ class Alphabet {
     if (!StrPool::is_noop)
       for (typename SymArray::iterator i = names.begin(), end = names.end(); i != end; ++i)
         //  if ( *i != Sym::empty )
-        StrPool::giveBack(*i);
+        pool.giveBack(*i);
 #endif
   }
 };
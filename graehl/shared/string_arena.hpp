@@ -0,0 +1,319 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    StringArena: interned strings bump-allocated in chunks (growing from 4KB
+    to 1MB, so a small alphabet's arena stays small), each named by a 32-bit
+    handle (chunk number << 20 | offset in the chunk) and stored with its
+    precomputed hash and length:
+
+      handle -> [uint32 hash][uint32 length][chars...]['\0'] (4-byte aligned)
+
+    strings aren't freed one at a time; the whole arena is released at once
+    (clear() or destruction), so an arena should belong to one short or
+    long lived owner (e.g. a machine's alphabets) rather than the whole process.
+
+    the index is open addressing over (hash, handle) pairs, so probes and
+    rehashing never touch (or rehash) the strings themselves.
+
+    save() writes index and strings to one file; map() mmaps such a file
+    read-only and interns on top of it (the index is copied only on the first
+    new string), so a saved symbol table "loads" without reading or hashing.
+    files aren't portable across endianness (map() checks the build).
+*/
+
+#ifndef GRAEHL__SHARED__STRING_ARENA_HPP
+#define GRAEHL__SHARED__STRING_ARENA_HPP
+#pragma once
+
+#include <graehl/shared/memmap.hpp>
+#include <graehl/shared/hash_murmur.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef GRAEHL_TEST
+#include <graehl/shared/test.hpp>
+#include <cstdio>
+#endif
+
+namespace graehl {
+
+struct StringArena : boost::noncopyable {
+  typedef boost::uint32_t handle;  // 0 means none
+  enum {
+    kChunkBits = 20,
+    kChunkSize = 1 << kChunkBits,
+    kFirstChunkSize = 4096,
+    kEntryHeader = 8,
+    kFirstIndexSize = 16
+  };
+
+  StringArena() { init(); }
+  ~StringArena() { free_chunks(); }
+
+  static boost::uint32_t hash(char const* s, std::size_t len) { return MurmurHash(s, (int)len); }
+
+  handle find(char const* s, std::size_t len) const { return find(s, len, hash(s, len)); }
+  handle find(char const* s) const { return find(s, std::strlen(s)); }
+
+  handle intern(char const* s) { return intern(s, std::strlen(s)); }
+  handle intern(char const* s, std::size_t len) {
+    boost::uint32_t const h = hash(s, len);
+    std::size_t i = h & mask;
+    for (; index[i].h; i = (i + 1) & mask)
+      if (index[i].hash == h && equal(index[i].h, s, len)) return index[i].h;
+    if (index != owned_index.data()) {  // first insert on top of a mapped index
+      own_index();
+      return intern(s, len);
+    }
+    handle const x = alloc(s, len, h);
+    index[i].hash = h;
+    index[i].h = x;
+    if (++n * 4 >= (mask + 1) * 3) grow();
+    return x;
+  }
+
+  char const* c_str(handle x) const { return entry(x) + kEntryHeader; }
+  std::size_t length(handle x) const { return header(x, 1); }
+  boost::uint32_t hash(handle x) const { return header(x, 0); }
+
+  /// number of distinct strings
+  std::size_t size() const { return n; }
+  /// bytes allocated for strings (including headers and chunk-end slack; not counting a map()ped file)
+  std::size_t bytes() const { return allocated; }
+
+  /// frees every string (all handles and c_str() become invalid)
+  void clear() { free_chunks(); }
+
+  void save(std::string const& path) const {
+    std::ofstream o(path.c_str(), std::ios::binary);
+    file_header f;
+    std::memcpy(f.magic, kMagic(), sizeof(f.magic));
+    f.chunk_bits = kChunkBits;
+    f.check = hash("graehl", 6);
+    f.n = (boost::uint32_t)n;
+    f.n_chunks = (boost::uint32_t)chunks.size();
+    f.index_size = (boost::uint32_t)(mask + 1);
+    f.unused = 0;
+    o.write((char const*)&f, sizeof(f));
+    o.write((char const*)index, sizeof(slot) * (mask + 1));
+    o.write((char const*)used.data(), sizeof(boost::uint32_t) * used.size());
+    for (std::size_t c = 0; c < chunks.size(); ++c) o.write(chunks[c], used[c]);
+    if (!o) throw std::runtime_error("StringArena: couldn't write " + path);
+  }
+
+  /// replace contents with a save()d file, mmapped read-only (handles are the same as in the saved arena)
+  void map(std::string const& path) {
+    free_chunks();
+    mapped.open(path, std::ios::in);
+    file_header const& f = *(file_header const*)mapped.data();
+    if (mapped.size() < sizeof(f) || std::memcmp(f.magic, kMagic(), sizeof(f.magic))
+        || f.chunk_bits != kChunkBits || f.check != hash("graehl", 6))
+      throw std::runtime_error("StringArena: " + path + " isn't a StringArena saved by a compatible build");
+    index = (slot*)(mapped.data() + sizeof(f));
+    mask = f.index_size - 1;
+    n = f.n;
+    boost::uint32_t const* u = (boost::uint32_t const*)(index + f.index_size);
+    used.assign(u, u + f.n_chunks);
+    char* at = (char*)(u + f.n_chunks);
+    for (std::size_t c = 0; c < used.size(); at += used[c++]) chunks.push_back(at);
+    if (mapped.size() != (std::size_t)(at - mapped.data()))
+      throw std::runtime_error("StringArena: " + path + " is truncated");
+    // the mapped chunks are read only, so new strings start a fresh one
+    top = chunk_end = chunks.size() << kChunkBits;
+  }
+
+ private:
+  struct slot {
+    boost::uint32_t hash;
+    handle h;
+  };
+  struct file_header {
+    char magic[8];
+    boost::uint32_t chunk_bits, check, n, n_chunks, index_size, unused;
+  };
+  static char const* kMagic() { return "strarena"; }
+
+  void init() {
+    owned_index.assign(kFirstIndexSize, slot());
+    index = owned_index.data();
+    mask = kFirstIndexSize - 1;
+    n = 0;
+    top = 0;
+    chunk_end = 0;
+    last_size = kFirstChunkSize / 2;
+    allocated = 0;
+  }
+
+  void free_chunks() {
+    for (std::size_t i = 0; i < owned.size(); ++i) delete[] owned[i];
+    owned.clear();
+    chunks.clear();
+    used.clear();
+    mapped.close();
+    init();
+  }
+
+  void own_index() {
+    std::vector<slot>(index, index + mask + 1).swap(owned_index);
+    index = owned_index.data();
+  }
+
+  handle find(char const* s, std::size_t len, boost::uint32_t h) const {
+    for (std::size_t i = h & mask; index[i].h; i = (i + 1) & mask)
+      if (index[i].hash == h && equal(index[i].h, s, len)) return index[i].h;
+    return 0;
+  }
+
+  bool equal(handle x, char const* s, std::size_t len) const {
+    return length(x) == len && !std::memcmp(c_str(x), s, len);
+  }
+
+  char const* entry(handle x) const { return chunks[x >> kChunkBits] + (x & (kChunkSize - 1)); }
+  boost::uint32_t header(handle x, unsigned i) const { return ((boost::uint32_t const*)entry(x))[i]; }
+
+  handle alloc(char const* s, std::size_t len, boost::uint32_t h) {
+    std::size_t const need = (kEntryHeader + len + 1 + 3) & ~(std::size_t)3;
+    std::size_t at = top;
+    if (chunks.empty() || at + need > chunk_end) {
+      std::size_t const skip = chunks.empty() ? kEntryHeader : 0;  // handle 0 means none
+      at = (chunks.size() << kChunkBits) + skip;
+      // chunks double up to kChunkSize; an oversized string gets a block spanning several chunk numbers
+      std::size_t size = chunks.empty() ? kFirstChunkSize : std::min(2 * last_size, (std::size_t)kChunkSize);
+      std::size_t nchunks = 1;
+      if (skip + need > size) {
+        nchunks = (skip + need + kChunkSize - 1) >> kChunkBits;
+        size = skip + need <= kChunkSize ? (std::size_t)kChunkSize : nchunks << kChunkBits;
+      }
+      if (at + (nchunks << kChunkBits) > 0xFFFFFFFFu)
+        throw std::runtime_error("StringArena: over 4096 chunks of strings");
+      char* block = new char[size];
+      std::memset(block, 0, skip);
+      owned.push_back(block);
+      for (std::size_t c = 0; c < nchunks; ++c) chunks.push_back(block + (c << kChunkBits));
+      used.resize(chunks.size(), 0);
+      last_size = size;
+      allocated += size;
+      chunk_end = (at - skip) + size;
+    }
+    char* e = chunks[at >> kChunkBits] + (at & (kChunkSize - 1));
+    boost::uint32_t* hdr = (boost::uint32_t*)e;
+    hdr[0] = h;
+    hdr[1] = (boost::uint32_t)len;
+    std::memcpy(e + kEntryHeader, s, len);
+    std::memset(e + kEntryHeader + len, 0, need - kEntryHeader - len);  // '\0' and alignment padding
+    top = at + need;
+    // save() writes chunk c up to used[c]
+    for (std::size_t c = at >> kChunkBits; (c << kChunkBits) < top; ++c)
+      used[c] = (boost::uint32_t)std::min(top - (c << kChunkBits), (std::size_t)kChunkSize);
+    return (handle)at;
+  }
+
+  void grow() {
+    std::vector<slot> bigger((mask + 1) * 2, slot());
+    std::size_t bigmask = bigger.size() - 1;
+    for (std::size_t i = 0; i <= mask; ++i)
+      if (index[i].h) {
+        std::size_t j = index[i].hash & bigmask;
+        while (bigger[j].h) j = (j + 1) & bigmask;
+        bigger[j] = index[i];
+      }
+    owned_index.swap(bigger);
+    index = owned_index.data();
+    mask = bigmask;
+  }
+
+  std::vector<char*> chunks;  // handle >> kChunkBits -> chunk base
+  std::vector<char*> owned;  // heap blocks (possibly several chunk numbers each)
+  std::vector<boost::uint32_t> used;  // bytes written to each chunk
+  mapped_file mapped;
+  std::vector<slot> owned_index;
+  slot* index;  // owned_index or inside mapped
+  std::size_t mask, n;
+  std::size_t top, chunk_end;  // next free handle; end of the current chunk (as a handle)
+  std::size_t last_size, allocated;
+};
+
+#ifdef GRAEHL_TEST
+BOOST_AUTO_TEST_CASE(TEST_STRING_ARENA) {
+  StringArena a;
+  BOOST_CHECK(!a.find("sym0"));
+  std::vector<StringArena::handle> hs;
+  for (unsigned i = 0; i < 50000; ++i) {
+    char buf[32];
+    std::sprintf(buf, "sym%u", i);
+    hs.push_back(a.intern(buf));
+  }
+  std::string big(3 * StringArena::kChunkSize, 'x');
+  StringArena::handle hbig = a.intern(big.c_str());
+  StringArena::handle hafter = a.intern("after");
+  BOOST_CHECK_EQUAL(a.size(), 50002u);
+  BOOST_CHECK(hs[0]);
+  BOOST_CHECK(a.intern("") && a.intern("") != hs[0]);
+  BOOST_CHECK_EQUAL(a.intern("sym0"), hs[0]);
+  BOOST_CHECK_EQUAL(a.intern("sym17"), hs[17]);
+  BOOST_CHECK_EQUAL(std::string(a.c_str(hs[49999])), "sym49999");
+  BOOST_CHECK_EQUAL(a.length(hbig), big.size());
+  BOOST_CHECK_EQUAL(a.intern(big.c_str()), hbig);
+  BOOST_CHECK_EQUAL(std::string(a.c_str(hafter)), "after");
+  BOOST_CHECK(!a.find("nope"));
+  a.clear();
+  BOOST_CHECK(!a.size() && !a.bytes() && !a.find("sym0"));
+  BOOST_CHECK_EQUAL(std::string(a.c_str(a.intern("sym0"))), "sym0");
+  BOOST_CHECK_EQUAL(a.bytes(), (std::size_t)StringArena::kFirstChunkSize);
+}
+
+BOOST_AUTO_TEST_CASE(TEST_STRING_ARENA_MAP) {
+  StringArena a;
+  std::vector<StringArena::handle> hs;
+  for (unsigned i = 0; i < 5000; ++i) {
+    char buf[32];
+    std::sprintf(buf, "sym%u", i);
+    hs.push_back(a.intern(buf));
+  }
+  std::string big(3 * StringArena::kChunkSize, 'x');
+  StringArena::handle hbig = a.intern(big.c_str()), hafter = a.intern("after");
+  std::string const path = std::tmpnam(0);
+  a.save(path);
+  StringArena b;
+  b.map(path);
+  BOOST_CHECK_EQUAL(b.size(), 5002u);
+  BOOST_CHECK_EQUAL(b.find("sym4999"), hs[4999]);
+  BOOST_CHECK_EQUAL(b.intern(big.c_str()), hbig);
+  BOOST_CHECK_EQUAL(std::string(b.c_str(hafter)), "after");
+  BOOST_CHECK(!b.bytes());
+  StringArena::handle hnew = b.intern("new");
+  BOOST_CHECK(hnew && b.find("new") == hnew && b.find("sym0") == hs[0]);
+  BOOST_CHECK_EQUAL(std::string(b.c_str(hs[3])), "sym3");
+  std::string const path2 = std::tmpnam(0);
+  b.save(path2);  // mapped and heap chunks together
+  StringArena c;
+  c.map(path2);
+  BOOST_CHECK(c.find("new") == hnew && c.find("sym17") == hs[17] && c.size() == 5003u);
+  b.map(path);  // remap drops "new"
+  BOOST_CHECK(!b.find("new") && b.find("sym1") == hs[1]);
+  std::remove(path.c_str());
+  std::remove(path2.c_str());
+}
+#endif
+
+}
+
+#endif
@@ -21,6 +21,7 @@
 #define STRING_BUILDER_GRAEHL_2015_10_29_HPP
 #pragma once
 
+#include <cstring>
 #include <vector>
 #include <string>
 #include <graehl/shared/string_buffer.hpp>
@@ -222,10 +223,7 @@ struct string_builder : string_buffer {
     (*this)(s.begin(), s.end());
     return *this;
   }
-  string_builder& operator()(char const* s) {
-    for (; *s; ++s) this->push_back(*s);
-    return *this;
-  }
+  string_builder& operator()(char const* s) { return (*this)(s, s + std::strlen(s)); }
   string_builder& operator()(char const* s, unsigned len) { return (*this)(s, s + len); }
 
   template <class T>
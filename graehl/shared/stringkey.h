@@ -73,7 +73,7 @@ struct StringKey {
   }
   bool operator == ( const StringKey &a ) const // for cool STL / graehl unsorted-buckets hash table
   {
-    return strcmp(str, a.str)==0;
+    return str == a.str || strcmp(str, a.str)==0;
   }
   int cmp( const StringKey &a ) const
   {
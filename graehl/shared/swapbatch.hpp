@@ -341,6 +341,7 @@ struct SwapBatch {
     out << size() << " items in " << n_batches() << " batches of " << batchsize << " bytes, stored in " << basename << "N";
   }
   size_type *d_tail; // write here: offset in size_types to next item.  could be an offset in bytes but both fields are size_type aligned for sure.
+  // is must be seekable (read_all* wrap anything else in a checkpoint_streambuf)
   BatchMember *read_one(std::istream &is)
   {
     BACKTRACE;
@@ -393,6 +394,13 @@ struct SwapBatch {
 
   void read_all(std::istream &in) {
     BACKTRACE;
+    if (!seekable_istream(in)) {
+      checkpoint_streambuf buf(in.rdbuf());
+      std::istream rewindable(&buf);
+      read_all(rewindable);
+      in.setstate(rewindable.rdstate());
+      return;
+    }
     while (in) {
       read_one(in);
     }
@@ -401,6 +409,13 @@ struct SwapBatch {
   template <class F>
   void read_all_enumerate(std::istream &in, F f) {
     BACKTRACE;
+    if (!seekable_istream(in)) {
+      checkpoint_streambuf buf(in.rdbuf());
+      std::istream rewindable(&buf);
+      read_all_enumerate(rewindable, f);
+      in.setstate(rewindable.rdstate());
+      return;
+    }
     while (in) {
       BatchMember *newguy = read_one(in);
       if (newguy)
@@ -408,9 +423,16 @@ struct SwapBatch {
     }
   }
 
-  // reads until eof or delim (which is consumed if it occurs)
+  // reads until eof or delim (which is consumed if it occurs; an unseekable in may be read further)
   void read_all(std::istream &in, char delim) {
     BACKTRACE;
+    if (!seekable_istream(in)) {
+      checkpoint_streambuf buf(in.rdbuf());
+      std::istream rewindable(&buf);
+      read_all(rewindable, delim);
+      in.setstate(rewindable.rdstate());
+      return;
+    }
     char c;
     while (in) {
       BREAK_ONCH_SPACE(delim);
@@ -421,6 +443,13 @@ struct SwapBatch {
   template <class F>
   void read_all_enumerate(std::istream &in, F f, char delim) {
     BACKTRACE;
+    if (!seekable_istream(in)) {
+      checkpoint_streambuf buf(in.rdbuf());
+      std::istream rewindable(&buf);
+      read_all_enumerate(rewindable, f, delim);
+      in.setstate(rewindable.rdstate());
+      return;
+    }
     char c;
     while (in) {
       BREAK_ONCH_SPACE(delim);
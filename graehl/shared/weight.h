@@ -60,6 +60,8 @@
 #include <graehl/shared/test.hpp>
 #include <cctype>
 #include <graehl/shared/debugprint.hpp>
+#include <graehl/shared/string_to.hpp>
+#include <graehl/shared/string_builder.hpp>
 #endif
 
 #ifdef _MSC_VER
@@ -138,6 +140,10 @@ struct logweight {  // capable of representing nonnegative reals
     swap(weight, a.weight);
   }
   inline friend void swap(self_type& a, self_type& b) throw() { a.swap(b); }
+  template <class A>
+  void serialize(A& a) {
+    a& weight;
+  }
 
  private:
   enum MAKENOTANON {
@@ -486,6 +492,34 @@ struct logweight {  // capable of representing nonnegative reals
     o.precision(old_precision);
     return GENIOGOOD;
   }
+
+  /// o's output format (out_log10, out_always_log etc.), for append
+  struct out_format {
+    int base, log;
+  };
+  template <class charT, class Traits>
+  static out_format get_out_format(std::basic_ostream<charT, Traits>& o) {
+    out_format f;
+    f.base = get_log_base(o);
+    f.log = get_log(o);
+    return f;
+  }
+
+  /// the text print(o) would write (o otherwise default formatted), appended to a string_builder
+  template <class Builder>
+  void append(Builder& b, out_format f) const {
+    unsigned const digits = sizeof(Real) > 4 ? 15 : 7;
+    if (isZero())
+      b('0');
+    else if ((f.log == SOMETIMES_LOG && fitsInReal()) || f.log == NEVER_LOG)
+      b.significant((double)getReal(), digits);
+    else if (f.base == LN)
+      b.significant((double)getLn(), digits)("ln");
+    else if (f.base == LOG10)
+      b.significant((double)getLog10(), digits)("log");
+    else
+      b("e^").significant((double)getLn(), digits);
+  }
   void throwbadweight() { throw "bad logweight"; }
 
   bool setString(const std::string& str) {
@@ -931,6 +965,37 @@ BOOST_AUTO_TEST_CASE(TEST_WEIGHT) {
   BOOST_CHECK(a == d);
   BOOST_CHECK(a == e);
 }
+
+template <class Real>
+void check_weight_append() {
+  typedef logweight<Real> W;
+  typedef std::ostream& (*manip)(std::ostream&);
+  manip const bases[] = {&W::out_default_base, &W::out_ln, &W::out_log10, &W::out_exp};
+  manip const logs[] = {&W::out_default_log, &W::out_always_log, &W::out_sometimes_log, &W::out_never_log};
+  double const lns[] = {0, 1, -1, 0.5, -2.302585092994046, 1e-9, -1e-9, 80, -80, 700, -700, 1e5, -1e5, 123.456789};
+  unsigned const n = sizeof(lns) / sizeof(lns[0]);
+  for (unsigned base = 0; base < 4; ++base)
+    for (unsigned log = 0; log < 4; ++log)
+      for (unsigned i = 0; i <= n; ++i) {
+        W w;
+        if (i < n)
+          w.setLn((Real)lns[i]);
+        else
+          w.setZero();
+        std::ostringstream o;
+        bases[base](o);
+        logs[log](o);
+        o << w;
+        string_builder b;
+        w.append(b, W::get_out_format(o));
+        BOOST_CHECK_EQUAL(o.str(), b.str());
+      }
+}
+
+BOOST_AUTO_TEST_CASE(TEST_WEIGHT_APPEND) {
+  check_weight_append<double>();
+  check_weight_append<float>();
+}
 #endif
 
 }  // ns
@@ -1022,6 +1087,14 @@ class numeric_limits<graehl::logweight<Real> > : public std::numeric_limits<Real
 
 namespace boost {}
 
+namespace graehl {
+// thread-local statics are defined here rather than in weight.cc so every TU sees the (constant)
+// initializer; otherwise g++ emits calls to a TLS init function that no TU defines
+template <class Real>
+THREADLOCAL int logweight<Real>::default_base = logweight<Real>::EXP;
+template <class Real>
+THREADLOCAL int logweight<Real>::default_thresh = logweight<Real>::ALWAYS_LOG;
+}
 
 #ifdef GRAEHL__SINGLE_MAIN
 #include <graehl/shared/weight.cc>